@@ -54,6 +54,10 @@ class PagedMemory {
     // reserved and the user should call EnsureCommitted() before writing to
     // memory addresses.
     kDontCommit = 1 << 1,
+
+    // Only for MapFile(). Maps the file with MAP_PRIVATE: writes go to
+    // copy-on-write pages private to the mapping and don't reach the file.
+    kMapPrivate = 1 << 2,
   };
 
   // Allocates |size| bytes using mmap(MAP_ANONYMOUS). The returned memory is
@@ -61,6 +65,14 @@ class PagedMemory {
   // For |flags|, see the AllocationFlags enum above.
   static PagedMemory Allocate(size_t size, int flags = 0);
 
+#if !PERFETTO_BUILDFLAG(PERFETTO_OS_WIN)
+  // Like Allocate(), but maps the first |size| bytes of the file |fd| with
+  // MAP_SHARED (or MAP_PRIVATE, see kMapPrivate) instead of anonymous memory.
+  // The file must be at least |size| bytes long. The returned object doesn't
+  // take ownership of |fd|, which can be closed once this returns.
+  static PagedMemory MapFile(int fd, size_t size, int flags = 0);
+#endif
+
   // Hint to the OS that the memory range is not needed and can be discarded.
   // The memory remains accessible and its contents may be retained, or they
   // may be zeroed. This function may be a NOP on some platforms. Returns true
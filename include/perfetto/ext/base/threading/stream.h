@@ -160,6 +160,20 @@ Stream<T> FlattenStreams(std::vector<Stream<T>> streams) {
   return MakeStream<FlattenImpl<T>>(std::move(streams));
 }
 
+// Creates a Stream<T> returning values generated by the streams returned by
+// each function in |fns| as soon as they are produced without preserving
+// ordering.
+//
+// Unlike |FlattenStreams|, at most |max_in_flight| of the streams exist at any
+// one time: the functions are called in order and the next one is only called
+// once one of the existing streams completes. This is useful to bound the
+// amount of work (and buffered results) when the streams start work eagerly.
+template <typename T>
+Stream<T> FlattenStreamsBounded(std::vector<std::function<Stream<T>()>> fns,
+                                uint32_t max_in_flight) {
+  return MakeStream<BoundedFlattenImpl<T>>(std::move(fns), max_in_flight);
+}
+
 // Collector for Stream<Status>::Collect() which immediately resolves the
 // returned Future when an error status is detected. Resolves with
 // OkStatus once the entire stream finishes after returning all OkStatus().
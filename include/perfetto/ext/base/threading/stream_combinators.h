@@ -17,6 +17,8 @@
 #ifndef INCLUDE_PERFETTO_EXT_BASE_THREADING_STREAM_COMBINATORS_H_
 #define INCLUDE_PERFETTO_EXT_BASE_THREADING_STREAM_COMBINATORS_H_
 
+#include <algorithm>
+#include <functional>
 #include <memory>
 #include <optional>
 #include <utility>
@@ -192,6 +194,98 @@ class FlattenImpl : public StreamPollable<T> {
   uint32_t eof_streams_ = 0;
 };
 
+// Implementation of a StreamPollable for creating a Stream<T> from a
+// std::vector of functions returning Stream<T>, keeping at most a fixed number
+// of the inner streams alive at any time.
+//
+// The inner streams are created in order: a new one is only created once one
+// of the existing ones completes. Polling resumes after the stream which last
+// returned a value so that a stream which is always ready cannot starve the
+// others.
+template <typename T>
+class BoundedFlattenImpl : public StreamPollable<T> {
+ public:
+  BoundedFlattenImpl(std::vector<std::function<Stream<T>()>> fns,
+                     uint32_t max_in_flight)
+      : fns_(std::move(fns)) {
+    PERFETTO_CHECK(max_in_flight > 0);
+    size_t slots = std::min<size_t>(max_in_flight, fns_.size());
+    slots_.resize(slots);
+    for (Slot& slot : slots_) {
+      slot.stream = NextStream();
+    }
+  }
+
+  StreamPollResult<T> PollNext(PollContext* upstream) override {
+    bool all_done = true;
+    for (uint32_t j = 0; j < slots_.size(); ++j) {
+      uint32_t i = (next_slot_ + j) % static_cast<uint32_t>(slots_.size());
+      Slot& slot = slots_[i];
+      while (slot.stream) {
+        std::optional<PollContext> ctx = PollContextForSlot(upstream, &slot);
+        if (!ctx) {
+          break;
+        }
+        StreamPollResult<T> res = slot.stream->PollNext(&*ctx);
+        if (res.IsPending()) {
+          PERFETTO_CHECK(!slot.handles.empty());
+          break;
+        }
+        if (!res.IsDone()) {
+          next_slot_ = i + 1;
+          return res;
+        }
+        // The stream has returned EOF: replace it with the next stream (if
+        // any) and poll that immediately.
+        slot.handles.clear();
+        slot.stream = NextStream();
+      }
+      all_done &= !slot.stream;
+    }
+    if (all_done) {
+      return DonePollResult();
+    }
+    for (const Slot& slot : slots_) {
+      upstream->RegisterAllInterested(slot.handles);
+    }
+    return PendingPollResult();
+  }
+
+ private:
+  struct Slot {
+    std::optional<Stream<T>> stream;
+    FlatSet<PlatformHandle> handles;
+  };
+
+  std::optional<Stream<T>> NextStream() {
+    if (next_fn_ >= fns_.size()) {
+      return std::nullopt;
+    }
+    // Free the function (and anything it captured) as soon as it was used.
+    std::function<Stream<T>()> fn = std::move(fns_[next_fn_++]);
+    return fn();
+  }
+
+  std::optional<PollContext> PollContextForSlot(PollContext* upstream,
+                                                Slot* slot) {
+    if (slot->handles.empty()) {
+      return PollContext(&slot->handles, &upstream->ready_handles());
+    }
+    for (PlatformHandle handle : upstream->ready_handles()) {
+      if (slot->handles.count(handle)) {
+        slot->handles.clear();
+        return PollContext(&slot->handles, &upstream->ready_handles());
+      }
+    }
+    return std::nullopt;
+  }
+
+  std::vector<std::function<Stream<T>()>> fns_;
+  size_t next_fn_ = 0;
+  std::vector<Slot> slots_;
+  uint32_t next_slot_ = 0;
+};
+
 // Implementation of a Stream<T> which immediately completes and calls a
 // function in the destructor.
 template <typename T, typename Function>
@@ -19,6 +19,7 @@
 
 #include <functional>
 #include <memory>
+#include <optional>
 #include <vector>
 
 #include "perfetto/base/status.h"
@@ -29,6 +30,8 @@
 namespace perfetto {
 namespace bigtrace {
 
+class TraceStore;
+
 // Shim interface allowing embedders to change how operations which interact
 // with the OS operate (e.g. IO, networking etc).
 class Environment {
@@ -40,6 +43,17 @@ class Environment {
   // but should be sized to balance memory use and syscall count.
   virtual base::StatusOrStream<std::vector<uint8_t>> ReadFile(
       const std::string& path) = 0;
+
+  // Returns the resident set size of the current process in bytes, if known.
+  // This is reported to the orchestrator to account for the memory used by
+  // each worker when placing traces. The default implementation reads
+  // /proc/self/statm on Linux and Android and returns nullopt elsewhere.
+  virtual std::optional<uint64_t> GetRssBytes();
+
+  // Returns the store the worker reads traces from. The default
+  // implementation reads traces with |ReadFile|; embedders reading traces
+  // from the local filesystem should return |TraceStore::CreateLocal()|.
+  virtual std::unique_ptr<TraceStore> CreateTraceStore();
 };
 
 }  // namespace bigtrace
@@ -39,6 +39,9 @@ class TracePoolQueryResponse;
 
 class TracePoolDestroyArgs;
 class TracePoolDestroyResponse;
+
+class TracePlacementStatsArgs;
+class TracePlacementStatsResponse;
 }  // namespace protos
 }  // namespace perfetto
 
@@ -79,6 +82,10 @@ class Orchestrator {
   // Destroys the TracePool with the specified id.
   virtual base::StatusOrFuture<protos::TracePoolDestroyResponse>
   TracePoolDestroy(const protos::TracePoolDestroyArgs&) = 0;
+
+  // Returns how traces are currently placed across workers.
+  virtual base::StatusOrFuture<protos::TracePlacementStatsResponse>
+  TracePlacementStats(const protos::TracePlacementStatsArgs&) = 0;
 };
 
 }  // namespace bigtrace
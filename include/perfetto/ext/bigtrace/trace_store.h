@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef INCLUDE_PERFETTO_EXT_BIGTRACE_TRACE_STORE_H_
+#define INCLUDE_PERFETTO_EXT_BIGTRACE_TRACE_STORE_H_
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "perfetto/ext/base/status_or.h"
+#include "perfetto/ext/base/threading/stream.h"
+#include "perfetto/trace_processor/trace_blob_view.h"
+
+namespace perfetto {
+namespace bigtrace {
+
+class Environment;
+
+// Interface for the storage the traces loaded by a Worker are read from.
+class TraceStore {
+ public:
+  virtual ~TraceStore();
+
+  // Returns a TraceStore reading traces from the local filesystem.
+  //
+  // Traces are mmap-ed and returned as slices of the mapping, avoiding any
+  // copy. The kernel is asked to read ahead of the chunk being parsed by an
+  // amount proportional to the rate at which chunks are consumed.
+  static std::unique_ptr<TraceStore> CreateLocal();
+
+  // Returns a TraceStore reading traces with |Environment::ReadFile|. The
+  // returned store does not support prefetching.
+  static std::unique_ptr<TraceStore> CreateForEnvironment(Environment*);
+
+  // Returns the contents of the trace at |path| as a stream of chunks to be
+  // parsed in order.
+  virtual base::StatusOrStream<trace_processor::TraceBlobView> ReadTrace(
+      const std::string& path) = 0;
+
+  // Hints that the traces at |paths| will be read soon. Implementations can
+  // use this to start fetching the traces in the background so that reading
+  // them overlaps with parsing the traces being loaded.
+  virtual void Prefetch(const std::vector<std::string>& paths) = 0;
+};
+
+}  // namespace bigtrace
+}  // namespace perfetto
+
+#endif  // INCLUDE_PERFETTO_EXT_BIGTRACE_TRACE_STORE_H_
@@ -17,6 +17,7 @@
 #ifndef INCLUDE_PERFETTO_EXT_BIGTRACE_WORKER_H_
 #define INCLUDE_PERFETTO_EXT_BIGTRACE_WORKER_H_
 
+#include <cstdint>
 #include <memory>
 #include <vector>
 
@@ -36,6 +37,9 @@ class SyncTraceStateResponse;
 
 class QueryTraceArgs;
 class QueryTraceResponse;
+
+class WorkerStatsArgs;
+class WorkerStatsResponse;
 }  // namespace protos
 
 namespace bigtrace {
@@ -47,15 +51,24 @@ class Environment;
 // See BigTraceWorker RPC service for high-level documentation.
 class Worker {
  public:
+  // The default number of bytes of traces which are kept loaded after they
+  // stop being assigned to the worker.
+  static constexpr uint64_t kDefaultMaxIdleTraceBytes = 2ull << 30;
+
   virtual ~Worker();
 
   // Returns an in-process implementation of the Worker given an instance of
   // |Environment| and a |ThreadPool|. The |Environment| will be used to
   // perform any interaction with the OS (e.g. opening and reading files) and
   // the |ThreadPool| will be used to dispatch requests to TraceProcessor.
-  static std::unique_ptr<Worker> CreateInProcesss(base::TaskRunner*,
-                                                  Environment*,
-                                                  base::ThreadPool*);
+  //
+  // Traces which stop being assigned to the worker are kept loaded, up to
+  // |max_idle_trace_bytes|, so they can be reused if assigned again.
+  static std::unique_ptr<Worker> CreateInProcesss(
+      base::TaskRunner*,
+      Environment*,
+      base::ThreadPool*,
+      uint64_t max_idle_trace_bytes = kDefaultMaxIdleTraceBytes);
 
   // Synchronize the state of the traces in the worker to the orchestrator.
   virtual base::StatusOrStream<protos::SyncTraceStateResponse> SyncTraceState(
@@ -64,6 +77,10 @@ class Worker {
   // Executes a SQL query on the specified trace.
   virtual base::StatusOrStream<protos::QueryTraceResponse> QueryTrace(
       const protos::QueryTraceArgs&) = 0;
+
+  // Returns the resource usage of the worker and of each loaded trace.
+  virtual base::StatusOrFuture<protos::WorkerStatsResponse> WorkerStats(
+      const protos::WorkerStatsArgs&) = 0;
 };
 
 }  // namespace bigtrace
@@ -18,6 +18,7 @@
 #define INCLUDE_PERFETTO_EXT_TRACE_PROCESSOR_RPC_QUERY_RESULT_SERIALIZER_H_
 
 #include <memory>
+#include <string>
 #include <vector>
 
 #include <limits.h>
@@ -51,10 +52,21 @@ class IteratorImpl;
 //   of a row).
 // The intended use case is streaaming these batches onto through a
 // chunked-encoded HTTP response, or through a repetition of Wasm calls.
+//
+// Batches are encoded either as a CellsBatch (row by row, one type byte per
+// cell) or as a ColumnarBatch (column by column, as typed arrays which can be
+// accessed without decoding each cell). See QueryArgs.ResultFormat in
+// trace_processor.proto.
 class QueryResultSerializer {
  public:
   static constexpr uint32_t kDefaultBatchSplitThreshold = 128 * 1024;
-  explicit QueryResultSerializer(Iterator);
+
+  enum class Format {
+    kCellsBatch,
+    kColumnarBatch,
+  };
+
+  explicit QueryResultSerializer(Iterator, Format = Format::kCellsBatch);
   ~QueryResultSerializer();
 
   // No copy or move.
@@ -70,6 +82,11 @@ class QueryResultSerializer {
   // extra copies.
   bool Serialize(std::vector<uint8_t>*);
 
+  // Ends the result early: appends a last, empty, batch and |error| to the
+  // passed message instead of the remaining rows and stops the query.
+  // Serialize() must not be called afterwards.
+  void Cancel(protos::pbzero::QueryResult*, const std::string& error);
+
   void set_batch_size_for_testing(uint32_t cells_per_batch, uint32_t thres) {
     cells_per_batch_ = cells_per_batch;
     batch_split_threshold_ = thres;
@@ -78,10 +95,12 @@ class QueryResultSerializer {
  private:
   void SerializeMetadata(protos::pbzero::QueryResult*);
   void SerializeBatch(protos::pbzero::QueryResult*);
+  void SerializeColumnarBatch(protos::pbzero::QueryResult*);
   void MaybeSerializeError(protos::pbzero::QueryResult*);
 
   std::unique_ptr<IteratorImpl> iter_;
   const uint32_t num_cols_;
+  const Format format_;
   bool did_write_metadata_ = false;
   bool eof_reached_ = false;
   uint32_t col_ = UINT32_MAX;
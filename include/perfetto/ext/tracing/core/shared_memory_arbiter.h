@@ -128,6 +128,10 @@ class PERFETTO_EXPORT_COMPONENT SharedMemoryArbiter {
   // immediately. And when the batching period ends, the commits that occurred
   // after the immediate flush will also be sent to the service.
   //
+  // |batch_commits_duration_ms| is the maximum length of the period: it is
+  // shortened when a period starts while the shared memory buffer is filling
+  // up, down to immediate commits when it is mostly full.
+  //
   // If the duration has already been set to a non-zero value before this method
   // is called, and there is already a scheduled flush with the previously-set
   // duration, the new duration will take effect after the scheduled flush
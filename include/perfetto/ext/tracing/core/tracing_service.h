@@ -21,6 +21,7 @@
 
 #include <functional>
 #include <memory>
+#include <string>
 #include <vector>
 
 #include "perfetto/base/export.h"
@@ -266,9 +267,29 @@ class PERFETTO_EXPORT_COMPONENT ConsumerEndpoint {
 struct PERFETTO_EXPORT_COMPONENT TracingServiceInitOpts {
   // Function used by tracing service to compress packets. Takes a pointer to
   // a vector of TracePackets and replaces the packets in the vector with
-  // compressed ones.
-  using CompressorFn = void (*)(std::vector<TracePacket>*);
+  // compressed ones. |level| is the TraceConfig.compression_level (0 means
+  // the compressor's default). Must be thread-safe if compression_threads > 0.
+  using CompressorFn = void (*)(std::vector<TracePacket>*, uint32_t level);
   CompressorFn compressor_fn = nullptr;
+
+  // If > 0, the chunks committed by producers are copied into the trace
+  // buffers by this many worker threads, each owning a subset of the buffers,
+  // rather than by the service task runner thread. The rest of the service
+  // keeps running on the task runner.
+  uint32_t copy_threads = 0;
+
+  // If > 0, large batches of packets read back from the trace buffers are
+  // split into groups that are compressed concurrently by this many worker
+  // threads. The output keeps the order of the packets.
+  uint32_t compression_threads = 0;
+
+  // Directory for the files backing the buffers that have
+  // TraceConfig.BufferConfig.persistent set. If empty, those buffers use
+  // anonymous memory like all the others. On construction, the service
+  // recovers the buffer files left behind by a previous instance that didn't
+  // shut down cleanly into trace files in this directory. Only the 10 most
+  // recent recovered traces are kept, older ones are deleted.
+  std::string persistent_buffers_dir;
 };
 
 // The public API of the tracing Service business logic.
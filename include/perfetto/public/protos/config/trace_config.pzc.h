@@ -233,6 +233,11 @@ PERFETTO_PB_FIELD(perfetto_protos_TraceConfig,
                   enum perfetto_protos_TraceConfig_CompressionType,
                   compression_type,
                   24);
+PERFETTO_PB_FIELD(perfetto_protos_TraceConfig,
+                  VARINT,
+                  uint32_t,
+                  compression_level,
+                  38);
 PERFETTO_PB_FIELD(perfetto_protos_TraceConfig,
                   VARINT,
                   bool,
@@ -564,5 +569,10 @@ PERFETTO_PB_FIELD(perfetto_protos_TraceConfig_BufferConfig,
                   bool,
                   clear_before_clone,
                   6);
+PERFETTO_PB_FIELD(perfetto_protos_TraceConfig_BufferConfig,
+                  VARINT,
+                  bool,
+                  persistent,
+                  7);
 
 #endif  // INCLUDE_PERFETTO_PUBLIC_PROTOS_CONFIG_TRACE_CONFIG_PZC_H_
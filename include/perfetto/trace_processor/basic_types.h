@@ -109,6 +109,21 @@ enum class DropTrackEventDataBefore {
   kTrackEventRangeOfInterest = 1,
 };
 
+// Limits on the resources that a single query can use. A query exceeding any
+// of them is aborted: its iterator stops and returns an error status. Zero
+// means no limit.
+struct PERFETTO_EXPORT_COMPONENT QueryBudget {
+  // Maximum wall time spent executing the query, i.e. in ExecuteQuery() and
+  // Iterator::Next(). The time between calls to Next() does not count.
+  uint64_t timeout_ms = 0;
+
+  // Maximum memory allocated by SQLite (e.g. to sort or to materialize
+  // intermediate results) while executing the query. Memory allocated by the
+  // tables of trace processor is not included. Queries with a memory budget
+  // fail if SQLite was initialized by someone else before trace processor.
+  uint64_t max_memory_bytes = 0;
+};
+
 // Struct for configuring a TraceProcessor instance (see trace_processor.h).
 struct PERFETTO_EXPORT_COMPONENT Config {
   // Indicates the sortinng mode that trace processor should use on the passed
@@ -158,6 +173,9 @@ struct PERFETTO_EXPORT_COMPONENT Config {
   // Sets developer-only flags to the provided values. Does not have any affect
   // unless |enable_dev_features| = true.
   std::unordered_map<std::string, std::string> dev_flags;
+
+  // Budget of the queries run with TraceProcessor::ExecuteQuery().
+  QueryBudget query_budget;
 };
 
 // Represents a dynamically typed value returned by SQL.
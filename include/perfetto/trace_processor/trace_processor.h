@@ -53,8 +53,23 @@ class PERFETTO_EXPORT_COMPONENT TraceProcessor : public TraceProcessorStorage {
   //
   // See documentation of the Iterator class for an example on how to use
   // the returned iterator.
+  //
+  // The query is aborted if it exceeds Config::query_budget.
   virtual Iterator ExecuteQuery(const std::string& sql) = 0;
 
+  // Same as ExecuteQuery() but with the given budget in place of
+  // Config::query_budget. The budget applies both to the statements run by
+  // this function and to the iteration of the returned Iterator.
+  virtual Iterator ExecuteQueryWithBudget(const std::string& sql,
+                                          const QueryBudget& budget) = 0;
+
+  // Returns true if |sql| is a single statement which does not change the
+  // state of the database. Such a query can be iterated while other queries
+  // are in progress. PerfettoSQL-only statements (e.g. INCLUDE PERFETTO
+  // MODULE) and functions which run SQL themselves (e.g. RUN_METRIC) are
+  // never considered read-only.
+  virtual bool IsReadOnlyQuery(const std::string& sql) = 0;
+
   // Registers SQL files with the associated path under the module named
   // |sql_module.name|. These modules can be run by using the |IMPORT| SQL
   // function.
@@ -102,12 +117,14 @@ class PERFETTO_EXPORT_COMPONENT TraceProcessor : public TraceProcessorStorage {
       MetricResultFormat format,
       std::string* metrics_string) = 0;
 
-  // Interrupts the current query. Typically used by Ctrl-C handler.
+  // Interrupts the current query. Typically used by Ctrl-C handler. This is
+  // the only method which can be called from a different thread.
   virtual void InterruptQuery() = 0;
 
   // Deletes all tables and views that have been created (by the UI or user)
   // after the trace was loaded. It preserves the built-in tables/view created
-  // by the ingestion process. Returns the number of table/views deleted.
+  // by the ingestion process and the ones created by INCLUDE PERFETTO MODULE
+  // statements. Returns the number of table/views deleted.
   virtual size_t RestoreInitialTables() = 0;
 
   // Sets/returns the name of the currently loaded trace or an empty string if
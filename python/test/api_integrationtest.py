@@ -13,8 +13,12 @@
 # See the License for the specific language governing permissions and
 # limitations under the License.
 
+import http.client
 import io
 import os
+import subprocess
+import tempfile
+import threading
 import unittest
 from typing import Optional
 
@@ -280,3 +284,78 @@ class TestApi(unittest.TestCase):
     with self.assertRaisesRegex(
         TraceProcessorException, expected_regex='.*source.*generator.*'):
       _ = btp.query('select * from sl')
+
+
+class TestShellBatch(unittest.TestCase):
+
+  def run_batch(self, query, traces):
+    with tempfile.TemporaryDirectory() as tmp_dir:
+      query_path = os.path.join(tmp_dir, 'query.sql')
+      with open(query_path, 'w') as f:
+        f.write(query)
+      return subprocess.run(
+          [os.environ["SHELL_PATH"], '--batch', '-q', query_path] + traces,
+          capture_output=True,
+          text=True)
+
+  def test_batch_query(self):
+    trace = example_android_trace_path()
+    res = self.run_batch('select count(*) as cnt from slice', [trace, trace])
+    self.assertEqual(res.returncode, 0, res.stderr)
+
+    lines = res.stdout.splitlines()
+    self.assertEqual(lines[0], '"trace_id","cnt"')
+    self.assertEqual(len(lines), 3)
+    for line in lines[1:]:
+      trace_id, cnt = line.split(',')
+      self.assertEqual(trace_id, '"{}"'.format(trace))
+      self.assertGreater(int(cnt), 0)
+
+  def test_batch_query_failure(self):
+    trace = example_android_trace_path()
+    res = self.run_batch('select count(*) as cnt from slice',
+                         ['/does/not/exist.pb', trace])
+    self.assertNotEqual(res.returncode, 0)
+    self.assertIn('Query failed on 1 of 2 traces', res.stderr)
+
+    # The traces which succeeded are still printed.
+    lines = res.stdout.splitlines()
+    self.assertEqual(len(lines), 2)
+    self.assertTrue(lines[1].startswith('"{}"'.format(trace)))
+
+
+class TestHttpd(unittest.TestCase):
+
+  def test_slow_query_next_to_fast_query(self):
+    tp = create_tp(trace=example_android_trace_path())
+    addr = '{}:{}'.format(tp.http.conn.host, tp.http.conn.port)
+
+    # Never returns its first row: it only stops when it is cancelled.
+    slow_args = tp.protos.QueryArgs()
+    slow_args.sql_query = ('with recursive n(x) as (select 1 union all '
+                           'select x + 1 from n) select count(x) from n')
+    slow = http.client.HTTPConnection(addr)
+    slow.request('POST', '/query', body=slow_args.SerializeToString())
+
+    # The server keeps serving the other connections while the query runs.
+    status = http.client.HTTPConnection(addr, timeout=30)
+    status.request('GET', '/status')
+    with status.getresponse() as f:
+      self.assertEqual(f.status, 200)
+
+    fast = TraceProcessor(addr='http://' + addr)
+    fast_rows = []
+    fast_thread = threading.Thread(
+        target=lambda: fast_rows.extend(
+            r.x for r in fast.query('select 1 as x')),
+        daemon=True)
+    fast_thread.start()
+
+    # Disconnecting cancels the slow query, which lets the fast one run.
+    slow.close()
+    fast_thread.join(timeout=30)
+    self.assertFalse(fast_thread.is_alive())
+    self.assertEqual(fast_rows, [1])
+
+    fast.close()
+    tp.close()
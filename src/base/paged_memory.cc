@@ -83,6 +83,40 @@ PagedMemory PagedMemory::Allocate(size_t req_size, int flags) {
   return memory;
 }
 
+#if !PERFETTO_BUILDFLAG(PERFETTO_OS_WIN)
+// static
+PagedMemory PagedMemory::MapFile(int fd, size_t req_size, int flags) {
+  size_t rounded_up_size = RoundUpToSysPageSize(req_size);
+  PERFETTO_CHECK(rounded_up_size >= req_size);
+  size_t outer_size = rounded_up_size + GuardSize() * 2;
+  // Reserve the whole range, guard pages included, then replace the usable
+  // region with the file mapping.
+  void* ptr = mmap(nullptr, outer_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS,
+                   -1, 0);
+  if (ptr == MAP_FAILED && (flags & kMayFail))
+    return PagedMemory();
+  PERFETTO_CHECK(ptr && ptr != MAP_FAILED);
+  char* usable_region = reinterpret_cast<char*>(ptr) + GuardSize();
+  const int share_flag = (flags & kMapPrivate) ? MAP_PRIVATE : MAP_SHARED;
+  void* res = mmap(usable_region, rounded_up_size, PROT_READ | PROT_WRITE,
+                   share_flag | MAP_FIXED, fd, 0);
+  if (res == MAP_FAILED) {
+    PERFETTO_CHECK(flags & kMayFail);
+    munmap(ptr, outer_size);
+    return PagedMemory();
+  }
+
+  auto memory = PagedMemory(usable_region, req_size);
+#if TRACK_COMMITTED_SIZE()
+  size_t initial_commit = req_size;
+  if (flags & kDontCommit)
+    initial_commit = std::min(initial_commit, kCommitChunkSize);
+  memory.EnsureCommitted(initial_commit);
+#endif  // TRACK_COMMITTED_SIZE()
+  return memory;
+}
+#endif  // !PERFETTO_BUILDFLAG(PERFETTO_OS_WIN)
+
 PagedMemory::PagedMemory() {}
 
 // clang-format off
@@ -17,8 +17,10 @@
 #include "perfetto/ext/base/paged_memory.h"
 
 #include <stdint.h>
+#include <string.h>
 
 #include "perfetto/base/build_config.h"
+#include "perfetto/ext/base/temp_file.h"
 #include "perfetto/ext/base/utils.h"
 #include "src/base/test/vm_test_utils.h"
 #include "test/gtest_and_gmock.h"
@@ -29,6 +31,10 @@
 #include <sys/resource.h>
 #endif
 
+#if !PERFETTO_BUILDFLAG(PERFETTO_OS_WIN)
+#include <unistd.h>
+#endif
+
 namespace perfetto {
 namespace base {
 namespace {
@@ -180,6 +186,55 @@ TEST(PagedMemoryTest, GuardRegions) {
   EXPECT_DEATH_IF_SUPPORTED({ raw[kSize] = 'x'; }, ".*");
 }
 
+#if !PERFETTO_BUILDFLAG(PERFETTO_OS_WIN)
+TEST(PagedMemoryTest, MapFile) {
+  const size_t kSize = GetSysPageSize() * 2;
+  TempFile tmp_file = TempFile::Create();
+  ASSERT_EQ(ftruncate(tmp_file.fd(), static_cast<off_t>(kSize)), 0);
+  PagedMemory mem = PagedMemory::MapFile(tmp_file.fd(), kSize);
+  ASSERT_TRUE(mem.IsValid());
+  ASSERT_EQ(mem.size(), kSize);
+
+  // Writes through the mapping are visible through the file.
+  char* raw = reinterpret_cast<char*>(mem.Get());
+  ASSERT_EQ(raw[kSize - 1], 0);
+  memcpy(raw + kSize - 4, "abc", 4);
+  char buf[4] = {};
+  ASSERT_EQ(pread(tmp_file.fd(), buf, sizeof(buf),
+                  static_cast<off_t>(kSize - 4)),
+            4);
+  EXPECT_STREQ(buf, "abc");
+
+  volatile char* vraw = raw;
+  EXPECT_DEATH_IF_SUPPORTED({ vraw[-1] = 'x'; }, ".*");
+  EXPECT_DEATH_IF_SUPPORTED({ vraw[kSize] = 'x'; }, ".*");
+}
+
+TEST(PagedMemoryTest, MapFilePrivate) {
+  const size_t kSize = GetSysPageSize() * 2;
+  TempFile tmp_file = TempFile::Create();
+  ASSERT_EQ(ftruncate(tmp_file.fd(), static_cast<off_t>(kSize)), 0);
+  ASSERT_EQ(pwrite(tmp_file.fd(), "abc", 4, 0), 4);
+  PagedMemory mem =
+      PagedMemory::MapFile(tmp_file.fd(), kSize, PagedMemory::kMapPrivate);
+  ASSERT_TRUE(mem.IsValid());
+  char* raw = reinterpret_cast<char*>(mem.Get());
+  EXPECT_STREQ(raw, "abc");
+
+  // Writes stay private to the mapping.
+  memcpy(raw, "xyz", 4);
+  EXPECT_STREQ(raw, "xyz");
+  char buf[4] = {};
+  ASSERT_EQ(pread(tmp_file.fd(), buf, sizeof(buf), 0), 4);
+  EXPECT_STREQ(buf, "abc");
+
+  // And the writes to the file aren't visible through the mapping anymore,
+  // at least for the pages that have been written to.
+  ASSERT_EQ(pwrite(tmp_file.fd(), "def", 4, 0), 4);
+  EXPECT_STREQ(raw, "xyz");
+}
+#endif  // !PERFETTO_BUILDFLAG(PERFETTO_OS_WIN)
+
 // Disable this on:
 // MacOS: because it doesn't seem to have an equivalent rlimit to bound mmap().
 // Fuchsia: doesn't support rlimit.
@@ -16,6 +16,7 @@
 
 #include "perfetto/ext/base/threading/stream.h"
 
+#include <functional>
 #include <vector>
 
 #include "perfetto/base/platform_handle.h"
@@ -330,6 +331,50 @@ TEST_F(StreamUnittest, FlattenStreams) {
   ASSERT_TRUE(stream.PollNext(&ctx_).IsDone());
 }
 
+TEST_F(StreamUnittest, FlattenStreamsBounded) {
+  EventFd event_fd;
+  const PlatformHandle fd = event_fd.fd();
+  uint32_t created = 0;
+
+  std::vector<std::function<Stream<int>()>> fns;
+  fns.emplace_back([&created, fd]() {
+    created++;
+    std::unique_ptr<MockStreamPollable<int>> a(new MockStreamPollable<int>());
+    EXPECT_CALL(*a, PollNext(_))
+        .WillOnce([fd](PollContext* ctx) {
+          ctx->RegisterInterested(fd);
+          return PendingPollResult();
+        })
+        .WillOnce(Return(StreamPollResult<int>(1)))
+        .WillOnce(Return(DonePollResult()));
+    return Stream<int>(std::move(a));
+  });
+  fns.emplace_back([&created]() {
+    created++;
+    return StreamOf(2);
+  });
+  fns.emplace_back([&created]() {
+    created++;
+    return StreamOf(3);
+  });
+
+  auto stream = base::FlattenStreamsBounded(std::move(fns), 2);
+  ASSERT_EQ(created, 2u);
+  ASSERT_EQ(stream.PollNext(&ctx_).item(), 2);
+  ASSERT_EQ(created, 2u);
+
+  // The third stream is only created once the second one completes.
+  ASSERT_EQ(stream.PollNext(&ctx_).item(), 3);
+  ASSERT_EQ(created, 3u);
+
+  ASSERT_TRUE(stream.PollNext(&ctx_).IsPending());
+  ASSERT_THAT(interested_, ElementsAre(fd));
+
+  ready_ = {fd};
+  ASSERT_EQ(stream.PollNext(&ctx_).item(), 1);
+  ASSERT_TRUE(stream.PollNext(&ctx_).IsDone());
+}
+
 }  // namespace
 }  // namespace base
 }  // namespace perfetto
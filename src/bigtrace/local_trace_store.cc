@@ -0,0 +1,264 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "src/bigtrace/local_trace_store.h"
+
+#include <fcntl.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "perfetto/base/build_config.h"
+#include "perfetto/base/status.h"
+#include "perfetto/base/time.h"
+#include "perfetto/ext/base/file_utils.h"
+#include "perfetto/ext/base/scoped_file.h"
+#include "perfetto/ext/base/status_or.h"
+#include "perfetto/ext/base/threading/poll.h"
+#include "perfetto/ext/base/threading/stream.h"
+#include "perfetto/ext/base/utils.h"
+#include "perfetto/trace_processor/trace_blob.h"
+#include "perfetto/trace_processor/trace_blob_view.h"
+
+#if TRACE_PROCESSOR_HAS_MMAP()
+#include <sys/mman.h>
+#endif
+
+#if !PERFETTO_BUILDFLAG(PERFETTO_OS_WIN)
+#include <unistd.h>
+#endif
+
+namespace perfetto {
+namespace bigtrace {
+namespace {
+
+using trace_processor::TraceBlob;
+using trace_processor::TraceBlobView;
+
+// The weight of the latest measurement in the parse rate average.
+constexpr double kParseRateSmoothing = 0.3;
+
+// The read-ahead used before the parse rate is known.
+constexpr uint64_t kDefaultReadAheadBytes = 4 * ReadAheadEstimator::kChunkSize;
+
+// Stream returning the chunks of a local trace file, asking the kernel to
+// read ahead of the chunk being returned.
+class LocalTraceStreamImpl
+    : public base::StreamPollable<base::StatusOr<TraceBlobView>> {
+ public:
+  LocalTraceStreamImpl(std::string path,
+                       std::shared_ptr<ReadAheadEstimator> read_ahead)
+      : path_(std::move(path)), read_ahead_(std::move(read_ahead)) {}
+
+  base::StreamPollResult<base::StatusOr<TraceBlobView>> PollNext(
+      base::PollContext*) override {
+    if (failed_) {
+      return base::DonePollResult();
+    }
+    if (!fd_) {
+      base::Status status = Open();
+      if (!status.ok()) {
+        failed_ = true;
+        return base::StatusOr<TraceBlobView>(status);
+      }
+    }
+    if (offset_ >= size_) {
+      return base::DonePollResult();
+    }
+
+    // The loader pulls the next chunk as soon as it starts parsing the
+    // previous one: apart from the second chunk, which is pulled right after
+    // the first, the time between two pulls is the time taken to parse a
+    // chunk.
+    int64_t now_ns = base::GetWallTimeNs().count();
+    if (last_chunk_ns_) {
+      read_ahead_->OnChunkParsed(last_chunk_size_, now_ns - *last_chunk_ns_);
+    }
+    if (offset_ > 0) {
+      last_chunk_ns_ = now_ns;
+    }
+
+    uint64_t chunk_size =
+        std::min<uint64_t>(ReadAheadEstimator::kChunkSize, size_ - offset_);
+    ReadAhead(offset_ + chunk_size);
+
+    TraceBlobView chunk;
+    if (mapping_) {
+      chunk = mapping_->slice_off(static_cast<size_t>(offset_),
+                                  static_cast<size_t>(chunk_size));
+    } else {
+      base::StatusOr<TraceBlobView> read = ReadChunk(chunk_size);
+      if (!read.ok()) {
+        failed_ = true;
+        return read;
+      }
+      chunk = std::move(*read);
+      if (chunk.size() == 0) {
+        // The file was truncated since it was opened.
+        return base::DonePollResult();
+      }
+    }
+    offset_ += chunk.size();
+    last_chunk_size_ = chunk.size();
+    return base::StatusOr<TraceBlobView>(std::move(chunk));
+  }
+
+ private:
+  base::Status Open() {
+    fd_ = base::OpenFile(path_, O_RDONLY);
+    if (!fd_) {
+      return base::ErrStatus("%s: could not open trace", path_.c_str());
+    }
+    auto size = lseek(*fd_, 0, SEEK_END);
+    if (size < 0 || lseek(*fd_, 0, SEEK_SET) != 0) {
+      return base::ErrStatus("%s: could not seek trace", path_.c_str());
+    }
+    size_ = static_cast<uint64_t>(size);
+
+#if TRACE_PROCESSOR_HAS_MMAP()
+    // Cannot use mmap on 32-bit systems for files > 2GB.
+    bool can_mmap = size_ > 0 && (sizeof(size_t) >= 8 || size_ <= 2147483648);
+    if (can_mmap) {
+      size_t whole_size = static_cast<size_t>(size_);
+      void* data = mmap(nullptr, whole_size, PROT_READ, MAP_PRIVATE, *fd_, 0);
+      if (data != MAP_FAILED) {
+        madvise(data, whole_size, MADV_SEQUENTIAL);
+        mapping_ = TraceBlobView(TraceBlob::FromMmap(data, whole_size));
+      }
+    }
+#endif
+    return base::OkStatus();
+  }
+
+  base::StatusOr<TraceBlobView> ReadChunk(uint64_t chunk_size) {
+    TraceBlob blob = TraceBlob::Allocate(static_cast<size_t>(chunk_size));
+    size_t read = 0;
+    while (read < blob.size()) {
+      auto res = base::Read(*fd_, blob.data() + read, blob.size() - read);
+      if (res < 0) {
+        return base::ErrStatus("%s: reading trace failed", path_.c_str());
+      }
+      if (res == 0) {
+        break;
+      }
+      read += static_cast<size_t>(res);
+    }
+    return TraceBlobView(std::move(blob), 0, read);
+  }
+
+  // Asks the kernel to read the bytes following |offset| which were not
+  // requested yet.
+  void ReadAhead(uint64_t offset) {
+    uint64_t end = std::min(size_, offset + read_ahead_->read_ahead_bytes());
+    uint64_t start = std::max(offset, read_ahead_until_);
+    if (start >= end) {
+      return;
+    }
+    read_ahead_until_ = end;
+#if TRACE_PROCESSOR_HAS_MMAP()
+    if (mapping_) {
+      // madvise requires a page aligned address.
+      uint64_t page_size = base::GetSysPageSize();
+      uint64_t aligned_start = start - start % page_size;
+      uint8_t* data = const_cast<uint8_t*>(mapping_->data());
+      madvise(data + aligned_start, static_cast<size_t>(end - aligned_start),
+              MADV_WILLNEED);
+      return;
+    }
+#endif
+#if PERFETTO_BUILDFLAG(PERFETTO_OS_LINUX) || \
+    PERFETTO_BUILDFLAG(PERFETTO_OS_ANDROID)
+    posix_fadvise(*fd_, static_cast<off_t>(start),
+                  static_cast<off_t>(end - start), POSIX_FADV_WILLNEED);
+#endif
+  }
+
+  const std::string path_;
+  std::shared_ptr<ReadAheadEstimator> read_ahead_;
+
+  base::ScopedFile fd_;
+  // The whole file, if it could be mmap-ed.
+  std::optional<TraceBlobView> mapping_;
+  uint64_t size_ = 0;
+  uint64_t offset_ = 0;
+  // The end of the range the kernel was asked to read.
+  uint64_t read_ahead_until_ = 0;
+  bool failed_ = false;
+
+  std::optional<int64_t> last_chunk_ns_;
+  uint64_t last_chunk_size_ = 0;
+};
+
+}  // namespace
+
+void ReadAheadEstimator::OnChunkParsed(uint64_t bytes, int64_t duration_ns) {
+  if (duration_ns <= 0) {
+    return;
+  }
+  double rate =
+      static_cast<double>(bytes) * 1e9 / static_cast<double>(duration_ns);
+  if (!bytes_per_sec_) {
+    bytes_per_sec_ = rate;
+    return;
+  }
+  bytes_per_sec_ = kParseRateSmoothing * rate +
+                   (1 - kParseRateSmoothing) * *bytes_per_sec_;
+}
+
+uint64_t ReadAheadEstimator::read_ahead_bytes() const {
+  if (!bytes_per_sec_) {
+    return kDefaultReadAheadBytes;
+  }
+  double bytes = *bytes_per_sec_ * kReadAheadSeconds;
+  if (bytes >= static_cast<double>(kMaxReadAheadBytes)) {
+    return kMaxReadAheadBytes;
+  }
+  return std::max(static_cast<uint64_t>(bytes), kMinReadAheadBytes);
+}
+
+LocalTraceStore::LocalTraceStore()
+    : read_ahead_(std::make_shared<ReadAheadEstimator>()) {}
+LocalTraceStore::~LocalTraceStore() = default;
+
+base::StatusOrStream<TraceBlobView> LocalTraceStore::ReadTrace(
+    const std::string& path) {
+  return base::MakeStream<LocalTraceStreamImpl>(path, read_ahead_);
+}
+
+void LocalTraceStore::Prefetch(const std::vector<std::string>& paths) {
+#if PERFETTO_BUILDFLAG(PERFETTO_OS_LINUX) || \
+    PERFETTO_BUILDFLAG(PERFETTO_OS_ANDROID)
+  // Prefetching the first read-ahead window is enough: the rest of the trace
+  // is read ahead while parsing.
+  uint64_t bytes = read_ahead_->read_ahead_bytes();
+  for (const std::string& path : paths) {
+    base::ScopedFile fd = base::OpenFile(path, O_RDONLY);
+    if (fd) {
+      posix_fadvise(*fd, 0, static_cast<off_t>(bytes), POSIX_FADV_WILLNEED);
+    }
+  }
+#else
+  base::ignore_result(paths);
+#endif
+}
+
+}  // namespace bigtrace
+}  // namespace perfetto
@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SRC_BIGTRACE_LOCAL_TRACE_STORE_H_
+#define SRC_BIGTRACE_LOCAL_TRACE_STORE_H_
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "perfetto/ext/base/status_or.h"
+#include "perfetto/ext/base/threading/stream.h"
+#include "perfetto/ext/bigtrace/trace_store.h"
+#include "perfetto/trace_processor/trace_blob_view.h"
+
+namespace perfetto {
+namespace bigtrace {
+
+// Estimates how far ahead of the chunk being parsed traces should be read so
+// that the data is in the page cache by the time it is needed.
+//
+// The parse rate is measured from the time between consecutive chunks being
+// pulled from the streams returned by |LocalTraceStore::ReadTrace|.
+class ReadAheadEstimator {
+ public:
+  // The size of the chunks returned by the local trace store.
+  static constexpr uint64_t kChunkSize = 16ull * 1024 * 1024;
+
+  // Reads ahead by this many seconds of parsing...
+  static constexpr double kReadAheadSeconds = 2;
+  // ...bounded to [kMinReadAheadBytes, kMaxReadAheadBytes].
+  static constexpr uint64_t kMinReadAheadBytes = kChunkSize;
+  static constexpr uint64_t kMaxReadAheadBytes = 512ull * 1024 * 1024;
+
+  // Records that |bytes| were parsed in |duration_ns|.
+  void OnChunkParsed(uint64_t bytes, int64_t duration_ns);
+
+  // Returns the number of bytes to read ahead.
+  uint64_t read_ahead_bytes() const;
+
+ private:
+  // Exponentially weighted moving average of the parse rate.
+  std::optional<double> bytes_per_sec_;
+};
+
+// Implementation of TraceStore reading traces from the local filesystem. See
+// |TraceStore::CreateLocal|.
+class LocalTraceStore : public TraceStore {
+ public:
+  LocalTraceStore();
+  ~LocalTraceStore() override;
+
+  base::StatusOrStream<trace_processor::TraceBlobView> ReadTrace(
+      const std::string& path) override;
+
+  // Asks the kernel to start reading the beginning of each of |paths| into
+  // the page cache. The reads are asynchronous and issued for all the traces
+  // at once.
+  void Prefetch(const std::vector<std::string>& paths) override;
+
+ private:
+  // Shared with the streams returned by |ReadTrace| which can outlive the
+  // store.
+  std::shared_ptr<ReadAheadEstimator> read_ahead_;
+};
+
+}  // namespace bigtrace
+}  // namespace perfetto
+
+#endif  // SRC_BIGTRACE_LOCAL_TRACE_STORE_H_
@@ -0,0 +1,112 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "src/bigtrace/local_trace_store.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "perfetto/base/flat_set.h"
+#include "perfetto/base/platform_handle.h"
+#include "perfetto/ext/base/file_utils.h"
+#include "perfetto/ext/base/status_or.h"
+#include "perfetto/ext/base/temp_file.h"
+#include "perfetto/ext/base/threading/poll.h"
+#include "perfetto/ext/base/threading/stream.h"
+#include "perfetto/trace_processor/trace_blob_view.h"
+#include "test/gtest_and_gmock.h"
+
+namespace perfetto {
+namespace bigtrace {
+namespace {
+
+using trace_processor::TraceBlobView;
+
+// Polls |stream| to completion, concatenating the chunks. The local store
+// never returns pending.
+base::StatusOr<std::string> ReadAll(base::StatusOrStream<TraceBlobView> stream,
+                                    size_t* chunk_count) {
+  base::FlatSet<base::PlatformHandle> ready;
+  base::FlatSet<base::PlatformHandle> interested;
+  base::PollContext ctx(&interested, &ready);
+  std::string contents;
+  for (auto res = stream.PollNext(&ctx); !res.IsDone();
+       res = stream.PollNext(&ctx)) {
+    EXPECT_FALSE(res.IsPending());
+    if (!res.item().ok()) {
+      return res.item().status();
+    }
+    contents.append(reinterpret_cast<const char*>(res.item()->data()),
+                    res.item()->size());
+    (*chunk_count)++;
+  }
+  return contents;
+}
+
+TEST(LocalTraceStoreUnittest, ReadsTraceInChunks) {
+  std::string contents(ReadAheadEstimator::kChunkSize * 2 + 123, 'a');
+  for (size_t i = 0; i < contents.size(); i += 4096) {
+    contents[i] = static_cast<char>('a' + (i / 4096) % 26);
+  }
+  base::TempFile file = base::TempFile::Create();
+  ASSERT_EQ(base::WriteAll(file.fd(), contents.data(), contents.size()),
+            static_cast<ssize_t>(contents.size()));
+
+  LocalTraceStore store;
+  store.Prefetch({file.path(), "/does/not/exist"});
+  size_t chunk_count = 0;
+  auto read = ReadAll(store.ReadTrace(file.path()), &chunk_count);
+  ASSERT_TRUE(read.ok()) << read.status().message();
+  EXPECT_EQ(*read, contents);
+  EXPECT_EQ(chunk_count, 3u);
+}
+
+TEST(LocalTraceStoreUnittest, EmptyAndMissingTraces) {
+  LocalTraceStore store;
+  base::TempFile file = base::TempFile::Create();
+  size_t chunk_count = 0;
+  auto read = ReadAll(store.ReadTrace(file.path()), &chunk_count);
+  ASSERT_TRUE(read.ok());
+  EXPECT_EQ(chunk_count, 0u);
+
+  read = ReadAll(store.ReadTrace("/does/not/exist"), &chunk_count);
+  EXPECT_FALSE(read.ok());
+}
+
+TEST(LocalTraceStoreUnittest, ReadAheadFollowsParseRate) {
+  ReadAheadEstimator estimator;
+  uint64_t initial = estimator.read_ahead_bytes();
+  EXPECT_GE(initial, ReadAheadEstimator::kMinReadAheadBytes);
+
+  // 16MB parsed in one second: read ahead two seconds worth of parsing.
+  estimator.OnChunkParsed(ReadAheadEstimator::kChunkSize, 1000000000);
+  EXPECT_EQ(estimator.read_ahead_bytes(), 2 * ReadAheadEstimator::kChunkSize);
+
+  // Slow parsing is bounded by the minimum...
+  ReadAheadEstimator slow;
+  slow.OnChunkParsed(1024, 1000000000);
+  EXPECT_EQ(slow.read_ahead_bytes(), ReadAheadEstimator::kMinReadAheadBytes);
+
+  // ...and fast parsing by the maximum.
+  ReadAheadEstimator fast;
+  fast.OnChunkParsed(ReadAheadEstimator::kChunkSize, 1000);
+  EXPECT_EQ(fast.read_ahead_bytes(), ReadAheadEstimator::kMaxReadAheadBytes);
+}
+
+}  // namespace
+}  // namespace bigtrace
+}  // namespace perfetto
@@ -16,10 +16,10 @@
 
 #include "src/bigtrace/orchestrator_impl.h"
 
+#include <functional>
 #include <memory>
 #include <optional>
 #include <string>
-#include <unordered_set>
 #include <utility>
 #include <vector>
 
@@ -36,6 +36,7 @@
 #include "perfetto/ext/bigtrace/worker.h"
 #include "protos/perfetto/bigtrace/orchestrator.pb.h"
 #include "protos/perfetto/bigtrace/worker.pb.h"
+#include "src/bigtrace/query_result_merger.h"
 #include "src/trace_processor/util/status_macros.h"
 
 namespace perfetto {
@@ -51,12 +52,49 @@ RpcResponseToPoolResponse(base::StatusOr<protos::QueryTraceResponse> resp) {
   return ret;
 }
 
+// Collects the per-trace results of a TracePoolQuery into a single merged
+// response. Stops at the first error, cancelling the queries still in flight.
+class MergeCollector
+    : public base::Collector<base::StatusOr<protos::QueryTraceResponse>,
+                             base::StatusOr<protos::TracePoolQueryResponse>> {
+ public:
+  explicit MergeCollector(const protos::TracePoolQueryMerge& spec)
+      : merger_(spec) {}
+
+  std::optional<base::StatusOr<protos::TracePoolQueryResponse>> OnNext(
+      base::StatusOr<protos::QueryTraceResponse> resp) override {
+    base::Status status = resp.status();
+    if (status.ok()) {
+      status = merger_.Add(resp->trace(), resp->result());
+    }
+    if (!status.ok()) {
+      return std::make_optional(
+          base::StatusOr<protos::TracePoolQueryResponse>(status));
+    }
+    return std::nullopt;
+  }
+
+  base::StatusOr<protos::TracePoolQueryResponse> OnDone() override {
+    protos::TracePoolQueryResponse ret;
+    *ret.mutable_result() = merger_.Finish();
+    return ret;
+  }
+
+ private:
+  QueryResultMerger merger_;
+};
+
 // The period of sync of state from the orchestrator to all the workers. This
 // constant trades freshness (i.e. lower period) vs unnecessary work (i.e.
 // higher period). 15s seems an acceptable number even for interactive trace
 // loads.
 static constexpr uint32_t kDefaultWorkerSyncPeriod = 15000;
 
+// The number of traces queried at the same time for each worker if the
+// TracePoolQuery does not specify a limit. This bounds the number of results
+// buffered in memory while keeping all the workers busy.
+static constexpr uint32_t kDefaultMaxInFlightTracesPerWorker = 8;
+
 }  // namespace
 
 Orchestrator::~Orchestrator() = default;
@@ -72,7 +110,8 @@ OrchestratorImpl::OrchestratorImpl(base::TaskRunner* task_runner,
                                    std::vector<std::unique_ptr<Worker>> workers)
     : task_runner_(task_runner),
       periodic_sync_task_(task_runner),
-      workers_(std::move(workers)) {
+      workers_(std::move(workers)),
+      placement_(static_cast<uint32_t>(workers_.size())) {
   base::PeriodicTask::Args args;
   args.task = [this] { ExecuteSyncWorkers(); };
   args.period_ms = kDefaultWorkerSyncPeriod;
@@ -108,19 +147,13 @@ OrchestratorImpl::TracePoolSetTraces(
         "Incrementally adding/removing items to pool not currently supported"));
   }
   pool->traces.assign(args.traces().begin(), args.traces().end());
-
-  uint32_t round_robin_worker_idx = 0;
   for (const std::string& trace_path : pool->traces) {
-    auto it_and_inserted = traces_.Insert(trace_path, Trace());
-    it_and_inserted.first->refcount++;
-    if (it_and_inserted.second) {
-      it_and_inserted.first->worker = workers_[round_robin_worker_idx].get();
-      // Set the worker index to the next worker in a round-robin fashion.
-      round_robin_worker_idx = (round_robin_worker_idx + 1) % workers_.size();
-    } else {
-      PERFETTO_CHECK(it_and_inserted.first);
-    }
+    traces_.Insert(trace_path, Trace()).first->refcount++;
   }
+  placement_.Place(pool->traces);
+
+  // Start loading the new traces now rather than at the next periodic sync.
+  ExecuteForceSyncWorkers();
   return protos::TracePoolSetTracesResponse();
 }
 
@@ -131,17 +164,50 @@ OrchestratorImpl::TracePoolQuery(const protos::TracePoolQueryArgs& args) {
     return base::StreamOf(base::StatusOr<protos::TracePoolQueryResponse>(
         base::ErrStatus("Unable to find pool %s", args.pool_id().c_str())));
   }
+  if (workers_.empty()) {
+    return base::StreamOf(base::StatusOr<protos::TracePoolQueryResponse>(
+        base::ErrStatus("No workers available to query pool %s",
+                        args.pool_id().c_str())));
+  }
 
-  std::vector<base::StatusOrStream<protos::QueryTraceResponse>> streams;
-  protos::QueryTraceArgs query_args;
-  *query_args.mutable_sql_query() = args.sql_query();
+  // The queries are started lazily, in the order of the traces in the pool.
+  // The worker is looked up only when the query starts as the trace might
+  // have been moved to another worker in the meantime.
+  using QueryStream = base::StatusOrStream<protos::QueryTraceResponse>;
+  std::vector<std::function<QueryStream()>> queries;
   for (const std::string& trace_path : pool->traces) {
-    auto* trace = traces_.Find(trace_path);
+    protos::QueryTraceArgs query_args;
     *query_args.mutable_trace() = trace_path;
-    streams.emplace_back(trace->worker->QueryTrace(query_args));
+    *query_args.mutable_sql_query() = args.sql_query();
+    queries.emplace_back([this, query_args]() -> QueryStream {
+      std::optional<uint32_t> worker =
+          placement_.WorkerForTrace(query_args.trace());
+      if (!worker) {
+        const char* trace = query_args.trace().c_str();
+        return base::StreamOf(base::StatusOr<protos::QueryTraceResponse>(
+            base::ErrStatus("%s: trace not found", trace)));
+      }
+      placement_.OnQueryStarted(*worker);
+      return workers_[*worker]->QueryTrace(query_args).Concat(
+          base::OnDestroyStream<base::StatusOr<protos::QueryTraceResponse>>(
+              [this, worker] { placement_.OnQueryFinished(*worker); }));
+    });
   }
-  return base::FlattenStreams(std::move(streams))
-      .MapFuture(&RpcResponseToPoolResponse);
+  uint32_t max_in_flight = args.max_in_flight_traces();
+  if (max_in_flight == 0) {
+    max_in_flight = kDefaultMaxInFlightTracesPerWorker *
+                    static_cast<uint32_t>(workers_.size());
+  }
+  QueryStream stream =
+      base::FlattenStreamsBounded(std::move(queries), max_in_flight);
+  if (!args.has_merge()) {
+    return std::move(stream).MapFuture(&RpcResponseToPoolResponse);
+  }
+  return base::StreamFromFuture(std::move(stream).Collect(
+      std::unique_ptr<base::Collector<
+          base::StatusOr<protos::QueryTraceResponse>,
+          base::StatusOr<protos::TracePoolQueryResponse>>>(
+          new MergeCollector(args.merge()))));
 }
 
 base::StatusOrFuture<protos::TracePoolDestroyResponse>
@@ -152,20 +218,25 @@ OrchestratorImpl::TracePoolDestroy(const protos::TracePoolDestroyArgs& args) {
     return base::StatusOr<protos::TracePoolDestroyResponse>(
         base::ErrStatus("Unable to find pool %s", id.c_str()));
   }
-  std::unordered_set<std::string> to_erase;
-  for (auto it = traces_.GetIterator(); it; ++it) {
-    PERFETTO_CHECK(it.value().refcount-- > 0);
-    if (it.value().refcount == 0) {
-      to_erase.emplace(it.key());
+  for (const std::string& trace_path : pool->traces) {
+    Trace* trace = traces_.Find(trace_path);
+    PERFETTO_CHECK(trace && trace->refcount-- > 0);
+    if (trace->refcount == 0) {
+      traces_.Erase(trace_path);
+      placement_.Remove(trace_path);
     }
   }
-  for (const std::string& trace_path : to_erase) {
-    traces_.Erase(trace_path);
-  }
   PERFETTO_CHECK(pools_.Erase(id));
   return protos::TracePoolDestroyResponse();
 }
 
+base::StatusOrFuture<protos::TracePlacementStatsResponse>
+OrchestratorImpl::TracePlacementStats(const protos::TracePlacementStatsArgs&) {
+  protos::TracePlacementStatsResponse resp;
+  placement_.GetStats(&resp);
+  return resp;
+}
+
 void OrchestratorImpl::ExecuteSyncWorkers() {
   if (periodic_sync_handle_) {
     return;
@@ -188,22 +259,55 @@ void OrchestratorImpl::ExecuteForceSyncWorkers() {
 }
 
 base::StatusFuture OrchestratorImpl::SyncWorkers() {
+  std::vector<base::StatusStream> streams;
+  for (uint32_t i = 0; i < workers_.size(); ++i) {
+    auto stats = workers_[i]->WorkerStats(protos::WorkerStatsArgs());
+    streams.push_back(base::StreamFromFuture(std::move(stats).ContinueWith(
+        [this, i](base::StatusOr<protos::WorkerStatsResponse> resp) {
+          // Stale stats only make placement less accurate: don't fail the
+          // sync because of them.
+          if (resp.ok()) {
+            placement_.UpdateWorkerStats(i, *resp);
+          } else {
+            PERFETTO_ELOG("Failed to get stats of worker %u: %s", i,
+                          resp.status().c_message());
+          }
+          return base::StatusFuture(base::OkStatus());
+        })));
+  }
+  return base::FlattenStreams(std::move(streams))
+      .Collect(base::AllOkCollector())
+      .ContinueWith([this](base::Status) {
+        std::optional<TracePlacement::Move> move = placement_.Rebalance();
+        if (move) {
+          PERFETTO_LOG("Moving trace %s from worker %u to worker %u",
+                       move->trace.c_str(), move->from_worker,
+                       move->to_worker);
+        }
+        return SyncTraceStates(move);
+      });
+}
+
+base::StatusFuture OrchestratorImpl::SyncTraceStates(
+    const std::optional<TracePlacement::Move>& move) {
   std::vector<base::StatusOrStream<protos::SyncTraceStateResponse>> streams;
-  base::FlatHashMap<Worker*, std::vector<std::string>> worker_to_traces;
+  std::vector<protos::SyncTraceStateArgs> worker_args(workers_.size());
   for (auto it = traces_.GetIterator(); it; ++it) {
-    auto it_and_inserted = worker_to_traces.Insert(it.value().worker, {});
-    it_and_inserted.first->emplace_back(it.key());
-  }
-  for (auto& worker : workers_) {
-    auto* traces = worker_to_traces.Find(worker.get());
-    if (!traces) {
-      continue;
-    }
-    protos::SyncTraceStateArgs args;
-    for (const auto& trace : *traces) {
-      args.add_traces(trace);
+    // Traces are only left unplaced when there are no workers.
+    std::optional<uint32_t> worker = placement_.WorkerForTrace(it.key());
+    if (worker) {
+      worker_args[*worker].add_traces(it.key());
     }
-    streams.push_back(worker->SyncTraceState(std::move(args)));
+  }
+  // The trace was moved to free memory on its old worker: keeping it there as
+  // an idle trace would defeat the purpose.
+  if (move) {
+    worker_args[move->from_worker].add_unload_traces(move->trace);
+  }
+  // Every worker is synced, even without traces, so that it unloads the
+  // traces which are not placed on it anymore.
+  for (uint32_t i = 0; i < workers_.size(); ++i) {
+    streams.push_back(workers_[i]->SyncTraceState(worker_args[i]));
   }
   return base::FlattenStreams(std::move(streams))
       .MapFuture([](base::StatusOr<protos::SyncTraceStateResponse> resp) {
@@ -27,6 +27,7 @@
 #include "perfetto/ext/base/threading/future.h"
 #include "perfetto/ext/base/threading/spawn.h"
 #include "perfetto/ext/bigtrace/orchestrator.h"
+#include "src/bigtrace/trace_placement.h"
 
 namespace perfetto {
 namespace protos {
@@ -52,18 +53,28 @@ class OrchestratorImpl : public Orchestrator {
   base::StatusOrFuture<protos::TracePoolDestroyResponse> TracePoolDestroy(
       const protos::TracePoolDestroyArgs&) override;
 
+  base::StatusOrFuture<protos::TracePlacementStatsResponse> TracePlacementStats(
+      const protos::TracePlacementStatsArgs&) override;
+
  private:
   struct TracePool {
     std::vector<std::string> traces;
   };
   struct Trace {
-    Worker* worker = nullptr;
     uint32_t refcount = 0;
   };
   void ExecuteSyncWorkers();
   void ExecuteForceSyncWorkers();
+
+  // Refreshes the worker stats, rebalances the traces if needed and then
+  // synchronizes the traces loaded by each worker with their placement.
   base::StatusFuture SyncWorkers();
 
+  // Synchronizes the traces loaded by each worker with their placement. The
+  // trace of |move|, if any, is unloaded from its old worker.
+  base::StatusFuture SyncTraceStates(
+      const std::optional<TracePlacement::Move>& move);
+
   base::TaskRunner* task_runner_ = nullptr;
   base::PeriodicTask periodic_sync_task_;
   std::optional<base::SpawnHandle> periodic_sync_handle_;
@@ -71,6 +82,7 @@ class OrchestratorImpl : public Orchestrator {
   std::vector<std::unique_ptr<Worker>> workers_;
   base::FlatHashMap<std::string, TracePool> pools_;
   base::FlatHashMap<std::string, Trace> traces_;
+  TracePlacement placement_;
 };
 
 }  // namespace bigtrace
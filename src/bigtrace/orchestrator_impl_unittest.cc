@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "src/bigtrace/orchestrator_impl.h"
+
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "perfetto/ext/base/status_or.h"
+#include "perfetto/ext/base/threading/future.h"
+#include "perfetto/ext/base/threading/spawn.h"
+#include "perfetto/ext/base/threading/stream.h"
+#include "perfetto/ext/bigtrace/worker.h"
+#include "protos/perfetto/bigtrace/orchestrator.pb.h"
+#include "src/base/test/test_task_runner.h"
+#include "test/gtest_and_gmock.h"
+
+namespace perfetto {
+namespace bigtrace {
+namespace {
+
+TEST(OrchestratorImplUnittest, QueryWithoutWorkersFails) {
+  base::TestTaskRunner task_runner;
+  std::unique_ptr<Orchestrator> orchestrator = Orchestrator::CreateInProcess(
+      &task_runner, std::vector<std::unique_ptr<Worker>>());
+
+  protos::TracePoolCreateArgs create_args;
+  create_args.set_pool_name("pool");
+  orchestrator->TracePoolCreate(create_args);
+
+  protos::TracePoolSetTracesArgs set_args;
+  set_args.set_pool_id("stateless:pool");
+  set_args.add_traces("a");
+  orchestrator->TracePoolSetTraces(set_args);
+  task_runner.RunUntilIdle();
+
+  protos::TracePoolQueryArgs query_args;
+  query_args.set_pool_id("stateless:pool");
+  query_args.set_sql_query("SELECT 1");
+  using Responses = std::vector<protos::TracePoolQueryResponse>;
+  auto drained = task_runner.CreateCheckpoint("drained");
+  std::optional<base::StatusOr<Responses>> result;
+  base::SpawnHandle handle = base::SpawnFuture(&task_runner, [&]() {
+    return orchestrator->TracePoolQuery(query_args)
+        .Collect(base::StatusOrVectorCollector<
+                 protos::TracePoolQueryResponse>())
+        .ContinueWith([&](base::StatusOr<Responses> res) {
+          result = std::move(res);
+          drained();
+          return base::Future<base::FVoid>(base::FVoid());
+        });
+  });
+  task_runner.RunUntilCheckpoint("drained");
+
+  ASSERT_FALSE(result->ok());
+  EXPECT_THAT(result->status().message(),
+              testing::HasSubstr("No workers available"));
+}
+
+}  // namespace
+}  // namespace bigtrace
+}  // namespace perfetto
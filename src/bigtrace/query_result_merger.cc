@@ -0,0 +1,358 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "src/bigtrace/query_result_merger.h"
+
+#include <algorithm>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "perfetto/base/status.h"
+#include "protos/perfetto/bigtrace/orchestrator.pb.h"
+#include "protos/perfetto/trace_processor/trace_processor.pb.h"
+#include "src/trace_processor/util/status_macros.h"
+
+namespace perfetto {
+namespace bigtrace {
+namespace {
+
+using CellsBatch = protos::QueryResult::CellsBatch;
+using Aggregate = protos::TracePoolQueryMerge::Aggregate;
+
+bool IsNumeric(CellsBatch::CellType type) {
+  return type == CellsBatch::CELL_VARINT || type == CellsBatch::CELL_FLOAT64;
+}
+
+// Orders the types of cells as SQLite does: NULLs before numbers before
+// strings before blobs.
+int TypeRank(CellsBatch::CellType type) {
+  switch (type) {
+    case CellsBatch::CELL_NULL:
+      return 0;
+    case CellsBatch::CELL_VARINT:
+    case CellsBatch::CELL_FLOAT64:
+      return 1;
+    case CellsBatch::CELL_STRING:
+      return 2;
+    case CellsBatch::CELL_BLOB:
+    case CellsBatch::CELL_INVALID:
+      return 3;
+  }
+  return 3;
+}
+
+template <typename T>
+void AppendRaw(std::string* out, T value) {
+  out->append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+}  // namespace
+
+QueryResultMerger::QueryResultMerger(protos::TracePoolQueryMerge spec)
+    : spec_(std::move(spec)) {}
+QueryResultMerger::~QueryResultMerger() = default;
+
+base::Status QueryResultMerger::Add(const std::string& trace,
+                                    const protos::QueryResult& result) {
+  if (!result.error().empty()) {
+    return base::ErrStatus("%s: %s", trace.c_str(), result.error().c_str());
+  }
+  if (result.column_names_size() > 0) {
+    RETURN_IF_ERROR(SetColumns(trace, result));
+  }
+  if (result.columnar_batch_size() > 0) {
+    return base::ErrStatus("%s: columnar results cannot be merged",
+                           trace.c_str());
+  }
+
+  const uint32_t num_cols = static_cast<uint32_t>(column_names_.size());
+  for (const CellsBatch& batch : result.batch()) {
+    if (batch.cells_size() == 0) {
+      continue;
+    }
+    if (num_cols == 0 || batch.cells_size() % num_cols != 0) {
+      return base::ErrStatus("%s: result has an invalid number of cells",
+                             trace.c_str());
+    }
+    int varint_idx = 0;
+    int float64_idx = 0;
+    int blob_idx = 0;
+    const std::string& strings = batch.string_cells();
+    size_t string_offset = 0;
+
+    std::vector<Cell> row;
+    row.reserve(num_cols);
+    for (int cell_type : batch.cells()) {
+      Cell cell;
+      cell.type = static_cast<CellType>(cell_type);
+      switch (cell.type) {
+        case CellsBatch::CELL_NULL:
+          break;
+        case CellsBatch::CELL_VARINT:
+          if (varint_idx >= batch.varint_cells_size()) {
+            return base::ErrStatus("%s: missing varint cell", trace.c_str());
+          }
+          cell.long_value = batch.varint_cells(varint_idx++);
+          break;
+        case CellsBatch::CELL_FLOAT64:
+          if (float64_idx >= batch.float64_cells_size()) {
+            return base::ErrStatus("%s: missing float64 cell", trace.c_str());
+          }
+          cell.double_value = batch.float64_cells(float64_idx++);
+          break;
+        case CellsBatch::CELL_STRING: {
+          size_t end = strings.find('\0', string_offset);
+          if (end == std::string::npos) {
+            return base::ErrStatus("%s: missing string cell", trace.c_str());
+          }
+          cell.bytes_value = strings.substr(string_offset, end - string_offset);
+          string_offset = end + 1;
+          break;
+        }
+        case CellsBatch::CELL_BLOB:
+          if (blob_idx >= batch.blob_cells_size()) {
+            return base::ErrStatus("%s: missing blob cell", trace.c_str());
+          }
+          cell.bytes_value = batch.blob_cells(blob_idx++);
+          break;
+        case CellsBatch::CELL_INVALID:
+          return base::ErrStatus("%s: invalid cell type", trace.c_str());
+      }
+      row.emplace_back(std::move(cell));
+      if (row.size() == num_cols) {
+        RETURN_IF_ERROR(AddRow(std::move(row)));
+        row = std::vector<Cell>();
+        row.reserve(num_cols);
+      }
+    }
+  }
+  return base::OkStatus();
+}
+
+protos::QueryResult QueryResultMerger::Finish() {
+  protos::QueryResult result;
+  for (const std::string& name : column_names_) {
+    result.add_column_names(name);
+  }
+  CellsBatch* batch = result.add_batch();
+  std::string strings;
+  for (const std::vector<Cell>& row : rows_) {
+    for (const Cell& cell : row) {
+      batch->add_cells(cell.type);
+      switch (cell.type) {
+        case CellsBatch::CELL_VARINT:
+          batch->add_varint_cells(cell.long_value);
+          break;
+        case CellsBatch::CELL_FLOAT64:
+          batch->add_float64_cells(cell.double_value);
+          break;
+        case CellsBatch::CELL_STRING:
+          strings.append(cell.bytes_value);
+          strings.push_back('\0');
+          break;
+        case CellsBatch::CELL_BLOB:
+          batch->add_blob_cells(cell.bytes_value);
+          break;
+        case CellsBatch::CELL_NULL:
+        case CellsBatch::CELL_INVALID:
+          break;
+      }
+    }
+  }
+  batch->set_string_cells(std::move(strings));
+  batch->set_is_last_batch(true);
+  return result;
+}
+
+base::Status QueryResultMerger::SetColumns(const std::string& trace,
+                                           const protos::QueryResult& result) {
+  std::vector<std::string> names(result.column_names().begin(),
+                                 result.column_names().end());
+  if (has_columns_) {
+    if (names != column_names_) {
+      return base::ErrStatus("%s: columns differ from the other traces",
+                             trace.c_str());
+    }
+    return base::OkStatus();
+  }
+
+  std::vector<ColumnMerge> merges;
+  for (const std::string& name : names) {
+    std::optional<ColumnMerge> merge;
+    for (const std::string& group_by : spec_.group_by_columns()) {
+      if (group_by == name) {
+        merge = ColumnMerge::kGroupBy;
+      }
+    }
+    for (const Aggregate& aggregate : spec_.aggregates()) {
+      if (aggregate.column() != name) {
+        continue;
+      }
+      if (merge) {
+        return base::ErrStatus("Column '%s' is merged more than once",
+                               name.c_str());
+      }
+      switch (aggregate.op()) {
+        case Aggregate::OP_SUM:
+          merge = ColumnMerge::kSum;
+          break;
+        case Aggregate::OP_MIN:
+          merge = ColumnMerge::kMin;
+          break;
+        case Aggregate::OP_MAX:
+          merge = ColumnMerge::kMax;
+          break;
+        case Aggregate::OP_UNSPECIFIED:
+          return base::ErrStatus("Column '%s' has no merge op", name.c_str());
+      }
+    }
+    if (!merge) {
+      return base::ErrStatus(
+          "Column '%s' is neither a group by column nor aggregated",
+          name.c_str());
+    }
+    merges.push_back(*merge);
+  }
+  for (const std::string& group_by : spec_.group_by_columns()) {
+    if (std::find(names.begin(), names.end(), group_by) == names.end()) {
+      return base::ErrStatus("Group by column '%s' not found in the result",
+                             group_by.c_str());
+    }
+  }
+  for (const Aggregate& aggregate : spec_.aggregates()) {
+    if (std::find(names.begin(), names.end(), aggregate.column()) ==
+        names.end()) {
+      return base::ErrStatus("Aggregated column '%s' not found in the result",
+                             aggregate.column().c_str());
+    }
+  }
+  column_names_ = std::move(names);
+  column_merges_ = std::move(merges);
+  has_columns_ = true;
+  return base::OkStatus();
+}
+
+base::Status QueryResultMerger::AddRow(std::vector<Cell> row) {
+  std::string key;
+  for (uint32_t i = 0; i < row.size(); ++i) {
+    if (column_merges_[i] != ColumnMerge::kGroupBy) {
+      continue;
+    }
+    const Cell& cell = row[i];
+    key.push_back(static_cast<char>(cell.type));
+    switch (cell.type) {
+      case CellsBatch::CELL_VARINT:
+        AppendRaw(&key, cell.long_value);
+        break;
+      case CellsBatch::CELL_FLOAT64:
+        AppendRaw(&key, cell.double_value);
+        break;
+      case CellsBatch::CELL_STRING:
+      case CellsBatch::CELL_BLOB:
+        AppendRaw(&key, static_cast<uint32_t>(cell.bytes_value.size()));
+        key.append(cell.bytes_value);
+        break;
+      case CellsBatch::CELL_NULL:
+      case CellsBatch::CELL_INVALID:
+        break;
+    }
+  }
+
+  uint32_t next_row = static_cast<uint32_t>(rows_.size());
+  auto it_and_inserted = row_for_group_.Insert(std::move(key), next_row);
+  if (it_and_inserted.second) {
+    rows_.emplace_back(std::move(row));
+    return base::OkStatus();
+  }
+  std::vector<Cell>& acc = rows_[*it_and_inserted.first];
+  for (uint32_t i = 0; i < row.size(); ++i) {
+    if (column_merges_[i] != ColumnMerge::kGroupBy) {
+      RETURN_IF_ERROR(MergeCell(i, std::move(row[i]), &acc[i]));
+    }
+  }
+  return base::OkStatus();
+}
+
+base::Status QueryResultMerger::MergeCell(uint32_t col,
+                                          Cell value,
+                                          Cell* acc) {
+  // As in SQL aggregates, NULLs are ignored.
+  if (value.type == CellsBatch::CELL_NULL) {
+    return base::OkStatus();
+  }
+  if (acc->type == CellsBatch::CELL_NULL) {
+    *acc = std::move(value);
+    return base::OkStatus();
+  }
+
+  ColumnMerge merge = column_merges_[col];
+  if (merge == ColumnMerge::kSum) {
+    if (!IsNumeric(value.type) || !IsNumeric(acc->type)) {
+      return base::ErrStatus("Column '%s': cannot sum non-numeric values",
+                             column_names_[col].c_str());
+    }
+    if (value.type == CellsBatch::CELL_VARINT &&
+        acc->type == CellsBatch::CELL_VARINT) {
+      // Same as the SQLite SUM() aggregate, which fails rather than wrapping
+      // around or losing precision.
+      if (__builtin_add_overflow(acc->long_value, value.long_value,
+                                 &acc->long_value)) {
+        return base::ErrStatus("Column '%s': integer overflow",
+                               column_names_[col].c_str());
+      }
+      return base::OkStatus();
+    }
+    double sum = (acc->type == CellsBatch::CELL_VARINT
+                      ? static_cast<double>(acc->long_value)
+                      : acc->double_value) +
+                 (value.type == CellsBatch::CELL_VARINT
+                      ? static_cast<double>(value.long_value)
+                      : value.double_value);
+    acc->type = CellsBatch::CELL_FLOAT64;
+    acc->double_value = sum;
+    return base::OkStatus();
+  }
+
+  // MIN or MAX: compute whether |value| is smaller than |acc|.
+  bool less;
+  int value_rank = TypeRank(value.type);
+  int acc_rank = TypeRank(acc->type);
+  if (value_rank != acc_rank) {
+    less = value_rank < acc_rank;
+  } else if (value.type == CellsBatch::CELL_VARINT &&
+             acc->type == CellsBatch::CELL_VARINT) {
+    less = value.long_value < acc->long_value;
+  } else if (IsNumeric(value.type)) {
+    double v = value.type == CellsBatch::CELL_VARINT
+                   ? static_cast<double>(value.long_value)
+                   : value.double_value;
+    double a = acc->type == CellsBatch::CELL_VARINT
+                   ? static_cast<double>(acc->long_value)
+                   : acc->double_value;
+    less = v < a;
+  } else {
+    less = value.bytes_value < acc->bytes_value;
+  }
+  if (less == (merge == ColumnMerge::kMin)) {
+    *acc = std::move(value);
+  }
+  return base::OkStatus();
+}
+
+}  // namespace bigtrace
+}  // namespace perfetto
@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SRC_BIGTRACE_QUERY_RESULT_MERGER_H_
+#define SRC_BIGTRACE_QUERY_RESULT_MERGER_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "perfetto/base/status.h"
+#include "perfetto/ext/base/flat_hash_map.h"
+#include "protos/perfetto/bigtrace/orchestrator.pb.h"
+#include "protos/perfetto/trace_processor/trace_processor.pb.h"
+
+namespace perfetto {
+namespace bigtrace {
+
+// Merges the results of running the same query on many traces into a single
+// table, as specified by a TracePoolQueryMerge: rows with the same values in
+// the group by columns are combined into one by merging the values of the
+// aggregated columns.
+//
+// Only the rows of each group are kept in memory so the memory use depends
+// on the number of distinct groups rather than the number of traces.
+class QueryResultMerger {
+ public:
+  explicit QueryResultMerger(protos::TracePoolQueryMerge spec);
+  ~QueryResultMerger();
+
+  // Merges a (possibly partial) result of the query on |trace|. Results
+  // containing an error cause an error to be returned.
+  base::Status Add(const std::string& trace, const protos::QueryResult&);
+
+  // Returns the merged result as a single batch.
+  protos::QueryResult Finish();
+
+ private:
+  using CellType = protos::QueryResult::CellsBatch::CellType;
+
+  enum class ColumnMerge {
+    kGroupBy,
+    kSum,
+    kMin,
+    kMax,
+  };
+
+  struct Cell {
+    CellType type = protos::QueryResult::CellsBatch::CELL_NULL;
+    int64_t long_value = 0;
+    double double_value = 0;
+    // The value of string and blob cells.
+    std::string bytes_value;
+  };
+
+  QueryResultMerger(const QueryResultMerger&) = delete;
+  QueryResultMerger& operator=(const QueryResultMerger&) = delete;
+
+  // Resolves how each column should be merged given the column names of the
+  // first result.
+  base::Status SetColumns(const std::string& trace,
+                          const protos::QueryResult&);
+
+  base::Status AddRow(std::vector<Cell> row);
+
+  base::Status MergeCell(uint32_t col, Cell value, Cell* acc);
+
+  protos::TracePoolQueryMerge spec_;
+  std::vector<std::string> column_names_;
+  std::vector<ColumnMerge> column_merges_;
+  bool has_columns_ = false;
+
+  // Maps the encoded values of the group by columns of a row to its index in
+  // |rows_|.
+  base::FlatHashMap<std::string, uint32_t> row_for_group_;
+  std::vector<std::vector<Cell>> rows_;
+};
+
+}  // namespace bigtrace
+}  // namespace perfetto
+
+#endif  // SRC_BIGTRACE_QUERY_RESULT_MERGER_H_
@@ -0,0 +1,210 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "src/bigtrace/query_result_merger.h"
+
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "perfetto/base/status.h"
+#include "protos/perfetto/bigtrace/orchestrator.pb.h"
+#include "protos/perfetto/trace_processor/trace_processor.pb.h"
+#include "test/gtest_and_gmock.h"
+
+namespace perfetto {
+namespace bigtrace {
+namespace {
+
+using testing::ElementsAre;
+using testing::HasSubstr;
+using CellsBatch = protos::QueryResult::CellsBatch;
+using Aggregate = protos::TracePoolQueryMerge::Aggregate;
+
+// A cell in the tests: either NULL, an integer, a double or a string.
+struct TestCell {
+  TestCell() = default;
+  TestCell(int v) : type(CellsBatch::CELL_VARINT), long_value(v) {}
+  TestCell(int64_t v) : type(CellsBatch::CELL_VARINT), long_value(v) {}
+  TestCell(double v) : type(CellsBatch::CELL_FLOAT64), double_value(v) {}
+  TestCell(const char* v) : type(CellsBatch::CELL_STRING), string_value(v) {}
+
+  CellsBatch::CellType type = CellsBatch::CELL_NULL;
+  int64_t long_value = 0;
+  double double_value = 0;
+  std::string string_value;
+};
+
+void AddRows(CellsBatch* batch,
+             const std::vector<std::vector<TestCell>>& rows) {
+  std::string strings = batch->string_cells();
+  for (const auto& row : rows) {
+    for (const TestCell& cell : row) {
+      batch->add_cells(cell.type);
+      if (cell.type == CellsBatch::CELL_VARINT) {
+        batch->add_varint_cells(cell.long_value);
+      } else if (cell.type == CellsBatch::CELL_FLOAT64) {
+        batch->add_float64_cells(cell.double_value);
+      } else if (cell.type == CellsBatch::CELL_STRING) {
+        strings.append(cell.string_value);
+        strings.push_back('\0');
+      }
+    }
+  }
+  batch->set_string_cells(strings);
+}
+
+protos::QueryResult Result(const std::vector<std::string>& columns,
+                           const std::vector<std::vector<TestCell>>& rows) {
+  protos::QueryResult result;
+  for (const std::string& column : columns) {
+    result.add_column_names(column);
+  }
+  AddRows(result.add_batch(), rows);
+  return result;
+}
+
+// Returns the rows of |result| formatted as strings.
+std::vector<std::string> Rows(const protos::QueryResult& result) {
+  std::vector<std::string> rows;
+  const CellsBatch& batch = result.batch(0);
+  int varint = 0;
+  int float64 = 0;
+  size_t string_offset = 0;
+  std::string row;
+  for (int i = 0; i < batch.cells_size(); ++i) {
+    if (i % result.column_names_size() != 0) {
+      row += ",";
+    }
+    switch (batch.cells(i)) {
+      case CellsBatch::CELL_NULL:
+        row += "NULL";
+        break;
+      case CellsBatch::CELL_VARINT:
+        row += std::to_string(batch.varint_cells(varint++));
+        break;
+      case CellsBatch::CELL_FLOAT64:
+        row += std::to_string(batch.float64_cells(float64++));
+        break;
+      case CellsBatch::CELL_STRING: {
+        size_t end = batch.string_cells().find('\0', string_offset);
+        row += batch.string_cells().substr(string_offset, end - string_offset);
+        string_offset = end + 1;
+        break;
+      }
+      default:
+        row += "?";
+    }
+    if ((i + 1) % result.column_names_size() == 0) {
+      rows.push_back(row);
+      row.clear();
+    }
+  }
+  return rows;
+}
+
+protos::TracePoolQueryMerge Spec(const std::vector<std::string>& group_by,
+                                 const std::vector<Aggregate>& aggregates) {
+  protos::TracePoolQueryMerge spec;
+  for (const std::string& column : group_by) {
+    spec.add_group_by_columns(column);
+  }
+  for (const Aggregate& aggregate : aggregates) {
+    *spec.add_aggregates() = aggregate;
+  }
+  return spec;
+}
+
+Aggregate Agg(const std::string& column, Aggregate::Op op) {
+  Aggregate aggregate;
+  aggregate.set_column(column);
+  aggregate.set_op(op);
+  return aggregate;
+}
+
+TEST(QueryResultMergerUnittest, MergesGroups) {
+  QueryResultMerger merger(Spec({"name"}, {Agg("cnt", Aggregate::OP_SUM),
+                                           Agg("lo", Aggregate::OP_MIN),
+                                           Agg("hi", Aggregate::OP_MAX)}));
+  std::vector<std::string> columns = {"name", "cnt", "lo", "hi"};
+  ASSERT_TRUE(merger
+                  .Add("t1", Result(columns, {{"a", 1, 5, 5},
+                                              {"b", 2, 1.5, 3}}))
+                  .ok());
+
+  // The second trace returns its results in two chunks: only the first one
+  // contains the column names.
+  ASSERT_TRUE(merger.Add("t2", Result(columns, {{"a", 3, 2, 10}})).ok());
+  protos::QueryResult chunk;
+  AddRows(chunk.add_batch(), {{"c", 7, TestCell(), "x"}});
+  AddRows(chunk.add_batch(), {{"b", 0.5, 1, 2}});
+  ASSERT_TRUE(merger.Add("t2", chunk).ok());
+
+  protos::QueryResult merged = merger.Finish();
+  EXPECT_THAT(merged.column_names(), ElementsAre("name", "cnt", "lo", "hi"));
+  EXPECT_TRUE(merged.batch(0).is_last_batch());
+  EXPECT_THAT(Rows(merged), ElementsAre("a,4,2,10", "b,2.500000,1,3",
+                                        "c,7,NULL,x"));
+}
+
+TEST(QueryResultMergerUnittest, NullGroupsAndNoGroupBy) {
+  QueryResultMerger by_null(Spec({"k"}, {Agg("v", Aggregate::OP_SUM)}));
+  ASSERT_TRUE(by_null.Add("t1", Result({"k", "v"}, {{TestCell(), 1}})).ok());
+  ASSERT_TRUE(by_null.Add("t2", Result({"k", "v"}, {{TestCell(), 2}})).ok());
+  EXPECT_THAT(Rows(by_null.Finish()), ElementsAre("NULL,3"));
+
+  // Without any group by column, all the rows are merged into one.
+  QueryResultMerger all(Spec({}, {Agg("v", Aggregate::OP_MAX)}));
+  ASSERT_TRUE(all.Add("t1", Result({"v"}, {{1}, {"z"}})).ok());
+  ASSERT_TRUE(all.Add("t2", Result({"v"}, {{3}})).ok());
+  EXPECT_THAT(Rows(all.Finish()), ElementsAre("z"));
+}
+
+TEST(QueryResultMergerUnittest, Errors) {
+  {
+    QueryResultMerger merger(Spec({"k"}, {}));
+    base::Status status = merger.Add("t1", Result({"k", "v"}, {}));
+    EXPECT_THAT(status.message(), HasSubstr("'v' is neither"));
+  }
+  {
+    QueryResultMerger merger(Spec({"k"}, {Agg("v", Aggregate::OP_SUM)}));
+    protos::QueryResult result;
+    result.set_error("no such table: foo");
+    base::Status status = merger.Add("t1", result);
+    EXPECT_EQ(status.message(), "t1: no such table: foo");
+  }
+  {
+    QueryResultMerger merger(Spec({"k"}, {Agg("v", Aggregate::OP_SUM)}));
+    ASSERT_TRUE(merger.Add("t1", Result({"k", "v"}, {{1, 1}})).ok());
+    base::Status status = merger.Add("t2", Result({"k", "w"}, {}));
+    EXPECT_THAT(status.message(), HasSubstr("columns differ"));
+
+    status = merger.Add("t3", Result({"k", "v"}, {{1, "x"}}));
+    EXPECT_THAT(status.message(), HasSubstr("cannot sum"));
+  }
+  {
+    QueryResultMerger merger(Spec({}, {Agg("v", Aggregate::OP_SUM)}));
+    int64_t max = std::numeric_limits<int64_t>::max();
+    ASSERT_TRUE(merger.Add("t1", Result({"v"}, {{max}})).ok());
+    base::Status status = merger.Add("t2", Result({"v"}, {{1}}));
+    EXPECT_THAT(status.message(), HasSubstr("integer overflow"));
+  }
+}
+
+}  // namespace
+}  // namespace bigtrace
+}  // namespace perfetto
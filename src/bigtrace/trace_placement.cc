@@ -0,0 +1,255 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "src/bigtrace/trace_placement.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "perfetto/base/logging.h"
+#include "protos/perfetto/bigtrace/orchestrator.pb.h"
+#include "protos/perfetto/bigtrace/worker.pb.h"
+
+namespace perfetto {
+namespace bigtrace {
+namespace {
+
+// A worker is considered skewed if its estimated memory use is more than this
+// factor larger than the least loaded worker.
+constexpr double kRebalanceSkewFactor = 1.25;
+
+}  // namespace
+
+TracePlacement::TracePlacement(uint32_t worker_count)
+    : workers_(worker_count) {}
+TracePlacement::~TracePlacement() = default;
+
+void TracePlacement::Place(const std::vector<std::string>& traces) {
+  if (workers_.empty()) {
+    return;
+  }
+  FootprintModel model = ComputeFootprintModel();
+  std::vector<uint64_t> loads = EstimatedWorkerLoads(model);
+  for (const std::string& trace : traces) {
+    if (traces_.Find(trace)) {
+      continue;
+    }
+    uint32_t best = 0;
+    for (uint32_t i = 1; i < workers_.size(); ++i) {
+      if (loads[i] < loads[best] ||
+          (loads[i] == loads[best] &&
+           workers_[i].in_flight_queries < workers_[best].in_flight_queries)) {
+        best = i;
+      }
+    }
+    Trace placed;
+    placed.worker = best;
+    loads[best] += EstimatedFootprint(model, placed);
+    traces_.Insert(trace, placed);
+    workers_[best].trace_count++;
+  }
+}
+
+void TracePlacement::Remove(const std::string& trace) {
+  Trace* placed = traces_.Find(trace);
+  if (!placed) {
+    return;
+  }
+  PERFETTO_CHECK(workers_[placed->worker].trace_count-- > 0);
+  traces_.Erase(trace);
+}
+
+std::optional<uint32_t> TracePlacement::WorkerForTrace(
+    const std::string& trace) const {
+  const Trace* placed = traces_.Find(trace);
+  return placed ? std::make_optional(placed->worker) : std::nullopt;
+}
+
+std::vector<std::string> TracePlacement::TracesForWorker(
+    uint32_t worker) const {
+  std::vector<std::string> res;
+  for (auto it = traces_.GetIterator(); it; ++it) {
+    if (it.value().worker == worker) {
+      res.push_back(it.key());
+    }
+  }
+  return res;
+}
+
+void TracePlacement::UpdateWorkerStats(
+    uint32_t worker,
+    const protos::WorkerStatsResponse& stats) {
+  WorkerState& state = workers_[worker];
+  state.rss_bytes = stats.has_rss_bytes()
+                        ? std::make_optional(stats.rss_bytes())
+                        : std::nullopt;
+  state.idle_loaded_bytes = 0;
+  for (const auto& trace_stats : stats.traces()) {
+    if (trace_stats.idle()) {
+      state.idle_loaded_bytes += trace_stats.loaded_bytes();
+      continue;
+    }
+    Trace* trace = traces_.Find(trace_stats.trace());
+    // Ignore traces which were moved away from this worker since the stats
+    // were requested.
+    if (trace && trace->worker == worker) {
+      trace->loaded_bytes = trace_stats.loaded_bytes();
+    }
+  }
+}
+
+void TracePlacement::OnQueryStarted(uint32_t worker) {
+  workers_[worker].in_flight_queries++;
+}
+
+void TracePlacement::OnQueryFinished(uint32_t worker) {
+  PERFETTO_CHECK(workers_[worker].in_flight_queries-- > 0);
+}
+
+std::optional<TracePlacement::Move> TracePlacement::Rebalance() {
+  if (workers_.empty()) {
+    return std::nullopt;
+  }
+  FootprintModel model = ComputeFootprintModel();
+  std::vector<uint64_t> loads = EstimatedWorkerLoads(model);
+  auto [min_it, max_it] = std::minmax_element(loads.begin(), loads.end());
+  uint32_t from = static_cast<uint32_t>(max_it - loads.begin());
+  uint32_t to = static_cast<uint32_t>(min_it - loads.begin());
+  uint64_t diff = *max_it - *min_it;
+  if (static_cast<double>(*max_it) <=
+          kRebalanceSkewFactor * static_cast<double>(*min_it) ||
+      workers_[from].trace_count <= 1) {
+    return std::nullopt;
+  }
+
+  // Moving a trace of footprint f changes the difference between the two
+  // workers to |diff - 2f|: pick the trace minimizing that. Only traces with
+  // f < diff make the placement strictly better.
+  std::optional<std::string> best;
+  uint64_t best_residual = diff;
+  for (auto it = traces_.GetIterator(); it; ++it) {
+    if (it.value().worker != from) {
+      continue;
+    }
+    uint64_t footprint = EstimatedFootprint(model, it.value());
+    if (footprint >= diff) {
+      continue;
+    }
+    uint64_t residual = diff > 2 * footprint ? diff - 2 * footprint
+                                             : 2 * footprint - diff;
+    if (residual < best_residual) {
+      best_residual = residual;
+      best = it.key();
+    }
+  }
+  if (!best) {
+    return std::nullopt;
+  }
+
+  Trace* trace = traces_.Find(*best);
+  trace->worker = to;
+  // The footprint is kept as the estimate until the new worker reloads the
+  // trace and reports it.
+  workers_[from].trace_count--;
+  workers_[to].trace_count++;
+  move_count_++;
+  return Move{*best, from, to};
+}
+
+void TracePlacement::GetStats(
+    protos::TracePlacementStatsResponse* stats) const {
+  std::vector<uint64_t> loads = EstimatedWorkerLoads(ComputeFootprintModel());
+  std::vector<uint64_t> loaded_bytes(workers_.size());
+  for (auto it = traces_.GetIterator(); it; ++it) {
+    loaded_bytes[it.value().worker] += it.value().loaded_bytes.value_or(0);
+  }
+  for (uint32_t i = 0; i < workers_.size(); ++i) {
+    auto* worker = stats->add_workers();
+    worker->set_worker_index(i);
+    worker->set_trace_count(workers_[i].trace_count);
+    worker->set_loaded_bytes(loaded_bytes[i]);
+    worker->set_estimated_memory_bytes(loads[i]);
+    if (workers_[i].rss_bytes) {
+      worker->set_rss_bytes(*workers_[i].rss_bytes);
+    }
+    worker->set_in_flight_queries(workers_[i].in_flight_queries);
+  }
+  stats->set_rebalance_move_count(move_count_);
+}
+
+TracePlacement::FootprintModel TracePlacement::ComputeFootprintModel()
+    const {
+  uint64_t total_loaded = 0;
+  uint64_t loaded_traces = 0;
+  // The bytes loaded by the workers which reported their RSS.
+  uint64_t rss_loaded = 0;
+  for (auto it = traces_.GetIterator(); it; ++it) {
+    const Trace& trace = it.value();
+    if (!trace.loaded_bytes) {
+      continue;
+    }
+    total_loaded += *trace.loaded_bytes;
+    loaded_traces++;
+    if (workers_[trace.worker].rss_bytes) {
+      rss_loaded += *trace.loaded_bytes;
+    }
+  }
+  uint64_t total_rss = 0;
+  for (const WorkerState& worker : workers_) {
+    if (worker.rss_bytes) {
+      total_rss += *worker.rss_bytes;
+      rss_loaded += worker.idle_loaded_bytes;
+    }
+  }
+
+  FootprintModel model;
+  if (loaded_traces > 0) {
+    model.average_loaded_bytes =
+        std::max<uint64_t>(total_loaded / loaded_traces, 1);
+  }
+  if (rss_loaded > 0 && total_rss > rss_loaded) {
+    model.memory_per_loaded_byte =
+        static_cast<double>(total_rss) / static_cast<double>(rss_loaded);
+  }
+  return model;
+}
+
+uint64_t TracePlacement::EstimatedFootprint(const FootprintModel& model,
+                                            const Trace& trace) {
+  uint64_t bytes = trace.loaded_bytes.value_or(model.average_loaded_bytes);
+  return static_cast<uint64_t>(static_cast<double>(bytes) *
+                               model.memory_per_loaded_byte);
+}
+
+std::vector<uint64_t> TracePlacement::EstimatedWorkerLoads(
+    const FootprintModel& model) const {
+  std::vector<uint64_t> loads(workers_.size());
+  for (uint32_t i = 0; i < workers_.size(); ++i) {
+    loads[i] = static_cast<uint64_t>(
+        static_cast<double>(workers_[i].idle_loaded_bytes) *
+        model.memory_per_loaded_byte);
+  }
+  for (auto it = traces_.GetIterator(); it; ++it) {
+    loads[it.value().worker] += EstimatedFootprint(model, it.value());
+  }
+  return loads;
+}
+
+}  // namespace bigtrace
+}  // namespace perfetto
@@ -0,0 +1,131 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SRC_BIGTRACE_TRACE_PLACEMENT_H_
+#define SRC_BIGTRACE_TRACE_PLACEMENT_H_
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "perfetto/ext/base/flat_hash_map.h"
+
+namespace perfetto {
+namespace protos {
+class WorkerStatsResponse;
+class TracePlacementStatsResponse;
+}  // namespace protos
+
+namespace bigtrace {
+
+// Decides which worker each trace is loaded on.
+//
+// The memory footprint of each trace is estimated from the number of bytes
+// parsed by its worker, scaled by the ratio between the RSS of the workers and
+// the total bytes they loaded (trace processor uses a multiple of the size
+// of the trace). Traces whose worker has not reported stats yet are assumed
+// to be of average size. Idle traces kept loaded by a worker count towards its
+// memory use but are never moved.
+//
+// New traces are placed on the worker with the lowest estimated memory use,
+// breaking ties by the number of queries in flight. As the estimates are only
+// known after traces are loaded, workers can still end up skewed:
+// |Rebalance| moves traces from the most to the least loaded worker, which
+// causes the trace to be evicted from the former and reloaded on the latter at
+// the next sync.
+class TracePlacement {
+ public:
+  struct Move {
+    std::string trace;
+    uint32_t from_worker = 0;
+    uint32_t to_worker = 0;
+  };
+
+  explicit TracePlacement(uint32_t worker_count);
+  ~TracePlacement();
+
+  // Assigns each of |traces| which is not yet placed to a worker. Without any
+  // worker the traces are left unplaced.
+  void Place(const std::vector<std::string>& traces);
+
+  // Removes |trace| from the worker it was placed on.
+  void Remove(const std::string& trace);
+
+  // Returns the worker |trace| is placed on, if any.
+  std::optional<uint32_t> WorkerForTrace(const std::string& trace) const;
+
+  // Returns the traces placed on |worker|.
+  std::vector<std::string> TracesForWorker(uint32_t worker) const;
+
+  // Updates the loaded bytes of the traces, the bytes of the idle traces and
+  // the RSS of |worker|.
+  void UpdateWorkerStats(uint32_t worker, const protos::WorkerStatsResponse&);
+
+  // Tracks the number of queries in flight on each worker.
+  void OnQueryStarted(uint32_t worker);
+  void OnQueryFinished(uint32_t worker);
+
+  // If the estimated memory use of the most loaded worker exceeds the least
+  // loaded one by more than the skew threshold, moves the trace which best
+  // evens them out and returns the move. Moves at most one trace per call so
+  // that each move is informed by fresh stats.
+  std::optional<Move> Rebalance();
+
+  void GetStats(protos::TracePlacementStatsResponse*) const;
+
+ private:
+  struct Trace {
+    uint32_t worker = 0;
+    // The number of bytes parsed by the worker, as of the last stats. Unknown
+    // until the trace is loaded.
+    std::optional<uint64_t> loaded_bytes;
+  };
+  struct WorkerState {
+    uint32_t trace_count = 0;
+    uint32_t in_flight_queries = 0;
+    std::optional<uint64_t> rss_bytes;
+    // The bytes loaded by the idle traces of the worker.
+    uint64_t idle_loaded_bytes = 0;
+  };
+
+  struct FootprintModel {
+    // The footprint of traces which were not loaded yet. At least 1 so that
+    // traces are spread evenly before any stats are known.
+    uint64_t average_loaded_bytes = 1;
+    // The memory used by the workers for each byte of trace loaded.
+    double memory_per_loaded_byte = 1;
+  };
+
+  TracePlacement(const TracePlacement&) = delete;
+  TracePlacement& operator=(const TracePlacement&) = delete;
+
+  FootprintModel ComputeFootprintModel() const;
+
+  static uint64_t EstimatedFootprint(const FootprintModel&, const Trace&);
+
+  // Returns the estimated memory footprint of all the traces on each worker.
+  std::vector<uint64_t> EstimatedWorkerLoads(const FootprintModel&) const;
+
+  base::FlatHashMap<std::string, Trace> traces_;
+  std::vector<WorkerState> workers_;
+  uint64_t move_count_ = 0;
+};
+
+}  // namespace bigtrace
+}  // namespace perfetto
+
+#endif  // SRC_BIGTRACE_TRACE_PLACEMENT_H_
@@ -0,0 +1,164 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "src/bigtrace/trace_placement.h"
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "protos/perfetto/bigtrace/orchestrator.pb.h"
+#include "protos/perfetto/bigtrace/worker.pb.h"
+#include "test/gtest_and_gmock.h"
+
+namespace perfetto {
+namespace bigtrace {
+namespace {
+
+using testing::UnorderedElementsAre;
+
+protos::WorkerStatsResponse Stats(
+    std::vector<std::pair<std::string, uint64_t>> traces,
+    std::optional<uint64_t> rss = std::nullopt) {
+  protos::WorkerStatsResponse stats;
+  if (rss) {
+    stats.set_rss_bytes(*rss);
+  }
+  for (const auto& [trace, bytes] : traces) {
+    auto* trace_stats = stats.add_traces();
+    trace_stats->set_trace(trace);
+    trace_stats->set_loaded_bytes(bytes);
+  }
+  return stats;
+}
+
+TEST(TracePlacementUnittest, SpreadsTracesBeforeStatsAreKnown) {
+  TracePlacement placement(3);
+  placement.Place({"a", "b", "c", "d", "e", "f"});
+  for (uint32_t i = 0; i < 3; ++i) {
+    EXPECT_EQ(placement.TracesForWorker(i).size(), 2u);
+  }
+  // Placing a trace again doesn't move it.
+  uint32_t worker = *placement.WorkerForTrace("a");
+  placement.Place({"a"});
+  EXPECT_EQ(*placement.WorkerForTrace("a"), worker);
+  EXPECT_FALSE(placement.WorkerForTrace("z"));
+}
+
+TEST(TracePlacementUnittest, PlacesNewTracesByMemory) {
+  TracePlacement placement(2);
+  placement.Place({"a", "b"});
+  ASSERT_EQ(*placement.WorkerForTrace("a"), 0u);
+  ASSERT_EQ(*placement.WorkerForTrace("b"), 1u);
+  placement.UpdateWorkerStats(0, Stats({{"a", 1000}}, 4000));
+  placement.UpdateWorkerStats(1, Stats({{"b", 10}}, 40));
+
+  // New traces are assumed to be of average size (505 bytes): both fit on the
+  // second worker before it uses more memory than the first one.
+  placement.Place({"c", "d"});
+  EXPECT_THAT(placement.TracesForWorker(1),
+              UnorderedElementsAre("b", "c", "d"));
+
+  // Queries in flight break ties.
+  TracePlacement busy(2);
+  busy.OnQueryStarted(0);
+  busy.Place({"x"});
+  EXPECT_EQ(*busy.WorkerForTrace("x"), 1u);
+  busy.OnQueryFinished(0);
+}
+
+TEST(TracePlacementUnittest, RebalancesSkewedWorkers) {
+  TracePlacement placement(2);
+  placement.Place({"a", "b", "c", "d"});
+  ASSERT_THAT(placement.TracesForWorker(0), UnorderedElementsAre("a", "c"));
+  placement.UpdateWorkerStats(0, Stats({{"a", 100}, {"c", 900}}));
+  placement.UpdateWorkerStats(1, Stats({{"b", 100}, {"d", 100}}));
+
+  // Moving "c" would make the second worker the most loaded one by more than
+  // before: only "a" improves the balance.
+  auto move = placement.Rebalance();
+  ASSERT_TRUE(move);
+  EXPECT_EQ(move->trace, "a");
+  EXPECT_EQ(move->from_worker, 0u);
+  EXPECT_EQ(move->to_worker, 1u);
+  EXPECT_EQ(*placement.WorkerForTrace("a"), 1u);
+
+  // The first worker only has one trace left.
+  EXPECT_FALSE(placement.Rebalance());
+
+  // Stats from the old worker of a moved trace are ignored.
+  placement.UpdateWorkerStats(0, Stats({{"a", 5000}, {"c", 900}}));
+  EXPECT_FALSE(placement.Rebalance());
+
+  protos::TracePlacementStatsResponse stats;
+  placement.GetStats(&stats);
+  ASSERT_EQ(stats.workers_size(), 2);
+  EXPECT_EQ(stats.workers(0).trace_count(), 1u);
+  EXPECT_EQ(stats.workers(0).loaded_bytes(), 900u);
+  EXPECT_EQ(stats.workers(1).trace_count(), 3u);
+  EXPECT_EQ(stats.workers(1).loaded_bytes(), 300u);
+  EXPECT_EQ(stats.rebalance_move_count(), 1u);
+}
+
+TEST(TracePlacementUnittest, CountsIdleTraces) {
+  TracePlacement placement(2);
+  placement.Place({"a", "b"});
+  ASSERT_EQ(*placement.WorkerForTrace("a"), 0u);
+  ASSERT_EQ(*placement.WorkerForTrace("b"), 1u);
+  protos::WorkerStatsResponse stats = Stats({{"a", 100}}, 2200);
+  auto* idle = stats.add_traces();
+  idle->set_trace("z");
+  idle->set_loaded_bytes(1000);
+  idle->set_idle(true);
+  placement.UpdateWorkerStats(0, stats);
+  placement.UpdateWorkerStats(1, Stats({{"b", 100}}, 200));
+
+  // The idle trace is not placed anywhere but uses the memory of the first
+  // worker.
+  EXPECT_FALSE(placement.WorkerForTrace("z"));
+  placement.Place({"c"});
+  EXPECT_EQ(*placement.WorkerForTrace("c"), 1u);
+}
+
+TEST(TracePlacementUnittest, NoWorkers) {
+  TracePlacement placement(0);
+  placement.Place({"a", "b"});
+  EXPECT_FALSE(placement.WorkerForTrace("a"));
+  EXPECT_FALSE(placement.Rebalance());
+
+  protos::TracePlacementStatsResponse stats;
+  placement.GetStats(&stats);
+  EXPECT_EQ(stats.workers_size(), 0);
+}
+
+TEST(TracePlacementUnittest, Remove) {
+  TracePlacement placement(2);
+  placement.Place({"a", "b", "c"});
+  placement.Remove("a");
+  placement.Remove("c");
+  EXPECT_FALSE(placement.WorkerForTrace("a"));
+  EXPECT_TRUE(placement.TracesForWorker(0).empty());
+
+  // The next trace goes to the now empty worker.
+  placement.Place({"d"});
+  EXPECT_EQ(*placement.WorkerForTrace("d"), 0u);
+}
+
+}  // namespace
+}  // namespace bigtrace
+}  // namespace perfetto
@@ -100,6 +100,65 @@ struct QueryRunner {
   bool has_more = true;
 };
 
+// Parses the chunks of a trace in order on the thread pool. The next chunk is
+// pulled from the stream as soon as the previous one starts being parsed, so
+// that reading the trace overlaps with parsing it.
+class ParseChunksImpl : public base::FuturePollable<base::Status> {
+ public:
+  ParseChunksImpl(base::StatusOrStream<TraceBlobView> chunks,
+                  base::ThreadPool* thread_pool,
+                  std::shared_ptr<TraceProcessor> tp,
+                  std::shared_ptr<std::atomic<uint64_t>> loaded_bytes)
+      : chunks_(std::move(chunks)),
+        thread_pool_(thread_pool),
+        tp_(std::move(tp)),
+        loaded_bytes_(std::move(loaded_bytes)) {}
+
+  base::FuturePollResult<base::Status> Poll(base::PollContext* ctx) override {
+    for (;;) {
+      if (!chunks_done_ && !next_chunk_) {
+        auto res = chunks_.PollNext(ctx);
+        if (res.IsDone()) {
+          chunks_done_ = true;
+        } else if (!res.IsPending()) {
+          RETURN_IF_ERROR(res.item().status());
+          next_chunk_ = std::move(*res.item());
+        }
+      }
+      if (parse_) {
+        ASSIGN_OR_RETURN_IF_PENDING_FUTURE(status, parse_->Poll(ctx));
+        RETURN_IF_ERROR(status);
+        parse_ = std::nullopt;
+      }
+      if (next_chunk_) {
+        loaded_bytes_->fetch_add(next_chunk_->size());
+        // shared_ptr as std::function requires the lambda to be copyable.
+        auto chunk = std::make_shared<TraceBlobView>(std::move(*next_chunk_));
+        next_chunk_ = std::nullopt;
+        parse_ = base::RunOnceOnThreadPool<base::Status>(
+            thread_pool_, [tp = tp_, chunk = std::move(chunk)] {
+              return tp->Parse(std::move(*chunk));
+            });
+        continue;
+      }
+      if (chunks_done_) {
+        return base::OkStatus();
+      }
+      return base::PendingPollResult();
+    }
+  }
+
+ private:
+  base::StatusOrStream<TraceBlobView> chunks_;
+  base::ThreadPool* const thread_pool_;
+  std::shared_ptr<TraceProcessor> tp_;
+  std::shared_ptr<std::atomic<uint64_t>> loaded_bytes_;
+
+  bool chunks_done_ = false;
+  std::optional<TraceBlobView> next_chunk_;
+  std::optional<base::StatusFuture> parse_;
+};
+
 }  // namespace
 
 TraceProcessorWrapper::TraceProcessorWrapper(std::string trace_path,
@@ -114,22 +173,13 @@ TraceProcessorWrapper::TraceProcessorWrapper(std::string trace_path,
 }
 
 base::StatusFuture TraceProcessorWrapper::LoadTrace(
-    base::StatusOrStream<std::vector<uint8_t>> file_stream) {
+    base::StatusOrStream<TraceBlobView> chunks) {
   if (trace_processor_.use_count() != 1) {
     return base::ErrStatus("Request is already in flight");
   }
-  return std::move(file_stream)
-      .MapFuture(
-          [thread_pool = thread_pool_, tp = trace_processor_](
-              base::StatusOr<std::vector<uint8_t>> d) -> base::StatusFuture {
-            RETURN_IF_ERROR(d.status());
-            return base::RunOnceOnThreadPool<base::Status>(
-                thread_pool, [res = std::move(*d), tp = std::move(tp)] {
-                  return tp->Parse(TraceBlobView(
-                      TraceBlob::CopyFrom(res.data(), res.size())));
-                });
-          })
-      .Collect(base::AllOkCollector())
+  loaded_bytes_->store(0);
+  return base::MakeFuture<ParseChunksImpl>(std::move(chunks), thread_pool_,
+                                           trace_processor_, loaded_bytes_)
       .ContinueWith([thread_pool = thread_pool_, tp = trace_processor_](
                         base::Status status) -> base::StatusFuture {
         RETURN_IF_ERROR(status);
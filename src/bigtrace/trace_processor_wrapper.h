@@ -17,10 +17,15 @@
 #ifndef SRC_BIGTRACE_TRACE_PROCESSOR_WRAPPER_H_
 #define SRC_BIGTRACE_TRACE_PROCESSOR_WRAPPER_H_
 
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
 #include "perfetto/ext/base/threading/future.h"
 #include "perfetto/ext/base/threading/stream.h"
 #include "perfetto/ext/base/threading/thread_pool.h"
 #include "perfetto/ext/trace_processor/rpc/query_result_serializer.h"
+#include "perfetto/trace_processor/trace_blob_view.h"
 #include "perfetto/trace_processor/trace_processor.h"
 
 namespace perfetto {
@@ -52,15 +57,19 @@ class TraceProcessorWrapper {
                         base::ThreadPool*,
                         Statefulness);
 
-  // Loads the trace given a stream of chunks to parse.
+  // Loads the trace given a stream of chunks to parse. The next chunk is
+  // requested while the previous one is being parsed.
   base::StatusFuture LoadTrace(
-      base::StatusOrStream<std::vector<uint8_t>> file_stream);
+      base::StatusOrStream<trace_processor::TraceBlobView> chunks);
 
   // Executes the given query on the trace processor and returns the results
   // as a stream.
   base::StatusOrStream<protos::QueryTraceResponse> Query(
       const std::string& sql);
 
+  // Returns the number of bytes of the trace passed to trace processor so far.
+  uint64_t loaded_bytes() const { return loaded_bytes_->load(); }
+
  private:
   using TraceProcessor = trace_processor::TraceProcessor;
 
@@ -74,6 +83,10 @@ class TraceProcessorWrapper {
   base::ThreadPool* thread_pool_ = nullptr;
   const Statefulness statefulness_ = Statefulness::kStateless;
   std::shared_ptr<TraceProcessor> trace_processor_;
+
+  // Shared with the load callbacks which can outlive this object.
+  std::shared_ptr<std::atomic<uint64_t>> loaded_bytes_ =
+      std::make_shared<std::atomic<uint64_t>>(0);
 };
 
 }  // namespace bigtrace
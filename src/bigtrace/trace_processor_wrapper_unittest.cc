@@ -29,6 +29,8 @@
 #include "perfetto/ext/base/threading/stream.h"
 #include "perfetto/ext/base/threading/thread_pool.h"
 #include "perfetto/ext/base/threading/util.h"
+#include "perfetto/trace_processor/trace_blob.h"
+#include "perfetto/trace_processor/trace_blob_view.h"
 #include "protos/perfetto/bigtrace/worker.pb.h"
 #include "test/gtest_and_gmock.h"
 
@@ -37,24 +39,26 @@ namespace bigtrace {
 namespace {
 
 using SF = TraceProcessorWrapper::Statefulness;
+using trace_processor::TraceBlob;
+using trace_processor::TraceBlobView;
 
 const char kSimpleSystrace[] = R"--(# tracer
   surfaceflinger-598   (  598) [004] .... 10852.771242: tracing_mark_write: B|598|some event
   surfaceflinger-598   (  598) [004] .... 10852.771245: tracing_mark_write: E|598
 )--";
 
-base::StatusOr<std::vector<uint8_t>> SimpleSystrace() {
-  return std::vector<uint8_t>(kSimpleSystrace,
-                              kSimpleSystrace + strlen(kSimpleSystrace));
+base::StatusOr<TraceBlobView> SimpleSystrace() {
+  return TraceBlobView(
+      TraceBlob::CopyFrom(kSimpleSystrace, strlen(kSimpleSystrace)));
 }
 
-std::vector<base::StatusOr<std::vector<uint8_t>>> SimpleSystraceChunked() {
+std::vector<base::StatusOr<TraceBlobView>> SimpleSystraceChunked() {
   std::string systrace(kSimpleSystrace);
-  std::vector<base::StatusOr<std::vector<uint8_t>>> chunks;
+  std::vector<base::StatusOr<TraceBlobView>> chunks;
   for (auto& chunk : base::SplitString(systrace, "\n")) {
     auto with_newline = chunk + "\n";
-    chunks.push_back(std::vector<uint8_t>(
-        with_newline.data(), with_newline.data() + with_newline.size()));
+    chunks.push_back(TraceBlobView(
+        TraceBlob::CopyFrom(with_newline.data(), with_newline.size())));
   }
 
   return chunks;
@@ -182,7 +186,7 @@ TEST(TraceProcessorWrapperUnittest, Chunked) {
   {
     auto chunked = SimpleSystraceChunked();
     ASSERT_EQ(chunked.size(), 3u);
-    auto load = wrapper.LoadTrace(base::StreamFrom(chunked));
+    auto load = wrapper.LoadTrace(base::StreamFrom(std::move(chunked)));
     base::Status status = WaitForFutureReady(load);
     ASSERT_TRUE(status.ok()) << status.message();
   }
@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "perfetto/ext/bigtrace/trace_store.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "perfetto/ext/base/status_or.h"
+#include "perfetto/ext/base/threading/future.h"
+#include "perfetto/ext/base/threading/stream.h"
+#include "perfetto/ext/bigtrace/environment.h"
+#include "perfetto/trace_processor/trace_blob.h"
+#include "perfetto/trace_processor/trace_blob_view.h"
+#include "src/bigtrace/local_trace_store.h"
+
+namespace perfetto {
+namespace bigtrace {
+namespace {
+
+using trace_processor::TraceBlob;
+using trace_processor::TraceBlobView;
+
+class EnvironmentTraceStore : public TraceStore {
+ public:
+  explicit EnvironmentTraceStore(Environment* environment)
+      : environment_(environment) {}
+
+  base::StatusOrStream<TraceBlobView> ReadTrace(
+      const std::string& path) override {
+    return environment_->ReadFile(path).MapFuture(
+        [](base::StatusOr<std::vector<uint8_t>> chunk) {
+          if (!chunk.ok()) {
+            return base::StatusOrFuture<TraceBlobView>(chunk.status());
+          }
+          return base::StatusOrFuture<TraceBlobView>(
+              TraceBlobView(TraceBlob::CopyFrom(chunk->data(), chunk->size())));
+        });
+  }
+
+  void Prefetch(const std::vector<std::string>&) override {}
+
+ private:
+  Environment* const environment_;
+};
+
+}  // namespace
+
+TraceStore::~TraceStore() = default;
+
+std::unique_ptr<TraceStore> TraceStore::CreateLocal() {
+  return std::make_unique<LocalTraceStore>();
+}
+
+std::unique_ptr<TraceStore> TraceStore::CreateForEnvironment(
+    Environment* environment) {
+  return std::make_unique<EnvironmentTraceStore>(environment);
+}
+
+std::unique_ptr<TraceStore> Environment::CreateTraceStore() {
+  return TraceStore::CreateForEnvironment(this);
+}
+
+}  // namespace bigtrace
+}  // namespace perfetto
@@ -16,17 +16,30 @@
 
 #include "src/bigtrace/worker_impl.h"
 
+#include <cstdint>
+#include <functional>
 #include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
 
+#include "perfetto/base/build_config.h"
 #include "perfetto/base/logging.h"
 #include "perfetto/base/status.h"
 #include "perfetto/base/task_runner.h"
+#include "perfetto/ext/base/file_utils.h"
 #include "perfetto/ext/base/status_or.h"
+#include "perfetto/ext/base/string_utils.h"
 #include "perfetto/ext/base/threading/future.h"
+#include "perfetto/ext/base/threading/poll.h"
 #include "perfetto/ext/base/threading/spawn.h"
 #include "perfetto/ext/base/threading/stream.h"
 #include "perfetto/ext/base/threading/util.h"
+#include "perfetto/ext/base/utils.h"
 #include "perfetto/ext/base/uuid.h"
+#include "perfetto/ext/bigtrace/environment.h"
+#include "perfetto/ext/bigtrace/trace_store.h"
 #include "perfetto/ext/bigtrace/worker.h"
 #include "protos/perfetto/bigtrace/orchestrator.pb.h"
 #include "protos/perfetto/bigtrace/worker.pb.h"
@@ -36,44 +49,139 @@
 namespace perfetto {
 namespace bigtrace {
 
+namespace {
+
+// The maximum number of traces loaded at the same time. Loading is mostly
+// bound by the thread pool so loading more traces at once would only delay
+// the time until the first ones can be queried.
+constexpr uint32_t kMaxConcurrentLoads = 4;
+
+using QueryStream = base::StatusOrStream<protos::QueryTraceResponse>;
+
+// Stream which waits for a trace to be loaded before polling the query stream
+// returned by |query_fn|.
+class QueryAfterLoadImpl
+    : public base::StreamPollable<base::StatusOr<protos::QueryTraceResponse>> {
+ public:
+  QueryAfterLoadImpl(base::StatusFuture load,
+                     std::function<QueryStream()> query_fn)
+      : load_(std::move(load)), query_fn_(std::move(query_fn)) {}
+
+  base::StreamPollResult<base::StatusOr<protos::QueryTraceResponse>> PollNext(
+      base::PollContext* ctx) override {
+    if (!query_) {
+      ASSIGN_OR_RETURN_IF_PENDING_FUTURE(status, load_.Poll(ctx));
+      query_ = status.ok() ? query_fn_()
+                           : base::StreamOf<base::StatusOr<
+                                 protos::QueryTraceResponse>>(status);
+    }
+    return query_->PollNext(ctx);
+  }
+
+ private:
+  base::StatusFuture load_;
+  std::function<QueryStream()> query_fn_;
+  std::optional<QueryStream> query_;
+};
+
+}  // namespace
+
+Environment::~Environment() = default;
+
+std::optional<uint64_t> Environment::GetRssBytes() {
+#if PERFETTO_BUILDFLAG(PERFETTO_OS_LINUX) || \
+    PERFETTO_BUILDFLAG(PERFETTO_OS_ANDROID)
+  // The second field is the number of resident pages.
+  std::string statm;
+  if (!base::ReadFile("/proc/self/statm", &statm)) {
+    return std::nullopt;
+  }
+  std::vector<std::string> fields = base::SplitString(statm, " ");
+  if (fields.size() < 2) {
+    return std::nullopt;
+  }
+  std::optional<uint64_t> pages = base::StringToUInt64(fields[1]);
+  if (!pages) {
+    return std::nullopt;
+  }
+  return *pages * base::GetSysPageSize();
+#else
+  return std::nullopt;
+#endif
+}
+
 Worker::~Worker() = default;
 
-std::unique_ptr<Worker> Worker::CreateInProcesss(base::TaskRunner* runner,
-                                                 Environment* environment,
-                                                 base::ThreadPool* pool) {
-  return std::make_unique<WorkerImpl>(runner, environment, pool);
+std::unique_ptr<Worker> Worker::CreateInProcesss(
+    base::TaskRunner* runner,
+    Environment* environment,
+    base::ThreadPool* pool,
+    uint64_t max_idle_trace_bytes) {
+  return std::make_unique<WorkerImpl>(runner, environment, pool,
+                                      max_idle_trace_bytes);
 }
 
 WorkerImpl::WorkerImpl(base::TaskRunner* runner,
                        Environment* environment,
-                       base::ThreadPool* pool)
-    : task_runner_(runner), environment_(environment), thread_pool_(pool) {}
+                       base::ThreadPool* pool,
+                       uint64_t max_idle_trace_bytes)
+    : task_runner_(runner),
+      environment_(environment),
+      thread_pool_(pool),
+      trace_store_(environment->CreateTraceStore()),
+      max_idle_trace_bytes_(max_idle_trace_bytes) {}
+
+WorkerImpl::~WorkerImpl() = default;
 
 base::StatusOrStream<protos::SyncTraceStateResponse> WorkerImpl::SyncTraceState(
     const protos::SyncTraceStateArgs& args) {
   base::FlatHashMap<std::string, Trace> new_traces;
   std::vector<base::StatusStream> streams;
   for (const std::string& trace : args.traces()) {
-    if (auto* ptr = traces_.Find(trace); ptr) {
-      auto it_and_inserted = new_traces.Insert(trace, std::move(*ptr));
-      PERFETTO_CHECK(it_and_inserted.second);
+    if (new_traces.Find(trace)) {
       continue;
     }
-    auto [handle, stream] =
-        base::SpawnResultFuture<base::Status>(task_runner_, [this, trace] {
-          auto t = traces_.Find(trace);
-          if (!t) {
-            return base::StatusFuture(
-                base::ErrStatus("%s: trace not found", trace.c_str()));
-          }
-          return t->wrapper->LoadTrace(environment_->ReadFile(trace));
-        });
-    auto tp = std::make_unique<TraceProcessorWrapper>(
+    Trace* existing = traces_.Find(trace);
+    // Traces which failed to load are retried.
+    if (existing && existing->state != Trace::State::kFailed) {
+      streams.emplace_back(base::StreamFromFuture(WaitForLoad(existing->load)));
+      new_traces.Insert(trace, std::move(*existing));
+      traces_.Erase(trace);
+      continue;
+    }
+    if (Trace* idle = idle_traces_.Find(trace); idle) {
+      streams.emplace_back(base::StreamFromFuture(WaitForLoad(idle->load)));
+      new_traces.Insert(trace, std::move(*idle));
+      idle_traces_.Erase(trace);
+      idle_lru_.remove(trace);
+      continue;
+    }
+    Trace queued;
+    queued.wrapper = std::make_unique<TraceProcessorWrapper>(
         trace, thread_pool_, TraceProcessorWrapper::Statefulness::kStateless);
-    streams.emplace_back(base::StreamFromFuture(std::move(stream)));
-    new_traces.Insert(trace, Trace{std::move(tp), std::move(handle)});
+    queued.load = std::make_shared<LoadState>();
+    streams.emplace_back(base::StreamFromFuture(WaitForLoad(queued.load)));
+    new_traces.Insert(trace, std::move(queued));
+    load_queue_.push_back(trace);
   }
+
+  // Anything left in |traces_| is not assigned to this worker anymore.
+  base::FlatHashMap<std::string, Trace> old_traces = std::move(traces_);
   traces_ = std::move(new_traces);
+  for (const std::string& trace : args.unload_traces()) {
+    if (Trace* old = old_traces.Find(trace); old) {
+      Unload(trace, std::move(*old));
+      old_traces.Erase(trace);
+    } else if (idle_traces_.Erase(trace)) {
+      idle_lru_.remove(trace);
+    }
+  }
+  for (auto it = old_traces.GetIterator(); it; ++it) {
+    Retire(it.key(), std::move(it.value()));
+  }
+  EvictIdleTraces();
+  StartQueuedLoads();
+
   return base::FlattenStreams(std::move(streams))
       .MapFuture([](base::Status status) {
         if (!status.ok()) {
@@ -91,7 +199,167 @@ base::StatusOrStream<protos::QueryTraceResponse> WorkerImpl::QueryTrace(
     return base::StreamOf<base::StatusOr<protos::QueryTraceResponse>>(
         base::ErrStatus("%s: trace not found", args.trace().c_str()));
   }
-  return tp->wrapper->Query(args.sql_query());
+  if (tp->state == Trace::State::kLoaded) {
+    return tp->wrapper->Query(args.sql_query());
+  }
+  if (tp->state == Trace::State::kQueued) {
+    // Someone is waiting for this trace: load it before the other queued ones.
+    load_queue_.remove(args.trace());
+    load_queue_.push_front(args.trace());
+  }
+  return base::MakeStream<QueryAfterLoadImpl>(
+      WaitForLoad(tp->load), [this, args]() {
+        // The trace could have been unassigned since the load finished.
+        auto* loaded = traces_.Find(args.trace());
+        if (!loaded || loaded->state != Trace::State::kLoaded) {
+          return base::StreamOf<base::StatusOr<protos::QueryTraceResponse>>(
+              base::ErrStatus("%s: trace not loaded", args.trace().c_str()));
+        }
+        return loaded->wrapper->Query(args.sql_query());
+      });
+}
+
+base::StatusOrFuture<protos::WorkerStatsResponse> WorkerImpl::WorkerStats(
+    const protos::WorkerStatsArgs&) {
+  protos::WorkerStatsResponse resp;
+  if (std::optional<uint64_t> rss = environment_->GetRssBytes(); rss) {
+    resp.set_rss_bytes(*rss);
+  }
+  for (auto it = traces_.GetIterator(); it; ++it) {
+    if (it.value().state != Trace::State::kLoaded) {
+      continue;
+    }
+    auto* trace = resp.add_traces();
+    trace->set_trace(it.key());
+    trace->set_loaded_bytes(it.value().wrapper->loaded_bytes());
+  }
+  // Idle traces are not assigned to this worker but still use its memory.
+  for (auto it = idle_traces_.GetIterator(); it; ++it) {
+    auto* trace = resp.add_traces();
+    trace->set_trace(it.key());
+    trace->set_loaded_bytes(it.value().wrapper->loaded_bytes());
+    trace->set_idle(true);
+  }
+  return resp;
+}
+
+base::StatusFuture WorkerImpl::WaitForLoad(std::shared_ptr<LoadState> load) {
+  class WaitForLoadImpl : public base::FuturePollable<base::Status> {
+   public:
+    explicit WaitForLoadImpl(std::shared_ptr<LoadState> load)
+        : load_(std::move(load)) {}
+
+    base::FuturePollResult<base::Status> Poll(base::PollContext* ctx) override {
+      if (!load_->done.ReadNonBlocking().is_closed) {
+        ctx->RegisterInterested(load_->done.read_fd());
+        return base::PendingPollResult();
+      }
+      return load_->status;
+    }
+
+   private:
+    std::shared_ptr<LoadState> load_;
+  };
+  return base::MakeFuture<WaitForLoadImpl>(std::move(load));
+}
+
+void WorkerImpl::StartQueuedLoads() {
+  while (loads_in_flight_ < kMaxConcurrentLoads && !load_queue_.empty()) {
+    std::string name = std::move(load_queue_.front());
+    load_queue_.pop_front();
+    Trace* trace = traces_.Find(name);
+    PERFETTO_CHECK(trace && trace->state == Trace::State::kQueued);
+    trace->state = Trace::State::kLoading;
+    loads_in_flight_++;
+    // The spawned function and its continuation can still run after the
+    // handle is destroyed: |load| identifies the load they belong to.
+    std::shared_ptr<LoadState> load = trace->load;
+    trace->load_handle = base::SpawnFuture(task_runner_, [this, name, load]() {
+      auto* t = traces_.Find(name);
+      if (!t || t->load != load) {
+        return base::Future<base::FVoid>(base::FVoid());
+      }
+      return t->wrapper->LoadTrace(trace_store_->ReadTrace(name))
+          .ContinueWith([this, name, load](base::Status status) {
+            OnLoadFinished(name, load, std::move(status));
+            return base::Future<base::FVoid>(base::FVoid());
+          });
+    });
+  }
+
+  // Fetch the traces which will be loaded next while the ones above parse.
+  std::vector<std::string> next;
+  auto it = load_queue_.begin();
+  for (uint32_t i = 0; i < kMaxConcurrentLoads && it != load_queue_.end();
+       ++i, ++it) {
+    Trace* trace = traces_.Find(*it);
+    if (!trace->prefetched) {
+      trace->prefetched = true;
+      next.push_back(*it);
+    }
+  }
+  if (!next.empty()) {
+    trace_store_->Prefetch(next);
+  }
+}
+
+void WorkerImpl::OnLoadFinished(const std::string& name,
+                                const std::shared_ptr<LoadState>& load,
+                                base::Status status) {
+  Trace* trace = traces_.Find(name);
+  if (!trace || trace->load != load) {
+    // The trace was unloaded while loading.
+    return;
+  }
+  PERFETTO_CHECK(trace->state == Trace::State::kLoading);
+  trace->state = status.ok() ? Trace::State::kLoaded : Trace::State::kFailed;
+  load->status = std::move(status);
+  load->done.Close();
+  // Note: |load_handle| is not reset as we are running inside it.
+  loads_in_flight_--;
+  StartQueuedLoads();
+}
+
+void WorkerImpl::Retire(const std::string& name, Trace trace) {
+  if (trace.state != Trace::State::kLoaded) {
+    Unload(name, std::move(trace));
+    return;
+  }
+  idle_lru_.push_front(name);
+  idle_traces_.Insert(name, std::move(trace));
+}
+
+void WorkerImpl::Unload(const std::string& name, Trace trace) {
+  switch (trace.state) {
+    case Trace::State::kQueued:
+      load_queue_.remove(name);
+      break;
+    case Trace::State::kLoading:
+      loads_in_flight_--;
+      break;
+    case Trace::State::kLoaded:
+    case Trace::State::kFailed:
+      return;
+  }
+  // Fail any query waiting for the load.
+  trace.load->status = base::ErrStatus("%s: trace unloaded", name.c_str());
+  trace.load->done.Close();
+}
+
+void WorkerImpl::EvictIdleTraces() {
+  uint64_t idle_bytes = 0;
+  for (auto it = idle_traces_.GetIterator(); it; ++it) {
+    idle_bytes += it.value().wrapper->loaded_bytes();
+  }
+  while (idle_bytes > max_idle_trace_bytes_) {
+    PERFETTO_CHECK(!idle_lru_.empty());
+    std::string name = std::move(idle_lru_.back());
+    idle_lru_.pop_back();
+    Trace* trace = idle_traces_.Find(name);
+    PERFETTO_CHECK(trace);
+    idle_bytes -= trace->wrapper->loaded_bytes();
+    idle_traces_.Erase(name);
+  }
 }
 
 }  // namespace bigtrace
@@ -17,16 +17,22 @@
 #ifndef SRC_BIGTRACE_WORKER_IMPL_H_
 #define SRC_BIGTRACE_WORKER_IMPL_H_
 
+#include <cstdint>
+#include <list>
 #include <memory>
 #include <optional>
+#include <string>
 #include <variant>
 #include <vector>
 
+#include "perfetto/base/status.h"
 #include "perfetto/base/task_runner.h"
 #include "perfetto/ext/base/flat_hash_map.h"
+#include "perfetto/ext/base/threading/channel.h"
 #include "perfetto/ext/base/threading/spawn.h"
 #include "perfetto/ext/base/threading/thread_pool.h"
 #include "perfetto/ext/bigtrace/environment.h"
+#include "perfetto/ext/bigtrace/trace_store.h"
 #include "perfetto/ext/bigtrace/worker.h"
 #include "src/bigtrace/trace_processor_wrapper.h"
 
@@ -41,9 +47,23 @@ enum GroupType : int;
 namespace perfetto {
 namespace bigtrace {
 
+// Implementation of Worker which loads traces in-process.
+//
+// At most |kMaxConcurrentLoads| traces are loaded at the same time: the others
+// wait in a queue, with traces which are queried being moved to its front.
+// Queries on traces which are not loaded yet wait for the load to finish.
+//
+// Loaded traces which are not assigned to this worker anymore are kept
+// "warm" in an LRU cache, bounded by the number of bytes loaded, so that they
+// don't need to be reloaded if they are assigned again (e.g. when a pool with
+// the same traces is recreated).
 class WorkerImpl : public Worker {
  public:
-  explicit WorkerImpl(base::TaskRunner*, Environment*, base::ThreadPool*);
+  WorkerImpl(base::TaskRunner*,
+             Environment*,
+             base::ThreadPool*,
+             uint64_t max_idle_trace_bytes);
+  ~WorkerImpl() override;
 
   // Synchronize the state of the traces in the worker to the orchestrator.
   base::StatusOrStream<protos::SyncTraceStateResponse> SyncTraceState(
@@ -53,15 +73,73 @@ class WorkerImpl : public Worker {
   base::StatusOrStream<protos::QueryTraceResponse> QueryTrace(
       const protos::QueryTraceArgs&) override;
 
+  // Returns the resource usage of the worker and of each loaded trace.
+  base::StatusOrFuture<protos::WorkerStatsResponse> WorkerStats(
+      const protos::WorkerStatsArgs&) override;
+
  private:
+  // The state of the load of a trace, shared with the futures waiting for it.
+  struct LoadState {
+    // Closed when the load finishes, after |status| is set.
+    base::Channel<base::FVoid> done{1};
+    base::Status status;
+  };
   struct Trace {
+    enum class State {
+      kQueued,
+      kLoading,
+      kLoaded,
+      kFailed,
+    };
     std::unique_ptr<TraceProcessorWrapper> wrapper;
-    base::SpawnHandle load_handle;
+    std::shared_ptr<LoadState> load;
+    State state = State::kQueued;
+    // Whether the trace store was asked to prefetch the trace.
+    bool prefetched = false;
+    // Set once the load of the trace has started.
+    std::optional<base::SpawnHandle> load_handle;
   };
+
+  // Returns a future which completes with the status of |load| once it
+  // finishes.
+  static base::StatusFuture WaitForLoad(std::shared_ptr<LoadState> load);
+
+  // Starts loading the traces at the front of |load_queue_| until
+  // |kMaxConcurrentLoads| traces are being loaded and prefetches the traces
+  // which will be loaded next.
+  void StartQueuedLoads();
+  void OnLoadFinished(const std::string& trace,
+                      const std::shared_ptr<LoadState>&,
+                      base::Status);
+
+  // Moves |trace|, which is not assigned to this worker anymore, to the idle
+  // traces if it is loaded or unloads it otherwise.
+  void Retire(const std::string& name, Trace trace);
+
+  // Unloads |trace|, failing any pending load.
+  void Unload(const std::string& name, Trace trace);
+
+  // Unloads the least recently used idle traces until the idle traces fit in
+  // |max_idle_trace_bytes_|.
+  void EvictIdleTraces();
+
   base::TaskRunner* const task_runner_;
   Environment* const environment_;
   base::ThreadPool* const thread_pool_;
+  std::unique_ptr<TraceStore> trace_store_;
+  const uint64_t max_idle_trace_bytes_;
+
+  // The traces assigned to this worker.
   base::FlatHashMap<std::string, Trace> traces_;
+
+  // The traces waiting to be loaded, in the order they will be loaded in.
+  std::list<std::string> load_queue_;
+  uint32_t loads_in_flight_ = 0;
+
+  // Loaded traces not assigned to this worker anymore and their names, most
+  // recently used first.
+  base::FlatHashMap<std::string, Trace> idle_traces_;
+  std::list<std::string> idle_lru_;
 };
 
 }  // namespace bigtrace
@@ -0,0 +1,211 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "src/bigtrace/worker_impl.h"
+
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "perfetto/base/build_config.h"
+#include "perfetto/base/status.h"
+#include "perfetto/ext/base/status_or.h"
+#include "perfetto/ext/base/threading/future.h"
+#include "perfetto/ext/base/threading/spawn.h"
+#include "perfetto/ext/base/threading/stream.h"
+#include "perfetto/ext/base/threading/thread_pool.h"
+#include "perfetto/ext/bigtrace/environment.h"
+#include "protos/perfetto/bigtrace/worker.pb.h"
+#include "src/base/test/test_task_runner.h"
+#include "test/gtest_and_gmock.h"
+
+namespace perfetto {
+namespace bigtrace {
+namespace {
+
+using testing::ElementsAre;
+
+const char kSimpleSystrace[] = R"--(# tracer
+  surfaceflinger-598   (  598) [004] .... 10852.771242: tracing_mark_write: B|598|some event
+  surfaceflinger-598   (  598) [004] .... 10852.771245: tracing_mark_write: E|598
+)--";
+
+// Environment returning the same trace for any path and recording the paths
+// which were read.
+class FakeEnvironment : public Environment {
+ public:
+  base::StatusOrStream<std::vector<uint8_t>> ReadFile(
+      const std::string& path) override {
+    reads.push_back(path);
+    return base::StreamOf(base::StatusOr<std::vector<uint8_t>>(
+        std::vector<uint8_t>(kSimpleSystrace,
+                             kSimpleSystrace + strlen(kSimpleSystrace))));
+  }
+
+  std::vector<std::string> reads;
+};
+
+class WorkerImplUnittest : public testing::Test {
+ protected:
+  // Polls |stream| to completion on the task runner, returning all its items.
+  template <typename T>
+  base::StatusOr<std::vector<T>> Drain(base::StatusOrStream<T> stream) {
+    std::string checkpoint = "drained_" + std::to_string(drain_count_++);
+    auto drained = task_runner_.CreateCheckpoint(checkpoint);
+    std::optional<base::StatusOr<std::vector<T>>> result;
+    base::SpawnHandle handle = base::SpawnFuture(&task_runner_, [&]() {
+      return std::move(stream)
+          .Collect(base::StatusOrVectorCollector<T>())
+          .ContinueWith([&](base::StatusOr<std::vector<T>> res) {
+            result = std::move(res);
+            drained();
+            return base::Future<base::FVoid>(base::FVoid());
+          });
+    });
+    task_runner_.RunUntilCheckpoint(checkpoint);
+    return std::move(*result);
+  }
+
+  base::StatusOrStream<protos::SyncTraceStateResponse> Sync(
+      Worker* worker,
+      const std::vector<std::string>& traces) {
+    protos::SyncTraceStateArgs args;
+    for (const std::string& trace : traces) {
+      args.add_traces(trace);
+    }
+    return worker->SyncTraceState(args);
+  }
+
+  base::StatusOrStream<protos::QueryTraceResponse> Query(
+      Worker* worker,
+      const std::string& trace) {
+    protos::QueryTraceArgs args;
+    args.set_trace(trace);
+    args.set_sql_query("SELECT COUNT(*) FROM slice");
+    return worker->QueryTrace(args);
+  }
+
+  protos::WorkerStatsResponse Stats(Worker* worker) {
+    protos::WorkerStatsResponse stats;
+    base::SpawnHandle handle = base::SpawnFuture(&task_runner_, [&]() {
+      return worker->WorkerStats(protos::WorkerStatsArgs())
+          .ContinueWith([&](base::StatusOr<protos::WorkerStatsResponse> res) {
+            stats = *res;
+            return base::Future<base::FVoid>(base::FVoid());
+          });
+    });
+    task_runner_.RunUntilIdle();
+    return stats;
+  }
+
+  base::TestTaskRunner task_runner_;
+  base::ThreadPool pool_{1};
+  FakeEnvironment env_;
+  uint32_t drain_count_ = 0;
+};
+
+TEST_F(WorkerImplUnittest, QueryWaitsForLoad) {
+  WorkerImpl worker(&task_runner_, &env_, &pool_,
+                    Worker::kDefaultMaxIdleTraceBytes);
+  auto sync = Sync(&worker, {"a"});
+
+  // The query is issued before the load had a chance to start.
+  auto query = Drain(Query(&worker, "a"));
+  ASSERT_TRUE(query.ok()) << query.status().message();
+  ASSERT_FALSE(query->empty());
+  EXPECT_EQ(query->front().trace(), "a");
+  EXPECT_FALSE(query->front().result().has_error());
+
+  auto synced = Drain(std::move(sync));
+  ASSERT_TRUE(synced.ok()) << synced.status().message();
+
+  auto missing = Drain(Query(&worker, "b"));
+  EXPECT_FALSE(missing.ok());
+}
+
+TEST_F(WorkerImplUnittest, ReusesIdleTraces) {
+  WorkerImpl worker(&task_runner_, &env_, &pool_,
+                    Worker::kDefaultMaxIdleTraceBytes);
+  ASSERT_TRUE(Drain(Sync(&worker, {"a"})).ok());
+
+  // "a" is not assigned anymore but is kept loaded.
+  ASSERT_TRUE(Drain(Sync(&worker, {})).ok());
+  EXPECT_FALSE(Drain(Query(&worker, "a")).ok());
+
+  ASSERT_TRUE(Drain(Sync(&worker, {"a"})).ok());
+  EXPECT_TRUE(Drain(Query(&worker, "a")).ok());
+  EXPECT_THAT(env_.reads, ElementsAre("a"));
+}
+
+TEST_F(WorkerImplUnittest, EvictsIdleTracesOverBudget) {
+  WorkerImpl worker(&task_runner_, &env_, &pool_, 0);
+  ASSERT_TRUE(Drain(Sync(&worker, {"a"})).ok());
+  ASSERT_TRUE(Drain(Sync(&worker, {})).ok());
+  ASSERT_TRUE(Drain(Sync(&worker, {"a"})).ok());
+  EXPECT_THAT(env_.reads, ElementsAre("a", "a"));
+}
+
+TEST_F(WorkerImplUnittest, LoadsQueriedTracesFirst) {
+  WorkerImpl worker(&task_runner_, &env_, &pool_,
+                    Worker::kDefaultMaxIdleTraceBytes);
+  auto sync = Sync(&worker, {"a", "b", "c", "d", "e", "f"});
+
+  // Only four traces are loaded at once: "f" jumps ahead of "e" as it is
+  // queried.
+  auto query = Drain(Query(&worker, "f"));
+  ASSERT_TRUE(query.ok()) << query.status().message();
+  ASSERT_TRUE(Drain(std::move(sync)).ok());
+  EXPECT_THAT(env_.reads, ElementsAre("a", "b", "c", "d", "f", "e"));
+  EXPECT_EQ(Stats(&worker).traces_size(), 6);
+}
+
+TEST_F(WorkerImplUnittest, UnloadsMovedTraces) {
+  WorkerImpl worker(&task_runner_, &env_, &pool_,
+                    Worker::kDefaultMaxIdleTraceBytes);
+  ASSERT_TRUE(Drain(Sync(&worker, {"a"})).ok());
+
+  // "a" was moved to another worker: it is not kept idle.
+  protos::SyncTraceStateArgs args;
+  args.add_unload_traces("a");
+  ASSERT_TRUE(Drain(worker.SyncTraceState(args)).ok());
+  EXPECT_EQ(Stats(&worker).traces_size(), 0);
+
+  ASSERT_TRUE(Drain(Sync(&worker, {"a"})).ok());
+  EXPECT_THAT(env_.reads, ElementsAre("a", "a"));
+}
+
+TEST_F(WorkerImplUnittest, StatsIncludeIdleTracesAndRss) {
+  WorkerImpl worker(&task_runner_, &env_, &pool_,
+                    Worker::kDefaultMaxIdleTraceBytes);
+  ASSERT_TRUE(Drain(Sync(&worker, {"a"})).ok());
+  ASSERT_TRUE(Drain(Sync(&worker, {})).ok());
+
+  protos::WorkerStatsResponse stats = Stats(&worker);
+  ASSERT_EQ(stats.traces_size(), 1);
+  EXPECT_EQ(stats.traces(0).trace(), "a");
+  EXPECT_TRUE(stats.traces(0).idle());
+  EXPECT_GT(stats.traces(0).loaded_bytes(), 0u);
+#if PERFETTO_BUILDFLAG(PERFETTO_OS_LINUX) || \
+    PERFETTO_BUILDFLAG(PERFETTO_OS_ANDROID)
+  EXPECT_GT(stats.rss_bytes(), 0u);
+#endif
+}
+
+}  // namespace
+}  // namespace bigtrace
+}  // namespace perfetto
@@ -16,6 +16,10 @@
 
 #include "src/protozero/filtering/message_filter.h"
 
+#include <string.h>
+
+#include <algorithm>
+
 #include "perfetto/base/logging.h"
 #include "perfetto/protozero/proto_utils.h"
 #include "src/protozero/filtering/string_filter.h"
@@ -126,8 +130,28 @@ MessageFilter::FilteredMessage MessageFilter::FilterMessageFragments(
   for (size_t slice_idx = 0; slice_idx < num_slices; ++slice_idx) {
     const InputSlice& slice = slices[slice_idx];
     const uint8_t* data = static_cast<const uint8_t*>(slice.data);
-    for (size_t i = 0; i < slice.len; ++i)
-      FilterOneByte(data[i]);
+    for (size_t i = 0; i < slice.len;) {
+      // Fastpath for the payload of strings, bytes and non-allowed
+      // submessages: copy (or skip) all of it but the last byte in one go. The
+      // last byte goes through FilterOneByte(), which takes care of filtering
+      // strings and popping the stack at the end of the field. Until then the
+      // field can't reach the end of the current message (the field length
+      // was checked against the message length when it started).
+      StackState* state = &stack_.back();
+      if (state->eat_next_bytes > 1) {
+        const uint32_t len = static_cast<uint32_t>(
+            std::min<size_t>(state->eat_next_bytes - 1, slice.len - i));
+        if (state->action != StackState::kDrop) {
+          memcpy(out_, &data[i], len);
+          out_ += len;
+        }
+        state->eat_next_bytes -= len;
+        state->in_bytes += len;
+        i += len;
+        continue;
+      }
+      FilterOneByte(data[i++]);
+    }
   }
 
   // Construct the output object.
@@ -141,7 +141,10 @@ class MessageFilter {
   StringFilter& string_filter() { return config_.string_filter(); }
 
  private:
-  // This is called by FilterMessageFragments().
+  // This is called by FilterMessageFragments() for every input byte, except
+  // for the payload of len-delimited fields that are not parsed (strings,
+  // bytes, denied submessages): all but their last byte is copied or skipped
+  // in bulk.
   // Inlining allows the compiler turn the per-byte call/return into a for loop,
   // while, at the same time, keeping the code easy to read and reason about.
   // It gives a 20-25% speedup (265ms vs 215ms for a 25MB trace).
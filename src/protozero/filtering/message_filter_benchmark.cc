@@ -18,9 +18,52 @@
 #include <string>
 
 #include "perfetto/ext/base/file_utils.h"
+#include "perfetto/protozero/scattered_heap_buffer.h"
 #include "src/base/test/utils.h"
+#include "src/protozero/filtering/filter_bytecode_generator.h"
 #include "src/protozero/filtering/message_filter.h"
 
+namespace {
+
+// A trace whose packets are dominated by large bytes fields, like the ones of
+// heap profiles or of raw ftrace data. Half of the large fields are allowed by
+// the filter returned by CreateLargeFieldsFilter(), the other half are not.
+std::string CreateLargeFieldsTrace() {
+  const std::string allowed_payload(1024, 'a');
+  const std::string denied_payload(512, 'd');
+  protozero::HeapBuffered<protozero::Message> trace;
+  for (uint32_t i = 0; i < 1000; i++) {
+    auto* packet = trace->BeginNestedMessage<protozero::Message>(1);
+    packet->AppendVarInt(1, 1000000ull * i);
+    auto* nested = packet->BeginNestedMessage<protozero::Message>(2);
+    nested->AppendVarInt(1, i);
+    nested->AppendString(2, "process_name");
+    nested->Finalize();
+    packet->AppendBytes(3, allowed_payload.data(), allowed_payload.size());
+    packet->AppendBytes(4, denied_payload.data(), denied_payload.size());
+    packet->Finalize();
+  }
+  return trace.SerializeAsString();
+}
+
+std::string CreateLargeFieldsFilter() {
+  protozero::FilterBytecodeGenerator gen;
+  // Message 0: the trace.
+  gen.AddNestedField(1, 1);
+  gen.EndMessage();
+  // Message 1: the packet.
+  gen.AddSimpleField(1);
+  gen.AddNestedField(2, 2);
+  gen.AddSimpleField(3);
+  gen.EndMessage();
+  // Message 2: the nested message in the packet.
+  gen.AddSimpleFieldRange(1, 2);
+  gen.EndMessage();
+  return gen.Serialize();
+}
+
+}  // namespace
+
 static void BM_ProtozeroMessageFilter(benchmark::State& state) {
   std::string trace_data;
   static const char kTestTrace[] = "test/data/example_android_trace_30s.pb";
@@ -46,3 +89,21 @@ static void BM_ProtozeroMessageFilter(benchmark::State& state) {
 }
 
 BENCHMARK(BM_ProtozeroMessageFilter);
+
+static void BM_ProtozeroMessageFilterLargeFields(benchmark::State& state) {
+  const std::string trace_data = CreateLargeFieldsTrace();
+  const std::string filter = CreateLargeFieldsFilter();
+
+  protozero::MessageFilter filt;
+  PERFETTO_CHECK(filt.LoadFilterBytecode(filter.data(), filter.size()));
+
+  for (auto _ : state) {
+    auto res = filt.FilterMessage(trace_data.data(), trace_data.size());
+    benchmark::DoNotOptimize(res);
+    benchmark::ClobberMemory();
+  }
+  state.SetBytesProcessed(
+      static_cast<int64_t>(state.iterations() * trace_data.size()));
+}
+
+BENCHMARK(BM_ProtozeroMessageFilterLargeFields);
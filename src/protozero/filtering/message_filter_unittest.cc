@@ -320,6 +320,84 @@ TEST(MessageFilterTest, StringFilter) {
   ASSERT_LT(filtered.size, encoded.size());
 }
 
+// Large string and bytes fields are copied or skipped in bulk. Checks that
+// the output is right when their payload spans several input slices.
+TEST(MessageFilterTest, LargeFieldsInFragments) {
+  auto schema = perfetto::base::TempFile::Create();
+  static const char kSchema[] = R"(
+  syntax = "proto2";
+  message FilterSchema {
+    message Nested {
+      optional bytes blob = 1;
+    }
+    optional bytes blob = 1;
+    optional string str = 2;
+    repeated Nested nest = 3;
+    optional int32 i32 = 5;
+  };
+  )";
+
+  perfetto::base::WriteAll(*schema, kSchema, strlen(kSchema));
+  perfetto::base::FlushFile(*schema);
+
+  FilterUtil filter;
+  ASSERT_TRUE(filter.LoadMessageDefinition(schema.path(), "", "", {},
+                                           {"FilterSchema:str"}));
+  std::string bytecode = filter.GenerateFilterBytecode();
+  ASSERT_GT(bytecode.size(), 0u);
+
+  const std::string blob(1000, 'x');
+  const std::string nested_blob(500, 'z');
+  const std::string denied(700, 'y');
+  const std::string str = "B|1234|foo " + std::string(300, 's');
+
+  HeapBuffered<Message> msg;
+  msg->AppendBytes(/*field_id=*/1, blob.data(), blob.size());
+  msg->AppendBytes(/*field_id=*/4, denied.data(), denied.size());
+  msg->AppendString(/*field_id=*/2, str);
+  auto* nest = msg->BeginNestedMessage<Message>(/*field_id=*/3);
+  nest->AppendBytes(/*field_id=*/1, nested_blob.data(), nested_blob.size());
+  nest->AppendBytes(/*field_id=*/9, denied.data(), denied.size());
+  nest->Finalize();
+  msg->AppendVarInt(/*field_id=*/5, 42);
+  std::vector<uint8_t> encoded = msg.SerializeAsArray();
+
+  MessageFilter flt;
+  ASSERT_TRUE(flt.LoadFilterBytecode(bytecode.data(), bytecode.size()));
+  flt.string_filter().AddRule(StringFilter::Policy::kMatchRedactGroups,
+                              R"(B\|\d+\|foo (.*))", "");
+
+  std::vector<MessageFilter::InputSlice> input_slices;
+  for (size_t i = 0; i < encoded.size(); i += 7) {
+    input_slices.emplace_back(MessageFilter::InputSlice{
+        &encoded[i], std::min<size_t>(7, encoded.size() - i)});
+  }
+  auto filtered =
+      flt.FilterMessageFragments(input_slices.data(), input_slices.size());
+  ASSERT_FALSE(filtered.error);
+
+  // The output must not depend on how the input is fragmented.
+  auto filtered_contiguous = flt.FilterMessage(encoded.data(), encoded.size());
+  ASSERT_FALSE(filtered_contiguous.error);
+  ASSERT_EQ(std::string(reinterpret_cast<char*>(filtered.data.get()),
+                        filtered.size),
+            std::string(reinterpret_cast<char*>(filtered_contiguous.data.get()),
+                        filtered_contiguous.size));
+
+  ProtoDecoder dec(filtered.data.get(), filtered.size);
+  EXPECT_EQ(dec.FindField(1).as_std_string(), blob);
+  EXPECT_FALSE(dec.FindField(4).valid());
+  std::string filtered_str = dec.FindField(2).as_std_string();
+  EXPECT_EQ(filtered_str.size(), str.size());
+  EXPECT_TRUE(
+      perfetto::base::StartsWith(filtered_str, "B|1234|foo P60REDACTED"));
+  ASSERT_TRUE(dec.FindField(3).valid());
+  ProtoDecoder nest_dec(dec.FindField(3).as_bytes());
+  EXPECT_EQ(nest_dec.FindField(1).as_std_string(), nested_blob);
+  EXPECT_FALSE(nest_dec.FindField(9).valid());
+  EXPECT_EQ(dec.FindField(5).as_int32(), 42);
+}
+
 TEST(MessageFilterTest, MalformedInput) {
   // Create and load a simple filter.
   auto schema = perfetto::base::TempFile::Create();
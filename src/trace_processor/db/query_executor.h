@@ -27,6 +27,7 @@
 #include "src/trace_processor/db/overlays/storage_overlay.h"
 #include "src/trace_processor/db/overlays/types.h"
 #include "src/trace_processor/db/storage/storage.h"
+#include "src/trace_processor/util/query_abort.h"
 
 namespace perfetto {
 namespace trace_processor {
@@ -49,9 +50,13 @@ class QueryExecutor {
       : columns_(columns), row_count_(row_count) {}
 
   // Apply all the constraints on the data and return the filtered RowMap.
+  // Returns an empty RowMap if the running query is aborted: it's up to the
+  // caller to report the error (see CheckQueryAbort()).
   RowMap Filter(const std::vector<Constraint>& cs) {
     RowMap rm(0, row_count_);
     for (const auto& c : cs) {
+      if (!CheckQueryAbort().ok())
+        return RowMap();
       FilterColumn(c, columns_[c.col_idx], &rm);
     }
     return rm;
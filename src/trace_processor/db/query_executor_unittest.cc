@@ -20,6 +20,7 @@
 #include "src/trace_processor/db/overlays/selector_overlay.h"
 #include "src/trace_processor/db/storage/numeric_storage.h"
 #include "src/trace_processor/db/storage/string_storage.h"
+#include "src/trace_processor/util/query_abort.h"
 #include "test/gtest_and_gmock.h"
 
 namespace perfetto {
@@ -35,6 +36,11 @@ using ArrangementOverlay = overlays::ArrangementOverlay;
 using NullOverlay = overlays::NullOverlay;
 using SelectorOverlay = overlays::SelectorOverlay;
 
+class AbortedQuery : public QueryAbortCheck {
+ public:
+  base::Status Check() const override { return base::ErrStatus("Aborted"); }
+};
+
 TEST(QueryExecutor, OnlyStorageRange) {
   std::vector<int64_t> storage_data{1, 2, 3, 4, 5};
   NumericStorage storage(storage_data.data(), 5, ColumnType::kInt64);
@@ -60,6 +66,23 @@ TEST(QueryExecutor, OnlyStorageRangeIsNull) {
   ASSERT_EQ(rm.size(), 0u);
 }
 
+TEST(QueryExecutor, FilterStopsWhenQueryIsAborted) {
+  std::vector<int64_t> storage_data{1, 2, 3, 4, 5};
+  NumericStorage storage(storage_data.data(), 5, ColumnType::kInt64);
+  SimpleColumn col{OverlaysVec(), &storage};
+
+  Constraint c{0, FilterOp::kGe, SqlValue::Long(3)};
+  QueryExecutor exec({col}, 5);
+  ASSERT_EQ(exec.Filter({c}).size(), 3u);
+
+  AbortedQuery aborted;
+  const QueryAbortCheck* prev = SetThreadQueryAbortCheck(&aborted);
+  RowMap res = exec.Filter({c});
+  SetThreadQueryAbortCheck(prev);
+
+  ASSERT_EQ(res.size(), 0u);
+}
+
 TEST(QueryExecutor, OnlyStorageIndex) {
   // Setup storage
   std::vector<int64_t> storage_data(10);
@@ -34,6 +34,7 @@
 #include "src/trace_processor/db/column_storage_overlay.h"
 #include "src/trace_processor/db/query_executor.h"
 #include "src/trace_processor/db/typed_column.h"
+#include "src/trace_processor/util/query_abort.h"
 #include "src/trace_processor/util/status_macros.h"
 
 namespace perfetto {
@@ -119,7 +120,8 @@ class Table {
   // Filters the Table using the specified filter constraints optionally
   // specifying what the returned RowMap should optimize for.
   // Returns a RowMap which, if applied to the table, would contain the rows
-  // post filter.
+  // post filter, or an empty RowMap if the running query is aborted (see
+  // CheckQueryAbort()).
   RowMap FilterToRowMap(
       const std::vector<Constraint>& cs,
       RowMap::OptimizeFor optimize_for = RowMap::OptimizeFor::kMemory) const {
@@ -132,6 +134,8 @@ class Table {
 
     RowMap rm(0, row_count_, optimize_for);
     for (const Constraint& c : cs) {
+      if (!CheckQueryAbort().ok())
+        return RowMap();
       columns_[c.col_idx].FilterInto(c.op, c.value, &rm);
     }
     return rm;
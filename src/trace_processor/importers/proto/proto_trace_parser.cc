@@ -226,6 +226,18 @@ void ProtoTraceParser::ParseTraceStats(ConstBytes blob) {
     storage->SetIndexedStats(
         stats::traced_buf_trace_writer_packet_loss, buf_num,
         static_cast<int64_t>(buf.trace_writer_packet_loss()));
+    storage->SetIndexedStats(
+        stats::traced_buf_chunk_payload_bytes_read, buf_num,
+        static_cast<int64_t>(buf.chunk_payload_bytes_read()));
+    storage->SetIndexedStats(
+        stats::traced_buf_chunk_payload_bytes_used, buf_num,
+        static_cast<int64_t>(buf.chunk_payload_bytes_used()));
+    storage->SetIndexedStats(
+        stats::traced_buf_chunks_read_with_fragmented_packet, buf_num,
+        static_cast<int64_t>(buf.chunks_read_with_fragmented_packet()));
+    storage->SetIndexedStats(
+        stats::traced_buf_chunks_discarded_over_quota, buf_num,
+        static_cast<int64_t>(buf.chunks_discarded_over_quota()));
   }
 }
 
@@ -16,23 +16,102 @@
 
 #include "src/trace_processor/iterator_impl.h"
 
+#include <sqlite3.h>
+
+#include <cinttypes>
+
 #include "perfetto/base/time.h"
 #include "perfetto/trace_processor/trace_processor_storage.h"
 #include "src/trace_processor/perfetto_sql/engine/perfetto_sql_engine.h"
 #include "src/trace_processor/sqlite/scoped_db.h"
 #include "src/trace_processor/storage/trace_storage.h"
 #include "src/trace_processor/trace_processor_impl.h"
+#include "src/trace_processor/util/status_macros.h"
 
 namespace perfetto {
 namespace trace_processor {
 
+QueryBudgetTracker::QueryBudgetTracker(const QueryBudget& budget,
+                                       const std::atomic<bool>* interrupted)
+    : budget_(budget), interrupted_(interrupted) {}
+
+QueryBudgetTracker::~QueryBudgetTracker() {
+  PERFETTO_DCHECK(!resumed_at_ns_);
+}
+
+// Only paused trackers are copied: the pointers saved by Resume() are only
+// meaningful while resumed.
+QueryBudgetTracker::QueryBudgetTracker(const QueryBudgetTracker& other)
+    : QueryAbortCheck(),
+      budget_(other.budget_),
+      interrupted_(other.interrupted_),
+      active_ns_(other.active_ns_),
+      memory_(other.memory_) {
+  PERFETTO_DCHECK(!other.resumed_at_ns_);
+}
+
+QueryBudgetTracker& QueryBudgetTracker::operator=(
+    const QueryBudgetTracker& other) {
+  PERFETTO_DCHECK(!resumed_at_ns_ && !other.resumed_at_ns_);
+  budget_ = other.budget_;
+  interrupted_ = other.interrupted_;
+  active_ns_ = other.active_ns_;
+  memory_ = other.memory_;
+  return *this;
+}
+
+void QueryBudgetTracker::Resume() {
+  PERFETTO_DCHECK(!resumed_at_ns_);
+  resumed_at_ns_ = base::GetWallTimeNs().count();
+  prev_memory_counter_ = SqliteEngine::SetThreadMemoryCounter(&memory_);
+  prev_abort_check_ = SetThreadQueryAbortCheck(this);
+}
+
+void QueryBudgetTracker::Pause() {
+  PERFETTO_DCHECK(resumed_at_ns_);
+  SetThreadQueryAbortCheck(prev_abort_check_);
+  SqliteEngine::SetThreadMemoryCounter(prev_memory_counter_);
+  prev_abort_check_ = nullptr;
+  prev_memory_counter_ = nullptr;
+  active_ns_ += base::GetWallTimeNs().count() - *resumed_at_ns_;
+  resumed_at_ns_ = std::nullopt;
+}
+
+base::Status QueryBudgetTracker::Check() const {
+  if (prev_abort_check_)
+    RETURN_IF_ERROR(prev_abort_check_->Check());
+  if (interrupted_ && interrupted_->load())
+    return base::ErrStatus("Query interrupted");
+  if (budget_.timeout_ms) {
+    int64_t elapsed_ns = active_ns_;
+    if (resumed_at_ns_)
+      elapsed_ns += base::GetWallTimeNs().count() - *resumed_at_ns_;
+    if (elapsed_ns > static_cast<int64_t>(budget_.timeout_ms) * 1000000) {
+      return base::ErrStatus("Query exceeded its time budget of %" PRIu64 " ms",
+                             budget_.timeout_ms);
+    }
+  }
+  // The peak rather than the current usage, so that the query keeps being
+  // aborted once it went over budget even if memory is freed meanwhile.
+  if (budget_.max_memory_bytes) {
+    if (memory_.peak > static_cast<int64_t>(budget_.max_memory_bytes)) {
+      return base::ErrStatus(
+          "Query exceeded its memory budget of %" PRIu64 " bytes",
+          budget_.max_memory_bytes);
+    }
+  }
+  return base::OkStatus();
+}
+
 IteratorImpl::IteratorImpl(
     TraceProcessorImpl* trace_processor,
     base::StatusOr<PerfettoSqlEngine::ExecutionResult> result,
-    uint32_t sql_stats_row)
+    uint32_t sql_stats_row,
+    QueryBudgetTracker budget)
     : trace_processor_(trace_processor),
       result_(std::move(result)),
-      sql_stats_row_(sql_stats_row) {}
+      sql_stats_row_(sql_stats_row),
+      budget_(budget) {}
 
 IteratorImpl::~IteratorImpl() {
   if (trace_processor_) {
@@ -50,6 +129,19 @@ void IteratorImpl::RecordFirstNextInSqlStats() {
   sql_stats->RecordQueryFirstNext(sql_stats_row_, t_first_next.count());
 }
 
+bool IteratorImpl::Step() {
+  TraceProcessorImpl* tp = trace_processor_.get();
+  budget_.Resume();
+  bool has_more = result_->stmt.Step();
+  budget_.Pause();
+
+  if (!result_->stmt.status().ok()) {
+    PERFETTO_DCHECK(!has_more);
+    result_ = tp->TakeQueryAbortReason(result_->stmt.status());
+  }
+  return has_more;
+}
+
 Iterator::Iterator(std::unique_ptr<IteratorImpl> iterator)
     : iterator_(std::move(iterator)) {}
 Iterator::~Iterator() = default;
@@ -19,6 +19,7 @@
 
 #include <sqlite3.h>
 
+#include <atomic>
 #include <memory>
 #include <optional>
 #include <vector>
@@ -34,17 +35,61 @@
 #include "src/trace_processor/sqlite/scoped_db.h"
 #include "src/trace_processor/sqlite/sqlite_engine.h"
 #include "src/trace_processor/sqlite/sqlite_utils.h"
+#include "src/trace_processor/util/query_abort.h"
 
 namespace perfetto {
 namespace trace_processor {
 
 class TraceProcessorImpl;
 
+// Tracks the resources used by a query since it was started against its
+// QueryBudget.
+//
+// Only what happens while the query is executing, i.e. between Resume() and
+// Pause(), is accounted: the time the caller takes to consume the rows between
+// two calls to Iterator::Next() does not count, nor does the memory allocated
+// by other queries running meanwhile on other threads.
+//
+// While resumed, the tracker is also the QueryAbortCheck of the thread, so
+// that the db layer and table functions stop once the query was interrupted
+// or exceeded its budget. The check it replaced, e.g. one installed by the
+// caller to cancel the query, still applies.
+class QueryBudgetTracker : public QueryAbortCheck {
+ public:
+  // |interrupted| is set by TraceProcessor::InterruptQuery().
+  QueryBudgetTracker(const QueryBudget&, const std::atomic<bool>* interrupted);
+  ~QueryBudgetTracker() override;
+
+  QueryBudgetTracker(const QueryBudgetTracker&);
+  QueryBudgetTracker& operator=(const QueryBudgetTracker&);
+
+  // Starts accounting the time and the SQLite memory used on the calling
+  // thread to this query. Must be followed by Pause() on the same thread.
+  void Resume();
+  void Pause();
+
+  // Returns an error if the query was interrupted or exceeded its budget, or
+  // if the check which was installed before Resume() fails.
+  base::Status Check() const override;
+
+ private:
+  QueryBudget budget_;
+  const std::atomic<bool>* interrupted_ = nullptr;
+  int64_t active_ns_ = 0;
+  std::optional<int64_t> resumed_at_ns_;
+  SqliteEngine::MemoryCounter memory_;
+
+  // What Resume() replaced on the thread, restored by Pause().
+  SqliteEngine::MemoryCounter* prev_memory_counter_ = nullptr;
+  const QueryAbortCheck* prev_abort_check_ = nullptr;
+};
+
 class IteratorImpl {
  public:
   IteratorImpl(TraceProcessorImpl* impl,
                base::StatusOr<PerfettoSqlEngine::ExecutionResult>,
-               uint32_t sql_stats_row);
+               uint32_t sql_stats_row,
+               QueryBudgetTracker budget);
   ~IteratorImpl();
 
   IteratorImpl(IteratorImpl&) noexcept = delete;
@@ -75,13 +120,8 @@ class IteratorImpl {
     if (!result_.ok()) {
       return false;
     }
-
-    bool has_more = result_->stmt.Step();
-    if (!result_->stmt.status().ok()) {
-      PERFETTO_DCHECK(!has_more);
-      result_ = result_->stmt.status();
-    }
-    return has_more;
+    // Delegate to the cc file as stepping needs to enforce the query budget.
+    return Step();
   }
 
   SqlValue Get(uint32_t col) const {
@@ -157,10 +197,13 @@ class IteratorImpl {
 
   void RecordFirstNextInSqlStats();
 
+  bool Step();
+
   ScopedTraceProcessor trace_processor_;
   base::StatusOr<PerfettoSqlEngine::ExecutionResult> result_;
   uint32_t sql_stats_row_ = 0;
   bool called_next_ = false;
+  QueryBudgetTracker budget_;
 };
 
 }  // namespace trace_processor
@@ -16,6 +16,7 @@
 
 #include "src/trace_processor/perfetto_sql/engine/perfetto_sql_engine.h"
 
+#include <algorithm>
 #include <cctype>
 #include <memory>
 #include <optional>
@@ -468,6 +469,10 @@ base::Status PerfettoSqlEngine::ExecuteInclude(
     return base::OkStatus();
   }
 
+  auto objects_before = ListDatabaseObjects();
+  RETURN_IF_ERROR(objects_before.status());
+  std::sort(objects_before->begin(), objects_before->end());
+
   auto it = Execute(SqlSource::FromModuleInclude(module_file->sql, key));
   if (!it.status().ok()) {
     return base::ErrStatus("%s%s",
@@ -476,10 +481,106 @@ base::Status PerfettoSqlEngine::ExecuteInclude(
   }
   if (it->statement_count_with_output > 0)
     return base::ErrStatus("INCLUDE: Included module returning values.");
+
+  // Remember which objects were created by this include: this allows them to
+  // be preserved (instead of recomputed) when the database is reset. Objects
+  // created by modules included transitively are already credited to those
+  // modules so they are skipped here.
+  auto objects_after = ListDatabaseObjects();
+  RETURN_IF_ERROR(objects_after.status());
+  std::vector<std::string> nested_objects = GetIncludedModuleObjects();
+  std::sort(nested_objects.begin(), nested_objects.end());
+  std::vector<std::pair<std::string, std::string>> created_objects;
+  for (auto& type_and_name : *objects_after) {
+    if (std::binary_search(objects_before->begin(), objects_before->end(),
+                           type_and_name) ||
+        std::binary_search(nested_objects.begin(), nested_objects.end(),
+                           type_and_name.second)) {
+      continue;
+    }
+    created_objects.push_back(std::move(type_and_name));
+  }
+
   module_file->included = true;
+  module_file->created_objects = std::move(created_objects);
+  return base::OkStatus();
+}
+
+base::Status PerfettoSqlEngine::RegisterModule(
+    const std::string& name,
+    sql_modules::RegisteredModule module) {
+  auto* old_module = modules_.Find(name);
+  if (!old_module) {
+    modules_.Insert(name, std::move(module));
+    return base::OkStatus();
+  }
+
+  // Files with unchanged SQL keep their objects; the objects of every other
+  // included file have to go as including the new version would otherwise
+  // fail trying to create them again.
+  std::vector<std::pair<std::string, std::string>> stale_objects;
+  for (auto it = old_module->include_key_to_file.GetIterator(); it; ++it) {
+    auto& old_file = it.value();
+    if (!old_file.included)
+      continue;
+    auto* new_file = module.include_key_to_file.Find(it.key());
+    if (new_file && new_file->sql_hash == old_file.sql_hash) {
+      new_file->included = true;
+      new_file->created_objects = std::move(old_file.created_objects);
+      continue;
+    }
+    stale_objects.insert(stale_objects.end(), old_file.created_objects.begin(),
+                         old_file.created_objects.end());
+  }
+  *old_module = std::move(module);
+
+  for (const auto& [type, object_name] : stale_objects) {
+    // Indices are dropped together with their table so, depending on the
+    // order, they might be gone already: hence IF EXISTS.
+    auto res = Execute(SqlSource::FromTraceProcessorImplementation(
+        "DROP " + type + " IF EXISTS " + object_name));
+    if (!res.ok()) {
+      return base::ErrStatus("Unable to drop %s %s of module %s: %s",
+                             type.c_str(), object_name.c_str(), name.c_str(),
+                             res.status().c_message());
+    }
+  }
   return base::OkStatus();
 }
 
+std::vector<std::string> PerfettoSqlEngine::GetIncludedModuleObjects() {
+  std::vector<std::string> objects;
+  for (auto module = modules_.GetIterator(); module; ++module) {
+    for (auto file = module.value().include_key_to_file.GetIterator(); file;
+         ++file) {
+      if (!file.value().included)
+        continue;
+      for (const auto& type_and_name : file.value().created_objects)
+        objects.push_back(type_and_name.second);
+    }
+  }
+  return objects;
+}
+
+base::StatusOr<std::vector<std::pair<std::string, std::string>>>
+PerfettoSqlEngine::ListDatabaseObjects() {
+  auto stmt =
+      engine_->PrepareStatement(SqlSource::FromTraceProcessorImplementation(
+          "SELECT type, name FROM sqlite_master UNION ALL "
+          "SELECT type, name FROM sqlite_temp_master"));
+  RETURN_IF_ERROR(stmt.status());
+  std::vector<std::pair<std::string, std::string>> objects;
+  while (stmt.Step()) {
+    objects.emplace_back(
+        reinterpret_cast<const char*>(
+            sqlite3_column_text(stmt.sqlite_stmt(), 0)),
+        reinterpret_cast<const char*>(
+            sqlite3_column_text(stmt.sqlite_stmt(), 1)));
+  }
+  RETURN_IF_ERROR(stmt.status());
+  return objects;
+}
+
 base::StatusOr<SqlSource> PerfettoSqlEngine::ExecuteCreateFunction(
     const PerfettoSqlParser::CreateFunction& cf,
     const PerfettoSqlParser& parser) {
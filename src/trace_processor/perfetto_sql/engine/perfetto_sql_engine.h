@@ -19,6 +19,9 @@
 
 #include <memory>
 #include <optional>
+#include <string>
+#include <utility>
+#include <vector>
 
 #include "perfetto/base/status.h"
 #include "perfetto/ext/base/flat_hash_map.h"
@@ -130,17 +133,24 @@ class PerfettoSqlEngine {
 
   SqliteEngine* sqlite_engine() { return engine_.get(); }
 
-  // Makes new SQL module available to import.
-  void RegisterModule(const std::string& name,
-                      sql_modules::RegisteredModule module) {
-    modules_.Insert(name, std::move(module));
-  }
+  // Makes new SQL module available to import. If a module with the same name
+  // was already registered, files whose SQL is unchanged keep their included
+  // state so the objects they created do not need to be recomputed; the
+  // objects created by files which changed or were removed are dropped.
+  base::Status RegisterModule(const std::string& name,
+                              sql_modules::RegisteredModule module);
 
   // Fetches registered SQL module.
   sql_modules::RegisteredModule* FindModule(const std::string& name) {
     return modules_.Find(name);
   }
 
+  // Returns the names of all the tables, views and indices created by including
+  // SQL modules. As modules only depend on the (immutable) trace tables and
+  // other modules, these can be preserved when resetting the database to its
+  // initial state.
+  std::vector<std::string> GetIncludedModuleObjects();
+
  private:
   base::StatusOr<SqlSource> ExecuteCreateFunction(
       const PerfettoSqlParser::CreateFunction&,
@@ -154,6 +164,11 @@ class PerfettoSqlEngine {
 
   base::Status ExecuteCreateMacro(const PerfettoSqlParser::CreateMacro&);
 
+  // Returns the (type, name) of all the tables, views and indices currently
+  // present in the database.
+  base::StatusOr<std::vector<std::pair<std::string, std::string>>>
+  ListDatabaseObjects();
+
   std::unique_ptr<QueryCache> query_cache_;
   StringPool* pool_ = nullptr;
   base::FlatHashMap<std::string, std::unique_ptr<RuntimeTableFunction::State>>
@@ -127,6 +127,102 @@ TEST_F(PerfettoSqlEngineTest, CreateMacro) {
   ASSERT_FALSE(res->stmt.Step());
 }
 
+sql_modules::RegisteredModule MakeModule(const std::string& key,
+                                         const std::string& sql) {
+  sql_modules::RegisteredModule module;
+  module.include_key_to_file.Insert(key, {sql, false});
+  return module;
+}
+
+TEST_F(PerfettoSqlEngineTest, IncludeTracksCreatedObjects) {
+  auto status = engine_.RegisterModule(
+      "foo", MakeModule("foo.bar", "CREATE PERFETTO TABLE foo_tbl AS "
+                                   "SELECT 42 AS x; "
+                                   "CREATE VIEW foo_view AS SELECT 1 AS y;"));
+  ASSERT_TRUE(status.ok()) << status.c_message();
+  auto res = engine_.Execute(
+      SqlSource::FromExecuteQuery("INCLUDE PERFETTO MODULE foo.bar"));
+  ASSERT_TRUE(res.ok()) << res.status().c_message();
+
+  auto objects = engine_.GetIncludedModuleObjects();
+  ASSERT_THAT(objects, ::testing::UnorderedElementsAre("foo_tbl", "foo_view"));
+}
+
+TEST_F(PerfettoSqlEngineTest, ReregisterModuleKeepsUnchangedFiles) {
+  const char kSql[] = "CREATE PERFETTO TABLE foo_tbl AS SELECT 42 AS x";
+  auto status = engine_.RegisterModule("foo", MakeModule("foo.bar", kSql));
+  ASSERT_TRUE(status.ok()) << status.c_message();
+  auto res = engine_.Execute(
+      SqlSource::FromExecuteQuery("INCLUDE PERFETTO MODULE foo.bar"));
+  ASSERT_TRUE(res.ok()) << res.status().c_message();
+
+  // Same SQL: the module stays included and its table is not recreated.
+  status = engine_.RegisterModule("foo", MakeModule("foo.bar", kSql));
+  ASSERT_TRUE(status.ok()) << status.c_message();
+  auto* file = engine_.FindModule("foo")->include_key_to_file.Find("foo.bar");
+  ASSERT_TRUE(file->included);
+  ASSERT_THAT(engine_.GetIncludedModuleObjects(),
+              ::testing::ElementsAre("foo_tbl"));
+
+  // Different SQL: the module has to be included again.
+  status = engine_.RegisterModule(
+      "foo",
+      MakeModule("foo.bar", "CREATE PERFETTO TABLE foo_tbl2 AS SELECT 1 AS x"));
+  ASSERT_TRUE(status.ok()) << status.c_message();
+  file = engine_.FindModule("foo")->include_key_to_file.Find("foo.bar");
+  ASSERT_FALSE(file->included);
+  ASSERT_TRUE(engine_.GetIncludedModuleObjects().empty());
+}
+
+TEST_F(PerfettoSqlEngineTest, ReregisterModuleDropsChangedFileObjects) {
+  auto status = engine_.RegisterModule(
+      "foo", MakeModule("foo.bar", "CREATE TABLE foo_tbl AS SELECT 42 AS x; "
+                                   "CREATE INDEX foo_idx ON foo_tbl(x);"));
+  ASSERT_TRUE(status.ok()) << status.c_message();
+  auto res = engine_.Execute(
+      SqlSource::FromExecuteQuery("INCLUDE PERFETTO MODULE foo.bar"));
+  ASSERT_TRUE(res.ok()) << res.status().c_message();
+
+  // The new version creates an object with the same name: including it must
+  // not fail because the old one is still around.
+  status = engine_.RegisterModule(
+      "foo", MakeModule("foo.bar", "CREATE PERFETTO TABLE foo_tbl AS "
+                                   "SELECT 1 AS x;"));
+  ASSERT_TRUE(status.ok()) << status.c_message();
+  res = engine_.Execute(
+      SqlSource::FromExecuteQuery("INCLUDE PERFETTO MODULE foo.bar"));
+  ASSERT_TRUE(res.ok()) << res.status().c_message();
+
+  auto it = engine_.ExecuteUntilLastStatement(
+      SqlSource::FromExecuteQuery("SELECT x FROM foo_tbl"));
+  ASSERT_TRUE(it.ok()) << it.status().c_message();
+  ASSERT_EQ(sqlite3_column_int64(it->stmt.sqlite_stmt(), 0), 1);
+  ASSERT_THAT(engine_.GetIncludedModuleObjects(),
+              ::testing::ElementsAre("foo_tbl"));
+}
+
+TEST_F(PerfettoSqlEngineTest, NestedIncludeObjectsCreditedToInnerModule) {
+  auto status = engine_.RegisterModule(
+      "foo", MakeModule("foo.bar", "CREATE PERFETTO TABLE foo_tbl AS "
+                                   "SELECT 42 AS x;"));
+  ASSERT_TRUE(status.ok()) << status.c_message();
+  status = engine_.RegisterModule(
+      "baz", MakeModule("baz.qux", "INCLUDE PERFETTO MODULE foo.bar; "
+                                   "CREATE VIEW baz_view AS "
+                                   "SELECT x FROM foo_tbl;"));
+  ASSERT_TRUE(status.ok()) << status.c_message();
+  auto res = engine_.Execute(
+      SqlSource::FromExecuteQuery("INCLUDE PERFETTO MODULE baz.qux"));
+  ASSERT_TRUE(res.ok()) << res.status().c_message();
+
+  auto* foo = engine_.FindModule("foo")->include_key_to_file.Find("foo.bar");
+  ASSERT_THAT(foo->created_objects,
+              ::testing::ElementsAre(std::make_pair("table", "foo_tbl")));
+  auto* baz = engine_.FindModule("baz")->include_key_to_file.Find("baz.qux");
+  ASSERT_THAT(baz->created_objects,
+              ::testing::ElementsAre(std::make_pair("view", "baz_view")));
+}
+
 }  // namespace
 }  // namespace trace_processor
 }  // namespace perfetto
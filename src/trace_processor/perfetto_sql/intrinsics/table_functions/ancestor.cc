@@ -85,22 +85,23 @@ std::unique_ptr<Table> ExtendWithStartId(
                                            std::move(start_ids));
 }
 
-template <typename ChildTable, typename ParentTable>
-base::Status BuildAncestorsTable(typename ParentTable::Id id,
-                                 const ParentTable& table,
-                                 std::unique_ptr<Table>& table_return) {
-  // Build up all the parents row ids.
-  std::vector<typename ParentTable::RowNumber> ancestors;
-  RETURN_IF_ERROR(GetAncestors(table, id, ancestors));
-  table_return =
-      ExtendWithStartId<ChildTable>(id.value, table, std::move(ancestors));
+base::Status GetAncestorSlices(
+    SliceTreeIndex* slice_index,
+    SliceId starting_id,
+    std::vector<tables::SliceTable::RowNumber>& row_numbers_accumulator) {
+  if (!slice_index->GetAncestors(starting_id, &row_numbers_accumulator)) {
+    return base::ErrStatus("no row with id %" PRIu32 "",
+                           static_cast<uint32_t>(starting_id.value));
+  }
   return base::OkStatus();
 }
 
 }  // namespace
 
-Ancestor::Ancestor(Type type, const TraceStorage* storage)
-    : type_(type), storage_(storage) {}
+Ancestor::Ancestor(Type type,
+                   const TraceStorage* storage,
+                   SliceTreeIndex* slice_index)
+    : type_(type), storage_(storage), slice_index_(slice_index) {}
 
 base::Status Ancestor::ValidateConstraints(const QueryConstraints& qc) {
   const auto& cs = qc.constraints();
@@ -152,14 +153,25 @@ base::Status Ancestor::ComputeTable(const std::vector<Constraint>& cs,
   int64_t start_id = constraint_it->value.AsLong();
   uint32_t start_id_uint = static_cast<uint32_t>(start_id);
   switch (type_) {
-    case Type::kSlice:
-      return BuildAncestorsTable<tables::AncestorSliceTable>(
-          SliceId(start_id_uint), storage_->slice_table(), table_return);
+    case Type::kSlice: {
+      std::vector<tables::SliceTable::RowNumber> ancestors;
+      RETURN_IF_ERROR(
+          GetAncestorSlices(slice_index_, SliceId(start_id_uint), ancestors));
+      table_return = ExtendWithStartId<tables::AncestorSliceTable>(
+          start_id_uint, storage_->slice_table(), std::move(ancestors));
+      return base::OkStatus();
+    }
 
-    case Type::kStackProfileCallsite:
-      return BuildAncestorsTable<tables::AncestorStackProfileCallsiteTable>(
-          CallsiteId(start_id_uint), storage_->stack_profile_callsite_table(),
-          table_return);
+    case Type::kStackProfileCallsite: {
+      const auto& callsites = storage_->stack_profile_callsite_table();
+      std::vector<tables::StackProfileCallsiteTable::RowNumber> ancestors;
+      RETURN_IF_ERROR(
+          GetAncestors(callsites, CallsiteId(start_id_uint), ancestors));
+      table_return =
+          ExtendWithStartId<tables::AncestorStackProfileCallsiteTable>(
+              start_id_uint, callsites, std::move(ancestors));
+      return base::OkStatus();
+    }
 
     case Type::kSliceByStack: {
       // Find the all slice ids that have the stack id and find all the
@@ -169,7 +181,7 @@ base::Status Ancestor::ComputeTable(const std::vector<Constraint>& cs,
           slice_table.FilterToIterator({slice_table.stack_id().eq(start_id)});
       std::vector<tables::SliceTable::RowNumber> ancestors;
       for (; it; ++it) {
-        RETURN_IF_ERROR(GetAncestors(slice_table, it.id(), ancestors));
+        RETURN_IF_ERROR(GetAncestorSlices(slice_index_, it.id(), ancestors));
       }
       // Sort to keep the slices in timestamp order.
       std::sort(ancestors.begin(), ancestors.end());
@@ -209,16 +221,5 @@ uint32_t Ancestor::EstimateRowCount() {
   return 1;
 }
 
-// static
-std::optional<std::vector<tables::SliceTable::RowNumber>>
-Ancestor::GetAncestorSlices(const tables::SliceTable& slices,
-                            SliceId slice_id) {
-  std::vector<tables::SliceTable::RowNumber> ret;
-  auto status = GetAncestors(slices, slice_id, ret);
-  if (!status.ok())
-    return std::nullopt;
-  return std::move(ret);  // -Wreturn-std-move-in-c++11
-}
-
 }  // namespace trace_processor
 }  // namespace perfetto
@@ -19,6 +19,7 @@
 
 #include <optional>
 
+#include "src/trace_processor/perfetto_sql/intrinsics/table_functions/slice_tree_index.h"
 #include "src/trace_processor/perfetto_sql/intrinsics/table_functions/static_table_function.h"
 #include "src/trace_processor/storage/trace_storage.h"
 
@@ -37,7 +38,9 @@ class Ancestor : public StaticTableFunction {
  public:
   enum class Type { kSlice = 1, kStackProfileCallsite = 2, kSliceByStack = 3 };
 
-  Ancestor(Type type, const TraceStorage* storage);
+  Ancestor(Type type,
+           const TraceStorage* storage,
+           SliceTreeIndex* slice_index);
 
   Table::Schema CreateSchema() override;
   std::string TableName() override;
@@ -48,15 +51,10 @@ class Ancestor : public StaticTableFunction {
                             const BitVector& cols_used,
                             std::unique_ptr<Table>& table_return) override;
 
-  // Returns a vector of rows numbers which are ancestors of |slice_id|.
-  // Returns std::nullopt if an invalid |slice_id| is given. This is used by
-  // ConnectedFlow to traverse flow indirectly connected flow events.
-  static std::optional<std::vector<tables::SliceTable::RowNumber>>
-  GetAncestorSlices(const tables::SliceTable& slices, SliceId slice_id);
-
  private:
   Type type_;
   const TraceStorage* storage_ = nullptr;
+  SliceTreeIndex* slice_index_ = nullptr;
 };
 
 }  // namespace trace_processor
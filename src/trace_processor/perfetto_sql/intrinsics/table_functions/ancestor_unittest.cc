@@ -28,8 +28,9 @@ TEST(Ancestor, SliceTableNullConstraint) {
   // because the source is empty.
   TraceStorage storage;
   storage.mutable_slice_table()->Insert({});
+  SliceTreeIndex index(&storage.slice_table());
 
-  Ancestor generator{Ancestor::Type::kSlice, &storage};
+  Ancestor generator{Ancestor::Type::kSlice, &storage, &index};
 
   // Check that if we pass start_id = NULL as a constraint, we correctly return
   // an empty table.
@@ -46,8 +47,9 @@ TEST(Ancestor, CallsiteTableNullConstraint) {
   // because the source is empty.
   TraceStorage storage;
   storage.mutable_stack_profile_callsite_table()->Insert({});
+  SliceTreeIndex index(&storage.slice_table());
 
-  Ancestor generator{Ancestor::Type::kStackProfileCallsite, &storage};
+  Ancestor generator{Ancestor::Type::kStackProfileCallsite, &storage, &index};
 
   // Check that if we pass start_id = NULL as a constraint, we correctly return
   // an empty table.
@@ -64,8 +66,9 @@ TEST(Ancestor, SliceByStackTableNullConstraint) {
   // because the source is empty.
   TraceStorage storage;
   storage.mutable_slice_table()->Insert({});
+  SliceTreeIndex index(&storage.slice_table());
 
-  Ancestor generator{Ancestor::Type::kSliceByStack, &storage};
+  Ancestor generator{Ancestor::Type::kSliceByStack, &storage, &index};
 
   // Check that if we pass start_id = NULL as a constraint, we correctly return
   // an empty table.
@@ -20,10 +20,10 @@
 #include <queue>
 #include <set>
 
-#include "src/trace_processor/perfetto_sql/intrinsics/table_functions/ancestor.h"
-#include "src/trace_processor/perfetto_sql/intrinsics/table_functions/descendant.h"
 #include "src/trace_processor/sqlite/sqlite_utils.h"
 #include "src/trace_processor/types/trace_processor_context.h"
+#include "src/trace_processor/util/query_abort.h"
+#include "src/trace_processor/util/status_macros.h"
 
 namespace perfetto {
 namespace trace_processor {
@@ -33,8 +33,10 @@ ConnectedFlowTable::~ConnectedFlowTable() = default;
 
 }  // namespace tables
 
-ConnectedFlow::ConnectedFlow(Mode mode, const TraceStorage* storage)
-    : mode_(mode), storage_(storage) {}
+ConnectedFlow::ConnectedFlow(Mode mode,
+                             const TraceStorage* storage,
+                             SliceTreeIndex* slice_index)
+    : mode_(mode), storage_(storage), slice_index_(slice_index) {}
 
 ConnectedFlow::~ConnectedFlow() = default;
 
@@ -83,7 +85,8 @@ enum RelativesVisitMode : uint8_t {
 //  bfs.TakeResultingFlows();
 class BFS {
  public:
-  explicit BFS(const TraceStorage* storage) : storage_(storage) {}
+  BFS(const TraceStorage* storage, SliceTreeIndex* slice_index)
+      : storage_(storage), slice_index_(slice_index) {}
 
   std::vector<tables::FlowTable::RowNumber> TakeResultingFlows() && {
     return std::move(flow_rows_);
@@ -97,8 +100,12 @@ class BFS {
   }
 
   // Visits all slices that can be reached from the given starting slices.
-  void VisitAll(FlowVisitMode visit_flow, RelativesVisitMode visit_relatives) {
+  // Returns an error if the running query is aborted meanwhile.
+  base::Status VisitAll(FlowVisitMode visit_flow,
+                        RelativesVisitMode visit_relatives) {
+    QueryAbortPoller abort_poller;
     while (!slices_to_visit_.empty()) {
+      RETURN_IF_ERROR(abort_poller.Poll());
       SliceId slice_id = slices_to_visit_.front().first;
       VisitType visit_type = slices_to_visit_.front().second;
       slices_to_visit_.pop();
@@ -120,22 +127,17 @@ class BFS {
         GoByFlow(slice_id, FlowDirection::OUTGOING);
       }
     }
+    return base::OkStatus();
   }
 
   // Includes the relatives of |slice_id| to the list of slices to visit.
   BFS& GoToRelatives(SliceId slice_id, RelativesVisitMode visit_relatives) {
-    const auto& slice_table = storage_->slice_table();
-    if (visit_relatives & VISIT_ANCESTORS) {
-      auto opt_ancestors = Ancestor::GetAncestorSlices(slice_table, slice_id);
-      if (opt_ancestors)
-        GoToRelativesImpl(*opt_ancestors);
-    }
-    if (visit_relatives & VISIT_DESCENDANTS) {
-      auto opt_descendants =
-          Descendant::GetDescendantSlices(slice_table, slice_id);
-      if (opt_descendants)
-        GoToRelativesImpl(*opt_descendants);
-    }
+    relatives_.clear();
+    if (visit_relatives & VISIT_ANCESTORS)
+      slice_index_->GetAncestors(slice_id, &relatives_);
+    if (visit_relatives & VISIT_DESCENDANTS)
+      slice_index_->GetDescendants(slice_id, &relatives_);
+    GoToRelativesImpl(relatives_);
     return *this;
   }
 
@@ -194,7 +196,11 @@ class BFS {
   std::set<SliceId> known_slices_;
   std::vector<tables::FlowTable::RowNumber> flow_rows_;
 
+  // Scratch buffer reused across calls to GoToRelatives().
+  std::vector<tables::SliceTable::RowNumber> relatives_;
+
   const TraceStorage* storage_;
+  SliceTreeIndex* slice_index_;
 };
 
 }  // namespace
@@ -230,20 +236,22 @@ base::Status ConnectedFlow::ComputeTable(const std::vector<Constraint>& cs,
                            static_cast<uint32_t>(start_id.value));
   }
 
-  BFS bfs(storage_);
+  BFS bfs(storage_, slice_index_);
 
+  base::Status status;
   switch (mode_) {
     case Mode::kDirectlyConnectedFlow:
-      bfs.Start(start_id).VisitAll(VISIT_INCOMING_AND_OUTGOING,
-                                   VISIT_NO_RELATIVES);
+      status = bfs.Start(start_id).VisitAll(VISIT_INCOMING_AND_OUTGOING,
+                                            VISIT_NO_RELATIVES);
       break;
     case Mode::kFollowingFlow:
-      bfs.Start(start_id).VisitAll(VISIT_OUTGOING, VISIT_DESCENDANTS);
+      status = bfs.Start(start_id).VisitAll(VISIT_OUTGOING, VISIT_DESCENDANTS);
       break;
     case Mode::kPrecedingFlow:
-      bfs.Start(start_id).VisitAll(VISIT_INCOMING, VISIT_ANCESTORS);
+      status = bfs.Start(start_id).VisitAll(VISIT_INCOMING, VISIT_ANCESTORS);
       break;
   }
+  RETURN_IF_ERROR(status);
 
   std::vector<tables::FlowTable::RowNumber> result_rows =
       std::move(bfs).TakeResultingFlows();
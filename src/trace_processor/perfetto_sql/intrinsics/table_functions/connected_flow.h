@@ -17,6 +17,7 @@
 #ifndef SRC_TRACE_PROCESSOR_PERFETTO_SQL_INTRINSICS_TABLE_FUNCTIONS_CONNECTED_FLOW_H_
 #define SRC_TRACE_PROCESSOR_PERFETTO_SQL_INTRINSICS_TABLE_FUNCTIONS_CONNECTED_FLOW_H_
 
+#include "src/trace_processor/perfetto_sql/intrinsics/table_functions/slice_tree_index.h"
 #include "src/trace_processor/perfetto_sql/intrinsics/table_functions/static_table_function.h"
 #include "src/trace_processor/perfetto_sql/intrinsics/table_functions/tables_py.h"
 #include "src/trace_processor/storage/trace_storage.h"
@@ -47,7 +48,7 @@ class ConnectedFlow : public StaticTableFunction {
     kFollowingFlow,
   };
 
-  ConnectedFlow(Mode mode, const TraceStorage*);
+  ConnectedFlow(Mode mode, const TraceStorage*, SliceTreeIndex*);
   ~ConnectedFlow() override;
 
   Table::Schema CreateSchema() override;
@@ -62,6 +63,7 @@ class ConnectedFlow : public StaticTableFunction {
  private:
   Mode mode_;
   const TraceStorage* storage_ = nullptr;
+  SliceTreeIndex* slice_index_ = nullptr;
 };
 
 }  // namespace trace_processor
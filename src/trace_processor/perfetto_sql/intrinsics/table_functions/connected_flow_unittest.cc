@@ -27,9 +27,10 @@ TEST(ConnectedFlow, SliceTableNullConstraint) {
   // because the source is empty.
   TraceStorage storage;
   storage.mutable_slice_table()->Insert({});
+  SliceTreeIndex index(&storage.slice_table());
 
   ConnectedFlow generator{ConnectedFlow::Mode::kDirectlyConnectedFlow,
-                          &storage};
+                          &storage, &index};
 
   // Check that if we pass start_id = NULL as a constraint, we correctly return
   // an empty table.
@@ -48,37 +48,16 @@ std::unique_ptr<Table> ExtendWithStartId(
 }
 
 base::Status GetDescendants(
-    const tables::SliceTable& slices,
+    SliceTreeIndex* slice_index,
     SliceId starting_id,
     std::vector<tables::SliceTable::RowNumber>& row_numbers_accumulator) {
-  auto start_ref = slices.FindById(starting_id);
-  // The query gave an invalid ID that doesn't exist in the slice table.
-  if (!start_ref) {
-    return base::ErrStatus("no row with id %" PRIu32 "",
-                           static_cast<uint32_t>(starting_id.value));
-  }
-
-  // As an optimization, for any finished slices, we only need to consider
-  // slices which started before the end of this slice (because slices on a
-  // track are always perfectly stacked).
-  // For unfinshed slices (i.e. -1 dur), we need to consider until the end of
-  // the trace so we cannot add any similar constraint.
-  std::vector<Constraint> cs;
-  if (start_ref->dur() >= 0) {
-    cs.emplace_back(slices.ts().le(start_ref->ts() + start_ref->dur()));
-  }
-
-  // All nested descendents must be on the same track, with a ts greater than
-  // |start_ref.ts| and whose depth is larger than |start_ref|'s.
-  cs.emplace_back(slices.ts().ge(start_ref->ts()));
-  cs.emplace_back(slices.track_id().eq(start_ref->track_id().value));
-  cs.emplace_back(slices.depth().gt(start_ref->depth()));
-
   // It's important we insert directly into |row_numbers_accumulator| and not
   // overwrite it because we expect the existing elements in
   // |row_numbers_accumulator| to be preserved.
-  for (auto it = slices.FilterToIterator(cs); it; ++it) {
-    row_numbers_accumulator.emplace_back(it.row_number());
+  if (!slice_index->GetDescendants(starting_id, &row_numbers_accumulator)) {
+    // The query gave an invalid ID that doesn't exist in the slice table.
+    return base::ErrStatus("no row with id %" PRIu32 "",
+                           static_cast<uint32_t>(starting_id.value));
   }
   return base::OkStatus();
 }
@@ -95,8 +74,10 @@ uint32_t GetConstraintColumnIndex(Descendant::Type type) {
 
 }  // namespace
 
-Descendant::Descendant(Type type, const TraceStorage* storage)
-    : type_(type), storage_(storage) {}
+Descendant::Descendant(Type type,
+                       const TraceStorage* storage,
+                       SliceTreeIndex* slice_index)
+    : type_(type), storage_(storage), slice_index_(slice_index) {}
 
 base::Status Descendant::ValidateConstraints(const QueryConstraints& qc) {
   const auto& cs = qc.constraints();
@@ -150,7 +131,7 @@ base::Status Descendant::ComputeTable(const std::vector<Constraint>& cs,
       // Build up all the children row ids.
       uint32_t start_id_uint = static_cast<uint32_t>(start_id);
       RETURN_IF_ERROR(GetDescendants(
-          slices, tables::SliceTable::Id(start_id_uint), descendants));
+          slice_index_, tables::SliceTable::Id(start_id_uint), descendants));
       table_return = ExtendWithStartId<tables::DescendantSliceTable>(
           start_id_uint, slices, std::move(descendants));
       break;
@@ -158,7 +139,7 @@ base::Status Descendant::ComputeTable(const std::vector<Constraint>& cs,
     case Type::kSliceByStack: {
       auto sbs_cs = {slices.stack_id().eq(start_id)};
       for (auto it = slices.FilterToIterator(sbs_cs); it; ++it) {
-        RETURN_IF_ERROR(GetDescendants(slices, it.id(), descendants));
+        RETURN_IF_ERROR(GetDescendants(slice_index_, it.id(), descendants));
       }
       table_return = ExtendWithStartId<tables::DescendantSliceByStackTable>(
           start_id, slices, std::move(descendants));
@@ -193,16 +174,5 @@ uint32_t Descendant::EstimateRowCount() {
   return 1;
 }
 
-// static
-std::optional<std::vector<tables::SliceTable::RowNumber>>
-Descendant::GetDescendantSlices(const tables::SliceTable& slices,
-                                SliceId slice_id) {
-  std::vector<tables::SliceTable::RowNumber> ret;
-  auto status = GetDescendants(slices, slice_id, ret);
-  if (!status.ok())
-    return std::nullopt;
-  return std::move(ret);
-}
-
 }  // namespace trace_processor
 }  // namespace perfetto
@@ -19,6 +19,7 @@
 
 #include <optional>
 
+#include "src/trace_processor/perfetto_sql/intrinsics/table_functions/slice_tree_index.h"
 #include "src/trace_processor/perfetto_sql/intrinsics/table_functions/static_table_function.h"
 #include "src/trace_processor/storage/trace_storage.h"
 
@@ -36,7 +37,7 @@ class Descendant : public StaticTableFunction {
  public:
   enum class Type { kSlice = 1, kSliceByStack = 2 };
 
-  Descendant(Type type, const TraceStorage*);
+  Descendant(Type type, const TraceStorage*, SliceTreeIndex*);
 
   Table::Schema CreateSchema() override;
   std::string TableName() override;
@@ -47,15 +48,10 @@ class Descendant : public StaticTableFunction {
                             const BitVector& cols_used,
                             std::unique_ptr<Table>& table_return) override;
 
-  // Returns a vector of slice rows which are descendants of |slice_id|. Returns
-  // std::nullopt if an invalid |slice_id| is given. This is used by
-  // ConnectedFlow to traverse flow indirectly connected flow events.
-  static std::optional<std::vector<tables::SliceTable::RowNumber>>
-  GetDescendantSlices(const tables::SliceTable& slices, SliceId slice_id);
-
  private:
   Type type_;
   const TraceStorage* storage_ = nullptr;
+  SliceTreeIndex* slice_index_ = nullptr;
 };
 
 }  // namespace trace_processor
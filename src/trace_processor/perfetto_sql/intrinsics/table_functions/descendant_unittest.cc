@@ -28,8 +28,9 @@ TEST(Descendant, SliceTableNullConstraint) {
   // because the source is empty.
   TraceStorage storage;
   storage.mutable_slice_table()->Insert({});
+  SliceTreeIndex index(&storage.slice_table());
 
-  Descendant generator{Descendant::Type::kSlice, &storage};
+  Descendant generator{Descendant::Type::kSlice, &storage, &index};
 
   // Check that if we pass start_id = NULL as a constraint, we correctly return
   // an empty table.
@@ -46,8 +47,9 @@ TEST(Descendant, SliceByStackTableNullConstraint) {
   // because the source is empty.
   TraceStorage storage;
   storage.mutable_slice_table()->Insert({});
+  SliceTreeIndex index(&storage.slice_table());
 
-  Descendant generator{Descendant::Type::kSliceByStack, &storage};
+  Descendant generator{Descendant::Type::kSliceByStack, &storage, &index};
 
   // Check that if we pass start_id = NULL as a constraint, we correctly return
   // an empty table.
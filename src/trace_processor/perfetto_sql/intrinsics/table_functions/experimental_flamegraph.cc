@@ -279,7 +279,7 @@ std::unique_ptr<tables::ExperimentalFlamegraphNodesTable> FocusTable(
 }  // namespace
 
 ExperimentalFlamegraph::ExperimentalFlamegraph(TraceProcessorContext* context)
-    : context_(context) {}
+    : context_(context), flamegraph_cache_(context->storage.get()) {}
 
 ExperimentalFlamegraph::~ExperimentalFlamegraph() = default;
 
@@ -336,12 +336,11 @@ base::Status ExperimentalFlamegraph::ComputeTable(
     auto* tracker = HeapGraphTracker::GetOrCreate(context_);
     table = tracker->BuildFlamegraph(values.ts, *values.upid);
   } else if (values.profile_type == ProfileType::kHeapProfile) {
-    table = BuildHeapProfileFlamegraph(context_->storage.get(), *values.upid,
-                                       values.ts);
+    table = flamegraph_cache_.BuildHeapProfileFlamegraph(*values.upid,
+                                                         values.ts);
   } else if (values.profile_type == ProfileType::kPerf) {
-    table = BuildNativeCallStackSamplingFlamegraph(
-        context_->storage.get(), values.upid, values.upid_group,
-        values.time_constraints);
+    table = flamegraph_cache_.BuildNativeCallStackSamplingFlamegraph(
+        values.upid, values.upid_group, values.time_constraints);
   }
   if (!table) {
     return base::ErrStatus("Failed to build flamegraph");
@@ -53,6 +53,11 @@ class ExperimentalFlamegraph : public StaticTableFunction {
 
  private:
   TraceProcessorContext* context_ = nullptr;
+
+  // Keeps the callsite tree and the per-process aggregations across queries
+  // so that changing the time range only processes the samples which entered
+  // or left it.
+  FlamegraphCache flamegraph_cache_;
 };
 
 }  // namespace trace_processor
@@ -21,6 +21,7 @@
 
 #include "src/trace_processor/sqlite/sqlite_utils.h"
 #include "src/trace_processor/types/trace_processor_context.h"
+#include "src/trace_processor/util/query_abort.h"
 
 namespace perfetto {
 namespace trace_processor {
@@ -65,7 +66,7 @@ base::Status ExperimentalFlatSlice::ComputeTable(
   table_return = ComputeFlatSliceTable(context_->storage->slice_table(),
                                        context_->storage->mutable_string_pool(),
                                        start_bound, end_bound);
-  return base::OkStatus();
+  return CheckQueryAbort();
 }
 
 std::unique_ptr<tables::ExperimentalFlatSliceTable>
@@ -189,7 +190,11 @@ ExperimentalFlatSlice::ComputeFlatSliceTable(const tables::SliceTable& slice,
     t.active.out_row = insert_sentinel(ts + dur, track_id);
   };
 
+  QueryAbortPoller abort_poller;
   for (uint32_t i = 0; i < slice.row_count(); ++i) {
+    if (!abort_poller.Poll().ok())
+      break;
+
     // TODO(lalitm): this can be optimized using a O(logn) lower bound/filter.
     // Not adding for now as a premature optimization but may be needed down the
     // line.
@@ -66,7 +66,8 @@ class ExperimentalFlatSlice : public StaticTableFunction {
                             const BitVector& cols_used,
                             std::unique_ptr<Table>& table_return) override;
 
-  // Visibile for testing.
+  // Visibile for testing. Returns an incomplete table if the running query is
+  // aborted (see CheckQueryAbort()).
   static std::unique_ptr<tables::ExperimentalFlatSliceTable>
   ComputeFlatSliceTable(const tables::SliceTable&,
                         StringPool*,
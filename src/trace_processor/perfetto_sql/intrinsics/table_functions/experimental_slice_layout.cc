@@ -16,7 +16,12 @@
 
 #include "src/trace_processor/perfetto_sql/intrinsics/table_functions/experimental_slice_layout.h"
 
+#include <algorithm>
+#include <limits>
+#include <numeric>
 #include <optional>
+#include <set>
+#include <tuple>
 
 #include "perfetto/ext/base/string_splitter.h"
 #include "perfetto/ext/base/string_utils.h"
@@ -32,26 +37,17 @@ ExperimentalSliceLayoutTable::~ExperimentalSliceLayoutTable() = default;
 
 namespace {
 
-struct GroupInfo {
-  GroupInfo(int64_t _start, int64_t _end, uint32_t _max_depth)
-      : start(_start), end(_end), layout_depth(0), max_depth(_max_depth) {}
-  int64_t start;
-  int64_t end;
-  uint32_t layout_depth;
-  uint32_t max_depth;
-};
-
 static constexpr uint32_t kFilterTrackIdsColumnIndex =
     tables::ExperimentalSliceLayoutTable::ColumnIndex::filter_track_ids;
+static constexpr uint32_t kTsColumnIndex =
+    tables::ExperimentalSliceLayoutTable::ColumnIndex::ts;
 
 }  // namespace
 
 ExperimentalSliceLayout::ExperimentalSliceLayout(
     StringPool* string_pool,
     const tables::SliceTable* table)
-    : string_pool_(string_pool),
-      slice_table_(table),
-      empty_string_id_(string_pool_->InternString("")) {}
+    : string_pool_(string_pool), slice_table_(table) {}
 ExperimentalSliceLayout::~ExperimentalSliceLayout() = default;
 
 Table::Schema ExperimentalSliceLayout::CreateSchema() {
@@ -82,8 +78,10 @@ base::Status ExperimentalSliceLayout::ComputeTable(
     const std::vector<Order>&,
     const BitVector&,
     std::unique_ptr<Table>& table_return) {
-  std::set<TrackId> selected_tracks;
+  std::vector<uint32_t> selected_tracks;
   std::string filter_string = "";
+  int64_t min_ts = std::numeric_limits<int64_t>::min();
+  int64_t max_ts = std::numeric_limits<int64_t>::max();
   for (const auto& c : cs) {
     bool is_filter_track_ids = c.col_idx == kFilterTrackIdsColumnIndex;
     bool is_equal = c.op == FilterOp::kEq;
@@ -93,54 +91,153 @@ base::Status ExperimentalSliceLayout::ComputeTable(
       for (base::StringSplitter sp(filter_string, ','); sp.Next();) {
         std::optional<uint32_t> maybe = base::CStringToUInt32(sp.cur_token());
         if (maybe) {
-          selected_tracks.insert(TrackId{maybe.value()});
+          selected_tracks.push_back(maybe.value());
         }
       }
     }
+
+    // Constraints on ts are only used to skip the slices which are obviously
+    // outside the requested window: SQLite still applies all the constraints
+    // to the returned table.
+    if (c.col_idx != kTsColumnIndex || c.value.type != SqlValue::kLong)
+      continue;
+    int64_t ts = c.value.AsLong();
+    switch (c.op) {
+      case FilterOp::kEq:
+        min_ts = std::max(min_ts, ts);
+        max_ts = std::min(max_ts, ts);
+        break;
+      case FilterOp::kGe:
+      case FilterOp::kGt:
+        min_ts = std::max(min_ts, ts);
+        break;
+      case FilterOp::kLe:
+      case FilterOp::kLt:
+        max_ts = std::min(max_ts, ts);
+        break;
+      case FilterOp::kNe:
+      case FilterOp::kIsNull:
+      case FilterOp::kIsNotNull:
+      case FilterOp::kGlob:
+      case FilterOp::kRegex:
+        break;
+    }
+  }
+  std::sort(selected_tracks.begin(), selected_tracks.end());
+  selected_tracks.erase(
+      std::unique(selected_tracks.begin(), selected_tracks.end()),
+      selected_tracks.end());
+
+  UpdateTracks();
+
+  // Try and find the layout in the cache.
+  auto it = layouts_.find(selected_tracks);
+  if (it == layouts_.end()) {
+    it = layouts_.emplace(selected_tracks, ComputeLayout(selected_tracks))
+             .first;
   }
 
   StringPool::Id filter_id =
       string_pool_->InternString(base::StringView(filter_string));
+  table_return = SelectWindow(it->second, min_ts, max_ts, filter_id);
+  return base::OkStatus();
+}
 
-  // Try and find the table in the cache.
-  auto cache_it = layout_table_cache_.find(filter_id);
-  if (cache_it != layout_table_cache_.end()) {
-    table_return.reset(new Table(cache_it->second->Copy()));
-    return base::OkStatus();
+void ExperimentalSliceLayout::UpdateTracks() {
+  std::set<uint32_t> updated_tracks;
+
+  // Slices which had not ended when they were first seen have their dur set
+  // in place when they end: the bounds of their groups are only final then.
+  for (auto it = incomplete_groups_.begin(); it != incomplete_groups_.end();) {
+    Group& group = tracks_[it->first].groups[it->second];
+    if (RefreshIncompleteGroup(group))
+      updated_tracks.insert(it->first);
+    it = group.incomplete_rows.empty() ? incomplete_groups_.erase(it)
+                                       : std::next(it);
   }
 
-  // Find all the slices for the tracks we want to filter and create a vector of
-  // row numbers out of them.
-  std::vector<tables::SliceTable::RowNumber> rows;
-  for (auto it = slice_table_->IterateRows(); it; ++it) {
-    if (selected_tracks.count(it.track_id())) {
-      rows.emplace_back(it.row_number());
+  uint32_t row_count = slice_table_->row_count();
+  uint32_t first_new_row = static_cast<uint32_t>(row_group_.size());
+  row_group_.resize(row_count);
+
+  const auto& track_id = slice_table_->track_id();
+  const auto& parent_id = slice_table_->parent_id();
+  const auto& ts = slice_table_->ts();
+  const auto& depth = slice_table_->depth();
+  for (uint32_t row = first_new_row; row < row_count; ++row) {
+    uint32_t track = track_id[row].value;
+    updated_tracks.insert(track);
+    TrackInfo& info = tracks_[track];
+    info.rows.push_back(row);
+
+    // Slices are added to the group of their parent. Parents are always
+    // inserted before their children and are on the same track.
+    std::optional<uint32_t> parent_row;
+    if (std::optional<SliceId> parent = parent_id[row]; parent) {
+      auto parent_ref = slice_table_->FindById(*parent);
+      if (parent_ref) {
+        uint32_t r = parent_ref->ToRowNumber().row_number();
+        if (r < row && track_id[r].value == track)
+          parent_row = r;
+      }
     }
+    if (!parent_row) {
+      row_group_[row] = static_cast<uint32_t>(info.groups.size());
+      info.groups.push_back(
+          Group{row, ts[row], ts[row], depth[row], ts[row], {}});
+    } else {
+      row_group_[row] = row_group_[*parent_row];
+    }
+    AddRowToGroup(row, track, row_group_[row]);
   }
 
-  // Compute the table and add it to the cache for future use.
-  std::unique_ptr<Table> layout_table =
-      ComputeLayoutTable(std::move(rows), filter_id);
-  auto res = layout_table_cache_.emplace(filter_id, std::move(layout_table));
+  // Drop the cached layouts which include any of the updated tracks: they are
+  // recomputed on the next query.
+  if (updated_tracks.empty())
+    return;
+  for (auto it = layouts_.begin(); it != layouts_.end();) {
+    bool stale = std::any_of(
+        it->first.begin(), it->first.end(),
+        [&updated_tracks](uint32_t t) { return updated_tracks.count(t); });
+    it = stale ? layouts_.erase(it) : std::next(it);
+  }
+}
 
-  table_return.reset(new Table(res.first->second->Copy()));
-  return base::OkStatus();
+void ExperimentalSliceLayout::AddRowToGroup(uint32_t row,
+                                            uint32_t track,
+                                            uint32_t group_idx) {
+  Group& group = tracks_[track].groups[group_idx];
+  group.max_depth = std::max(group.max_depth, slice_table_->depth()[row]);
+  int64_t dur = slice_table_->dur()[row];
+  if (dur == -1) {
+    if (group.incomplete_rows.empty())
+      incomplete_groups_.emplace_back(track, group_idx);
+    group.incomplete_rows.push_back(row);
+    group.end = std::numeric_limits<int64_t>::max();
+    return;
+  }
+  group.completed_end =
+      std::max(group.completed_end, slice_table_->ts()[row] + dur);
+  if (group.incomplete_rows.empty())
+    group.end = group.completed_end;
 }
 
-// Build up a table of slice id -> root slice id by observing each
-// (id, opt_parent_id) pair in order.
-tables::SliceTable::Id ExperimentalSliceLayout::InsertSlice(
-    std::map<tables::SliceTable::Id, tables::SliceTable::Id>& id_map,
-    tables::SliceTable::Id id,
-    std::optional<tables::SliceTable::Id> parent_id) {
-  if (parent_id) {
-    tables::SliceTable::Id root_id = id_map[parent_id.value()];
-    id_map[id] = root_id;
-    return root_id;
-  } else {
-    id_map[id] = id;
-    return id;
+bool ExperimentalSliceLayout::RefreshIncompleteGroup(Group& group) {
+  const auto& ts = slice_table_->ts();
+  const auto& dur = slice_table_->dur();
+  auto& rows = group.incomplete_rows;
+  for (auto it = rows.begin(); it != rows.end();) {
+    if (dur[*it] == -1) {
+      ++it;
+      continue;
+    }
+    group.completed_end = std::max(group.completed_end, ts[*it] + dur[*it]);
+    it = rows.erase(it);
   }
+  if (!rows.empty())
+    return false;
+  group.end = group.completed_end;
+  return true;
 }
 
 // The problem we're trying to solve is this: given a number of tracks each of
@@ -164,125 +261,142 @@ tables::SliceTable::Id ExperimentalSliceLayout::InsertSlice(
 // We do this by computing an additional column: layout_depth. layout_depth
 // tells us the vertical position of each slice in each stalactite.
 //
-// The algorithm works in three passes:
-// 1. For each stalactite find the 'bounding box' (start, end, & max depth)
-// 2. Considering each stalactite bounding box in start ts order pick a
+// The bounding box (start, end, & max depth) of each stalactite is kept up to
+// date per track by UpdateTracks(). The layout of a set of tracks is then
+// computed in two passes:
+// 1. Considering each stalactite bounding box in start ts order pick a
 //    layout_depth for the root slice of stalactite to avoid collisions with
 //    all previous stalactite's we've considered.
-// 3. Go though each slice and give it a layout_depth by summing it's
+// 2. Go though each slice and give it a layout_depth by summing it's
 //    current depth and the root layout_depth of the stalactite it belongs to.
 //
-std::unique_ptr<Table> ExperimentalSliceLayout::ComputeLayoutTable(
-    std::vector<tables::SliceTable::RowNumber> rows,
-    StringPool::Id filter_id) {
-  std::map<tables::SliceTable::Id, GroupInfo> groups;
-  // Map of id -> root_id
-  std::map<tables::SliceTable::Id, tables::SliceTable::Id> id_map;
-
-  // Step 1:
-  // Find the bounding box (start ts, end ts, and max depth) for each group
-  // TODO(lalitm): Update this to use iterator (as this code will be slow after
-  // the event table is implemented)
-  for (tables::SliceTable::RowNumber i : rows) {
-    auto ref = i.ToRowReference(*slice_table_);
-
-    tables::SliceTable::Id id = ref.id();
-    uint32_t depth = ref.depth();
-    int64_t start = ref.ts();
-    int64_t dur = ref.dur();
-    int64_t end = dur == -1 ? std::numeric_limits<int64_t>::max() : start + dur;
-    InsertSlice(id_map, id, ref.parent_id());
-    std::map<tables::SliceTable::Id, GroupInfo>::iterator it;
-    bool inserted;
-    std::tie(it, inserted) = groups.emplace(
-        std::piecewise_construct, std::forward_as_tuple(id_map[id]),
-        std::forward_as_tuple(start, end, depth));
-    if (!inserted) {
-      it->second.max_depth = std::max(it->second.max_depth, depth);
-      it->second.end = std::max(it->second.end, end);
-    }
+// The layout always covers the whole trace so that the depth of a slice does
+// not depend on the window being queried.
+ExperimentalSliceLayout::Layout ExperimentalSliceLayout::ComputeLayout(
+    const std::vector<uint32_t>& track_ids) {
+  std::vector<const TrackInfo*> tracks;
+  for (uint32_t track_id : track_ids) {
+    auto it = tracks_.find(track_id);
+    if (it != tracks_.end())
+      tracks.push_back(&it->second);
   }
 
-  // Sort the groups by ts
-  std::vector<GroupInfo*> sorted_groups;
-  sorted_groups.resize(groups.size());
-  size_t idx = 0;
-  for (auto& group : groups) {
-    sorted_groups[idx++] = &group.second;
+  // Sort the groups by ts, breaking ties by the row of their root.
+  std::vector<const Group*> sorted_groups;
+  for (const TrackInfo* track : tracks) {
+    for (const Group& group : track->groups) {
+      sorted_groups.push_back(&group);
+    }
   }
-  std::sort(std::begin(sorted_groups), std::end(sorted_groups),
-            [](const GroupInfo* group1, const GroupInfo* group2) {
-              return group1->start < group2->start;
+  std::sort(sorted_groups.begin(), sorted_groups.end(),
+            [](const Group* a, const Group* b) {
+              return std::tie(a->start, a->root_row) <
+                     std::tie(b->start, b->root_row);
             });
 
-  // Step 2:
+  // Step 1:
   // Go though each group and choose a depth for the root slice.
   // We keep track of those groups where the start time has passed but the
   // end time has not in this vector:
-  std::vector<GroupInfo*> still_open;
-  for (GroupInfo* group : sorted_groups) {
-    int64_t start = group->start;
-    uint32_t max_depth = group->max_depth;
-
-    // Discard all 'closed' groups where that groups end_ts is < our start_ts:
-    {
-      auto it = still_open.begin();
-      while (it != still_open.end()) {
-        if ((*it)->end <= start) {
-          it = still_open.erase(it);
-        } else {
-          ++it;
-        }
-      }
-    }
-
-    // Find a start layout depth for this group s.t. our start depth +
+  struct OpenGroup {
+    int64_t end;
+    uint32_t start_depth;
+    uint32_t end_depth;
+  };
+  std::vector<OpenGroup> still_open;
+  // Map of root row -> layout depth.
+  std::unordered_map<uint32_t, uint32_t> root_layout_depth;
+  for (const Group* group : sorted_groups) {
+    // Discard all 'closed' groups where that groups end_ts is < our start_ts.
+    still_open.erase(std::remove_if(still_open.begin(), still_open.end(),
+                                    [group](const OpenGroup& open) {
+                                      return open.end <= group->start;
+                                    }),
+                     still_open.end());
+
+    // Find the lowest start layout depth for this group s.t. our start depth +
     // our max depth will not intersect with the start depth + max depth for
-    // any of the open groups:
+    // any of the open groups. Considering the open groups from the top, this
+    // is the first gap which is tall enough.
+    std::sort(still_open.begin(), still_open.end(),
+              [](const OpenGroup& a, const OpenGroup& b) {
+                return a.start_depth < b.start_depth;
+              });
     uint32_t layout_depth = 0;
-    bool done = false;
-    while (!done) {
-      done = true;
-      uint32_t start_depth = layout_depth;
-      uint32_t end_depth = layout_depth + max_depth;
-      for (const auto& open : still_open) {
-        uint32_t open_start_depth = open->layout_depth;
-        uint32_t open_end_depth = open->layout_depth + open->max_depth;
-        bool fully_above_open = end_depth < open_start_depth;
-        bool fully_below_open = open_end_depth < start_depth;
-        if (!fully_above_open && !fully_below_open) {
-          // This is extremely dumb, we can make a much better guess for what
-          // depth to try next but it is a little complicated to get right.
-          layout_depth++;
-          done = false;
-          break;
-        }
-      }
+    for (const OpenGroup& open : still_open) {
+      if (layout_depth + group->max_depth < open.start_depth)
+        break;
+      layout_depth = std::max(layout_depth, open.end_depth + 1);
     }
 
-    // Add this group to the open groups & re
-    still_open.push_back(group);
+    still_open.push_back(
+        OpenGroup{group->end, layout_depth, layout_depth + group->max_depth});
+    root_layout_depth[group->root_row] = layout_depth;
+  }
+
+  // Step 2: Merge the rows of all the tracks and compute the layout depth of
+  // each slice: its current slice depth + root slice depth of the group.
+  Layout layout;
+  for (const TrackInfo* track : tracks) {
+    layout.rows.insert(layout.rows.end(), track->rows.begin(),
+                       track->rows.end());
+  }
+  std::sort(layout.rows.begin(), layout.rows.end());
+
+  const auto& track_id = slice_table_->track_id();
+  const auto& depth = slice_table_->depth();
+  const auto& ts = slice_table_->ts();
+  layout.layout_depth.reserve(layout.rows.size());
+  for (uint32_t row : layout.rows) {
+    const TrackInfo& track = tracks_.at(track_id[row].value);
+    const Group& group = track.groups[row_group_[row]];
+    layout.layout_depth.push_back(depth[row] +
+                                  root_layout_depth.at(group.root_row));
+  }
 
-    // Set our root layout depth:
-    group->layout_depth = layout_depth;
+  layout.by_ts.resize(layout.rows.size());
+  std::iota(layout.by_ts.begin(), layout.by_ts.end(), 0u);
+  std::stable_sort(layout.by_ts.begin(), layout.by_ts.end(),
+                   [&](uint32_t a, uint32_t b) {
+                     return ts[layout.rows[a]] < ts[layout.rows[b]];
+                   });
+  return layout;
+}
+
+std::unique_ptr<Table> ExperimentalSliceLayout::SelectWindow(
+    const Layout& layout,
+    int64_t min_ts,
+    int64_t max_ts,
+    StringPool::Id filter_id) {
+  std::vector<uint32_t> indices;
+  if (min_ts == std::numeric_limits<int64_t>::min() &&
+      max_ts == std::numeric_limits<int64_t>::max()) {
+    indices.resize(layout.rows.size());
+    std::iota(indices.begin(), indices.end(), 0u);
+  } else if (min_ts <= max_ts) {
+    const auto& ts = slice_table_->ts();
+    auto ts_of = [&](uint32_t idx) { return ts[layout.rows[idx]]; };
+    auto begin = std::lower_bound(
+        layout.by_ts.begin(), layout.by_ts.end(), min_ts,
+        [&](uint32_t idx, int64_t value) { return ts_of(idx) < value; });
+    auto end = std::upper_bound(
+        begin, layout.by_ts.end(), max_ts,
+        [&](int64_t value, uint32_t idx) { return value < ts_of(idx); });
+    indices.assign(begin, end);
+    std::sort(indices.begin(), indices.end());
   }
 
-  // Step 3: Add the two new columns layout_depth and filter_track_ids:
+  std::vector<tables::SliceTable::RowNumber> rows;
+  rows.reserve(indices.size());
   ColumnStorage<uint32_t> layout_depth_column;
   ColumnStorage<StringPool::Id> filter_column;
-
-  for (tables::SliceTable::RowNumber i : rows) {
-    auto ref = i.ToRowReference(*slice_table_);
-
-    // Each slice depth is it's current slice depth + root slice depth of the
-    // group:
-    uint32_t group_depth = groups.at(id_map[ref.id()]).layout_depth;
-    layout_depth_column.Append(ref.depth() + group_depth);
+  for (uint32_t idx : indices) {
+    rows.emplace_back(layout.rows[idx]);
+    layout_depth_column.Append(layout.layout_depth[idx]);
     // We must set this to the value we got in the constraint to ensure our
     // rows are not filtered out:
     filter_column.Append(filter_id);
   }
-
   return tables::ExperimentalSliceLayoutTable::SelectAndExtendParent(
       *slice_table_, std::move(rows), std::move(layout_depth_column),
       std::move(filter_column));
@@ -17,7 +17,11 @@
 #ifndef SRC_TRACE_PROCESSOR_PERFETTO_SQL_INTRINSICS_TABLE_FUNCTIONS_EXPERIMENTAL_SLICE_LAYOUT_H_
 #define SRC_TRACE_PROCESSOR_PERFETTO_SQL_INTRINSICS_TABLE_FUNCTIONS_EXPERIMENTAL_SLICE_LAYOUT_H_
 
-#include <set>
+#include <map>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include "src/trace_processor/perfetto_sql/intrinsics/table_functions/static_table_function.h"
 #include "src/trace_processor/storage/trace_storage.h"
@@ -41,21 +45,74 @@ class ExperimentalSliceLayout : public StaticTableFunction {
                             std::unique_ptr<Table>& table_return) override;
 
  private:
-  std::unique_ptr<Table> ComputeLayoutTable(
-      std::vector<tables::SliceTable::RowNumber> rows,
-      StringPool::Id filter_id);
-  tables::SliceTable::Id InsertSlice(
-      std::map<tables::SliceTable::Id, tables::SliceTable::Id>& id_map,
-      tables::SliceTable::Id id,
-      std::optional<tables::SliceTable::Id> parent_id);
-
-  // TODO(lalitm): remove this cache and move to having explicitly scoped
-  // lifetimes of dynamic tables.
-  std::unordered_map<StringId, std::unique_ptr<Table>> layout_table_cache_;
+  // A root slice and all of its descendants.
+  struct Group {
+    uint32_t root_row;
+    int64_t start;
+    int64_t end;
+    uint32_t max_depth;
+
+    // End of the slices of the group which have ended.
+    int64_t completed_end;
+
+    // Rows of the slices of the group which had not ended (i.e. dur = -1)
+    // when last seen. While this is not empty, |end| is unbounded and the
+    // group is checked again on every call to UpdateTracks().
+    std::vector<uint32_t> incomplete_rows;
+  };
+
+  // Packing structure of a single track. This only ever grows as slices are
+  // added to the track.
+  struct TrackInfo {
+    // Rows of the slices on this track, in row order.
+    std::vector<uint32_t> rows;
+    std::vector<Group> groups;
+  };
+
+  // Layout of a set of tracks.
+  struct Layout {
+    // All the slice rows of the tracks, in row order.
+    std::vector<uint32_t> rows;
+    // The layout depth of each entry in |rows|.
+    std::vector<uint32_t> layout_depth;
+    // Indices into |rows|, sorted by ts.
+    std::vector<uint32_t> by_ts;
+  };
+
+  // Extends the per-track structures with the slices inserted since the last
+  // call, recomputes the groups whose incomplete slices have ended and drops
+  // the layouts of the tracks which changed.
+  void UpdateTracks();
+
+  // Adds |row| to |group|, updating its bounds.
+  void AddRowToGroup(uint32_t row, uint32_t track, uint32_t group_idx);
+
+  // Recomputes the bounds of a group whose incomplete slices might have ended.
+  // Returns true if they changed.
+  bool RefreshIncompleteGroup(Group& group);
+
+  Layout ComputeLayout(const std::vector<uint32_t>& track_ids);
+
+  std::unique_ptr<Table> SelectWindow(const Layout& layout,
+                                      int64_t min_ts,
+                                      int64_t max_ts,
+                                      StringPool::Id filter_id);
+
+  // Keyed by track id.
+  std::unordered_map<uint32_t, TrackInfo> tracks_;
+
+  // Keyed by the sorted list of track ids.
+  std::map<std::vector<uint32_t>, Layout> layouts_;
+
+  // For every indexed row, the index of its group in the TrackInfo of its
+  // track.
+  std::vector<uint32_t> row_group_;
+
+  // (track id, group index) of the groups with incomplete slices.
+  std::vector<std::pair<uint32_t, uint32_t>> incomplete_groups_;
 
   StringPool* string_pool_;
   const tables::SliceTable* slice_table_;
-  const StringPool::Id empty_string_id_;
 };
 
 }  // namespace trace_processor
@@ -318,6 +318,119 @@ TEST(ExperimentalSliceLayoutTest, FilterOutTracks) {
 )");
 }
 
+TEST(ExperimentalSliceLayoutTest, TsWindow) {
+  StringPool pool;
+  tables::SliceTable slice_table(&pool);
+  StringId name = pool.InternString("Slice");
+
+  auto a = Insert(&slice_table, 0 /*ts*/, 4 /*dur*/, 1 /*track_id*/, name,
+                  std::nullopt);
+  Insert(&slice_table, 0 /*ts*/, 2 /*dur*/, 1 /*track_id*/, name, a);
+  Insert(&slice_table, 3 /*ts*/, 4 /*dur*/, 2 /*track_id*/, name,
+         std::nullopt);
+  Insert(&slice_table, 8 /*ts*/, 2 /*dur*/, 2 /*track_id*/, name,
+         std::nullopt);
+
+  ExperimentalSliceLayout gen(&pool, &slice_table);
+
+  // Only the slices starting in the window are returned, but their depth is
+  // the same as when the whole trace is laid out.
+  std::unique_ptr<Table> table;
+  auto status = gen.ComputeTable(
+      {Constraint{kColumn, FilterOp::kEq, SqlValue::String("1,2")},
+       Constraint{tables::ExperimentalSliceLayoutTable::ColumnIndex::ts,
+                  FilterOp::kGe, SqlValue::Long(1)},
+       Constraint{tables::ExperimentalSliceLayoutTable::ColumnIndex::ts,
+                  FilterOp::kLe, SqlValue::Long(7)}},
+      {}, BitVector(), table);
+  EXPECT_TRUE(status.ok());
+  ExpectOutput(*table, R"(
+
+
+   ####
+)");
+}
+
+TEST(ExperimentalSliceLayoutTest, SlicesAddedAfterQuery) {
+  StringPool pool;
+  tables::SliceTable slice_table(&pool);
+  StringId name = pool.InternString("Slice");
+
+  Insert(&slice_table, 0 /*ts*/, 4 /*dur*/, 1 /*track_id*/, name,
+         std::nullopt);
+  Insert(&slice_table, 3 /*ts*/, 4 /*dur*/, 2 /*track_id*/, name,
+         std::nullopt);
+
+  ExperimentalSliceLayout gen(&pool, &slice_table);
+
+  std::unique_ptr<Table> table;
+  auto status = gen.ComputeTable(
+      {Constraint{kColumn, FilterOp::kEq, SqlValue::String("1,2")}}, {},
+      BitVector(), table);
+  EXPECT_TRUE(status.ok());
+  ExpectOutput(*table, R"(
+####
+   ####
+)");
+
+  // The layout of the tracks which got new slices is recomputed.
+  Insert(&slice_table, 1 /*ts*/, 4 /*dur*/, 3 /*track_id*/, name,
+         std::nullopt);
+  Insert(&slice_table, 5 /*ts*/, 1 /*dur*/, 1 /*track_id*/, name,
+         std::nullopt);
+  status = gen.ComputeTable(
+      {Constraint{kColumn, FilterOp::kEq, SqlValue::String("2,1")}}, {},
+      BitVector(), table);
+  EXPECT_TRUE(status.ok());
+  ExpectOutput(*table, R"(
+#### #
+   ####
+)");
+  status = gen.ComputeTable(
+      {Constraint{kColumn, FilterOp::kEq, SqlValue::String("1,2,3")}}, {},
+      BitVector(), table);
+  EXPECT_TRUE(status.ok());
+  ExpectOutput(*table, R"(
+#### #
+ ####
+   ####
+)");
+}
+
+TEST(ExperimentalSliceLayoutTest, IncompleteSliceEndsAfterQuery) {
+  StringPool pool;
+  tables::SliceTable slice_table(&pool);
+  StringId name = pool.InternString("Slice");
+
+  auto a = Insert(&slice_table, 0 /*ts*/, -1 /*dur*/, 1 /*track_id*/, name,
+                  std::nullopt);
+  Insert(&slice_table, 5 /*ts*/, 2 /*dur*/, 2 /*track_id*/, name,
+         std::nullopt);
+
+  ExperimentalSliceLayout gen(&pool, &slice_table);
+
+  // While |a| has not ended, it overlaps everything after it.
+  std::unique_ptr<Table> table;
+  auto status = gen.ComputeTable(
+      {Constraint{kColumn, FilterOp::kEq, SqlValue::String("1,2")}}, {},
+      BitVector(), table);
+  EXPECT_TRUE(status.ok());
+  ExpectOutput(*table, R"(
+
+     ##
+)");
+
+  // Once it ends, the layout is recomputed even if no slice was added.
+  slice_table.mutable_dur()->Set(a.value, 3);
+  status = gen.ComputeTable(
+      {Constraint{kColumn, FilterOp::kEq, SqlValue::String("1,2")}}, {},
+      BitVector(), table);
+  EXPECT_TRUE(status.ok());
+  ExpectOutput(*table, R"(
+###  ##
+)");
+}
+
 }  // namespace
 }  // namespace trace_processor
 }  // namespace perfetto
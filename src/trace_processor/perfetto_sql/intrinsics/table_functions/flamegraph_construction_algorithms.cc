@@ -16,9 +16,12 @@
 
 #include "src/trace_processor/perfetto_sql/intrinsics/table_functions/flamegraph_construction_algorithms.h"
 
-#include <set>
-#include <unordered_set>
+#include <algorithm>
+#include <limits>
+#include <map>
+#include <thread>
 
+#include "perfetto/base/build_config.h"
 #include "perfetto/ext/base/string_splitter.h"
 #include "perfetto/ext/base/string_utils.h"
 
@@ -38,11 +41,6 @@ struct MergedCallsite {
   }
 };
 
-struct FlamegraphTableAndMergedCallsites {
-  std::unique_ptr<tables::ExperimentalFlamegraphNodesTable> tbl;
-  std::vector<uint32_t> callsite_to_merged_callsite;
-};
-
 std::vector<MergedCallsite> GetMergedCallsites(TraceStorage* storage,
                                                uint32_t callstack_row) {
   const tables::StackProfileCallsiteTable& callsites_tbl =
@@ -86,29 +84,85 @@ std::vector<MergedCallsite> GetMergedCallsites(TraceStorage* storage,
   std::reverse(result.begin(), result.end());
   return result;
 }
+constexpr uint32_t kNoSample = std::numeric_limits<uint32_t>::max();
+
+// Below this number of samples, aggregating on a single thread is faster than
+// spawning threads.
+constexpr uint32_t kMinSamplesForParallelAggregation = 1 << 20;
+constexpr uint32_t kMaxAggregationThreads = 8;
+
+// Splits [begin, end) into contiguous chunks and calls |fn| on each of them,
+// using a thread per chunk if the range is large enough. Returns the results
+// of |fn| in the order of the chunks.
+template <typename Result, typename Fn>
+std::vector<Result> AggregateInChunks(uint32_t begin, uint32_t end, Fn fn) {
+  uint32_t chunks = 1;
+#if !PERFETTO_BUILDFLAG(PERFETTO_OS_WASM)
+  if (end - begin >= kMinSamplesForParallelAggregation) {
+    chunks = std::clamp(std::thread::hardware_concurrency(), 1u,
+                        kMaxAggregationThreads);
+  }
+#endif
+  std::vector<Result> results(chunks);
+  uint32_t chunk_size = (end - begin + chunks - 1) / chunks;
+  if (chunks == 1) {
+    fn(begin, end, results[0]);
+    return results;
+  }
+#if !PERFETTO_BUILDFLAG(PERFETTO_OS_WASM)
+  std::vector<std::thread> threads;
+  for (uint32_t i = 0; i < chunks; ++i) {
+    uint32_t chunk_begin = std::min(end, begin + i * chunk_size);
+    uint32_t chunk_end = std::min(end, chunk_begin + chunk_size);
+    threads.emplace_back([&fn, &results, i, chunk_begin, chunk_end] {
+      fn(chunk_begin, chunk_end, results[i]);
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+#endif
+  return results;
+}
+
+void AddTo(std::vector<int64_t>& to, const std::vector<int64_t>& from) {
+  for (size_t i = 0; i < from.size(); ++i) {
+    to[i] += from[i];
+  }
+}
+
 }  // namespace
 
-static FlamegraphTableAndMergedCallsites BuildFlamegraphTableTreeStructure(
-    TraceStorage* storage,
-    std::optional<UniquePid> upid,
-    std::optional<std::string> upid_group,
-    int64_t default_timestamp,
-    StringId profile_type) {
+FlamegraphCache::FlamegraphCache(TraceStorage* storage) : storage_(storage) {}
+FlamegraphCache::~FlamegraphCache() = default;
+
+void FlamegraphCache::MaybeRebuildCallsiteTree() {
   const tables::StackProfileCallsiteTable& callsites_tbl =
-      storage->stack_profile_callsite_table();
+      storage_->stack_profile_callsite_table();
+  uint32_t callsite_rows = callsites_tbl.row_count();
+  uint32_t frame_rows = storage_->stack_profile_frame_table().row_count();
+  uint32_t symbol_rows = storage_->symbol_table().row_count();
+  if (tree_built_ && callsite_rows == tree_callsite_rows_ &&
+      frame_rows == tree_frame_rows_ && symbol_rows == tree_symbol_rows_) {
+    return;
+  }
+  tree_built_ = true;
+  tree_callsite_rows_ = callsite_rows;
+  tree_frame_rows_ = frame_rows;
+  tree_symbol_rows_ = symbol_rows;
 
-  std::vector<uint32_t> callsite_to_merged_callsite(callsites_tbl.row_count(),
-                                                    0);
-  std::map<MergedCallsite, uint32_t> merged_callsites_to_table_idx;
+  // Everything aggregated so far refers to the old nodes.
+  heap_profile_states_.Clear();
+  perf_sample_states_.Clear();
 
-  std::unique_ptr<tables::ExperimentalFlamegraphNodesTable> tbl(
-      new tables::ExperimentalFlamegraphNodesTable(
-          storage->mutable_string_pool()));
+  nodes_.clear();
+  callsite_to_node_.assign(callsite_rows, 0);
+  std::map<MergedCallsite, uint32_t> merged_callsites_to_node;
 
   // FORWARD PASS:
   // Aggregate callstacks by frame name / mapping name. Use symbolization
   // data.
-  for (uint32_t i = 0; i < callsites_tbl.row_count(); ++i) {
+  for (uint32_t i = 0; i < callsite_rows; ++i) {
     std::optional<uint32_t> parent_idx;
 
     auto opt_parent_id = callsites_tbl.parent_id()[i];
@@ -116,295 +170,448 @@ static FlamegraphTableAndMergedCallsites BuildFlamegraphTableTreeStructure(
       parent_idx = callsites_tbl.id().IndexOf(*opt_parent_id);
       // Make sure what we index into has been populated already.
       PERFETTO_CHECK(*parent_idx < i);
-      parent_idx = callsite_to_merged_callsite[*parent_idx];
+      parent_idx = callsite_to_node_[*parent_idx];
     }
 
-    auto callsites = GetMergedCallsites(storage, i);
+    auto callsites = GetMergedCallsites(storage_, i);
     // Loop below needs to run at least once for parent_idx to get updated.
     PERFETTO_CHECK(!callsites.empty());
-    std::map<MergedCallsite, uint32_t> callsites_to_rowid;
     for (MergedCallsite& merged_callsite : callsites) {
       merged_callsite.parent_idx = parent_idx;
-      auto it = merged_callsites_to_table_idx.find(merged_callsite);
-      if (it == merged_callsites_to_table_idx.end()) {
-        std::tie(it, std::ignore) = merged_callsites_to_table_idx.emplace(
-            merged_callsite, merged_callsites_to_table_idx.size());
-        tables::ExperimentalFlamegraphNodesTable::Row row{};
-        if (parent_idx) {
-          row.depth = tbl->depth()[*parent_idx] + 1;
-          row.parent_id = tbl->id()[*parent_idx];
-        } else {
-          row.depth = 0;
-          row.parent_id = std::nullopt;
-        }
-
-        // The 'ts' column is given a default value, taken from the query.
-        // So if the query is:
-        // `select * form experimental_flamegraph
-        //  where ts = 605908369259172
-        //  and upid = 1
-        //  and profile_type = 'native'`
-        // then row.ts == 605908369259172, for all rows
-        // This is not accurate. However, at present there is no other
-        // straightforward way of assigning timestamps to non-leaf nodes in the
-        // flamegraph tree. Non-leaf nodes would have to be assigned >= 1
-        // timestamps, which would increase data size without an advantage.
-        row.ts = default_timestamp;
-        if (upid) {
-          row.upid = *upid;
-        }
-        if (upid_group) {
-          row.upid_group = storage->InternString(base::StringView(*upid_group));
-        }
-        row.profile_type = profile_type;
-        row.name = merged_callsite.frame_name;
-        row.map_name = merged_callsite.mapping_name;
-        tbl->Insert(row);
-        callsites_to_rowid[merged_callsite] =
-            static_cast<uint32_t>(merged_callsites_to_table_idx.size() - 1);
-
-        PERFETTO_CHECK(merged_callsites_to_table_idx.size() ==
-                       tbl->row_count());
-      } else {
-        MergedCallsite saved_callsite = it->first;
-        callsites_to_rowid.erase(saved_callsite);
-        if (saved_callsite.source_file != merged_callsite.source_file) {
-          saved_callsite.source_file = std::nullopt;
-        }
-        if (saved_callsite.line_number != merged_callsite.line_number) {
-          saved_callsite.line_number = std::nullopt;
-        }
-        callsites_to_rowid[saved_callsite] = it->second;
+      auto [it, inserted] = merged_callsites_to_node.emplace(
+          merged_callsite, static_cast<uint32_t>(nodes_.size()));
+      if (inserted) {
+        // The source file and line number of a node are the ones of the first
+        // callsite merged into it.
+        uint32_t depth = parent_idx ? nodes_[*parent_idx].depth + 1 : 0;
+        nodes_.push_back(Node{merged_callsite.frame_name,
+                              merged_callsite.mapping_name,
+                              merged_callsite.source_file,
+                              merged_callsite.line_number, parent_idx, depth});
       }
       parent_idx = it->second;
     }
 
-    for (const auto& it : callsites_to_rowid) {
-      if (it.first.source_file) {
-        tbl->mutable_source_file()->Set(it.second, *it.first.source_file);
-      }
-      if (it.first.line_number) {
-        tbl->mutable_line_number()->Set(it.second, *it.first.line_number);
-      }
-    }
-
     PERFETTO_CHECK(parent_idx);
-    callsite_to_merged_callsite[i] = *parent_idx;
+    callsite_to_node_[i] = *parent_idx;
   }
+}
 
-  return {std::move(tbl), callsite_to_merged_callsite};
+FlamegraphCache::HeapProfileState& FlamegraphCache::GetHeapProfileState(
+    UniquePid upid) {
+  const tables::HeapProfileAllocationTable& allocation_tbl =
+      storage_->heap_profile_allocation_table();
+  HeapProfileState& state = heap_profile_states_[upid];
+  if (state.source_rows == allocation_tbl.row_count())
+    return state;
+
+  state = HeapProfileState();
+  state.source_rows = allocation_tbl.row_count();
+
+  std::vector<uint32_t> rows;
+  for (auto it = allocation_tbl.FilterToIterator(
+           {allocation_tbl.upid().eq(upid)});
+       it; ++it) {
+    rows.push_back(it.row_number().row_number());
+  }
+  std::stable_sort(rows.begin(), rows.end(), [&](uint32_t a, uint32_t b) {
+    return allocation_tbl.ts()[a] < allocation_tbl.ts()[b];
+  });
+
+  state.ts.reserve(rows.size());
+  state.node.reserve(rows.size());
+  state.size.reserve(rows.size());
+  state.count.reserve(rows.size());
+  for (uint32_t row : rows) {
+    int64_t size = allocation_tbl.size()[row];
+    int64_t count = allocation_tbl.count()[row];
+    PERFETTO_CHECK((size <= 0 && count <= 0) || (size >= 0 && count >= 0));
+    state.ts.push_back(allocation_tbl.ts()[row]);
+    state.node.push_back(
+        callsite_to_node_[allocation_tbl.callsite_id()[row].value]);
+    state.size.push_back(size);
+    state.count.push_back(count);
+  }
+  return state;
 }
 
-static std::unique_ptr<tables::ExperimentalFlamegraphNodesTable>
-BuildFlamegraphTableHeapSizeAndCount(
-    std::unique_ptr<tables::ExperimentalFlamegraphNodesTable> tbl,
-    const std::vector<uint32_t>& callsite_to_merged_callsite,
-    const Table& filtered) {
-  for (auto it = filtered.IterateRows(); it; it.Next()) {
-    int64_t size =
-        it.Get(static_cast<uint32_t>(
-                   tables::HeapProfileAllocationTable::ColumnIndex::size))
-            .long_value;
-    int64_t count =
-        it.Get(static_cast<uint32_t>(
-                   tables::HeapProfileAllocationTable::ColumnIndex::count))
-            .long_value;
-    int64_t callsite_id =
-        it
-            .Get(static_cast<uint32_t>(
-                tables::HeapProfileAllocationTable::ColumnIndex::callsite_id))
-            .long_value;
+FlamegraphCache::PerfSampleState& FlamegraphCache::GetPerfSampleState(
+    const std::vector<UniquePid>& upids) {
+  const tables::PerfSampleTable& samples_tbl = storage_->perf_sample_table();
+  const tables::ThreadTable& thread_tbl = storage_->thread_table();
 
-    PERFETTO_CHECK((size <= 0 && count <= 0) || (size >= 0 && count >= 0));
-    uint32_t merged_idx =
-        callsite_to_merged_callsite[static_cast<unsigned long>(callsite_id)];
+  std::string key;
+  for (UniquePid upid : upids) {
+    key += std::to_string(upid);
+    key += ',';
+  }
+  PerfSampleState& state = perf_sample_states_[key];
+  if (state.sample_rows == samples_tbl.row_count() &&
+      state.thread_rows == thread_tbl.row_count()) {
+    return state;
+  }
+
+  state = PerfSampleState();
+  state.sample_rows = samples_tbl.row_count();
+  state.thread_rows = thread_tbl.row_count();
+
+  // Create set of all utids mapped to the given vector of upids.
+  std::vector<bool> is_selected_utid(thread_tbl.row_count());
+  for (uint32_t i = 0; i < thread_tbl.row_count(); ++i) {
+    std::optional<uint32_t> row_upid = thread_tbl.upid()[i];
+    is_selected_utid[i] =
+        row_upid && std::binary_search(upids.begin(), upids.end(), *row_upid);
+  }
+
+  // Get all samples that have callstacks (some samples can have only counter
+  // values) and correspond to the selected utids.
+  std::vector<uint32_t> rows;
+  for (uint32_t i = 0; i < samples_tbl.row_count(); ++i) {
+    std::optional<CallsiteId> callsite_id = samples_tbl.callsite_id()[i];
+    uint32_t utid = samples_tbl.utid()[i];
+    if (!callsite_id || utid >= is_selected_utid.size() ||
+        !is_selected_utid[utid]) {
+      continue;
+    }
+    rows.push_back(i);
+  }
+  // The parser emits the samples sorted by timestamp but nothing in the table
+  // guarantees it.
+  std::stable_sort(rows.begin(), rows.end(), [&](uint32_t a, uint32_t b) {
+    return samples_tbl.ts()[a] < samples_tbl.ts()[b];
+  });
+
+  state.ts.reserve(rows.size());
+  state.node.reserve(rows.size());
+  for (uint32_t row : rows) {
+    state.ts.push_back(samples_tbl.ts()[row]);
+    state.node.push_back(
+        callsite_to_node_[(*samples_tbl.callsite_id()[row]).value]);
+  }
+  return state;
+}
+
+// static
+void FlamegraphCache::AddAllocations(const HeapProfileState& state,
+                                     uint32_t begin,
+                                     uint32_t end,
+                                     int64_t sign,
+                                     NodeTotals* totals) {
+  for (uint32_t i = begin; i < end; ++i) {
+    uint32_t node = state.node[i];
+    int64_t size = state.size[i];
+    int64_t count = state.count[i];
     // On old heapprofd producers, the count field is incorrectly set and we
     // zero it in proto_trace_parser.cc.
     // As such, we cannot depend on count == 0 to imply size == 0, so we check
     // for both of them separately.
     if (size > 0) {
-      tbl->mutable_alloc_size()->Set(merged_idx,
-                                     tbl->alloc_size()[merged_idx] + size);
+      totals->alloc_size[node] += sign * size;
     }
     if (count > 0) {
-      tbl->mutable_alloc_count()->Set(merged_idx,
-                                      tbl->alloc_count()[merged_idx] + count);
+      totals->alloc_count[node] += sign * count;
     }
-
-    tbl->mutable_size()->Set(merged_idx, tbl->size()[merged_idx] + size);
-    tbl->mutable_count()->Set(merged_idx, tbl->count()[merged_idx] + count);
+    totals->size[node] += sign * size;
+    totals->count[node] += sign * count;
   }
+}
 
-  // BACKWARD PASS:
-  // Propagate sizes to parents.
-  for (int64_t i = tbl->row_count() - 1; i >= 0; --i) {
-    auto idx = static_cast<uint32_t>(i);
-
-    tbl->mutable_cumulative_size()->Set(
-        idx, tbl->cumulative_size()[idx] + tbl->size()[idx]);
-    tbl->mutable_cumulative_count()->Set(
-        idx, tbl->cumulative_count()[idx] + tbl->count()[idx]);
-
-    tbl->mutable_cumulative_alloc_size()->Set(
-        idx, tbl->cumulative_alloc_size()[idx] + tbl->alloc_size()[idx]);
-    tbl->mutable_cumulative_alloc_count()->Set(
-        idx, tbl->cumulative_alloc_count()[idx] + tbl->alloc_count()[idx]);
-
-    auto parent = tbl->parent_id()[idx];
-    if (parent) {
-      uint32_t parent_idx = *tbl->id().IndexOf(
-          tables::ExperimentalFlamegraphNodesTable::Id(*parent));
-      tbl->mutable_cumulative_size()->Set(
-          parent_idx,
-          tbl->cumulative_size()[parent_idx] + tbl->cumulative_size()[idx]);
-      tbl->mutable_cumulative_count()->Set(
-          parent_idx,
-          tbl->cumulative_count()[parent_idx] + tbl->cumulative_count()[idx]);
-
-      tbl->mutable_cumulative_alloc_size()->Set(
-          parent_idx, tbl->cumulative_alloc_size()[parent_idx] +
-                          tbl->cumulative_alloc_size()[idx]);
-      tbl->mutable_cumulative_alloc_count()->Set(
-          parent_idx, tbl->cumulative_alloc_count()[parent_idx] +
-                          tbl->cumulative_alloc_count()[idx]);
+// static
+void FlamegraphCache::UpdatePerfSampleTotals(PerfSampleState* state,
+                                             uint32_t begin,
+                                             uint32_t end,
+                                             uint32_t node_count) {
+  // Number of samples to look at when aggregating from scratch and when
+  // applying the difference with the previous range respectively.
+  uint32_t scratch_cost = end - begin;
+  uint32_t delta_cost = scratch_cost;
+  if (state->aggregated) {
+    uint32_t overlap = 0;
+    if (begin < state->end && state->begin < end) {
+      overlap = std::min(end, state->end) - std::max(begin, state->begin);
     }
+    delta_cost =
+        (end - begin - overlap) + (state->end - state->begin - overlap);
   }
 
-  return tbl;
+  if (!state->aggregated || delta_cost >= scratch_cost) {
+    struct ChunkTotals {
+      std::vector<int64_t> count;
+      std::vector<uint32_t> last_sample;
+    };
+    auto chunks = AggregateInChunks<ChunkTotals>(
+        begin, end,
+        [state, node_count](uint32_t b, uint32_t e, ChunkTotals& out) {
+          out.count.assign(node_count, 0);
+          out.last_sample.assign(node_count, kNoSample);
+          for (uint32_t i = b; i < e; ++i) {
+            uint32_t node = state->node[i];
+            out.count[node]++;
+            out.last_sample[node] = i;
+          }
+        });
+    ChunkTotals& merged = chunks[0];
+    for (size_t c = 1; c < chunks.size(); ++c) {
+      AddTo(merged.count, chunks[c].count);
+      for (uint32_t n = 0; n < node_count; ++n) {
+        if (chunks[c].last_sample[n] != kNoSample)
+          merged.last_sample[n] = chunks[c].last_sample[n];
+      }
+    }
+    state->totals.size = merged.count;
+    state->totals.count = std::move(merged.count);
+    state->last_sample = std::move(merged.last_sample);
+  } else {
+    NodeTotals& totals = state->totals;
+    std::vector<uint32_t>& last_sample = state->last_sample;
+    auto add = [&](uint32_t b, uint32_t e) {
+      for (uint32_t i = b; i < e; ++i) {
+        uint32_t node = state->node[i];
+        totals.size[node]++;
+        totals.count[node]++;
+        if (last_sample[node] == kNoSample || last_sample[node] < i)
+          last_sample[node] = i;
+      }
+    };
+    // Nodes which lost the sample they took their timestamp from.
+    uint32_t lost_last_sample = 0;
+    auto remove = [&](uint32_t b, uint32_t e) {
+      for (uint32_t i = b; i < e; ++i) {
+        uint32_t node = state->node[i];
+        totals.size[node]--;
+        totals.count[node]--;
+        if (last_sample[node] == i) {
+          last_sample[node] = kNoSample;
+          lost_last_sample += totals.count[node] > 0;
+        }
+      }
+    };
+    if (begin < state->begin)
+      add(begin, state->begin);
+    if (end > state->end)
+      add(state->end, end);
+    if (begin > state->begin)
+      remove(state->begin, begin);
+    if (end < state->end)
+      remove(end, state->end);
+
+    // Find the new last sample of those nodes by scanning backwards: this
+    // usually ends quickly as the nodes which lost their last sample are the
+    // ones which had samples close to the previous end of the range.
+    for (uint32_t i = end; i > begin && lost_last_sample > 0; --i) {
+      uint32_t node = state->node[i - 1];
+      if (last_sample[node] == kNoSample && totals.count[node] > 0) {
+        last_sample[node] = i - 1;
+        lost_last_sample--;
+      }
+    }
+  }
+  state->aggregated = true;
+  state->begin = begin;
+  state->end = end;
 }
 
-static std::unique_ptr<tables::ExperimentalFlamegraphNodesTable>
-BuildFlamegraphTableCallstackSizeAndCount(
-    std::unique_ptr<tables::ExperimentalFlamegraphNodesTable> tbl,
-    const std::vector<uint32_t>& callsite_to_merged_callsite,
-    const Table& filtered) {
-  for (auto it = filtered.IterateRows(); it; it.Next()) {
-    int64_t callsite_id =
-        it.Get(static_cast<uint32_t>(
-                   tables::PerfSampleTable::ColumnIndex::callsite_id))
-            .long_value;
-    int64_t ts =
-        it.Get(static_cast<uint32_t>(tables::PerfSampleTable::ColumnIndex::ts))
-            .long_value;
-
-    uint32_t merged_idx =
-        callsite_to_merged_callsite[static_cast<unsigned long>(callsite_id)];
-    tbl->mutable_size()->Set(merged_idx, tbl->size()[merged_idx] + 1);
-    tbl->mutable_count()->Set(merged_idx, tbl->count()[merged_idx] + 1);
-    tbl->mutable_ts()->Set(merged_idx, ts);
-  }
+std::unique_ptr<tables::ExperimentalFlamegraphNodesTable>
+FlamegraphCache::BuildTable(const NodeTotals& totals,
+                            const std::vector<int64_t>& node_ts,
+                            std::optional<UniquePid> upid,
+                            std::optional<std::string> upid_group,
+                            StringId profile_type) {
+  auto node_count = static_cast<uint32_t>(nodes_.size());
+  auto value_or_zero = [](const std::vector<int64_t>& v, uint32_t i) {
+    return v.empty() ? 0 : v[i];
+  };
 
   // BACKWARD PASS:
   // Propagate sizes to parents.
-  for (int64_t i = tbl->row_count() - 1; i >= 0; --i) {
-    auto idx = static_cast<uint32_t>(i);
+  NodeTotals cumulative;
+  cumulative.size.assign(node_count, 0);
+  cumulative.count.assign(node_count, 0);
+  cumulative.alloc_size.assign(node_count, 0);
+  cumulative.alloc_count.assign(node_count, 0);
+  for (uint32_t i = node_count; i > 0; --i) {
+    uint32_t idx = i - 1;
+    cumulative.size[idx] += value_or_zero(totals.size, idx);
+    cumulative.count[idx] += value_or_zero(totals.count, idx);
+    cumulative.alloc_size[idx] += value_or_zero(totals.alloc_size, idx);
+    cumulative.alloc_count[idx] += value_or_zero(totals.alloc_count, idx);
+
+    std::optional<uint32_t> parent = nodes_[idx].parent;
+    if (parent) {
+      cumulative.size[*parent] += cumulative.size[idx];
+      cumulative.count[*parent] += cumulative.count[idx];
+      cumulative.alloc_size[*parent] += cumulative.alloc_size[idx];
+      cumulative.alloc_count[*parent] += cumulative.alloc_count[idx];
+    }
+  }
 
-    tbl->mutable_cumulative_size()->Set(
-        idx, tbl->cumulative_size()[idx] + tbl->size()[idx]);
-    tbl->mutable_cumulative_count()->Set(
-        idx, tbl->cumulative_count()[idx] + tbl->count()[idx]);
+  std::optional<StringId> upid_group_id;
+  if (upid_group) {
+    upid_group_id = storage_->InternString(base::StringView(*upid_group));
+  }
 
-    auto parent = tbl->parent_id()[idx];
-    if (parent) {
-      uint32_t parent_idx = *tbl->id().IndexOf(
-          tables::ExperimentalFlamegraphNodesTable::Id(*parent));
-      tbl->mutable_cumulative_size()->Set(
-          parent_idx,
-          tbl->cumulative_size()[parent_idx] + tbl->cumulative_size()[idx]);
-      tbl->mutable_cumulative_count()->Set(
-          parent_idx,
-          tbl->cumulative_count()[parent_idx] + tbl->cumulative_count()[idx]);
+  std::unique_ptr<tables::ExperimentalFlamegraphNodesTable> tbl(
+      new tables::ExperimentalFlamegraphNodesTable(
+          storage_->mutable_string_pool()));
+  for (uint32_t i = 0; i < node_count; ++i) {
+    const Node& node = nodes_[i];
+    tables::ExperimentalFlamegraphNodesTable::Row row{};
+    // The 'ts' column is given a default value, taken from the query.
+    // So if the query is:
+    // `select * form experimental_flamegraph
+    //  where ts = 605908369259172
+    //  and upid = 1
+    //  and profile_type = 'native'`
+    // then row.ts == 605908369259172, for all rows
+    // This is not accurate. However, at present there is no other
+    // straightforward way of assigning timestamps to non-leaf nodes in the
+    // flamegraph tree. Non-leaf nodes would have to be assigned >= 1
+    // timestamps, which would increase data size without an advantage.
+    row.ts = node_ts[i];
+    if (upid) {
+      row.upid = *upid;
     }
+    row.upid_group = upid_group_id;
+    row.profile_type = profile_type;
+    row.depth = node.depth;
+    row.name = node.name;
+    row.map_name = node.map_name;
+    if (node.parent) {
+      row.parent_id =
+          tables::ExperimentalFlamegraphNodesTable::Id(*node.parent);
+    }
+    row.source_file = node.source_file;
+    row.line_number = node.line_number;
+    row.size = value_or_zero(totals.size, i);
+    row.count = value_or_zero(totals.count, i);
+    row.alloc_size = value_or_zero(totals.alloc_size, i);
+    row.alloc_count = value_or_zero(totals.alloc_count, i);
+    row.cumulative_size = cumulative.size[i];
+    row.cumulative_count = cumulative.count[i];
+    row.cumulative_alloc_size = cumulative.alloc_size[i];
+    row.cumulative_alloc_count = cumulative.alloc_count[i];
+    tbl->Insert(row);
   }
   return tbl;
 }
 
 std::unique_ptr<tables::ExperimentalFlamegraphNodesTable>
-BuildHeapProfileFlamegraph(TraceStorage* storage,
-                           UniquePid upid,
-                           int64_t timestamp) {
-  const tables::HeapProfileAllocationTable& allocation_tbl =
-      storage->heap_profile_allocation_table();
+FlamegraphCache::BuildHeapProfileFlamegraph(UniquePid upid, int64_t timestamp) {
+  MaybeRebuildCallsiteTree();
+  HeapProfileState& state = GetHeapProfileState(upid);
+
   // PASS OVER ALLOCATIONS:
-  // Aggregate allocations into the newly built tree.
-  auto filtered = allocation_tbl.Filter(
-      {allocation_tbl.ts().le(timestamp), allocation_tbl.upid().eq(upid)});
-  if (filtered.row_count() == 0) {
+  // Aggregate allocations into the tree. The allocations which are part of the
+  // flamegraph are a prefix of the sorted allocations so only the ones between
+  // the previous and the new end of the prefix need to be looked at.
+  auto end = static_cast<uint32_t>(
+      std::upper_bound(state.ts.begin(), state.ts.end(), timestamp) -
+      state.ts.begin());
+  if (end == 0) {
     return nullptr;
   }
-  StringId profile_type = storage->InternString("native");
-  FlamegraphTableAndMergedCallsites table_and_callsites =
-      BuildFlamegraphTableTreeStructure(storage, upid, std::nullopt, timestamp,
-                                        profile_type);
-  return BuildFlamegraphTableHeapSizeAndCount(
-      std::move(table_and_callsites.tbl),
-      table_and_callsites.callsite_to_merged_callsite, filtered);
+
+  auto node_count = static_cast<uint32_t>(nodes_.size());
+  uint32_t delta = end > state.aggregated ? end - state.aggregated
+                                           : state.aggregated - end;
+  if (state.totals.size.empty() || delta >= end) {
+    auto chunks = AggregateInChunks<NodeTotals>(
+        0, end, [&state, node_count](uint32_t b, uint32_t e, NodeTotals& out) {
+          out.size.assign(node_count, 0);
+          out.count.assign(node_count, 0);
+          out.alloc_size.assign(node_count, 0);
+          out.alloc_count.assign(node_count, 0);
+          AddAllocations(state, b, e, 1, &out);
+        });
+    state.totals = std::move(chunks[0]);
+    for (size_t c = 1; c < chunks.size(); ++c) {
+      AddTo(state.totals.size, chunks[c].size);
+      AddTo(state.totals.count, chunks[c].count);
+      AddTo(state.totals.alloc_size, chunks[c].alloc_size);
+      AddTo(state.totals.alloc_count, chunks[c].alloc_count);
+    }
+  } else if (end > state.aggregated) {
+    AddAllocations(state, state.aggregated, end, 1, &state.totals);
+  } else if (end < state.aggregated) {
+    AddAllocations(state, end, state.aggregated, -1, &state.totals);
+  }
+  state.aggregated = end;
+
+  std::vector<int64_t> node_ts(node_count, timestamp);
+  StringId profile_type = storage_->InternString("native");
+  return BuildTable(state.totals, node_ts, upid, std::nullopt, profile_type);
 }
 
 std::unique_ptr<tables::ExperimentalFlamegraphNodesTable>
-BuildNativeCallStackSamplingFlamegraph(
-    TraceStorage* storage,
+FlamegraphCache::BuildNativeCallStackSamplingFlamegraph(
     std::optional<UniquePid> upid,
     std::optional<std::string> upid_group,
     const std::vector<TimeConstraints>& time_constraints) {
   // 1.Extract required upids from input.
-  std::unordered_set<UniquePid> upids;
+  std::vector<UniquePid> upids;
   if (upid) {
-    upids.insert(*upid);
+    upids.push_back(*upid);
   } else {
     for (base::StringSplitter sp(*upid_group, ','); sp.Next();) {
       std::optional<uint32_t> maybe = base::CStringToUInt32(sp.cur_token());
       if (maybe) {
-        upids.insert(*maybe);
+        upids.push_back(*maybe);
       }
     }
   }
+  std::sort(upids.begin(), upids.end());
+  upids.erase(std::unique(upids.begin(), upids.end()), upids.end());
 
-  // 2.Create set of all utids mapped to the given vector of upids
-  std::set<tables::ThreadTable::Id> utids;
-  RowMap threads_in_pid_rm;
-  for (uint32_t i = 0; i < storage->thread_table().row_count(); ++i) {
-    std::optional<uint32_t> row_upid = storage->thread_table().upid()[i];
-    if (row_upid && upids.count(*row_upid) > 0) {
-      threads_in_pid_rm.Insert(i);
-    }
-  }
-
-  for (auto it = threads_in_pid_rm.IterateRows(); it; it.Next()) {
-    utids.insert(storage->thread_table().id()[it.index()]);
-  }
-
-  // 3.Get all row indices in perf_sample that have callstacks (some samples
-  // can have only counter values) and correspond to the requested utids.
-  std::vector<uint32_t> cs_rows;
-  for (uint32_t i = 0; i < storage->perf_sample_table().row_count(); ++i) {
-    if (storage->perf_sample_table().callsite_id()[i].has_value() &&
-        utids.find(static_cast<tables::ThreadTable::Id>(
-            storage->perf_sample_table().utid()[i])) != utids.end()) {
-      cs_rows.push_back(i);
-    }
-  }
-
-  // 4.Filter rows that correspond to the selected utids
-  RowMap filtered_rm = RowMap(std::move(cs_rows));
-  Table filtered = storage->perf_sample_table().Apply(std::move(filtered_rm));
-
-  // 5.Filter rows by time constraints
+  // 2.Convert the time constraints to an inclusive range of timestamps.
+  int64_t min_ts = std::numeric_limits<int64_t>::min();
+  int64_t max_ts = std::numeric_limits<int64_t>::max();
+  bool empty_range = false;
   for (const auto& tc : time_constraints) {
-    if (!(tc.op == FilterOp::kGt || tc.op == FilterOp::kLt ||
-          tc.op == FilterOp::kGe || tc.op == FilterOp::kLe)) {
-      PERFETTO_FATAL("Filter operation %d not permitted for perf.",
-                     static_cast<int>(tc.op));
+    switch (tc.op) {
+      case FilterOp::kGt:
+        if (tc.value == std::numeric_limits<int64_t>::max()) {
+          empty_range = true;
+        } else {
+          min_ts = std::max(min_ts, tc.value + 1);
+        }
+        break;
+      case FilterOp::kGe:
+        min_ts = std::max(min_ts, tc.value);
+        break;
+      case FilterOp::kLt:
+        if (tc.value == std::numeric_limits<int64_t>::min()) {
+          empty_range = true;
+        } else {
+          max_ts = std::min(max_ts, tc.value - 1);
+        }
+        break;
+      case FilterOp::kLe:
+        max_ts = std::min(max_ts, tc.value);
+        break;
+      case FilterOp::kEq:
+      case FilterOp::kNe:
+      case FilterOp::kIsNull:
+      case FilterOp::kIsNotNull:
+      case FilterOp::kGlob:
+      case FilterOp::kRegex:
+        PERFETTO_FATAL("Filter operation %d not permitted for perf.",
+                       static_cast<int>(tc.op));
     }
-    Constraint cs = Constraint{
-        static_cast<uint32_t>(tables::PerfSampleTable::ColumnIndex::ts), tc.op,
-        SqlValue::Long(tc.value)};
-    filtered = filtered.Filter({cs});
   }
-  if (filtered.row_count() == 0) {
+
+  // 3.Find the samples of the selected processes in that range.
+  MaybeRebuildCallsiteTree();
+  PerfSampleState& state = GetPerfSampleState(upids);
+  auto begin = static_cast<uint32_t>(
+      std::lower_bound(state.ts.begin(), state.ts.end(), min_ts) -
+      state.ts.begin());
+  auto end = static_cast<uint32_t>(
+      std::upper_bound(state.ts.begin(), state.ts.end(), max_ts) -
+      state.ts.begin());
+  if (empty_range || min_ts > max_ts || begin >= end) {
     std::unique_ptr<tables::ExperimentalFlamegraphNodesTable> empty_tbl(
         new tables::ExperimentalFlamegraphNodesTable(
-            storage->mutable_string_pool()));
+            storage_->mutable_string_pool()));
     return empty_tbl;
   }
 
@@ -424,13 +631,36 @@ BuildNativeCallStackSamplingFlamegraph(
       default_timestamp = tc.value;
     }
   }
-  StringId profile_type = storage->InternString("perf");
-  FlamegraphTableAndMergedCallsites table_and_callsites =
-      BuildFlamegraphTableTreeStructure(storage, upid, upid_group,
-                                        default_timestamp, profile_type);
-  return BuildFlamegraphTableCallstackSizeAndCount(
-      std::move(table_and_callsites.tbl),
-      table_and_callsites.callsite_to_merged_callsite, filtered);
+
+  // 4.Aggregate the samples into the tree.
+  auto node_count = static_cast<uint32_t>(nodes_.size());
+  UpdatePerfSampleTotals(&state, begin, end, node_count);
+
+  // Nodes with samples take the timestamp of their last sample.
+  std::vector<int64_t> node_ts(node_count, default_timestamp);
+  for (uint32_t i = 0; i < node_count; ++i) {
+    if (state.last_sample[i] != kNoSample)
+      node_ts[i] = state.ts[state.last_sample[i]];
+  }
+  StringId profile_type = storage_->InternString("perf");
+  return BuildTable(state.totals, node_ts, upid, upid_group, profile_type);
+}
+
+std::unique_ptr<tables::ExperimentalFlamegraphNodesTable>
+BuildHeapProfileFlamegraph(TraceStorage* storage,
+                           UniquePid upid,
+                           int64_t timestamp) {
+  return FlamegraphCache(storage).BuildHeapProfileFlamegraph(upid, timestamp);
+}
+
+std::unique_ptr<tables::ExperimentalFlamegraphNodesTable>
+BuildNativeCallStackSamplingFlamegraph(
+    TraceStorage* storage,
+    std::optional<UniquePid> upid,
+    std::optional<std::string> upid_group,
+    const std::vector<TimeConstraints>& time_constraints) {
+  return FlamegraphCache(storage).BuildNativeCallStackSamplingFlamegraph(
+      upid, std::move(upid_group), time_constraints);
 }
 
 }  // namespace trace_processor
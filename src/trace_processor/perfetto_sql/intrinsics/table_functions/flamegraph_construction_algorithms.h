@@ -17,6 +17,12 @@
 #ifndef SRC_TRACE_PROCESSOR_PERFETTO_SQL_INTRINSICS_TABLE_FUNCTIONS_FLAMEGRAPH_CONSTRUCTION_ALGORITHMS_H_
 #define SRC_TRACE_PROCESSOR_PERFETTO_SQL_INTRINSICS_TABLE_FUNCTIONS_FLAMEGRAPH_CONSTRUCTION_ALGORITHMS_H_
 
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "perfetto/ext/base/flat_hash_map.h"
 #include "src/trace_processor/storage/trace_storage.h"
 
 namespace perfetto {
@@ -28,6 +34,137 @@ struct TimeConstraints {
   int64_t value;
 };
 
+// Builds flamegraphs of native heap profiles and callstack samples, keeping
+// the state needed to answer repeated queries for the same process cheaply.
+//
+// The tree of merged callsites (callsites with the same frame, mapping and
+// parent) only depends on the callsite, frame and symbol tables, so it is
+// built once and shared by all processes and profile types.
+//
+// For each process (or group of processes) and profile type, the samples are
+// extracted once, sorted by timestamp, and the per-node totals of the last
+// query are kept: a query over a different time range then only needs to add
+// the samples which entered the range and subtract the ones which left it
+// instead of aggregating every sample again.
+//
+// All the cached state is rebuilt if rows are added to the tables it was
+// derived from.
+class FlamegraphCache {
+ public:
+  explicit FlamegraphCache(TraceStorage* storage);
+  ~FlamegraphCache();
+
+  FlamegraphCache(const FlamegraphCache&) = delete;
+  FlamegraphCache& operator=(const FlamegraphCache&) = delete;
+
+  std::unique_ptr<tables::ExperimentalFlamegraphNodesTable>
+  BuildHeapProfileFlamegraph(UniquePid upid, int64_t timestamp);
+
+  std::unique_ptr<tables::ExperimentalFlamegraphNodesTable>
+  BuildNativeCallStackSamplingFlamegraph(
+      std::optional<UniquePid> upid,
+      std::optional<std::string> upid_group,
+      const std::vector<TimeConstraints>& time_constraints);
+
+ private:
+  // A node of the flamegraph: all the callsites with the same frame name,
+  // mapping name and parent node are merged together.
+  struct Node {
+    StringId name;
+    StringId map_name;
+    std::optional<StringId> source_file;
+    std::optional<uint32_t> line_number;
+    std::optional<uint32_t> parent;
+    uint32_t depth;
+  };
+
+  // Self totals of each node, indexed by node. Empty vectors are all zeros.
+  struct NodeTotals {
+    std::vector<int64_t> size;
+    std::vector<int64_t> count;
+    std::vector<int64_t> alloc_size;
+    std::vector<int64_t> alloc_count;
+  };
+
+  // Allocations of a single process, sorted by timestamp. The totals are of
+  // the allocations in [0, aggregated).
+  struct HeapProfileState {
+    uint32_t source_rows = 0;
+    std::vector<int64_t> ts;
+    std::vector<uint32_t> node;
+    std::vector<int64_t> size;
+    std::vector<int64_t> count;
+
+    uint32_t aggregated = 0;
+    NodeTotals totals;
+  };
+
+  // Callstack samples of a set of processes, sorted by timestamp. The totals
+  // are of the samples in [begin, end) and |last_sample| is, for each node,
+  // the index of the last of those samples which is attributed to it.
+  struct PerfSampleState {
+    uint32_t sample_rows = 0;
+    uint32_t thread_rows = 0;
+    std::vector<int64_t> ts;
+    std::vector<uint32_t> node;
+
+    bool aggregated = false;
+    uint32_t begin = 0;
+    uint32_t end = 0;
+    NodeTotals totals;
+    std::vector<uint32_t> last_sample;
+  };
+
+  // Builds |nodes_| and |callsite_to_node_| if the tables they are derived
+  // from changed since they were last built.
+  void MaybeRebuildCallsiteTree();
+
+  HeapProfileState& GetHeapProfileState(UniquePid upid);
+  PerfSampleState& GetPerfSampleState(const std::vector<UniquePid>& upids);
+
+  // Adds (or subtracts, if |sign| is -1) the allocations in [begin, end) of
+  // |state| to |totals|.
+  static void AddAllocations(const HeapProfileState& state,
+                             uint32_t begin,
+                             uint32_t end,
+                             int64_t sign,
+                             NodeTotals* totals);
+
+  // Updates the totals of |state| to be the ones of the samples in
+  // [begin, end), either by applying the difference with the previously
+  // aggregated range or by aggregating from scratch if that is cheaper.
+  static void UpdatePerfSampleTotals(PerfSampleState* state,
+                                     uint32_t begin,
+                                     uint32_t end,
+                                     uint32_t node_count);
+
+  // Creates the output table with a row for every node, computing the
+  // cumulative values from the given self values. |node_ts| is the value of
+  // the ts column of each node.
+  std::unique_ptr<tables::ExperimentalFlamegraphNodesTable> BuildTable(
+      const NodeTotals& totals,
+      const std::vector<int64_t>& node_ts,
+      std::optional<UniquePid> upid,
+      std::optional<std::string> upid_group,
+      StringId profile_type);
+
+  TraceStorage* const storage_;
+
+  // Row counts of the callsite, frame and symbol tables when |nodes_| was
+  // built.
+  uint32_t tree_callsite_rows_ = 0;
+  uint32_t tree_frame_rows_ = 0;
+  uint32_t tree_symbol_rows_ = 0;
+  bool tree_built_ = false;
+
+  std::vector<Node> nodes_;
+  std::vector<uint32_t> callsite_to_node_;
+
+  base::FlatHashMap<UniquePid, HeapProfileState> heap_profile_states_;
+  base::FlatHashMap<std::string, PerfSampleState> perf_sample_states_;
+};
+
+// Convenience wrappers which build a flamegraph without keeping any state.
 std::unique_ptr<tables::ExperimentalFlamegraphNodesTable>
 BuildHeapProfileFlamegraph(TraceStorage* storage,
                            UniquePid upid,
@@ -39,6 +176,7 @@ BuildNativeCallStackSamplingFlamegraph(
     std::optional<UniquePid> upid,
     std::optional<std::string> upid_group,
     const std::vector<TimeConstraints>& time_constraints);
+
 }  // namespace trace_processor
 }  // namespace perfetto
 
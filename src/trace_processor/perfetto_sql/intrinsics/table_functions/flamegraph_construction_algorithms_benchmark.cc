@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <benchmark/benchmark.h>
+
+#include <random>
+
+#include "src/trace_processor/perfetto_sql/intrinsics/table_functions/flamegraph_construction_algorithms.h"
+
+namespace perfetto {
+namespace trace_processor {
+namespace {
+
+constexpr uint32_t kSampleCount = 10 * 1000 * 1000;
+constexpr uint32_t kFrameCount = 2000;
+constexpr uint32_t kCallsiteCount = 50000;
+constexpr int64_t kSampleIntervalNs = 1000;
+
+bool IsBenchmarkFunctionalOnly() {
+  return getenv("BENCHMARK_FUNCTIONAL_TEST_ONLY") != nullptr;
+}
+
+// A synthetic perf profile of a single process: random callstacks sampled at
+// a fixed interval.
+TraceStorage* GetProfile() {
+  static TraceStorage* storage = [] {
+    auto* s = new TraceStorage();
+    std::minstd_rand0 rnd(0);
+
+    tables::StackProfileMappingTable::Row mapping;
+    mapping.name = s->InternString("libfoo.so");
+    auto mapping_id =
+        s->mutable_stack_profile_mapping_table()->Insert(mapping).id;
+
+    std::vector<FrameId> frames;
+    for (uint32_t i = 0; i < kFrameCount; ++i) {
+      tables::StackProfileFrameTable::Row frame;
+      frame.name = s->InternString(
+          base::StringView("frame_" + std::to_string(i)));
+      frame.mapping = mapping_id;
+      frames.push_back(
+          s->mutable_stack_profile_frame_table()->Insert(frame).id);
+    }
+
+    std::vector<CallsiteId> callsites;
+    for (uint32_t i = 0; i < kCallsiteCount; ++i) {
+      tables::StackProfileCallsiteTable::Row callsite;
+      if (i > 0 && rnd() % 16 != 0) {
+        callsite.parent_id = callsites[rnd() % callsites.size()];
+      }
+      callsite.frame_id = frames[rnd() % frames.size()];
+      callsites.push_back(
+          s->mutable_stack_profile_callsite_table()->Insert(callsite).id);
+    }
+
+    tables::ThreadTable::Row thread;
+    thread.upid = 0;
+    s->mutable_thread_table()->Insert(thread);
+
+    uint32_t sample_count = IsBenchmarkFunctionalOnly() ? 1000 : kSampleCount;
+    for (uint32_t i = 0; i < sample_count; ++i) {
+      tables::PerfSampleTable::Row sample;
+      sample.ts = i * kSampleIntervalNs;
+      sample.utid = 0;
+      sample.callsite_id = callsites[rnd() % callsites.size()];
+      s->mutable_perf_sample_table()->Insert(sample);
+    }
+    return s;
+  }();
+  return storage;
+}
+
+std::vector<TimeConstraints> Range(int64_t start, int64_t end) {
+  return {{FilterOp::kGe, start}, {FilterOp::kLe, end}};
+}
+
+// Builds the flamegraph of the whole profile from scratch.
+static void BM_FlamegraphPerfFullBuild(benchmark::State& state) {
+  TraceStorage* storage = GetProfile();
+  int64_t end = storage->perf_sample_table().row_count() * kSampleIntervalNs;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(BuildNativeCallStackSamplingFlamegraph(
+        storage, 0u, std::nullopt, Range(0, end)));
+  }
+}
+BENCHMARK(BM_FlamegraphPerfFullBuild)->Unit(benchmark::kMillisecond);
+
+// Moves a window over half of the profile by 1% at a time, as when panning
+// the timeline in the UI.
+static void BM_FlamegraphPerfPanWindow(benchmark::State& state) {
+  TraceStorage* storage = GetProfile();
+  int64_t end = storage->perf_sample_table().row_count() * kSampleIntervalNs;
+  int64_t window = end / 2;
+  int64_t step = end / 100;
+
+  FlamegraphCache cache(storage);
+  benchmark::DoNotOptimize(cache.BuildNativeCallStackSamplingFlamegraph(
+      0u, std::nullopt, Range(0, window)));
+  int64_t start = 0;
+  for (auto _ : state) {
+    start = (start + step) % (end - window);
+    benchmark::DoNotOptimize(cache.BuildNativeCallStackSamplingFlamegraph(
+        0u, std::nullopt, Range(start, start + window)));
+  }
+}
+BENCHMARK(BM_FlamegraphPerfPanWindow)->Unit(benchmark::kMillisecond);
+
+}  // namespace
+}  // namespace trace_processor
+}  // namespace perfetto
@@ -0,0 +1,232 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "src/trace_processor/perfetto_sql/intrinsics/table_functions/flamegraph_construction_algorithms.h"
+
+#include "test/gtest_and_gmock.h"
+
+namespace perfetto {
+namespace trace_processor {
+namespace {
+
+using Nodes = tables::ExperimentalFlamegraphNodesTable;
+
+class FlamegraphConstructionTest : public ::testing::Test {
+ protected:
+  FlamegraphConstructionTest() {
+    tables::StackProfileMappingTable::Row mapping;
+    mapping.name = storage_.InternString("libfoo.so");
+    auto mapping_id =
+        storage_.mutable_stack_profile_mapping_table()->Insert(mapping).id;
+
+    // main -> foo -> bar
+    //      -> foo -> baz
+    //      -> bar
+    // The two "foo" callsites have different frames with the same name and so
+    // are merged in the flamegraph.
+    auto main = AddCallsite(mapping_id, "main", std::nullopt);
+    auto foo1 = AddCallsite(mapping_id, "foo", main);
+    auto foo2 = AddCallsite(mapping_id, "foo", main);
+    callsites_.push_back(AddCallsite(mapping_id, "bar", foo1));
+    callsites_.push_back(AddCallsite(mapping_id, "baz", foo2));
+    callsites_.push_back(AddCallsite(mapping_id, "bar", main));
+    callsites_.push_back(main);
+
+    for (uint32_t i = 0; i < 2; ++i) {
+      tables::ThreadTable::Row thread;
+      thread.tid = i;
+      thread.upid = i;
+      storage_.mutable_thread_table()->Insert(thread);
+    }
+
+    // Samples for both processes, interleaved, every 10ns.
+    for (uint32_t i = 0; i < 200; ++i) {
+      tables::PerfSampleTable::Row sample;
+      sample.ts = i * 10;
+      sample.utid = i % 2;
+      sample.callsite_id = callsites_[(i * 7) % callsites_.size()];
+      storage_.mutable_perf_sample_table()->Insert(sample);
+
+      tables::HeapProfileAllocationTable::Row alloc;
+      // Allocations are not sorted by timestamp.
+      alloc.ts = (i * 37) % 200;
+      alloc.upid = i % 2;
+      alloc.callsite_id = callsites_[(i * 3) % callsites_.size()];
+      alloc.size = i % 5 == 0 ? -64 : 128;
+      alloc.count = i % 5 == 0 ? -1 : 2;
+      storage_.mutable_heap_profile_allocation_table()->Insert(alloc);
+    }
+  }
+
+  CallsiteId AddCallsite(MappingId mapping,
+                         const char* name,
+                         std::optional<CallsiteId> parent) {
+    tables::StackProfileFrameTable::Row frame;
+    frame.name = storage_.InternString(name);
+    frame.mapping = mapping;
+    auto frame_id =
+        storage_.mutable_stack_profile_frame_table()->Insert(frame).id;
+
+    tables::StackProfileCallsiteTable::Row callsite;
+    callsite.parent_id = parent;
+    callsite.frame_id = frame_id;
+    return storage_.mutable_stack_profile_callsite_table()->Insert(callsite).id;
+  }
+
+  static void ExpectSameTable(const Nodes& actual, const Nodes& expected) {
+    ASSERT_EQ(actual.row_count(), expected.row_count());
+    for (uint32_t i = 0; i < actual.row_count(); ++i) {
+      EXPECT_EQ(actual.ts()[i], expected.ts()[i]) << i;
+      EXPECT_EQ(actual.name()[i], expected.name()[i]) << i;
+      EXPECT_EQ(actual.parent_id()[i], expected.parent_id()[i]) << i;
+      EXPECT_EQ(actual.depth()[i], expected.depth()[i]) << i;
+      EXPECT_EQ(actual.size()[i], expected.size()[i]) << i;
+      EXPECT_EQ(actual.count()[i], expected.count()[i]) << i;
+      EXPECT_EQ(actual.alloc_size()[i], expected.alloc_size()[i]) << i;
+      EXPECT_EQ(actual.alloc_count()[i], expected.alloc_count()[i]) << i;
+      EXPECT_EQ(actual.cumulative_size()[i], expected.cumulative_size()[i])
+          << i;
+      EXPECT_EQ(actual.cumulative_count()[i], expected.cumulative_count()[i])
+          << i;
+      EXPECT_EQ(actual.cumulative_alloc_size()[i],
+                expected.cumulative_alloc_size()[i])
+          << i;
+    }
+  }
+
+  TraceStorage storage_;
+  std::vector<CallsiteId> callsites_;
+};
+
+TEST_F(FlamegraphConstructionTest, MergesCallsites) {
+  auto tbl = BuildNativeCallStackSamplingFlamegraph(
+      &storage_, 0u, std::nullopt, {{FilterOp::kLe, 10000}});
+  ASSERT_EQ(tbl->row_count(), 5u);
+
+  // main, foo, bar, baz, bar.
+  EXPECT_EQ(tbl->depth()[0], 0u);
+  EXPECT_EQ(tbl->depth()[1], 1u);
+  EXPECT_EQ(tbl->parent_id()[2], tbl->id()[1]);
+  EXPECT_EQ(tbl->parent_id()[3], tbl->id()[1]);
+  EXPECT_EQ(tbl->parent_id()[4], tbl->id()[0]);
+  EXPECT_EQ(tbl->cumulative_count()[0], 100);
+  EXPECT_EQ(tbl->cumulative_count()[1],
+            tbl->cumulative_count()[2] + tbl->cumulative_count()[3]);
+}
+
+TEST_F(FlamegraphConstructionTest, PerfIncrementalMatchesFullBuild) {
+  FlamegraphCache cache(&storage_);
+  std::vector<std::vector<TimeConstraints>> queries = {
+      {{FilterOp::kGe, 0}, {FilterOp::kLe, 1000}},
+      // Grow both ends.
+      {{FilterOp::kGe, 0}, {FilterOp::kLe, 1990}},
+      // Shrink the end: nodes lose their last sample.
+      {{FilterOp::kGe, 0}, {FilterOp::kLt, 1500}},
+      // Shrink the start.
+      {{FilterOp::kGt, 400}, {FilterOp::kLt, 1500}},
+      // Disjoint range.
+      {{FilterOp::kGe, 1600}, {FilterOp::kLe, 1990}},
+      {{FilterOp::kGe, 1590}, {FilterOp::kLe, 1700}},
+  };
+  for (const auto& query : queries) {
+    for (auto upid : {0u, 1u}) {
+      auto expected = BuildNativeCallStackSamplingFlamegraph(
+          &storage_, upid, std::nullopt, query);
+      auto actual =
+          cache.BuildNativeCallStackSamplingFlamegraph(upid, std::nullopt,
+                                                       query);
+      ExpectSameTable(*actual, *expected);
+    }
+    auto expected = BuildNativeCallStackSamplingFlamegraph(
+        &storage_, std::nullopt, "0,1", query);
+    auto actual =
+        cache.BuildNativeCallStackSamplingFlamegraph(std::nullopt, "1,0",
+                                                     query);
+    ExpectSameTable(*actual, *expected);
+  }
+
+  auto empty = cache.BuildNativeCallStackSamplingFlamegraph(
+      0u, std::nullopt, {{FilterOp::kGt, 5000}});
+  EXPECT_EQ(empty->row_count(), 0u);
+}
+
+TEST_F(FlamegraphConstructionTest, PerfSamplesOutOfOrder) {
+  // Append samples with timestamps earlier than the ones already in the table.
+  for (int64_t ts : {1005, 15, 3, 1995, 3}) {
+    tables::PerfSampleTable::Row sample;
+    sample.ts = ts;
+    sample.utid = 0;
+    sample.callsite_id = callsites_[static_cast<size_t>(ts) % 4];
+    storage_.mutable_perf_sample_table()->Insert(sample);
+  }
+
+  FlamegraphCache cache(&storage_);
+  std::vector<std::pair<int64_t, int64_t>> ranges = {
+      {0, 1000}, {0, 1990}, {0, 10}, {10, 1500}, {1000, 2000}};
+  for (auto [min_ts, max_ts] : ranges) {
+    std::vector<TimeConstraints> query = {{FilterOp::kGe, min_ts},
+                                          {FilterOp::kLe, max_ts}};
+    auto actual =
+        cache.BuildNativeCallStackSamplingFlamegraph(0u, std::nullopt, query);
+    auto expected = BuildNativeCallStackSamplingFlamegraph(
+        &storage_, 0u, std::nullopt, query);
+    ExpectSameTable(*actual, *expected);
+
+    // All the samples are under "main".
+    const auto& samples = storage_.perf_sample_table();
+    int64_t count = 0;
+    for (uint32_t i = 0; i < samples.row_count(); ++i) {
+      count += samples.utid()[i] == 0 && samples.ts()[i] >= min_ts &&
+               samples.ts()[i] <= max_ts;
+    }
+    ASSERT_GT(actual->row_count(), 0u);
+    EXPECT_EQ(actual->cumulative_count()[0], count);
+  }
+}
+
+TEST_F(FlamegraphConstructionTest, HeapProfileIncrementalMatchesFullBuild) {
+  FlamegraphCache cache(&storage_);
+  for (int64_t ts : {100, 199, 150, 20, 180, 1}) {
+    auto expected = BuildHeapProfileFlamegraph(&storage_, 1u, ts);
+    auto actual = cache.BuildHeapProfileFlamegraph(1u, ts);
+    ASSERT_TRUE(expected);
+    ASSERT_TRUE(actual);
+    ExpectSameTable(*actual, *expected);
+  }
+  // The allocations of process 1 all have odd timestamps.
+  EXPECT_FALSE(cache.BuildHeapProfileFlamegraph(1u, 0));
+}
+
+TEST_F(FlamegraphConstructionTest, RebuildsWhenSamplesAreAdded) {
+  FlamegraphCache cache(&storage_);
+  std::vector<TimeConstraints> query = {{FilterOp::kLe, 10000}};
+  auto before = cache.BuildNativeCallStackSamplingFlamegraph(
+      0u, std::nullopt, query);
+
+  tables::PerfSampleTable::Row sample;
+  sample.ts = 5000;
+  sample.utid = 0;
+  sample.callsite_id = callsites_[0];
+  storage_.mutable_perf_sample_table()->Insert(sample);
+
+  auto after = cache.BuildNativeCallStackSamplingFlamegraph(
+      0u, std::nullopt, query);
+  EXPECT_EQ(after->cumulative_count()[0], before->cumulative_count()[0] + 1);
+}
+
+}  // namespace
+}  // namespace trace_processor
+}  // namespace perfetto
@@ -0,0 +1,184 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "src/trace_processor/perfetto_sql/intrinsics/table_functions/slice_flattened.h"
+
+#include <algorithm>
+#include <memory>
+#include <optional>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "src/trace_processor/types/trace_processor_context.h"
+
+namespace perfetto {
+namespace trace_processor {
+namespace tables {
+
+SliceFlattenedTable::~SliceFlattenedTable() = default;
+
+}  // namespace tables
+
+namespace {
+
+struct Event {
+  int64_t ts;
+  // The row of the slice which becomes the most active one. Unset if no slice
+  // is active after this event (i.e. this is the end of a root slice).
+  std::optional<uint32_t> active_row;
+  uint32_t depth;
+};
+
+struct OpenSlice {
+  int64_t end_ts;
+  uint32_t row;
+};
+
+struct Track {
+  std::vector<OpenSlice> stack;
+  std::vector<Event> events;
+};
+
+}  // namespace
+
+SliceFlattened::SliceFlattened(TraceProcessorContext* context)
+    : context_(context) {}
+SliceFlattened::~SliceFlattened() = default;
+
+Table::Schema SliceFlattened::CreateSchema() {
+  return tables::SliceFlattenedTable::ComputeStaticSchema();
+}
+
+std::string SliceFlattened::TableName() {
+  return tables::SliceFlattenedTable::Name();
+}
+
+uint32_t SliceFlattened::EstimateRowCount() {
+  return 2 * context_->storage->slice_table().row_count();
+}
+
+base::Status SliceFlattened::ValidateConstraints(const QueryConstraints&) {
+  return base::OkStatus();
+}
+
+base::Status SliceFlattened::ComputeTable(
+    const std::vector<Constraint>&,
+    const std::vector<Order>&,
+    const BitVector&,
+    std::unique_ptr<Table>& table_return) {
+  // The slice table does not change after the trace is loaded so we only
+  // need to compute the table once.
+  if (!slice_flattened_table_) {
+    slice_flattened_table_ = ComputeSliceFlattenedTable(
+        context_->storage->slice_table(),
+        context_->storage->thread_track_table(),
+        context_->storage->mutable_string_pool());
+  }
+  table_return.reset(new Table(slice_flattened_table_->Copy()));
+  return base::OkStatus();
+}
+
+// static
+std::unique_ptr<tables::SliceFlattenedTable>
+SliceFlattened::ComputeSliceFlattenedTable(
+    const tables::SliceTable& slices,
+    const tables::ThreadTrackTable& thread_tracks,
+    StringPool* pool) {
+  std::unordered_set<TrackId> thread_track_ids;
+  for (auto it = thread_tracks.IterateRows(); it; ++it) {
+    thread_track_ids.insert(it.id());
+  }
+
+  auto end_event = [&slices](uint32_t row) {
+    Event event{slices.ts()[row] + slices.dur()[row], std::nullopt,
+                slices.depth()[row]};
+    if (auto parent_id = slices.parent_id()[row]; parent_id) {
+      auto parent = slices.FindById(*parent_id);
+      event.active_row = parent->ToRowNumber().row_number();
+      event.depth--;
+    }
+    return event;
+  };
+
+  // Keep track of the order in which tracks are seen so the output is
+  // deterministic.
+  std::vector<TrackId> track_order;
+  std::unordered_map<TrackId, Track> tracks;
+  for (uint32_t i = 0; i < slices.row_count(); ++i) {
+    // Instants and incomplete slices are never the most active slice.
+    int64_t dur = slices.dur()[i];
+    if (dur <= 0)
+      continue;
+
+    TrackId track_id = slices.track_id()[i];
+    if (thread_track_ids.count(track_id) == 0)
+      continue;
+
+    auto [it, inserted] = tracks.emplace(track_id, Track());
+    if (inserted)
+      track_order.push_back(track_id);
+    Track& track = it->second;
+
+    // Close all the slices which ended before this slice started. On thread
+    // tracks slices are strictly nested so this will emit the end events in
+    // timestamp order.
+    int64_t ts = slices.ts()[i];
+    while (!track.stack.empty() && track.stack.back().end_ts <= ts) {
+      track.events.push_back(end_event(track.stack.back().row));
+      track.stack.pop_back();
+    }
+    track.events.push_back(Event{ts, i, slices.depth()[i]});
+    track.stack.push_back(OpenSlice{ts + dur, i});
+  }
+
+  std::unique_ptr<tables::SliceFlattenedTable> out(
+      new tables::SliceFlattenedTable(pool));
+  for (TrackId track_id : track_order) {
+    Track& track = tracks[track_id];
+    while (!track.stack.empty()) {
+      track.events.push_back(end_event(track.stack.back().row));
+      track.stack.pop_back();
+    }
+
+    // Improperly nested slices can cause the events to be out of order: fall
+    // back to sorting in this (rare) case.
+    auto ts_less = [](const Event& a, const Event& b) { return a.ts < b.ts; };
+    if (!std::is_sorted(track.events.begin(), track.events.end(), ts_less)) {
+      std::stable_sort(track.events.begin(), track.events.end(), ts_less);
+    }
+
+    for (size_t i = 0; i < track.events.size(); ++i) {
+      const Event& event = track.events[i];
+      if (!event.active_row)
+        continue;
+
+      tables::SliceFlattenedTable::Row row;
+      row.slice_id = slices.id()[*event.active_row];
+      row.ts = event.ts;
+      if (i + 1 < track.events.size())
+        row.dur = track.events[i + 1].ts - event.ts;
+      row.depth = event.depth;
+      row.name = slices.name()[*event.active_row];
+      row.track_id = track_id;
+      out->Insert(row);
+    }
+  }
+  return out;
+}
+
+}  // namespace trace_processor
+}  // namespace perfetto
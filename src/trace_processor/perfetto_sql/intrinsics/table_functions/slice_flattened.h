@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SRC_TRACE_PROCESSOR_PERFETTO_SQL_INTRINSICS_TABLE_FUNCTIONS_SLICE_FLATTENED_H_
+#define SRC_TRACE_PROCESSOR_PERFETTO_SQL_INTRINSICS_TABLE_FUNCTIONS_SLICE_FLATTENED_H_
+
+#include <memory>
+
+#include "src/trace_processor/perfetto_sql/intrinsics/table_functions/static_table_function.h"
+#include "src/trace_processor/perfetto_sql/intrinsics/table_functions/tables_py.h"
+#include "src/trace_processor/storage/trace_storage.h"
+
+namespace perfetto {
+namespace trace_processor {
+
+class TraceProcessorContext;
+
+// Native implementation of the interval flattening used by the
+// |experimental_slice_flattened| table in the experimental.flat_slices stdlib
+// module.
+//
+// For every thread track, each slice start and each slice end is turned into
+// an event: the start of a slice makes that slice the "most active" one, the
+// end of a slice makes its parent the most active one. Each event lasts until
+// the next event on the same track. Events which make no slice active (i.e.
+// the end of a root slice) are not emitted.
+//
+// Slices are processed in timestamp order keeping a per-track stack of open
+// slices so the events are generated (almost always) already sorted: this
+// makes the whole computation linear in the number of slices instead of
+// requiring a window function over all the events.
+class SliceFlattened : public StaticTableFunction {
+ public:
+  explicit SliceFlattened(TraceProcessorContext* context);
+  ~SliceFlattened() override;
+
+  Table::Schema CreateSchema() override;
+  std::string TableName() override;
+  uint32_t EstimateRowCount() override;
+  base::Status ValidateConstraints(const QueryConstraints&) override;
+  base::Status ComputeTable(const std::vector<Constraint>& cs,
+                            const std::vector<Order>& ob,
+                            const BitVector& cols_used,
+                            std::unique_ptr<Table>& table_return) override;
+
+  // Visible for testing.
+  static std::unique_ptr<tables::SliceFlattenedTable>
+  ComputeSliceFlattenedTable(const tables::SliceTable& slices,
+                             const tables::ThreadTrackTable& thread_tracks,
+                             StringPool* pool);
+
+ private:
+  TraceProcessorContext* context_ = nullptr;
+  std::unique_ptr<Table> slice_flattened_table_;
+};
+
+}  // namespace trace_processor
+}  // namespace perfetto
+
+#endif  // SRC_TRACE_PROCESSOR_PERFETTO_SQL_INTRINSICS_TABLE_FUNCTIONS_SLICE_FLATTENED_H_
@@ -0,0 +1,133 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "src/trace_processor/perfetto_sql/intrinsics/table_functions/slice_flattened.h"
+
+#include "test/gtest_and_gmock.h"
+
+namespace perfetto {
+namespace trace_processor {
+namespace {
+
+class SliceFlattenedTest : public ::testing::Test {
+ protected:
+  TrackId AddThreadTrack() {
+    tables::ThreadTrackTable::Row row;
+    row.utid = 1;
+    return storage_.mutable_thread_track_table()->Insert(row).id;
+  }
+
+  SliceId AddSlice(TrackId track_id,
+                   int64_t ts,
+                   int64_t dur,
+                   std::optional<SliceId> parent_id = std::nullopt) {
+    tables::SliceTable::Row row;
+    row.ts = ts;
+    row.dur = dur;
+    row.track_id = track_id;
+    row.parent_id = parent_id;
+    if (parent_id) {
+      row.depth =
+          storage_.slice_table().FindById(*parent_id)->depth() + 1;
+    }
+    return storage_.mutable_slice_table()->Insert(row).id;
+  }
+
+  std::unique_ptr<tables::SliceFlattenedTable> Compute() {
+    return SliceFlattened::ComputeSliceFlattenedTable(
+        storage_.slice_table(), storage_.thread_track_table(),
+        storage_.mutable_string_pool());
+  }
+
+  TraceStorage storage_;
+};
+
+TEST_F(SliceFlattenedTest, Nested) {
+  TrackId track = AddThreadTrack();
+
+  // A-------------------A
+  //     C----C  D------D
+  SliceId a = AddSlice(track, 100, 100);
+  SliceId c = AddSlice(track, 120, 20, a);
+  SliceId d = AddSlice(track, 150, 30, a);
+
+  auto out = Compute();
+  ASSERT_EQ(out->row_count(), 5u);
+
+  const auto& slice_id = out->slice_id();
+  const auto& ts = out->ts();
+  const auto& dur = out->dur();
+  const auto& depth = out->depth();
+
+  ASSERT_EQ(slice_id[0], a);
+  ASSERT_EQ(ts[0], 100);
+  ASSERT_EQ(dur[0], 20);
+  ASSERT_EQ(depth[0], 0u);
+
+  ASSERT_EQ(slice_id[1], c);
+  ASSERT_EQ(ts[1], 120);
+  ASSERT_EQ(dur[1], 20);
+  ASSERT_EQ(depth[1], 1u);
+
+  ASSERT_EQ(slice_id[2], a);
+  ASSERT_EQ(ts[2], 140);
+  ASSERT_EQ(dur[2], 10);
+  ASSERT_EQ(depth[2], 0u);
+
+  ASSERT_EQ(slice_id[3], d);
+  ASSERT_EQ(ts[3], 150);
+  ASSERT_EQ(dur[3], 30);
+
+  // The end of the root slice is not emitted but still bounds the last row.
+  ASSERT_EQ(slice_id[4], a);
+  ASSERT_EQ(ts[4], 180);
+  ASSERT_EQ(dur[4], 20);
+}
+
+TEST_F(SliceFlattenedTest, GapBetweenRoots) {
+  TrackId track = AddThreadTrack();
+
+  SliceId a = AddSlice(track, 100, 10);
+  SliceId b = AddSlice(track, 130, 10);
+
+  auto out = Compute();
+  ASSERT_EQ(out->row_count(), 2u);
+  ASSERT_EQ(out->slice_id()[0], a);
+  ASSERT_EQ(out->dur()[0], 10);
+  ASSERT_EQ(out->slice_id()[1], b);
+  ASSERT_EQ(out->ts()[1], 130);
+  ASSERT_EQ(out->dur()[1], 10);
+}
+
+TEST_F(SliceFlattenedTest, IgnoresInstantsAndNonThreadTracks) {
+  TrackId process_track = storage_.mutable_track_table()->Insert({}).id;
+  TrackId track = AddThreadTrack();
+
+  AddSlice(process_track, 100, 10);
+  SliceId a = AddSlice(track, 100, 10);
+  AddSlice(track, 105, 0, a);
+  AddSlice(track, 106, -1, a);
+
+  auto out = Compute();
+  ASSERT_EQ(out->row_count(), 1u);
+  ASSERT_EQ(out->slice_id()[0], a);
+  ASSERT_EQ(out->track_id()[0], track);
+  ASSERT_EQ(out->dur()[0], 10);
+}
+
+}  // namespace
+}  // namespace trace_processor
+}  // namespace perfetto
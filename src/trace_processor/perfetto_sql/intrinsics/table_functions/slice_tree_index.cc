@@ -0,0 +1,133 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "src/trace_processor/perfetto_sql/intrinsics/table_functions/slice_tree_index.h"
+
+#include <algorithm>
+#include <utility>
+
+namespace perfetto {
+namespace trace_processor {
+
+SliceTreeIndex::SliceTreeIndex(const tables::SliceTable* slices)
+    : slices_(slices) {}
+SliceTreeIndex::~SliceTreeIndex() = default;
+
+bool SliceTreeIndex::GetAncestors(SliceId id, std::vector<RowNumber>* out) {
+  std::optional<uint32_t> row = RowForId(id);
+  if (!row)
+    return false;
+  for (uint32_t p = parent_row_[*row]; p != kNoParent; p = parent_row_[p]) {
+    out->emplace_back(p);
+  }
+  return true;
+}
+
+bool SliceTreeIndex::GetDescendants(SliceId id, std::vector<RowNumber>* out) {
+  std::optional<uint32_t> row = RowForId(id);
+  if (!row)
+    return false;
+
+  // The first position of the subtree is the slice itself.
+  uint32_t begin = subtree_begin_[*row] + 1;
+  uint32_t end = subtree_end_[*row];
+  size_t first = out->size();
+  for (uint32_t pos = begin; pos < end; ++pos) {
+    out->emplace_back(traversal_[pos]);
+  }
+
+  // Children are visited in timestamp order so the traversal is sorted except
+  // when a slice nested in a child starts at the same time as the child's next
+  // sibling.
+  auto added = out->begin() + static_cast<std::ptrdiff_t>(first);
+  if (!std::is_sorted(added, out->end()))
+    std::sort(added, out->end());
+  return true;
+}
+
+std::optional<uint32_t> SliceTreeIndex::RowForId(SliceId id) {
+  MaybeRebuild();
+  auto ref = slices_->FindById(id);
+  if (!ref)
+    return std::nullopt;
+  return ref->ToRowNumber().row_number();
+}
+
+void SliceTreeIndex::MaybeRebuild() {
+  uint32_t row_count = slices_->row_count();
+  if (row_count == indexed_rows_)
+    return;
+  indexed_rows_ = row_count;
+
+  // Compute the parent of every slice and lay out the children of each slice
+  // contiguously (in row, and so timestamp, order) in |children|.
+  parent_row_.assign(row_count, kNoParent);
+  std::vector<uint32_t> children_begin(row_count + 1, 0);
+  const auto& parent_id = slices_->parent_id();
+  for (uint32_t i = 0; i < row_count; ++i) {
+    std::optional<SliceId> parent = parent_id[i];
+    if (!parent)
+      continue;
+    auto parent_ref = slices_->FindById(*parent);
+    if (!parent_ref)
+      continue;
+    uint32_t parent_row = parent_ref->ToRowNumber().row_number();
+    parent_row_[i] = parent_row;
+    children_begin[parent_row + 1]++;
+  }
+  for (uint32_t i = 0; i < row_count; ++i) {
+    children_begin[i + 1] += children_begin[i];
+  }
+  std::vector<uint32_t> children(children_begin[row_count]);
+  std::vector<uint32_t> next_child(children_begin.begin(),
+                                   children_begin.end() - 1);
+  for (uint32_t i = 0; i < row_count; ++i) {
+    if (parent_row_[i] != kNoParent)
+      children[next_child[parent_row_[i]]++] = i;
+  }
+
+  // Iterative depth-first traversal of every stack, starting from the roots
+  // in timestamp order.
+  subtree_begin_.assign(row_count, 0);
+  subtree_end_.assign(row_count, 0);
+  traversal_.clear();
+  traversal_.reserve(row_count);
+
+  // Pairs of (row, index of the next child of |row| to visit).
+  std::vector<std::pair<uint32_t, uint32_t>> stack;
+  for (uint32_t root = 0; root < row_count; ++root) {
+    if (parent_row_[root] != kNoParent)
+      continue;
+    subtree_begin_[root] = static_cast<uint32_t>(traversal_.size());
+    traversal_.push_back(root);
+    stack.emplace_back(root, children_begin[root]);
+    while (!stack.empty()) {
+      auto& [row, next] = stack.back();
+      if (next == children_begin[row + 1]) {
+        subtree_end_[row] = static_cast<uint32_t>(traversal_.size());
+        stack.pop_back();
+        continue;
+      }
+      uint32_t child = children[next++];
+      subtree_begin_[child] = static_cast<uint32_t>(traversal_.size());
+      traversal_.push_back(child);
+      stack.emplace_back(child, children_begin[child]);
+    }
+  }
+}
+
+}  // namespace trace_processor
+}  // namespace perfetto
@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SRC_TRACE_PROCESSOR_PERFETTO_SQL_INTRINSICS_TABLE_FUNCTIONS_SLICE_TREE_INDEX_H_
+#define SRC_TRACE_PROCESSOR_PERFETTO_SQL_INTRINSICS_TABLE_FUNCTIONS_SLICE_TREE_INDEX_H_
+
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <vector>
+
+#include "src/trace_processor/storage/trace_storage.h"
+
+namespace perfetto {
+namespace trace_processor {
+
+// Nested set (a.k.a. Euler tour) index over the parent/child relationship of
+// the slice table.
+//
+// Every slice is assigned the position at which it is first visited by a
+// depth-first traversal of the slice forest (children are visited in
+// timestamp order). All the descendants of a slice are then the contiguous
+// range of positions between its own position and the end of its subtree:
+// finding them is a range lookup rather than a filter over the whole table.
+//
+// The index is built lazily on first use and rebuilt only if slices were
+// added since it was last built: as parent_id is never changed after a slice
+// is inserted, this makes it safe to use while a trace is still being loaded.
+class SliceTreeIndex {
+ public:
+  using RowNumber = tables::SliceTable::RowNumber;
+
+  explicit SliceTreeIndex(const tables::SliceTable* slices);
+  ~SliceTreeIndex();
+
+  // Appends the rows of all the ancestors of |id| to |out|, starting from its
+  // parent and ending with the root of its stack. Returns false if |id| does
+  // not exist.
+  bool GetAncestors(SliceId id, std::vector<RowNumber>* out);
+
+  // Appends the rows of all the descendants of |id| to |out| in timestamp
+  // order. Returns false if |id| does not exist.
+  bool GetDescendants(SliceId id, std::vector<RowNumber>* out);
+
+ private:
+  static constexpr uint32_t kNoParent = std::numeric_limits<uint32_t>::max();
+
+  // Rebuilds the index if new slices were inserted since it was last built.
+  void MaybeRebuild();
+
+  std::optional<uint32_t> RowForId(SliceId id);
+
+  const tables::SliceTable* slices_ = nullptr;
+
+  // Number of rows in the slice table when the index was last built.
+  uint32_t indexed_rows_ = 0;
+
+  // All indexed by row number.
+  std::vector<uint32_t> parent_row_;
+  std::vector<uint32_t> subtree_begin_;
+  std::vector<uint32_t> subtree_end_;
+
+  // The inverse of |subtree_begin_|: position in the traversal -> row.
+  std::vector<uint32_t> traversal_;
+};
+
+}  // namespace trace_processor
+}  // namespace perfetto
+
+#endif  // SRC_TRACE_PROCESSOR_PERFETTO_SQL_INTRINSICS_TABLE_FUNCTIONS_SLICE_TREE_INDEX_H_
@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "src/trace_processor/perfetto_sql/intrinsics/table_functions/slice_tree_index.h"
+
+#include "test/gtest_and_gmock.h"
+
+namespace perfetto {
+namespace trace_processor {
+namespace {
+
+using ::testing::ElementsAre;
+using ::testing::IsEmpty;
+
+class SliceTreeIndexTest : public ::testing::Test {
+ protected:
+  SliceId AddSlice(int64_t ts,
+                   int64_t dur,
+                   std::optional<SliceId> parent_id = std::nullopt) {
+    tables::SliceTable::Row row;
+    row.ts = ts;
+    row.dur = dur;
+    row.parent_id = parent_id;
+    if (parent_id) {
+      row.depth = storage_.slice_table().FindById(*parent_id)->depth() + 1;
+    }
+    return storage_.mutable_slice_table()->Insert(row).id;
+  }
+
+  std::vector<uint32_t> Ancestors(SliceId id) {
+    std::vector<SliceTreeIndex::RowNumber> rows;
+    EXPECT_TRUE(index_.GetAncestors(id, &rows));
+    return ToRows(rows);
+  }
+
+  std::vector<uint32_t> Descendants(SliceId id) {
+    std::vector<SliceTreeIndex::RowNumber> rows;
+    EXPECT_TRUE(index_.GetDescendants(id, &rows));
+    return ToRows(rows);
+  }
+
+  static std::vector<uint32_t> ToRows(
+      const std::vector<SliceTreeIndex::RowNumber>& rows) {
+    std::vector<uint32_t> res;
+    for (auto row : rows)
+      res.push_back(row.row_number());
+    return res;
+  }
+
+  TraceStorage storage_;
+  SliceTreeIndex index_{&storage_.slice_table()};
+};
+
+TEST_F(SliceTreeIndexTest, NestedStacks) {
+  // A-------------A  E---E
+  //   B------B  D-D
+  //    C--C
+  SliceId a = AddSlice(0, 100);
+  SliceId b = AddSlice(10, 50, a);
+  SliceId c = AddSlice(20, 10, b);
+  SliceId d = AddSlice(70, 10, a);
+  SliceId e = AddSlice(100, 10);
+
+  ASSERT_THAT(Ancestors(a), IsEmpty());
+  ASSERT_THAT(Ancestors(c), ElementsAre(1u, 0u));
+  ASSERT_THAT(Ancestors(d), ElementsAre(0u));
+
+  ASSERT_THAT(Descendants(a), ElementsAre(1u, 2u, 3u));
+  ASSERT_THAT(Descendants(b), ElementsAre(2u));
+  ASSERT_THAT(Descendants(c), IsEmpty());
+
+  // A slice starting exactly at the end of |a| is not one of its descendants.
+  ASSERT_THAT(Descendants(e), IsEmpty());
+}
+
+TEST_F(SliceTreeIndexTest, DescendantsInTimestampOrder) {
+  // A----------A
+  //  B---BD---D
+  //      I
+  SliceId a = AddSlice(0, 100);
+  SliceId b = AddSlice(10, 20, a);
+  AddSlice(30, 10, a);
+  // An instant at the end of |b| is visited after |d| in row order.
+  AddSlice(30, 0, b);
+
+  ASSERT_THAT(Descendants(a), ElementsAre(1u, 2u, 3u));
+}
+
+TEST_F(SliceTreeIndexTest, RebuildsAfterInsert) {
+  SliceId a = AddSlice(0, 100);
+  ASSERT_THAT(Descendants(a), IsEmpty());
+
+  SliceId b = AddSlice(10, 10, a);
+  ASSERT_THAT(Descendants(a), ElementsAre(1u));
+  ASSERT_THAT(Ancestors(b), ElementsAre(0u));
+}
+
+TEST_F(SliceTreeIndexTest, InvalidId) {
+  AddSlice(0, 100);
+
+  std::vector<SliceTreeIndex::RowNumber> rows;
+  ASSERT_FALSE(index_.GetAncestors(SliceId(10u), &rows));
+  ASSERT_FALSE(index_.GetDescendants(SliceId(10u), &rows));
+}
+
+}  // namespace
+}  // namespace trace_processor
+}  // namespace perfetto
@@ -29,6 +29,8 @@ from src.trace_processor.tables.metadata_tables import PROCESS_TABLE
 from src.trace_processor.tables.profiler_tables import STACK_PROFILE_CALLSITE_TABLE
 from src.trace_processor.tables.slice_tables import SLICE_TABLE
 from src.trace_processor.tables.sched_tables import SCHED_SLICE_TABLE
+from src.trace_processor.tables.sched_tables import THREAD_STATE_TABLE
+from src.trace_processor.tables.track_tables import TRACK_TABLE
 
 ANCESTOR_SLICE_TABLE = Table(
     python_module=__file__,
@@ -151,6 +153,57 @@ EXPERIMENTAL_SLICE_LAYOUT_TABLE = Table(
     ],
     parent=SLICE_TABLE)
 
+SLICE_FLATTENED_TABLE = Table(
+    python_module=__file__,
+    class_name="SliceFlattenedTable",
+    sql_name="internal_slice_flattened",
+    columns=[
+        C("slice_id", CppTableId(SLICE_TABLE)),
+        C("ts", CppInt64()),
+        C("dur", CppOptional(CppInt64())),
+        C("depth", CppUint32()),
+        C("name", CppOptional(CppString())),
+        C("track_id", CppTableId(TRACK_TABLE)),
+    ])
+
+THREAD_EXECUTING_SPAN_GRAPH_TABLE = Table(
+    python_module=__file__,
+    class_name="ThreadExecutingSpanGraphTable",
+    sql_name="internal_thread_executing_span_graph",
+    columns=[
+        C("root_id", CppTableId(THREAD_STATE_TABLE)),
+        C("parent_id", CppOptional(CppTableId(THREAD_STATE_TABLE))),
+        C("span_id", CppTableId(THREAD_STATE_TABLE)),
+        C("ts", CppInt64()),
+        C("dur", CppOptional(CppInt64())),
+        C("utid", CppUint32()),
+        C("waker_utid", CppOptional(CppUint32())),
+        C("blocked_dur", CppOptional(CppInt64())),
+        C("blocked_state", CppOptional(CppString())),
+        C("blocked_function", CppOptional(CppString())),
+        C("is_root", CppUint32()),
+        C("depth", CppUint32()),
+    ])
+
+THREAD_EXECUTING_SPAN_CRITICAL_PATH_TABLE = Table(
+    python_module=__file__,
+    class_name="ThreadExecutingSpanCriticalPathTable",
+    sql_name="internal_thread_executing_span_critical_path",
+    columns=[
+        C("parent_id", CppOptional(CppTableId(THREAD_STATE_TABLE))),
+        C("span_id", CppTableId(THREAD_STATE_TABLE)),
+        C("ts", CppInt64()),
+        C("dur", CppOptional(CppInt64())),
+        C("utid", CppUint32()),
+        C("critical_path_id", CppTableId(THREAD_STATE_TABLE)),
+        C("critical_path_blocked_ts", CppOptional(CppInt64())),
+        C("critical_path_blocked_dur", CppOptional(CppInt64())),
+        C("critical_path_blocked_state", CppOptional(CppString())),
+        C("critical_path_blocked_function", CppOptional(CppString())),
+        C("critical_path_utid", CppUint32()),
+        C("critical_path_upid", CppOptional(CppUint32())),
+    ])
+
 # Keep this list sorted.
 ALL_TABLES = [
     ANCESTOR_SLICE_BY_STACK_TABLE,
@@ -163,4 +216,7 @@ ALL_TABLES = [
     EXPERIMENTAL_COUNTER_DUR_TABLE,
     EXPERIMENTAL_SCHED_UPID_TABLE,
     EXPERIMENTAL_SLICE_LAYOUT_TABLE,
+    SLICE_FLATTENED_TABLE,
+    THREAD_EXECUTING_SPAN_CRITICAL_PATH_TABLE,
+    THREAD_EXECUTING_SPAN_GRAPH_TABLE,
 ]
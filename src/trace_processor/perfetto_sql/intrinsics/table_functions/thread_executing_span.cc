@@ -0,0 +1,462 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "src/trace_processor/perfetto_sql/intrinsics/table_functions/thread_executing_span.h"
+
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <optional>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "perfetto/ext/base/hash.h"
+#include "src/trace_processor/types/trace_processor_context.h"
+#include "src/trace_processor/util/query_abort.h"
+#include "src/trace_processor/util/status_macros.h"
+
+namespace perfetto {
+namespace trace_processor {
+namespace tables {
+
+ThreadExecutingSpanGraphTable::~ThreadExecutingSpanGraphTable() = default;
+ThreadExecutingSpanCriticalPathTable::~ThreadExecutingSpanCriticalPathTable() =
+    default;
+
+}  // namespace tables
+
+namespace {
+
+using ThreadStateTable = tables::ThreadStateTable;
+using GraphTable = tables::ThreadExecutingSpanGraphTable;
+using CriticalPathTable = tables::ThreadExecutingSpanCriticalPathTable;
+
+// A thread executing span. All the rows refer to the thread_state table.
+struct Span {
+  uint32_t utid;
+  // The runnable state starting the span.
+  uint32_t start_row;
+  // The sleep state which was blocking the thread before |start_row|. Unset
+  // for the first span of the thread.
+  std::optional<uint32_t> blocked_row;
+  // The start of the sleep state ending this span or the end of the thread if
+  // the thread never sleeps again.
+  std::optional<int64_t> end_ts;
+};
+
+struct SleepKey {
+  uint32_t utid;
+  int64_t end_ts;
+
+  bool operator==(const SleepKey& o) const {
+    return utid == o.utid && end_ts == o.end_ts;
+  }
+};
+
+struct SleepKeyHash {
+  size_t operator()(const SleepKey& k) const {
+    return static_cast<size_t>(base::Hasher::Combine(k.utid, k.end_ts));
+  }
+};
+
+struct ThreadInfo {
+  std::optional<uint32_t> first_row;
+  // Last state (in timestamp order) which has a known duration.
+  std::optional<uint32_t> last_complete_row;
+  // Earliest sleep state which is followed by a wakeup.
+  std::optional<uint32_t> first_blocked_row;
+  // (sleep, runnable) pairs of neighbouring states in timestamp order.
+  std::vector<std::pair<uint32_t, uint32_t>> wakeups;
+};
+
+// Stitches the thread states of each thread into thread executing spans.
+std::vector<Span> ComputeSpans(const ThreadStateTable& thread_state,
+                               const StringPool& pool) {
+  std::optional<StringId> runnable = pool.GetId("R");
+  std::optional<StringId> sleeping = pool.GetId("S");
+  std::optional<StringId> uninterruptible = pool.GetId("D");
+  std::optional<StringId> idle = pool.GetId("I");
+  auto is_sleep = [&](StringId state) {
+    return state == sleeping || state == uninterruptible || state == idle;
+  };
+
+  // First pass: index all the sleep states by their end so they can be
+  // matched with the runnable state which follows them.
+  std::unordered_map<uint32_t, ThreadInfo> threads;
+  std::unordered_map<SleepKey, std::vector<uint32_t>, SleepKeyHash> sleeps;
+  for (uint32_t i = 0; i < thread_state.row_count(); ++i) {
+    uint32_t utid = thread_state.utid()[i];
+    ThreadInfo& info = threads[utid];
+    if (!info.first_row)
+      info.first_row = i;
+
+    int64_t dur = thread_state.dur()[i];
+    if (dur == -1)
+      continue;
+    info.last_complete_row = i;
+    if (is_sleep(thread_state.state()[i])) {
+      sleeps[SleepKey{utid, thread_state.ts()[i] + dur}].push_back(i);
+    }
+  }
+
+  // Second pass: find all the runnable states woken up by a process (rather
+  // than an interrupt) which directly follow a sleep.
+  for (uint32_t i = 0; i < thread_state.row_count(); ++i) {
+    if (thread_state.dur()[i] == -1 || !thread_state.waker_utid()[i])
+      continue;
+
+    // Older kernels don't report the IRQ context so also accept null here:
+    // this means the graph might contain wakeups from interrupts.
+    std::optional<uint32_t> irq_context = thread_state.irq_context()[i];
+    if (irq_context && *irq_context != 0)
+      continue;
+
+    uint32_t utid = thread_state.utid()[i];
+    auto it = sleeps.find(SleepKey{utid, thread_state.ts()[i]});
+    if (it == sleeps.end())
+      continue;
+
+    ThreadInfo& info = threads[utid];
+    for (uint32_t sleep_row : it->second) {
+      info.wakeups.emplace_back(sleep_row, i);
+      if (!info.first_blocked_row || sleep_row < *info.first_blocked_row)
+        info.first_blocked_row = sleep_row;
+    }
+  }
+
+  std::vector<Span> spans;
+  for (const auto& [utid, info] : threads) {
+    std::optional<int64_t> thread_end_ts;
+    if (info.last_complete_row) {
+      thread_end_ts = thread_state.ts()[*info.last_complete_row] +
+                      thread_state.dur()[*info.last_complete_row];
+    }
+
+    // The first state of the thread starts a span if it is runnable, even if
+    // we don't know what it was blocked on.
+    uint32_t first_row = *info.first_row;
+    if (thread_state.dur()[first_row] != -1 &&
+        thread_state.state()[first_row] == runnable) {
+      std::optional<int64_t> end_ts = thread_end_ts;
+      if (info.first_blocked_row)
+        end_ts = thread_state.ts()[*info.first_blocked_row];
+      spans.push_back(Span{utid, first_row, std::nullopt, end_ts});
+    }
+
+    for (size_t i = 0; i < info.wakeups.size(); ++i) {
+      std::optional<int64_t> end_ts = thread_end_ts;
+      if (i + 1 < info.wakeups.size())
+        end_ts = thread_state.ts()[info.wakeups[i + 1].first];
+      spans.push_back(Span{utid, info.wakeups[i].second,
+                           info.wakeups[i].first, end_ts});
+    }
+  }
+  return spans;
+}
+
+}  // namespace
+
+ThreadExecutingSpanGraph::ThreadExecutingSpanGraph(
+    TraceProcessorContext* context)
+    : context_(context) {}
+ThreadExecutingSpanGraph::~ThreadExecutingSpanGraph() = default;
+
+Table::Schema ThreadExecutingSpanGraph::CreateSchema() {
+  return GraphTable::ComputeStaticSchema();
+}
+
+std::string ThreadExecutingSpanGraph::TableName() {
+  return GraphTable::Name();
+}
+
+uint32_t ThreadExecutingSpanGraph::EstimateRowCount() {
+  return context_->storage->thread_state_table().row_count();
+}
+
+base::Status ThreadExecutingSpanGraph::ValidateConstraints(
+    const QueryConstraints&) {
+  return base::OkStatus();
+}
+
+base::Status ThreadExecutingSpanGraph::ComputeTable(
+    const std::vector<Constraint>&,
+    const std::vector<Order>&,
+    const BitVector&,
+    std::unique_ptr<Table>& table_return) {
+  const GraphTable& graph = GetGraph();
+  RETURN_IF_ERROR(CheckQueryAbort());
+  table_return.reset(new Table(graph.Copy()));
+  return base::OkStatus();
+}
+
+const GraphTable& ThreadExecutingSpanGraph::GetGraph() {
+  const auto& thread_state = context_->storage->thread_state_table();
+  if (graph_thread_state_rows_ != thread_state.row_count()) {
+    graph_table_ = ComputeGraphTable(thread_state,
+                                     context_->storage->mutable_string_pool());
+    // An aborted computation leaves the graph incomplete: don't reuse it.
+    graph_thread_state_rows_ = std::nullopt;
+    if (CheckQueryAbort().ok())
+      graph_thread_state_rows_ = thread_state.row_count();
+  }
+  return *graph_table_;
+}
+
+// static
+std::unique_ptr<GraphTable> ThreadExecutingSpanGraph::ComputeGraphTable(
+    const ThreadStateTable& thread_state,
+    StringPool* pool) {
+  std::vector<Span> spans = ComputeSpans(thread_state, *pool);
+
+  // Index the spans of each thread by their start.
+  std::unordered_map<uint32_t, std::vector<uint32_t>> spans_by_utid;
+  for (uint32_t i = 0; i < spans.size(); ++i) {
+    spans_by_utid[spans[i].utid].push_back(i);
+  }
+  auto start_ts = [&](uint32_t span_idx) {
+    return thread_state.ts()[spans[span_idx].start_row];
+  };
+  for (auto& [utid, span_idxs] : spans_by_utid) {
+    std::stable_sort(span_idxs.begin(), span_idxs.end(),
+                     [&](uint32_t a, uint32_t b) {
+                       return start_ts(a) < start_ts(b);
+                     });
+  }
+
+  // A span is woken up by the spans of its waker thread which were executing
+  // at the time of the wakeup. As the spans of a thread don't overlap (except
+  // possibly at their boundaries), only the spans starting right before the
+  // wakeup need to be considered.
+  std::unordered_map<uint32_t, std::vector<uint32_t>> children_by_parent_row;
+  std::unordered_set<uint32_t> parent_rows;
+  std::unordered_set<uint32_t> child_rows;
+  for (uint32_t i = 0; i < spans.size(); ++i) {
+    std::optional<uint32_t> waker_utid =
+        thread_state.waker_utid()[spans[i].start_row];
+    if (!waker_utid)
+      continue;
+    auto waker_it = spans_by_utid.find(*waker_utid);
+    if (waker_it == spans_by_utid.end())
+      continue;
+
+    int64_t ts = start_ts(i);
+    const std::vector<uint32_t>& waker_spans = waker_it->second;
+    auto it = std::upper_bound(
+        waker_spans.begin(), waker_spans.end(), ts,
+        [&](int64_t value, uint32_t span_idx) {
+          return value < start_ts(span_idx);
+        });
+    while (it != waker_spans.begin()) {
+      const Span& parent = spans[*--it];
+      if (!parent.end_ts)
+        continue;
+      if (*parent.end_ts < ts)
+        break;
+      children_by_parent_row[parent.start_row].push_back(i);
+      parent_rows.insert(parent.start_row);
+      child_rows.insert(spans[i].start_row);
+    }
+  }
+
+  struct PendingRow {
+    uint32_t span_idx;
+    uint32_t root_row;
+    std::optional<uint32_t> parent_row;
+    uint32_t depth;
+  };
+  std::deque<PendingRow> pending;
+  for (uint32_t i = 0; i < spans.size(); ++i) {
+    uint32_t row = spans[i].start_row;
+    if (parent_rows.count(row) && !child_rows.count(row))
+      pending.push_back(PendingRow{i, row, std::nullopt, 0});
+  }
+
+  std::unique_ptr<GraphTable> out(new GraphTable(pool));
+  QueryAbortPoller abort_poller;
+  while (!pending.empty()) {
+    if (!abort_poller.Poll().ok())
+      break;
+
+    PendingRow cur = pending.front();
+    pending.pop_front();
+
+    const Span& span = spans[cur.span_idx];
+    GraphTable::Row row;
+    row.root_id = thread_state.id()[cur.root_row];
+    if (cur.parent_row)
+      row.parent_id = thread_state.id()[*cur.parent_row];
+    row.span_id = thread_state.id()[span.start_row];
+    row.ts = start_ts(cur.span_idx);
+    if (span.end_ts)
+      row.dur = *span.end_ts - row.ts;
+    row.utid = span.utid;
+    row.waker_utid = thread_state.waker_utid()[span.start_row];
+    if (span.blocked_row) {
+      row.blocked_dur = thread_state.dur()[*span.blocked_row];
+      row.blocked_state = thread_state.state()[*span.blocked_row];
+      row.blocked_function = thread_state.blocked_function()[*span.blocked_row];
+    }
+    row.is_root = !cur.parent_row;
+    row.depth = cur.depth;
+    out->Insert(row);
+
+    auto children_it = children_by_parent_row.find(span.start_row);
+    if (children_it == children_by_parent_row.end())
+      continue;
+
+    // Wakeups at identical timestamps could, in theory, create cycles: no
+    // valid path can be longer than the number of spans.
+    if (cur.depth >= spans.size())
+      continue;
+    for (uint32_t child_idx : children_it->second) {
+      pending.push_back(
+          PendingRow{child_idx, cur.root_row, span.start_row, cur.depth + 1});
+    }
+  }
+  return out;
+}
+
+ThreadExecutingSpanCriticalPath::ThreadExecutingSpanCriticalPath(
+    TraceProcessorContext* context,
+    ThreadExecutingSpanGraph* graph)
+    : context_(context), graph_(graph) {}
+ThreadExecutingSpanCriticalPath::~ThreadExecutingSpanCriticalPath() = default;
+
+Table::Schema ThreadExecutingSpanCriticalPath::CreateSchema() {
+  return CriticalPathTable::ComputeStaticSchema();
+}
+
+std::string ThreadExecutingSpanCriticalPath::TableName() {
+  return CriticalPathTable::Name();
+}
+
+uint32_t ThreadExecutingSpanCriticalPath::EstimateRowCount() {
+  return context_->storage->thread_state_table().row_count();
+}
+
+base::Status ThreadExecutingSpanCriticalPath::ValidateConstraints(
+    const QueryConstraints&) {
+  return base::OkStatus();
+}
+
+base::Status ThreadExecutingSpanCriticalPath::ComputeTable(
+    const std::vector<Constraint>&,
+    const std::vector<Order>&,
+    const BitVector&,
+    std::unique_ptr<Table>& table_return) {
+  // Same invalidation as the graph: the critical paths also depend on the
+  // thread table for the process of each thread.
+  uint32_t thread_state_rows =
+      context_->storage->thread_state_table().row_count();
+  const auto& thread = context_->storage->thread_table();
+  if (!critical_path_table_ ||
+      thread_state_rows != critical_path_thread_state_rows_ ||
+      thread.row_count() != critical_path_thread_rows_) {
+    critical_path_table_ =
+        ComputeCriticalPathTable(graph_->GetGraph(), thread,
+                                 context_->storage->mutable_string_pool());
+    critical_path_thread_state_rows_ = thread_state_rows;
+    critical_path_thread_rows_ = thread.row_count();
+    // An aborted computation leaves the table incomplete: don't reuse it.
+    if (base::Status status = CheckQueryAbort(); !status.ok()) {
+      critical_path_table_.reset();
+      return status;
+    }
+  }
+  table_return.reset(new Table(critical_path_table_->Copy()));
+  return base::OkStatus();
+}
+
+// static
+std::unique_ptr<CriticalPathTable>
+ThreadExecutingSpanCriticalPath::ComputeCriticalPathTable(
+    const GraphTable& graph,
+    const tables::ThreadTable& thread,
+    StringPool* pool) {
+  std::unordered_map<uint32_t, std::vector<uint32_t>> graph_rows_by_span_id;
+  for (uint32_t i = 0; i < graph.row_count(); ++i) {
+    graph_rows_by_span_id[graph.span_id()[i].value].push_back(i);
+  }
+
+  std::unique_ptr<CriticalPathTable> out(new CriticalPathTable(pool));
+
+  // Every span is the start of its own critical path: starting from it, walk
+  // up the wakeup graph for as long as the waker spans were executing while
+  // the span was blocked.
+  std::vector<std::pair<CriticalPathTable::Row, uint32_t>> stack;
+  QueryAbortPoller abort_poller;
+  for (uint32_t i = 0; i < graph.row_count(); ++i) {
+    CriticalPathTable::Row row;
+    row.parent_id = graph.parent_id()[i];
+    row.span_id = graph.span_id()[i];
+    row.ts = graph.ts()[i];
+    row.dur = graph.dur()[i];
+    row.utid = graph.utid()[i];
+    row.critical_path_id = graph.span_id()[i];
+    row.critical_path_blocked_dur = graph.blocked_dur()[i];
+    if (row.critical_path_blocked_dur)
+      row.critical_path_blocked_ts = row.ts - *row.critical_path_blocked_dur;
+    row.critical_path_blocked_state = graph.blocked_state()[i];
+    row.critical_path_blocked_function = graph.blocked_function()[i];
+    row.critical_path_utid = row.utid;
+    if (row.utid < thread.row_count())
+      row.critical_path_upid = thread.upid()[row.utid];
+
+    stack.emplace_back(row, 0);
+    while (!stack.empty()) {
+      if (!abort_poller.Poll().ok())
+        return out;
+
+      auto [cur, length] = stack.back();
+      stack.pop_back();
+      out->Insert(cur);
+
+      if (!cur.parent_id || !cur.critical_path_blocked_ts ||
+          cur.ts <= *cur.critical_path_blocked_ts) {
+        continue;
+      }
+
+      // As for the graph, no valid path can be longer than the number of
+      // spans.
+      if (length >= graph.row_count())
+        continue;
+
+      auto parents_it = graph_rows_by_span_id.find(cur.parent_id->value);
+      if (parents_it == graph_rows_by_span_id.end())
+        continue;
+      for (uint32_t parent : parents_it->second) {
+        // The critical path never goes back past the start of the blocked
+        // region and ends when the next span in the path starts.
+        int64_t ts =
+            std::max(graph.ts()[parent], *cur.critical_path_blocked_ts);
+        CriticalPathTable::Row next = cur;
+        next.parent_id = graph.parent_id()[parent];
+        next.span_id = graph.span_id()[parent];
+        next.ts = ts;
+        next.dur = std::nullopt;
+        if (auto dur = graph.dur()[parent]; dur)
+          next.dur = std::min(ts + *dur, cur.ts) - ts;
+        next.utid = graph.utid()[parent];
+        stack.emplace_back(next, length + 1);
+      }
+    }
+  }
+  return out;
+}
+
+}  // namespace trace_processor
+}  // namespace perfetto
@@ -0,0 +1,128 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SRC_TRACE_PROCESSOR_PERFETTO_SQL_INTRINSICS_TABLE_FUNCTIONS_THREAD_EXECUTING_SPAN_H_
+#define SRC_TRACE_PROCESSOR_PERFETTO_SQL_INTRINSICS_TABLE_FUNCTIONS_THREAD_EXECUTING_SPAN_H_
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+
+#include "src/trace_processor/perfetto_sql/intrinsics/table_functions/static_table_function.h"
+#include "src/trace_processor/perfetto_sql/intrinsics/table_functions/tables_py.h"
+#include "src/trace_processor/storage/trace_storage.h"
+
+namespace perfetto {
+namespace trace_processor {
+
+class TraceProcessorContext;
+
+// Native implementation of the wakeup graph walks used by the
+// experimental.thread_executing_span stdlib module.
+//
+// A "thread executing span" starts with a runnable thread_state woken up by a
+// process (as opposed to an interrupt) and lasts until the sleep preceding the
+// next such runnable state on the same thread. Given the following states:
+// S0__|R0__Running0___|S1__|R1__Running1___|S2__|R2__Running2__S2|
+// we have the spans [R0, S1), [R1, S2) and [R2, end of thread).
+//
+// A span is the child of the span of its waker thread which was executing when
+// the wakeup happened. Spans which wake other spans but were not woken up by
+// any span are the roots of the graph.
+//
+// Both the stitching of thread states into spans and the walks over the graph
+// are linear in the size of the output; the SQL equivalent needed recursive
+// CTEs which are very slow on large traces.
+
+// Table function returning every span reachable from a root, together with its
+// root and depth in the graph.
+class ThreadExecutingSpanGraph : public StaticTableFunction {
+ public:
+  explicit ThreadExecutingSpanGraph(TraceProcessorContext* context);
+  ~ThreadExecutingSpanGraph() override;
+
+  Table::Schema CreateSchema() override;
+  std::string TableName() override;
+  uint32_t EstimateRowCount() override;
+  base::Status ValidateConstraints(const QueryConstraints&) override;
+  base::Status ComputeTable(const std::vector<Constraint>& cs,
+                            const std::vector<Order>& ob,
+                            const BitVector& cols_used,
+                            std::unique_ptr<Table>& table_return) override;
+
+  // Returns the graph for the current contents of the thread_state table. The
+  // graph is computed on first use and recomputed only if thread states were
+  // added since it was last built, so it is also valid while a trace is still
+  // being loaded. The graph is incomplete if the running query is aborted
+  // (see CheckQueryAbort()).
+  const tables::ThreadExecutingSpanGraphTable& GetGraph();
+
+  // Visible for testing. Both functions return an incomplete table if the
+  // running query is aborted.
+  static std::unique_ptr<tables::ThreadExecutingSpanGraphTable>
+  ComputeGraphTable(const tables::ThreadStateTable& thread_state,
+                    StringPool* pool);
+
+ private:
+  TraceProcessorContext* context_ = nullptr;
+  std::unique_ptr<tables::ThreadExecutingSpanGraphTable> graph_table_;
+
+  // Number of rows in the thread_state table when |graph_table_| was built,
+  // or nullopt if it must be rebuilt.
+  std::optional<uint32_t> graph_thread_state_rows_;
+};
+
+// Table function returning, for every span in the graph, the chain of ancestor
+// spans which were executing while the span was blocked (i.e. its critical
+// path).
+class ThreadExecutingSpanCriticalPath : public StaticTableFunction {
+ public:
+  // |graph| is the table function whose cached graph the critical paths are
+  // computed from. It must outlive this object.
+  ThreadExecutingSpanCriticalPath(TraceProcessorContext* context,
+                                  ThreadExecutingSpanGraph* graph);
+  ~ThreadExecutingSpanCriticalPath() override;
+
+  Table::Schema CreateSchema() override;
+  std::string TableName() override;
+  uint32_t EstimateRowCount() override;
+  base::Status ValidateConstraints(const QueryConstraints&) override;
+  base::Status ComputeTable(const std::vector<Constraint>& cs,
+                            const std::vector<Order>& ob,
+                            const BitVector& cols_used,
+                            std::unique_ptr<Table>& table_return) override;
+
+  // Visible for testing.
+  static std::unique_ptr<tables::ThreadExecutingSpanCriticalPathTable>
+  ComputeCriticalPathTable(const tables::ThreadExecutingSpanGraphTable& graph,
+                           const tables::ThreadTable& thread,
+                           StringPool* pool);
+
+ private:
+  TraceProcessorContext* context_ = nullptr;
+  ThreadExecutingSpanGraph* graph_ = nullptr;
+  std::unique_ptr<Table> critical_path_table_;
+
+  // Number of rows in the thread_state and thread tables when
+  // |critical_path_table_| was built.
+  uint32_t critical_path_thread_state_rows_ = 0;
+  uint32_t critical_path_thread_rows_ = 0;
+};
+
+}  // namespace trace_processor
+}  // namespace perfetto
+
+#endif  // SRC_TRACE_PROCESSOR_PERFETTO_SQL_INTRINSICS_TABLE_FUNCTIONS_THREAD_EXECUTING_SPAN_H_
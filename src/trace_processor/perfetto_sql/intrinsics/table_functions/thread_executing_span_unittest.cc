@@ -0,0 +1,154 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "src/trace_processor/perfetto_sql/intrinsics/table_functions/thread_executing_span.h"
+
+#include "src/trace_processor/types/trace_processor_context.h"
+#include "test/gtest_and_gmock.h"
+
+namespace perfetto {
+namespace trace_processor {
+namespace {
+
+class ThreadExecutingSpanTest : public ::testing::Test {
+ protected:
+  ThreadExecutingSpanTest() {
+    context_.storage.reset(new TraceStorage());
+    storage_ = context_.storage.get();
+    // utid 0 is the swapper, utid 1 the waker and utid 2 the wakee.
+    for (uint32_t i = 0; i < 3; ++i) {
+      tables::ThreadTable::Row row;
+      row.tid = i;
+      row.upid = i;
+      storage_->mutable_thread_table()->Insert(row);
+    }
+  }
+
+  tables::ThreadStateTable::Id AddState(
+      int64_t ts,
+      int64_t dur,
+      uint32_t utid,
+      const char* state,
+      std::optional<uint32_t> waker_utid = std::nullopt) {
+    tables::ThreadStateTable::Row row;
+    row.ts = ts;
+    row.dur = dur;
+    row.utid = utid;
+    row.state = storage_->InternString(state);
+    row.waker_utid = waker_utid;
+    return storage_->mutable_thread_state_table()->Insert(row).id;
+  }
+
+  TraceProcessorContext context_;
+  TraceStorage* storage_ = nullptr;
+};
+
+TEST_F(ThreadExecutingSpanTest, SimpleWakeup) {
+  // Thread 1 runs for the whole trace and wakes up thread 2 at ts 50.
+  auto root = AddState(0, 10, 1, "R");
+  AddState(0, 50, 2, "S");
+  AddState(10, 90, 1, "Running");
+  auto wakee = AddState(50, 10, 2, "R", 1);
+  AddState(60, 20, 2, "Running");
+  AddState(80, 20, 2, "S");
+
+  auto graph = ThreadExecutingSpanGraph::ComputeGraphTable(
+      storage_->thread_state_table(), storage_->mutable_string_pool());
+  ASSERT_EQ(graph->row_count(), 2u);
+
+  ASSERT_EQ(graph->span_id()[0], root);
+  ASSERT_EQ(graph->root_id()[0], root);
+  ASSERT_EQ(graph->parent_id()[0], std::nullopt);
+  ASSERT_EQ(graph->ts()[0], 0);
+  ASSERT_EQ(graph->dur()[0], 100);
+  ASSERT_EQ(graph->is_root()[0], 1u);
+  ASSERT_EQ(graph->depth()[0], 0u);
+
+  ASSERT_EQ(graph->span_id()[1], wakee);
+  ASSERT_EQ(graph->root_id()[1], root);
+  ASSERT_EQ(graph->parent_id()[1], root);
+  ASSERT_EQ(graph->ts()[1], 50);
+  ASSERT_EQ(graph->dur()[1], 50);
+  ASSERT_EQ(graph->waker_utid()[1], 1u);
+  ASSERT_EQ(graph->blocked_dur()[1], 50);
+  ASSERT_EQ(graph->is_root()[1], 0u);
+  ASSERT_EQ(graph->depth()[1], 1u);
+
+  auto path = ThreadExecutingSpanCriticalPath::ComputeCriticalPathTable(
+      *graph, storage_->thread_table(), storage_->mutable_string_pool());
+  ASSERT_EQ(path->row_count(), 3u);
+
+  // The root was never blocked so its critical path is only itself.
+  ASSERT_EQ(path->span_id()[0], root);
+  ASSERT_EQ(path->critical_path_id()[0], root);
+
+  // The critical path of the wakee goes through the waker for the whole
+  // duration of the blocked region.
+  ASSERT_EQ(path->span_id()[1], wakee);
+  ASSERT_EQ(path->critical_path_id()[1], wakee);
+  ASSERT_EQ(path->critical_path_upid()[1], 2u);
+  ASSERT_EQ(path->span_id()[2], root);
+  ASSERT_EQ(path->critical_path_id()[2], wakee);
+  ASSERT_EQ(path->ts()[2], 0);
+  ASSERT_EQ(path->dur()[2], 50);
+  ASSERT_EQ(path->utid()[2], 1u);
+  ASSERT_EQ(path->critical_path_utid()[2], 2u);
+}
+
+TEST_F(ThreadExecutingSpanTest, InterruptWakeupIsIgnored) {
+  AddState(0, 10, 1, "R");
+  AddState(0, 50, 2, "S");
+  AddState(10, 90, 1, "Running");
+  tables::ThreadStateTable::Row row;
+  row.ts = 50;
+  row.dur = 10;
+  row.utid = 2;
+  row.state = storage_->InternString("R");
+  row.waker_utid = 1;
+  row.irq_context = 1;
+  storage_->mutable_thread_state_table()->Insert(row);
+
+  auto graph = ThreadExecutingSpanGraph::ComputeGraphTable(
+      storage_->thread_state_table(), storage_->mutable_string_pool());
+  ASSERT_EQ(graph->row_count(), 0u);
+}
+
+TEST_F(ThreadExecutingSpanTest, CachedGraphRebuiltWhenThreadStatesAdded) {
+  ThreadExecutingSpanGraph graph_fn(&context_);
+  ThreadExecutingSpanCriticalPath critical_path_fn(&context_, &graph_fn);
+
+  AddState(0, 10, 1, "R");
+  AddState(0, 50, 2, "S");
+  AddState(10, 90, 1, "Running");
+  ASSERT_EQ(graph_fn.GetGraph().row_count(), 0u);
+
+  std::unique_ptr<Table> path;
+  ASSERT_TRUE(critical_path_fn.ComputeTable({}, {}, BitVector(), path).ok());
+  ASSERT_EQ(path->row_count(), 0u);
+
+  // The wakeup arrives later (e.g. the trace is still being loaded): both the
+  // graph and the critical paths computed from it have to pick it up.
+  AddState(50, 10, 2, "R", 1);
+  AddState(60, 20, 2, "Running");
+  ASSERT_EQ(graph_fn.GetGraph().row_count(), 2u);
+
+  ASSERT_TRUE(critical_path_fn.ComputeTable({}, {}, BitVector(), path).ok());
+  ASSERT_EQ(path->row_count(), 3u);
+}
+
+}  // namespace
+}  // namespace trace_processor
+}  // namespace perfetto
@@ -47,218 +47,6 @@ FROM thread_state
 WHERE thread_state.dur != -1 AND thread_state.waker_utid IS NOT NULL
    AND (thread_state.irq_context = 0 OR thread_state.irq_context IS NULL);
 
--- Similar to |internal_runnable_state| but finds the first runnable state at thread.
-CREATE VIEW internal_first_runnable_state
-AS
-WITH
-  first_state AS (
-    SELECT
-      MIN(thread_state.id) AS id
-    FROM thread_state
-    GROUP BY utid
-  )
-SELECT
-  thread_state.id,
-  thread_state.ts,
-  thread_state.dur,
-  thread_state.state,
-  thread_state.utid,
-  thread_state.waker_utid
-FROM thread_state
-JOIN first_state USING (id)
-WHERE thread_state.dur != -1 AND thread_state.state = 'R';
-
---
--- Finds all sleep states including interruptible (S) and uninterruptible (D).
-CREATE VIEW internal_sleep_state
-AS
-SELECT
-  thread_state.id,
-  thread_state.ts,
-  thread_state.dur,
-  thread_state.state,
-  thread_state.blocked_function,
-  thread_state.utid
-FROM thread_state
-WHERE dur != -1 AND (state = 'S' OR state = 'D' OR state = 'I');
-
---
--- Finds the last execution for every thread to end executing_spans without a Sleep.
---
-CREATE VIEW internal_thread_end_ts
-AS
-SELECT
-  MAX(ts) + dur AS end_ts,
-  utid
-FROM thread_state
-WHERE dur != -1
-GROUP BY utid;
-
--- Similar to |internal_sleep_state| but finds the first sleep state in a thread.
-CREATE VIEW internal_first_sleep_state
-AS
-SELECT
-  MIN(s.id) AS id,
-  s.ts,
-  s.dur,
-  s.state,
-  s.blocked_function,
-  s.utid
-FROM internal_sleep_state s
-JOIN internal_runnable_state r
-  ON s.utid = r.utid AND (s.ts + s.dur = r.ts)
-GROUP BY s.utid;
-
---
--- Finds all neighbouring ('Sleeping', 'Runnable') thread_states pairs from the same thread.
--- More succintly, pairs of S[n-1]-R[n] where R is woken by a process context and S is an
--- interruptible or uninterruptible sleep state.
---
--- This is achieved by joining the |internal_runnable_state|.ts with the
--- |internal_sleep_state|.|ts + dur|.
---
--- With the S-R pairs of a thread, we can re-align to [R-S) intervals with LEADS and LAGS.
---
--- Given the following thread_states on a thread:
--- S0__|R0__Running0___|S1__|R1__Running1___|S2__|R2__Running2__S2|.
---
--- We have 3 thread_executing_spans: [R0, S0), [R1, S1), [R2, S2).
---
--- We define the following markers in this table:
---
--- prev_start_id    = R0_id.
--- prev_start_ts    = R0_ts.
--- prev_start_dur   = R0_dur.
--- prev_start_state = 'R'.
---
--- prev_end_id      = S0_id.
--- prev_end_ts      = S0_ts.
--- prev_end_dur     = S0_dur.
--- prev_end_state   = 'S' or 'D'.
---
--- start_id         = R1_id.
--- start_ts         = R1_ts.
--- start_dur        = R1_dur.
--- start_state      = 'R'.
---
--- end_id           = S1_id.
--- end_ts           = S1_ts.
--- end_dur          = S1_dur.
--- end_state        = 'S' or 'D'.
-CREATE TABLE internal_wakeup AS
-  SELECT
-  LAG(r.id, 1) OVER (PARTITION BY r.utid ORDER BY r.ts) AS prev_start_id,
-  LAG(r.ts, 1) OVER (PARTITION BY r.utid ORDER BY r.ts) AS prev_start_ts,
-  LAG(r.dur, 1) OVER (PARTITION BY r.utid ORDER BY r.ts) AS prev_start_dur,
-  LAG(r.state, 1) OVER (PARTITION BY r.utid ORDER BY r.ts) AS prev_start_state,
-  s.id AS prev_end_id,
-  s.ts AS prev_end_ts,
-  s.dur AS prev_end_dur,
-  s.state AS prev_end_state,
-  s.blocked_function AS prev_blocked_function,
-  r.id AS start_id,
-  r.ts AS start_ts,
-  r.dur AS start_dur,
-  r.state AS start_state,
-  r.utid AS utid,
-  r.waker_utid,
-  LEAD(s.id, 1) OVER (PARTITION BY r.utid ORDER BY r.ts) AS end_id,
-  IFNULL(LEAD(s.ts, 1) OVER (PARTITION BY r.utid ORDER BY r.ts), thread_end.end_ts)  AS end_ts,
-  LEAD(s.dur, 1) OVER (PARTITION BY r.utid ORDER BY r.ts) AS end_dur,
-  LEAD(s.state, 1) OVER (PARTITION BY r.utid ORDER BY r.ts) AS end_state,
-  LEAD(s.blocked_function, 1) OVER (PARTITION BY r.utid ORDER BY r.ts) AS blocked_function
-FROM internal_runnable_state r
-JOIN internal_sleep_state s
-  ON s.utid = r.utid AND (s.ts + s.dur = r.ts)
-LEFT JOIN internal_thread_end_ts thread_end USING(utid)
-UNION ALL
-  SELECT
-  NULL AS prev_start_id,
-  NULL AS prev_start_ts,
-  NULL AS prev_start_dur,
-  NULL AS prev_start_state,
-  NULL AS prev_end_id,
-  NULL AS prev_end_ts,
-  NULL AS prev_end_dur,
-  NULL AS prev_end_state,
-  NULL AS prev_blocked_function,
-  r.id AS start_id,
-  r.ts AS start_ts,
-  r.dur AS start_dur,
-  r.state AS start_state,
-  r.utid AS utid,
-  r.waker_utid,
-  s.id AS end_id,
-  IFNULL(s.ts, thread_end.end_ts)  AS end_ts,
-  s.dur AS end_dur,
-  s.state AS end_state,
-  s.blocked_function AS blocked_function
-FROM internal_first_runnable_state r
-LEFT JOIN internal_first_sleep_state s
-  ON s.utid = r.utid
-LEFT JOIN internal_thread_end_ts thread_end USING(utid);
-
--- Improves performance of |internal_wakeup_chain| computation.
-CREATE
-  INDEX internal_wakeup_idx
-ON internal_wakeup(waker_utid, start_ts);
-
---
--- Builds the parent-child chain from all thread_executing_spans. The parent is the waker and
--- child is the wakee.
---
--- Note that this doesn't include the roots. We'll compute the roots below.
--- This two step process improves performance because it's more efficient to scan
--- parent and find a child between than to scan child and find the parent it lies between.
-CREATE VIEW internal_wakeup_chain
-AS
-SELECT parent.start_id AS parent_id, child.*
-FROM internal_wakeup parent
-JOIN internal_wakeup child
-  ON (
-    parent.utid = child.waker_utid
-    AND child.start_ts BETWEEN parent.start_ts AND parent.end_ts);
-
---
--- Finds the roots of the |internal_wakeup_chain|.
-CREATE PERFETTO TABLE internal_wakeup_root
-AS
-WITH
-  internal_wakeup_root_id AS (
-    SELECT DISTINCT parent_id AS id FROM internal_wakeup_chain
-    EXCEPT
-    SELECT DISTINCT start_id AS id FROM internal_wakeup_chain
-  )
-SELECT NULL AS parent_id, internal_wakeup.*
-FROM internal_wakeup
-JOIN internal_wakeup_root_id
-  ON internal_wakeup_root_id.id = internal_wakeup.start_id;
-
---
--- Finds the leafs of the |internal_wakeup_chain|.
-CREATE PERFETTO TABLE internal_wakeup_leaf AS
-WITH
-  internal_wakeup_leaf_id AS (
-    SELECT DISTINCT start_id AS id FROM internal_wakeup_chain
-    EXCEPT
-    SELECT DISTINCT parent_id AS id FROM internal_wakeup_chain
-  )
-SELECT internal_wakeup_chain.*
-FROM internal_wakeup_chain
-JOIN internal_wakeup_leaf_id
-  ON internal_wakeup_leaf_id.id = internal_wakeup_chain.start_id;
-
---
--- Merges the roots, leafs and the rest of the chain.
-CREATE TABLE internal_wakeup_graph
-AS
-SELECT internal_wakeup_chain.*, 0 AS is_root, (internal_wakeup_leaf.start_id IS NOT NULL) AS is_leaf
-FROM internal_wakeup_chain
-LEFT JOIN internal_wakeup_leaf
-  USING (start_id)
-UNION ALL
-SELECT *, 1 AS is_root, 0 AS is_leaf FROM internal_wakeup_root;
-
 -- Thread_executing_span graph of all wakeups across all processes.
 --
 -- @column root_id            Id of thread_executing_span that initiated the wakeup of |id|.
@@ -274,83 +62,44 @@ SELECT *, 1 AS is_root, 0 AS is_leaf FROM internal_wakeup_root;
 -- @column is_root            Whether the thread_executing_span is a root.
 -- @column depth              Tree depth of thread executing span from the root.
 CREATE TABLE experimental_thread_executing_span_graph AS
-WITH roots AS (
+-- Stitching thread states into spans and walking the wakeup graph from its
+-- roots is done natively by |internal_thread_executing_span_graph|.
 SELECT
-  start_id AS root_id,
-  parent_id,
-  start_id AS id,
-  start_ts AS ts,
-  end_ts - start_ts AS dur,
-  utid,
-  waker_utid,
-  prev_end_dur AS blocked_dur,
-  prev_end_state AS blocked_state,
-  prev_blocked_function AS blocked_function,
-  1 AS is_root,
-  0 AS depth
-FROM internal_wakeup_root
-), chain AS (
-  SELECT * FROM roots
-  UNION ALL
-  SELECT
-    chain.root_id,
-    graph.parent_id,
-    graph.start_id AS id,
-    graph.start_ts AS ts,
-    graph.end_ts - graph.start_ts AS dur,
-    graph.utid,
-    graph.waker_utid,
-    graph.prev_end_dur AS blocked_dur,
-    graph.prev_end_state AS blocked_state,
-    graph.prev_blocked_function AS blocked_function,
-    0 AS is_root,
-    chain.depth + 1 AS depth
-  FROM internal_wakeup_graph graph
-  JOIN chain ON chain.id = graph.parent_id
-) SELECT chain.*, thread.upid FROM chain LEFT JOIN thread USING(utid);
-
--- It finds the MAX between the start of the critical span and the start
--- of the blocked region. This ensures that the critical path doesn't overlap
--- the preceding thread_executing_span before the blocked region.
-CREATE PERFETTO FUNCTION internal_critical_path_start_ts(ts LONG, leaf_blocked_ts LONG)
-RETURNS LONG AS SELECT MAX($ts, IFNULL($leaf_blocked_ts, $ts));
+  graph.root_id,
+  graph.parent_id,
+  graph.span_id AS id,
+  graph.ts,
+  graph.dur,
+  graph.utid,
+  graph.waker_utid,
+  graph.blocked_dur,
+  graph.blocked_state,
+  graph.blocked_function,
+  graph.is_root,
+  graph.depth,
+  thread.upid
+FROM internal_thread_executing_span_graph graph
+LEFT JOIN thread USING(utid);
 
 -- See |experimental_thread_executing_span_critical_path|
 CREATE PERFETTO TABLE internal_critical_path
 AS
-WITH chain AS (
-  SELECT
-    parent_id,
-    id,
-    ts,
-    dur,
-    utid,
-    id AS critical_path_id,
-    ts - blocked_dur AS critical_path_blocked_ts,
-    blocked_dur AS critical_path_blocked_dur,
-    blocked_state AS critical_path_blocked_state,
-    blocked_function AS critical_path_blocked_function,
-    utid AS critical_path_utid,
-    upid AS critical_path_upid
-  FROM experimental_thread_executing_span_graph graph
-  UNION ALL
-  SELECT
-    graph.parent_id,
-    graph.id,
-    internal_critical_path_start_ts(graph.ts, chain.critical_path_blocked_ts) AS ts,
-    MIN(internal_critical_path_start_ts(graph.ts, chain.critical_path_blocked_ts) + graph.dur, chain.ts)
-      - internal_critical_path_start_ts(graph.ts, chain.critical_path_blocked_ts) AS dur,
-    graph.utid,
-    chain.critical_path_id,
-    chain.critical_path_blocked_ts,
-    chain.critical_path_blocked_dur,
-    chain.critical_path_blocked_state,
-    chain.critical_path_blocked_function,
-    chain.critical_path_utid,
-    chain.critical_path_upid
-  FROM experimental_thread_executing_span_graph graph
-  JOIN chain ON (chain.parent_id = graph.id AND (chain.ts > chain.critical_path_blocked_ts))
-) SELECT * FROM chain;
+-- For every span, the chain of its ancestors is walked (natively) for as long
+-- as they overlap the blocked region preceding the span.
+SELECT
+  parent_id,
+  span_id AS id,
+  ts,
+  dur,
+  utid,
+  critical_path_id,
+  critical_path_blocked_ts,
+  critical_path_blocked_dur,
+  critical_path_blocked_state,
+  critical_path_blocked_function,
+  critical_path_utid,
+  critical_path_upid
+FROM internal_thread_executing_span_critical_path;
 
 -- Thread executing span critical paths for all threads. For each thread, the critical path of
 -- every sleeping thread state is computed and unioned with the thread executing spans on that thread.
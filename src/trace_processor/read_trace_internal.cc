@@ -100,7 +100,8 @@ util::Status ReadTraceUnfinalized(
       // Parse the file in chunks so we get some status update on stdio.
       static constexpr size_t kMmapChunkSize = 128ul * 1024 * 1024;
       while (bytes_read < whole_size_64) {
-        progress_callback(bytes_read);
+        if (progress_callback)
+          progress_callback(bytes_read);
         const size_t bytes_read_z = static_cast<size_t>(bytes_read);
         size_t slice_size = std::min(whole_size - bytes_read_z, kMmapChunkSize);
         TraceBlobView slice = whole_mmap.slice_off(bytes_read_z, slice_size);
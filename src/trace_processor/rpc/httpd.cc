@@ -20,14 +20,25 @@
 
 #include "src/trace_processor/rpc/httpd.h"
 
+#include <atomic>
+#include <condition_variable>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
 #include "perfetto/ext/base/http/http_server.h"
 #include "perfetto/ext/base/string_utils.h"
 #include "perfetto/ext/base/string_view.h"
+#include "perfetto/ext/base/thread_task_runner.h"
 #include "perfetto/ext/base/unix_task_runner.h"
 #include "perfetto/ext/base/utils.h"
+#include "perfetto/ext/trace_processor/rpc/query_result_serializer.h"
 #include "perfetto/protozero/scattered_heap_buffer.h"
 #include "perfetto/trace_processor/trace_processor.h"
 #include "src/trace_processor/rpc/rpc.h"
+#include "src/trace_processor/util/query_abort.h"
 
 #include "protos/perfetto/trace_processor/trace_processor.pbzero.h"
 
@@ -49,20 +60,99 @@ const char* kAllowedCORSOrigins[] = {
 
 class Httpd : public base::HttpRequestHandler {
  public:
-  explicit Httpd(std::unique_ptr<TraceProcessor>);
+  Httpd(std::unique_ptr<TraceProcessor>, const QueryBudget&);
   ~Httpd() override;
   void Run(int port);
 
  private:
+  // Aborts a query once the client which issued it has disconnected.
+  class QueryCancellation : public QueryAbortCheck {
+   public:
+    void Cancel() { cancelled_.store(true); }
+    base::Status Check() const override;
+
+   private:
+    std::atomic<bool> cancelled_{false};
+  };
+
+  // A /query request whose result is still being streamed back.
+  struct PendingQuery {
+    // Null once the client has disconnected.
+    base::HttpServerConnection* conn = nullptr;
+    // The serialized QueryArgs of the request.
+    std::string args;
+
+    // Set by the steps run on |query_runner_|.
+    std::unique_ptr<QueryResultSerializer> serializer;
+    bool read_only = true;
+    std::vector<uint8_t> batch;
+    bool has_more = false;
+
+    QueryCancellation cancellation;
+  };
+
   // HttpRequestHandler implementation.
   void OnHttpRequest(const base::HttpRequest&) override;
   void OnWebsocketMessage(const base::WebsocketMessage&) override;
+  void OnHttpConnectionClosed(base::HttpServerConnection*) override;
 
   void ServeHelpPage(const base::HttpRequest&);
 
+  // Starts running the next step of the first pending query on
+  // |query_runner_|, unless a step is already running.
+  void PostQueryStep();
+
+  // Runs on |query_runner_|. Starts |query| if it hasn't been yet and fills
+  // its next batch.
+  void RunQueryStep(PendingQuery* query);
+
+  // Sends the batch produced by the step which has just completed and moves
+  // its query at the back of |pending_queries_|.
+  void OnQueryStepDone();
+
+  // Blocks until the running query step, if any, is done. Must be called
+  // before using |trace_processor_rpc_| on this thread.
+  void WaitForQueryStep();
+
+  // Sends all the remaining batches of all the pending queries.
+  void FinishPendingQueries();
+
+  // Posts a task which sends the next batch of the query streamed on
+  // |websocket_query_conn_|.
+  void PostWebsocketQueryStep();
+
+  // Sends the next batch (or, if |finish|, all the remaining batches) of the
+  // query streamed on |websocket_query_conn_|.
+  void StepWebsocketQuery(bool finish);
+
   Rpc trace_processor_rpc_;
   base::UnixTaskRunner task_runner_;
   base::HttpServer http_srv_;
+
+  // Once the trace is finalized, the /query requests are run on
+  // |query_runner_|, one batch at a time and round-robin across connections.
+  // This thread meanwhile keeps serving the other connections and cancels the
+  // queries of the clients which disconnect. Only one step runs at a time and
+  // this thread doesn't use |trace_processor_rpc_| while it does: the trace
+  // processor (and the SQLite connection behind it) is not thread-safe. Hence
+  // a query which is slow to produce its next batch still delays the queries
+  // of the other connections.
+  std::list<PendingQuery> pending_queries_;
+  bool query_step_running_ = false;
+  std::mutex query_step_mutex_;
+  std::condition_variable query_step_done_cv_;
+  bool query_step_done_ = false;  // Guarded by |query_step_mutex_|.
+
+  // The websocket connection whose TPM_QUERY_STREAMING result is being sent
+  // by |trace_processor_rpc_|. The batches are sent one per task, so that the
+  // messages received in between (e.g. TPM_CANCEL_QUERY) are handled without
+  // waiting for the whole result.
+  base::HttpServerConnection* websocket_query_conn_ = nullptr;
+  bool websocket_query_step_posted_ = false;
+
+  // Destroyed first, so that no step is running when the rest is.
+  base::ThreadTaskRunner query_runner_ =
+      base::ThreadTaskRunner::CreateAndStart("tp_query");
 };
 
 base::HttpServerConnection* g_cur_conn;
@@ -71,6 +161,32 @@ base::StringView Vec2Sv(const std::vector<uint8_t>& v) {
   return base::StringView(reinterpret_cast<const char*>(v.data()), v.size());
 }
 
+// Sends |batch| as a chunk of the reply to a /query request, followed by the
+// end of the reply unless |has_more|.
+void SendQueryBatch(base::HttpServerConnection* conn,
+                    const std::vector<uint8_t>& batch,
+                    bool has_more) {
+  PERFETTO_DLOG("Sending response chunk, len=%zu eof=%d", batch.size(),
+                !has_more);
+  base::StackString<32> chunk_hdr("%zx\r\n", batch.size());
+  conn->SendResponseBody(chunk_hdr.c_str(), chunk_hdr.len());
+  conn->SendResponseBody(batch.data(), batch.size());
+  conn->SendResponseBody("\r\n", 2);
+  if (!has_more)
+    conn->SendResponseBody("0\r\n\r\n", 5);
+}
+
+// Sends all the remaining batches of |serializer| as the reply to a /query
+// request.
+void SendQueryResult(base::HttpServerConnection* conn,
+                     QueryResultSerializer* serializer) {
+  for (bool has_more = true; has_more;) {
+    std::vector<uint8_t> batch;
+    has_more = serializer->Serialize(&batch);
+    SendQueryBatch(conn, batch, has_more);
+  }
+}
+
 // Used both by websockets and /rpc chunked HTTP endpoints.
 void SendRpcChunk(const void* data, uint32_t len) {
   if (data == nullptr) {
@@ -90,9 +206,14 @@ void SendRpcChunk(const void* data, uint32_t len) {
   }
 }
 
-Httpd::Httpd(std::unique_ptr<TraceProcessor> preloaded_instance)
+Httpd::Httpd(std::unique_ptr<TraceProcessor> preloaded_instance,
+             const QueryBudget& query_budget)
     : trace_processor_rpc_(std::move(preloaded_instance)),
-      http_srv_(&task_runner_, this) {}
+      http_srv_(&task_runner_, this) {
+  trace_processor_rpc_.set_query_budget(query_budget);
+  // Overlaps receiving the trace with parsing it.
+  trace_processor_rpc_.set_pipelined_append(true);
+}
 Httpd::~Httpd() = default;
 
 void Httpd::Run(int port) {
@@ -116,6 +237,15 @@ void Httpd::OnHttpRequest(const base::HttpRequest& req) {
     return ServeHelpPage(req);
   }
 
+  // A request on a connection which is still receiving the result of a query
+  // has been pipelined by the client: complete the previous reply first.
+  for (const PendingQuery& query : pending_queries_) {
+    if (query.conn == req.conn) {
+      FinishPendingQueries();
+      break;
+    }
+  }
+
   static int last_req_id = 0;
   auto seq_hdr = req.GetHeader("x-seq-id").value_or(base::StringView());
   int seq_id = base::StringToInt32(seq_hdr.ToStdString()).value_or(0);
@@ -138,11 +268,30 @@ void Httpd::OnHttpRequest(const base::HttpRequest& req) {
       "Transfer-Encoding: chunked",            //
   };
 
+  // Doesn't need to wait for the running query step: it only reads the name of
+  // the trace, which queries don't change.
   if (req.uri == "/status") {
     auto status = trace_processor_rpc_.GetStatus();
     return conn.SendResponse("200 OK", default_headers, Vec2Sv(status));
   }
 
+  // Whether the query is read-only is only known once it has been prepared, on
+  // |query_runner_|: see OnQueryStepDone().
+  if (req.uri == "/query" && trace_processor_rpc_.is_trace_finalized()) {
+    conn.SendResponseHeaders("200 OK", chunked_headers,
+                             base::HttpServerConnection::kOmitContentLength);
+    pending_queries_.emplace_back();
+    pending_queries_.back().conn = req.conn;
+    pending_queries_.back().args = req.body.ToStdString();
+    PostQueryStep();
+    return;
+  }
+
+  // All the other requests can change the state of the trace processor, so
+  // they are handled only once the pending queries are done.
+  FinishPendingQueries();
+  StepWebsocketQuery(/*finish=*/true);
+
   if (req.uri == "/websocket" && req.is_websocket_handshake) {
     // Will trigger OnWebsocketMessage() when is received.
     // It returns a 403 if the origin is not in kAllowedCORSOrigins.
@@ -200,26 +349,15 @@ void Httpd::OnHttpRequest(const base::HttpRequest& req) {
   // |batch_split_threshold_| in query_result_serializer.h.
   // This is temporary, it will be switched to WebSockets soon.
   if (req.uri == "/query") {
-    std::vector<uint8_t> response;
-
     // Start the chunked reply.
     conn.SendResponseHeaders("200 OK", chunked_headers,
                              base::HttpServerConnection::kOmitContentLength);
 
-    // |on_result_chunk| will be called nested within the same callstack of the
-    // rpc.Query() call. No further calls will be made once Query() returns.
-    auto on_result_chunk = [&](const uint8_t* buf, size_t len, bool has_more) {
-      PERFETTO_DLOG("Sending response chunk, len=%zu eof=%d", len, !has_more);
-      base::StackString<32> chunk_hdr("%zx\r\n", len);
-      conn.SendResponseBody(chunk_hdr.c_str(), chunk_hdr.len());
-      conn.SendResponseBody(buf, len);
-      conn.SendResponseBody("\r\n", 2);
-      if (!has_more)
-        conn.SendResponseBody("0\r\n\r\n", 5);
-    };
-    trace_processor_rpc_.Query(
-        reinterpret_cast<const uint8_t*>(req.body.data()), req.body.size(),
-        on_result_chunk);
+    std::unique_ptr<QueryResultSerializer> serializer =
+        trace_processor_rpc_.StartQuery(
+            reinterpret_cast<const uint8_t*>(req.body.data()),
+            req.body.size());
+    SendQueryResult(&conn, serializer.get());
     return;
   }
 
@@ -244,20 +382,208 @@ void Httpd::OnHttpRequest(const base::HttpRequest& req) {
 }
 
 void Httpd::OnWebsocketMessage(const base::WebsocketMessage& msg) {
+  FinishPendingQueries();
+  // The query streamed on this connection is instead completed or cancelled
+  // by the Rpc, depending on the message.
+  if (websocket_query_conn_ != msg.conn)
+    StepWebsocketQuery(/*finish=*/true);
+
   PERFETTO_CHECK(g_cur_conn == nullptr);
   g_cur_conn = msg.conn;
   trace_processor_rpc_.SetRpcResponseFunction(SendRpcChunk);
+  trace_processor_rpc_.set_incremental_query_streaming(true);
   // OnRpcRequest() will call SendRpcChunk() one or more times.
   trace_processor_rpc_.OnRpcRequest(msg.data.data(), msg.data.size());
+  trace_processor_rpc_.set_incremental_query_streaming(false);
+  trace_processor_rpc_.SetRpcResponseFunction(nullptr);
+  g_cur_conn = nullptr;
+
+  if (trace_processor_rpc_.has_streaming_query()) {
+    websocket_query_conn_ = msg.conn;
+    PostWebsocketQueryStep();
+  } else {
+    websocket_query_conn_ = nullptr;
+  }
+}
+
+void Httpd::OnHttpConnectionClosed(base::HttpServerConnection* conn) {
+  // Destroying the serializer stops the query: there is no point in computing
+  // the rest of the result if the client went away.
+  if (conn == websocket_query_conn_) {
+    PERFETTO_LOG("[HTTP] Query cancelled: the client disconnected");
+    WaitForQueryStep();
+    trace_processor_rpc_.DropStreamingQuery();
+    websocket_query_conn_ = nullptr;
+  }
+  for (auto it = pending_queries_.begin(); it != pending_queries_.end();) {
+    if (it->conn != conn) {
+      ++it;
+      continue;
+    }
+    PERFETTO_LOG("[HTTP] Query cancelled: the client disconnected");
+    // The query of the running step is in use on |query_runner_|: it is
+    // aborted there and dropped once the step is done.
+    if (query_step_running_ && it == pending_queries_.begin()) {
+      it->conn = nullptr;
+      it->cancellation.Cancel();
+      ++it;
+    } else {
+      it = pending_queries_.erase(it);
+    }
+  }
+}
+
+base::Status Httpd::QueryCancellation::Check() const {
+  if (cancelled_.load())
+    return base::ErrStatus("Query cancelled: the client disconnected");
+  return base::OkStatus();
+}
+
+void Httpd::PostQueryStep() {
+  if (query_step_running_ || pending_queries_.empty())
+    return;
+  query_step_running_ = true;
+  PendingQuery* query = &pending_queries_.front();
+  query_runner_.PostTask([this, query] {
+    RunQueryStep(query);
+    {
+      std::lock_guard<std::mutex> lock(query_step_mutex_);
+      query_step_done_ = true;
+    }
+    query_step_done_cv_.notify_one();
+    task_runner_.PostTask([this] {
+      OnQueryStepDone();
+      PostQueryStep();
+    });
+  });
+}
+
+void Httpd::RunQueryStep(PendingQuery* query) {
+  const QueryAbortCheck* prev_abort_check =
+      SetThreadQueryAbortCheck(&query->cancellation);
+  const auto* args = reinterpret_cast<const uint8_t*>(query->args.data());
+  if (!query->serializer) {
+    // Only read-only queries are interleaved with other queries: e.g. SQLite
+    // fails to drop a table while other statements are still being stepped.
+    protos::pbzero::QueryArgs::Decoder decoder(args, query->args.size());
+    query->read_only = trace_processor_rpc_.IsReadOnlyQuery(
+        decoder.sql_query().ToStdString());
+    if (query->read_only) {
+      query->serializer =
+          trace_processor_rpc_.StartQuery(args, query->args.size());
+    }
+  }
+  if (query->serializer) {
+    query->batch.clear();
+    query->has_more = query->serializer->Serialize(&query->batch);
+  }
+  SetThreadQueryAbortCheck(prev_abort_check);
+}
+
+void Httpd::OnQueryStepDone() {
+  if (!query_step_running_)
+    return;
+  {
+    std::lock_guard<std::mutex> lock(query_step_mutex_);
+    if (!query_step_done_)
+      return;
+    query_step_done_ = false;
+  }
+  query_step_running_ = false;
+
+  auto it = pending_queries_.begin();
+  if (!it->conn) {
+    pending_queries_.erase(it);
+    return;
+  }
+  if (!it->read_only) {
+    // Runs on its own, once the other pending queries are done.
+    std::list<PendingQuery> query;
+    query.splice(query.begin(), pending_queries_, it);
+    FinishPendingQueries();
+    std::unique_ptr<QueryResultSerializer> serializer =
+        trace_processor_rpc_.StartQuery(
+            reinterpret_cast<const uint8_t*>(query.front().args.data()),
+            query.front().args.size());
+    SendQueryResult(query.front().conn, serializer.get());
+    return;
+  }
+  SendQueryBatch(it->conn, it->batch, it->has_more);
+  if (it->has_more) {
+    pending_queries_.splice(pending_queries_.end(), pending_queries_, it);
+  } else {
+    pending_queries_.erase(it);
+  }
+}
+
+void Httpd::WaitForQueryStep() {
+  if (!query_step_running_)
+    return;
+  {
+    std::unique_lock<std::mutex> lock(query_step_mutex_);
+    query_step_done_cv_.wait(lock, [this] { return query_step_done_; });
+  }
+  OnQueryStepDone();
+}
+
+void Httpd::FinishPendingQueries() {
+  WaitForQueryStep();
+  // The queries which have already started go first: as above, some
+  // statements can't run while other ones are being stepped.
+  for (auto it = pending_queries_.begin(); it != pending_queries_.end();) {
+    if (it->serializer) {
+      SendQueryResult(it->conn, it->serializer.get());
+      it = pending_queries_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  for (PendingQuery& query : pending_queries_) {
+    std::unique_ptr<QueryResultSerializer> serializer =
+        trace_processor_rpc_.StartQuery(
+            reinterpret_cast<const uint8_t*>(query.args.data()),
+            query.args.size());
+    SendQueryResult(query.conn, serializer.get());
+  }
+  pending_queries_.clear();
+}
+
+void Httpd::PostWebsocketQueryStep() {
+  if (websocket_query_step_posted_)
+    return;
+  websocket_query_step_posted_ = true;
+  task_runner_.PostTask([this] {
+    websocket_query_step_posted_ = false;
+    StepWebsocketQuery(/*finish=*/false);
+    if (websocket_query_conn_)
+      PostWebsocketQueryStep();
+  });
+}
+
+void Httpd::StepWebsocketQuery(bool finish) {
+  if (!websocket_query_conn_)
+    return;
+  WaitForQueryStep();
+  PERFETTO_CHECK(g_cur_conn == nullptr);
+  g_cur_conn = websocket_query_conn_;
+  trace_processor_rpc_.SetRpcResponseFunction(SendRpcChunk);
+  if (finish) {
+    trace_processor_rpc_.FinishStreamingQuery();
+  } else {
+    trace_processor_rpc_.StepStreamingQuery();
+  }
   trace_processor_rpc_.SetRpcResponseFunction(nullptr);
   g_cur_conn = nullptr;
+  if (!trace_processor_rpc_.has_streaming_query())
+    websocket_query_conn_ = nullptr;
 }
 
 }  // namespace
 
 void RunHttpRPCServer(std::unique_ptr<TraceProcessor> preloaded_instance,
-                      std::string port_number) {
-  Httpd srv(std::move(preloaded_instance));
+                      std::string port_number,
+                      const QueryBudget& query_budget) {
+  Httpd srv(std::move(preloaded_instance), query_budget);
   std::optional<int> port_opt = base::StringToInt32(port_number);
   int port = port_opt.has_value() ? *port_opt : kBindPort;
   srv.Run(port);
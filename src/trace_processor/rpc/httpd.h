@@ -24,13 +24,18 @@ namespace perfetto {
 namespace trace_processor {
 
 class TraceProcessor;
+struct QueryBudget;
 
 // Starts a RPC server that handles requests using protobuf-over-HTTP.
 // It takes control of the calling thread and does not return.
 // The unique_ptr argument is optional. If non-null, the HTTP server will adopt
 // an existing instance with a pre-loaded trace. If null, it will create a new
 // instance when pushing data into the /parse endpoint.
-void RunHttpRPCServer(std::unique_ptr<TraceProcessor>, std::string);
+// The QueryBudget limits all the queries, whatever budget the clients request
+// (see Rpc::set_query_budget()).
+void RunHttpRPCServer(std::unique_ptr<TraceProcessor>,
+                      std::string,
+                      const QueryBudget&);
 
 }  // namespace trace_processor
 }  // namespace perfetto
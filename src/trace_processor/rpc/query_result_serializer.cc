@@ -16,8 +16,11 @@
 
 #include "perfetto/ext/trace_processor/rpc/query_result_serializer.h"
 
+#include <algorithm>
+#include <string>
 #include <vector>
 
+#include "perfetto/ext/base/flat_hash_map.h"
 #include "perfetto/protozero/packed_repeated_fields.h"
 #include "perfetto/protozero/proto_utils.h"
 #include "perfetto/protozero/scattered_heap_buffer.h"
@@ -32,10 +35,13 @@ namespace {
 
 namespace pu = ::protozero::proto_utils;
 using BatchProto = protos::pbzero::QueryResult::CellsBatch;
+using ColumnarBatchProto = protos::pbzero::QueryResult::ColumnarBatch;
+using ColumnProto = protos::pbzero::QueryResult::ColumnarBatch::Column;
 using ResultProto = protos::pbzero::QueryResult;
 
-// The reserved field in trace_processor.proto.
+// The reserved fields in trace_processor.proto.
 static constexpr uint32_t kPaddingFieldId = 7;
+static constexpr uint32_t kColumnPaddingFieldId = 8;
 
 uint8_t MakeLenDelimTag(uint32_t field_num) {
   uint32_t tag = pu::MakeTagLengthDelimited(field_num);
@@ -43,10 +49,68 @@ uint8_t MakeLenDelimTag(uint32_t field_num) {
   return static_cast<uint8_t>(tag);
 }
 
+// Appends |data| as the length-delimited field |field_num| of |msg|, making
+// sure that the payload starts at a 64-bit aligned offset in the output
+// stream, so that JS can access it by overlaying a TypedArray, without extra
+// copies. The gap is filled with the |padding_field_num| varint field.
+void AppendAligned(protozero::Message* msg,
+                   uint32_t field_num,
+                   uint32_t padding_field_num,
+                   const void* data,
+                   uint32_t size) {
+  const auto& writer = *msg->stream_writer();
+  uint8_t preamble[16];
+  uint8_t* preamble_end = &preamble[0];
+  *(preamble_end++) = MakeLenDelimTag(field_num);
+  preamble_end = pu::WriteVarInt(size, preamble_end);
+  uint32_t preamble_size = static_cast<uint32_t>(preamble_end - &preamble[0]);
+
+  // The byte after the preamble must start at a 64bit-aligned offset.
+  // The padding needs to be > 1 Byte because of proto encoding.
+  const uint32_t off = static_cast<uint32_t>(writer.written() + preamble_size);
+  const uint32_t aligned_off = (off + 7) & ~7u;
+  uint32_t padding = aligned_off - off;
+  padding = padding == 1 ? 9 : padding;
+  if (padding > 0) {
+    uint8_t pad_buf[10];
+    uint8_t* pad = pad_buf;
+    *(pad++) = pu::MakeTagVarInt(padding_field_num);
+    for (uint32_t i = 0; i < padding - 2; i++)
+      *(pad++) = 0x80;
+    *(pad++) = 0;
+    msg->AppendRawProtoBytes(pad_buf, static_cast<size_t>(pad - pad_buf));
+  }
+  msg->AppendRawProtoBytes(preamble, preamble_size);
+  PERFETTO_CHECK(writer.written() % 8 == 0);
+  msg->AppendRawProtoBytes(data, size);
+}
+
+// The cells of one column of a ColumnarBatch. Each value vector is extended
+// lazily: it is only allocated once a cell of its type is seen, and zero-filled
+// for the rows which came before.
+struct ColumnBuffer {
+  // The CellsBatch::CellType of each row.
+  std::vector<uint8_t> cell_types;
+  // Bitmask of (1 << CellType) of all the cells.
+  uint32_t types_seen = 0;
+
+  std::vector<int64_t> longs;
+  std::vector<double> doubles;
+  std::vector<uint32_t> string_indices;
+  std::vector<std::string> blobs;
+
+  // The NUL-separated dictionary of distinct strings and the index of each
+  // string in it.
+  std::string string_dict;
+  base::FlatHashMap<std::string, uint32_t> string_ids;
+};
+
 }  // namespace
 
-QueryResultSerializer::QueryResultSerializer(Iterator iter)
-    : iter_(iter.take_impl()), num_cols_(iter_->ColumnCount()) {}
+QueryResultSerializer::QueryResultSerializer(Iterator iter, Format format)
+    : iter_(iter.take_impl()),
+      num_cols_(iter_->ColumnCount()),
+      format_(format) {}
 
 QueryResultSerializer::~QueryResultSerializer() = default;
 
@@ -71,11 +135,33 @@ bool QueryResultSerializer::Serialize(protos::pbzero::QueryResult* res) {
   // write an empty batch with the EOF marker. Errors can happen also in the
   // middle of a query, not just before starting it.
 
-  SerializeBatch(res);
+  if (format_ == Format::kColumnarBatch) {
+    SerializeColumnarBatch(res);
+  } else {
+    SerializeBatch(res);
+  }
   MaybeSerializeError(res);
   return !eof_reached_;
 }
 
+void QueryResultSerializer::Cancel(protos::pbzero::QueryResult* res,
+                                   const std::string& error) {
+  PERFETTO_CHECK(!eof_reached_);
+  if (!did_write_metadata_) {
+    SerializeMetadata(res);
+    did_write_metadata_ = true;
+  }
+  if (format_ == Format::kColumnarBatch) {
+    res->add_columnar_batch()->set_is_last_batch(true);
+  } else {
+    res->add_batch()->set_is_last_batch(true);
+  }
+  res->set_error(error);
+  eof_reached_ = true;
+  // Destroying the iterator resets the statement.
+  iter_.reset();
+}
+
 void QueryResultSerializer::SerializeBatch(protos::pbzero::QueryResult* res) {
   // The buffer is filled in this way:
   // - Append all the strings as we iterate through the results. The rationale
@@ -87,7 +173,6 @@ void QueryResultSerializer::SerializeBatch(protos::pbzero::QueryResult* res) {
   // Note: this function uses uint32_t instead of size_t because Wasm doesn't
   // have yet native 64-bit integers and this is perf-sensitive.
 
-  const auto& writer = *res->stream_writer();
   auto* batch = res->add_batch();
 
   // Start the |string_cells|.
@@ -208,32 +293,9 @@ void QueryResultSerializer::SerializeBatch(protos::pbzero::QueryResult* res) {
   // a TypedArray, without extra copies.
   const uint32_t doubles_size = static_cast<uint32_t>(doubles.size());
   if (doubles_size > 0) {
-    uint8_t preamble[16];
-    uint8_t* preamble_end = &preamble[0];
-    *(preamble_end++) = MakeLenDelimTag(BatchProto::kFloat64CellsFieldNumber);
-    preamble_end = pu::WriteVarInt(doubles_size, preamble_end);
-    uint32_t preamble_size = static_cast<uint32_t>(preamble_end - &preamble[0]);
-
-    // The byte after the preamble must start at a 64bit-aligned offset.
-    // The padding needs to be > 1 Byte because of proto encoding.
-    const uint32_t off =
-        static_cast<uint32_t>(writer.written() + preamble_size);
-    const uint32_t aligned_off = (off + 7) & ~7u;
-    uint32_t padding = aligned_off - off;
-    padding = padding == 1 ? 9 : padding;
-    if (padding > 0) {
-      uint8_t pad_buf[10];
-      uint8_t* pad = pad_buf;
-      *(pad++) = pu::MakeTagVarInt(kPaddingFieldId);
-      for (uint32_t i = 0; i < padding - 2; i++)
-        *(pad++) = 0x80;
-      *(pad++) = 0;
-      batch->AppendRawProtoBytes(pad_buf, static_cast<size_t>(pad - pad_buf));
-    }
-    batch->AppendRawProtoBytes(preamble, preamble_size);
-    PERFETTO_CHECK(writer.written() % 8 == 0);
-    batch->AppendRawProtoBytes(doubles.data(), doubles_size);
-  }  // if (doubles_size > 0)
+    AppendAligned(batch, BatchProto::kFloat64CellsFieldNumber, kPaddingFieldId,
+                  doubles.data(), doubles_size);
+  }
 
   // Append the blobs.
   if (blobs.size() > 0) {
@@ -250,6 +312,143 @@ void QueryResultSerializer::SerializeBatch(protos::pbzero::QueryResult* res) {
   batch->Finalize();
 }
 
+void QueryResultSerializer::SerializeColumnarBatch(
+    protos::pbzero::QueryResult* res) {
+  // Unlike SerializeBatch(), the cells can't be streamed out while iterating:
+  // each column is buffered and written out at the end of the batch.
+  std::vector<ColumnBuffer> columns(num_cols_);
+  const uint32_t max_rows =
+      num_cols_ > 0 ? std::max(cells_per_batch_ / num_cols_, 1u) : 0;
+
+  // See the comment in SerializeBatch().
+  uint32_t approx_batch_size = 16;
+
+  std::string scratch;
+  uint32_t num_rows = 0;
+  bool batch_full = false;
+  for (;; ++num_rows) {
+    // col_ < num_cols_ iff the iterator is already positioned on a row that
+    // didn't fit in the previous batch.
+    if (col_ >= num_cols_) {
+      if (!iter_->Next())
+        break;  // EOF or error.
+      col_ = 0;
+    }
+    PERFETTO_DCHECK(num_cols_ > 0);
+    if (num_rows >= max_rows || approx_batch_size > batch_split_threshold_) {
+      batch_full = true;
+      break;
+    }
+
+    for (uint32_t c = 0; c < num_cols_; ++c) {
+      ColumnBuffer& col = columns[c];
+      auto value = iter_->Get(c);
+      uint8_t cell_type = BatchProto::CELL_INVALID;
+      switch (value.type) {
+        case SqlValue::Type::kNull: {
+          cell_type = BatchProto::CELL_NULL;
+          break;
+        }
+        case SqlValue::Type::kLong: {
+          cell_type = BatchProto::CELL_VARINT;
+          col.longs.resize(num_rows);
+          col.longs.push_back(value.long_value);
+          approx_batch_size += sizeof(int64_t);
+          break;
+        }
+        case SqlValue::Type::kDouble: {
+          cell_type = BatchProto::CELL_FLOAT64;
+          col.doubles.resize(num_rows);
+          col.doubles.push_back(value.double_value);
+          approx_batch_size += sizeof(double);
+          break;
+        }
+        case SqlValue::Type::kString: {
+          cell_type = BatchProto::CELL_STRING;
+          scratch.assign(value.string_value);
+          uint32_t* id = col.string_ids.Find(scratch);
+          if (!id) {
+            auto next_id = static_cast<uint32_t>(col.string_ids.size());
+            id = col.string_ids.Insert(scratch, next_id).first;
+            col.string_dict.append(scratch.c_str(), scratch.size() + 1);
+            approx_batch_size += static_cast<uint32_t>(scratch.size()) + 1;
+          }
+          col.string_indices.resize(num_rows);
+          col.string_indices.push_back(*id);
+          approx_batch_size += sizeof(uint32_t);
+          break;
+        }
+        case SqlValue::Type::kBytes: {
+          cell_type = BatchProto::CELL_BLOB;
+          auto* src = static_cast<const char*>(value.bytes_value);
+          col.blobs.resize(num_rows);
+          col.blobs.emplace_back(src, value.bytes_count);
+          approx_batch_size += static_cast<uint32_t>(value.bytes_count) + 4;
+          break;
+        }
+      }
+      PERFETTO_DCHECK(cell_type != BatchProto::CELL_INVALID);
+      col.cell_types.push_back(cell_type);
+      col.types_seen |= 1u << cell_type;
+    }
+    col_ = num_cols_;
+  }
+
+  auto* batch = res->add_columnar_batch();
+  batch->set_num_rows(num_rows);
+  for (ColumnBuffer& col : columns) {
+    if (num_rows == 0)
+      break;
+    auto* column = batch->add_columns();
+    if (col.types_seen & (1u << BatchProto::CELL_NULL)) {
+      std::vector<uint8_t> null_bitmap((num_rows + 7) / 8);
+      for (uint32_t r = 0; r < num_rows; ++r) {
+        if (col.cell_types[r] == BatchProto::CELL_NULL)
+          null_bitmap[r / 8] |= static_cast<uint8_t>(1u << (r % 8));
+      }
+      column->set_null_bitmap(null_bitmap.data(), null_bitmap.size());
+    }
+    if (!col.longs.empty()) {
+      col.longs.resize(num_rows);
+      AppendAligned(column, ColumnProto::kLongValuesFieldNumber,
+                    kColumnPaddingFieldId, col.longs.data(),
+                    num_rows * static_cast<uint32_t>(sizeof(int64_t)));
+    }
+    if (!col.doubles.empty()) {
+      col.doubles.resize(num_rows);
+      AppendAligned(column, ColumnProto::kDoubleValuesFieldNumber,
+                    kColumnPaddingFieldId, col.doubles.data(),
+                    num_rows * static_cast<uint32_t>(sizeof(double)));
+    }
+    if (!col.string_indices.empty()) {
+      col.string_indices.resize(num_rows);
+      column->set_string_dict(col.string_dict);
+      AppendAligned(column, ColumnProto::kStringIndicesFieldNumber,
+                    kColumnPaddingFieldId, col.string_indices.data(),
+                    num_rows * static_cast<uint32_t>(sizeof(uint32_t)));
+    }
+    if (!col.blobs.empty()) {
+      col.blobs.resize(num_rows);
+      for (const std::string& blob : col.blobs)
+        column->add_blob_values(blob);
+    }
+
+    // Columns holding a single type of value (plus NULLs) don't need the type
+    // of each cell.
+    uint32_t value_types = col.types_seen & ~(1u << BatchProto::CELL_NULL);
+    if (value_types & (value_types - 1)) {
+      column->set_cell_types(col.cell_types.data(), col.cell_types.size());
+    }
+  }
+
+  // If this is the last batch, write the EOF field.
+  if (!batch_full) {
+    eof_reached_ = true;
+    batch->set_is_last_batch(true);
+  }
+  batch->Finalize();
+}
+
 void QueryResultSerializer::MaybeSerializeError(
     protos::pbzero::QueryResult* res) {
   if (iter_->Status().ok())
@@ -32,14 +32,20 @@ bool IsBenchmarkFunctionalOnly() {
   return getenv("BENCHMARK_FUNCTIONAL_TEST_ONLY") != nullptr;
 }
 
+// The third argument selects the QueryResultSerializer::Format.
 void BenchmarkArgs(benchmark::internal::Benchmark* b) {
   if (IsBenchmarkFunctionalOnly()) {
-    b->Ranges({{1024, 1024}, {4096, 4096}});
+    b->Ranges({{1024, 1024}, {4096, 4096}, {0, 1}});
   } else {
-    b->RangeMultiplier(8)->Ranges({{128, 8192}, {4096, 1024 * 512}});
+    b->RangeMultiplier(8)->Ranges({{128, 8192}, {4096, 1024 * 512}, {0, 1}});
   }
 }
 
+QueryResultSerializer::Format GetFormat(const benchmark::State& state) {
+  return state.range(2) ? QueryResultSerializer::Format::kColumnarBatch
+                        : QueryResultSerializer::Format::kCellsBatch;
+}
+
 void RunQueryChecked(TraceProcessor* tp, const std::string& query) {
   auto iter = tp->ExecuteQuery(query);
   iter.Next();
@@ -58,7 +64,7 @@ static void BM_QueryResultSerializer_Mixed(benchmark::State& state) {
   for (auto _ : state) {
     auto iter = tp->ExecuteQuery(
         "select dur || dur as x, ts, dur * 1.0 as dur, quantum_ts from win");
-    QueryResultSerializer serializer(std::move(iter));
+    QueryResultSerializer serializer(std::move(iter), GetFormat(state));
     serializer.set_batch_size_for_testing(
         static_cast<uint32_t>(state.range(0)),
         static_cast<uint32_t>(state.range(1)));
@@ -80,7 +86,30 @@ static void BM_QueryResultSerializer_Strings(benchmark::State& state) {
   for (auto _ : state) {
     auto iter = tp->ExecuteQuery(
         "select  ts || '-' || ts , (dur * 1.0) || dur from win");
-    QueryResultSerializer serializer(std::move(iter));
+    QueryResultSerializer serializer(std::move(iter), GetFormat(state));
+    serializer.set_batch_size_for_testing(
+        static_cast<uint32_t>(state.range(0)),
+        static_cast<uint32_t>(state.range(1)));
+    while (serializer.Serialize(&buf)) {
+    }
+    benchmark::DoNotOptimize(buf.data());
+    buf.clear();
+  }
+  benchmark::ClobberMemory();
+}
+
+// Strings with few distinct values, as for thread or slice names.
+static void BM_QueryResultSerializer_RepeatedStrings(benchmark::State& state) {
+  auto tp = TraceProcessor::CreateInstance(Config());
+  RunQueryChecked(tp.get(), "create virtual table win using window;");
+  RunQueryChecked(tp.get(),
+                  "update win set window_start=0, window_dur=100000, quantum=1 "
+                  "where rowid = 0");
+  VectorType buf;
+  for (auto _ : state) {
+    auto iter = tp->ExecuteQuery(
+        "select 'thread_' || (ts % 64) as name, ts, dur from win");
+    QueryResultSerializer serializer(std::move(iter), GetFormat(state));
     serializer.set_batch_size_for_testing(
         static_cast<uint32_t>(state.range(0)),
         static_cast<uint32_t>(state.range(1)));
@@ -94,3 +123,4 @@ static void BM_QueryResultSerializer_Strings(benchmark::State& state) {
 
 BENCHMARK(BM_QueryResultSerializer_Mixed)->Apply(BenchmarkArgs);
 BENCHMARK(BM_QueryResultSerializer_Strings)->Apply(BenchmarkArgs);
+BENCHMARK(BM_QueryResultSerializer_RepeatedStrings)->Apply(BenchmarkArgs);
@@ -24,6 +24,7 @@
 #include <vector>
 
 #include "perfetto/ext/base/string_utils.h"
+#include "perfetto/protozero/scattered_heap_buffer.h"
 #include "perfetto/trace_processor/basic_types.h"
 #include "perfetto/trace_processor/trace_processor.h"
 #include "test/gtest_and_gmock.h"
@@ -91,6 +92,10 @@ class TestDeserializer {
   bool eof_reached = false;
 
  private:
+  void DeserializeColumnarBatch(protozero::ConstBytes batch_bytes);
+  SqlValue CopyString(const std::string&);
+  SqlValue CopyBytes(const std::string&);
+
   std::vector<std::unique_ptr<char[]>> copied_buf_;
 };
 
@@ -111,6 +116,10 @@ void TestDeserializer::DeserializeBuffer(const uint8_t* start, size_t size) {
   for (auto it = result.column_names(); it; ++it)
     columns.push_back(it->as_std_string());
 
+  for (auto batch_it = result.columnar_batch(); batch_it; ++batch_it) {
+    DeserializeColumnarBatch(batch_it->as_bytes());
+  }
+
   for (auto batch_it = result.batch(); batch_it; ++batch_it) {
     ASSERT_FALSE(eof_reached);
     auto batch_bytes = batch_it->as_bytes();
@@ -193,6 +202,118 @@ void TestDeserializer::DeserializeBuffer(const uint8_t* start, size_t size) {
   }
 }
 
+SqlValue TestDeserializer::CopyString(const std::string& str) {
+  copied_buf_.emplace_back(new char[str.size() + 1]);
+  memcpy(copied_buf_.back().get(), str.c_str(), str.size() + 1);
+  return SqlValue::String(copied_buf_.back().get());
+}
+
+SqlValue TestDeserializer::CopyBytes(const std::string& bytes) {
+  copied_buf_.emplace_back(new char[bytes.size()]);
+  memcpy(copied_buf_.back().get(), bytes.data(), bytes.size());
+  return SqlValue::Bytes(copied_buf_.back().get(), bytes.size());
+}
+
+void TestDeserializer::DeserializeColumnarBatch(
+    protozero::ConstBytes batch_bytes) {
+  ASSERT_FALSE(eof_reached);
+  ResultProto::ColumnarBatch::Decoder batch(batch_bytes.data, batch_bytes.size);
+  eof_reached = batch.is_last_batch();
+  const uint32_t num_rows = batch.num_rows();
+
+  // Row-major cells of this batch.
+  std::vector<SqlValue> batch_cells(num_rows * columns.size());
+  uint32_t col = 0;
+  for (auto col_it = batch.columns(); col_it; ++col_it, ++col) {
+    ASSERT_LT(col, columns.size());
+    auto col_bytes = col_it->as_bytes();
+    ResultProto::ColumnarBatch::Column::Decoder column(col_bytes.data,
+                                                       col_bytes.size);
+
+    auto array = [&](protozero::ConstBytes bytes, size_t elem_size) {
+      EXPECT_EQ(bytes.size, num_rows * elem_size);
+      return bytes.data;
+    };
+    const uint8_t* longs = nullptr;
+    if (column.has_long_values())
+      longs = array(column.long_values(), sizeof(int64_t));
+    const uint8_t* doubles = nullptr;
+    if (column.has_double_values())
+      doubles = array(column.double_values(), sizeof(double));
+    const uint8_t* string_indices = nullptr;
+    std::vector<std::string> dict;
+    if (column.has_string_indices()) {
+      string_indices = array(column.string_indices(), sizeof(uint32_t));
+      std::string merged = column.string_dict().ToStdString();
+      for (size_t pos = 0; pos < merged.size();) {
+        size_t next_sep = merged.find('\0', pos);
+        dict.emplace_back(merged.substr(pos, next_sep - pos));
+        pos = next_sep + 1;
+      }
+    }
+    std::vector<std::string> blobs;
+    for (auto it = column.blob_values(); it; ++it)
+      blobs.emplace_back((*it).ToStdString());
+    ASSERT_TRUE(blobs.empty() || blobs.size() == num_rows);
+
+    std::string cell_types = column.cell_types().ToStdString();
+    std::string null_bitmap = column.null_bitmap().ToStdString();
+    for (uint32_t row = 0; row < num_rows; ++row) {
+      uint8_t cell_type = BatchProto::CELL_INVALID;
+      if (!cell_types.empty()) {
+        cell_type = static_cast<uint8_t>(cell_types[row]);
+      } else if (!null_bitmap.empty() &&
+                 (null_bitmap[row / 8] & (1 << (row % 8)))) {
+        cell_type = BatchProto::CELL_NULL;
+      } else if (longs) {
+        cell_type = BatchProto::CELL_VARINT;
+      } else if (doubles) {
+        cell_type = BatchProto::CELL_FLOAT64;
+      } else if (string_indices) {
+        cell_type = BatchProto::CELL_STRING;
+      } else if (!blobs.empty()) {
+        cell_type = BatchProto::CELL_BLOB;
+      }
+
+      SqlValue& value = batch_cells[row * columns.size() + col];
+      switch (cell_type) {
+        case BatchProto::CELL_NULL:
+          break;
+        case BatchProto::CELL_VARINT: {
+          ASSERT_TRUE(longs);
+          int64_t v;
+          memcpy(&v, longs + row * sizeof(int64_t), sizeof(v));
+          value = SqlValue::Long(v);
+          break;
+        }
+        case BatchProto::CELL_FLOAT64: {
+          ASSERT_TRUE(doubles);
+          double v;
+          memcpy(&v, doubles + row * sizeof(double), sizeof(v));
+          value = SqlValue::Double(v);
+          break;
+        }
+        case BatchProto::CELL_STRING: {
+          ASSERT_TRUE(string_indices);
+          uint32_t idx;
+          memcpy(&idx, string_indices + row * sizeof(uint32_t), sizeof(idx));
+          ASSERT_LT(idx, dict.size());
+          value = CopyString(dict[idx]);
+          break;
+        }
+        case BatchProto::CELL_BLOB:
+          ASSERT_FALSE(blobs.empty());
+          value = CopyBytes(blobs[row]);
+          break;
+        default:
+          FAIL() << "Unknown cell type " << cell_type;
+      }
+    }
+  }
+  ASSERT_TRUE(num_rows == 0 || col == columns.size());
+  cells.insert(cells.end(), batch_cells.begin(), batch_cells.end());
+}
+
 TEST(QueryResultSerializerTest, ShortBatch) {
   auto tp = TraceProcessor::CreateInstance(trace_processor::Config());
 
@@ -428,6 +549,35 @@ TEST(QueryResultSerializerTest, ErrorAfterSomeResults) {
   EXPECT_TRUE(deser.eof_reached);
 }
 
+TEST(QueryResultSerializerTest, Cancel) {
+  auto tp = TraceProcessor::CreateInstance(trace_processor::Config());
+  auto iter = tp->ExecuteQuery(
+      "with recursive c(x) as (select 1 union all select x + 1 from c) "
+      "select x from c");
+  QueryResultSerializer ser(std::move(iter));
+  ser.set_batch_size_for_testing(4, 4096);
+  TestDeserializer deser;
+  std::vector<uint8_t> buf;
+  ASSERT_TRUE(ser.Serialize(&buf));
+  deser.DeserializeBuffer(buf.data(), buf.size());
+  EXPECT_FALSE(deser.eof_reached);
+
+  protozero::HeapBuffered<ResultProto> result;
+  ser.Cancel(result.get(), "Query cancelled");
+  buf = result.SerializeAsArray();
+  deser.DeserializeBuffer(buf.data(), buf.size());
+  EXPECT_EQ(deser.error, "Query cancelled");
+  EXPECT_THAT(deser.cells,
+              ElementsAre(SqlValue::Long(1), SqlValue::Long(2),
+                          SqlValue::Long(3), SqlValue::Long(4)));
+  EXPECT_EQ(deser.columns, std::vector<std::string>{"x"});
+  EXPECT_TRUE(deser.eof_reached);
+
+  // The trace processor can run other queries.
+  iter = tp->ExecuteQuery("select 1");
+  ASSERT_TRUE(iter.Next());
+}
+
 TEST(QueryResultSerializerTest, NoResultQuery) {
   auto tp = TraceProcessor::CreateInstance(trace_processor::Config());
   {
@@ -452,6 +602,130 @@ TEST(QueryResultSerializerTest, NoResultQuery) {
   }
 }
 
+TEST(QueryResultSerializerTest, ColumnarShortBatch) {
+  auto tp = TraceProcessor::CreateInstance(trace_processor::Config());
+
+  auto iter = tp->ExecuteQuery(
+      "select 1 as i8, 42001001001 as i64, 1e9 as f64, NULL as n, "
+      "'a_string' as str, cast('a_blob' as blob) as blb");
+  QueryResultSerializer ser(std::move(iter),
+                            QueryResultSerializer::Format::kColumnarBatch);
+  TestDeserializer deser;
+  deser.SerializeAndDeserialize(&ser);
+
+  EXPECT_THAT(deser.columns,
+              ElementsAre("i8", "i64", "f64", "n", "str", "blb"));
+  EXPECT_THAT(deser.cells,
+              ElementsAre(SqlValue::Long(1), SqlValue::Long(42001001001),
+                          SqlValue::Double(1e9), SqlValue(),
+                          SqlValue::String("a_string"),
+                          SqlValue::Bytes("a_blob", 6)));
+}
+
+TEST(QueryResultSerializerTest, ColumnarDictionaryEncodesStrings) {
+  auto tp = TraceProcessor::CreateInstance(trace_processor::Config());
+
+  RunQueryChecked(tp.get(), "create virtual table win using window;");
+  RunQueryChecked(tp.get(),
+                  "update win set window_start=0, window_dur=1000, quantum=1 "
+                  "where rowid = 0");
+  auto iter = tp->ExecuteQuery(
+      "select iif(ts % 3 = 0, 'fizz', 'buzz') as s, ts from win");
+  QueryResultSerializer ser(std::move(iter),
+                            QueryResultSerializer::Format::kColumnarBatch);
+
+  std::vector<uint8_t> buf;
+  ASSERT_FALSE(ser.Serialize(&buf));
+  ResultProto::Decoder result(buf.data(), buf.size());
+  ResultProto::ColumnarBatch::Decoder batch(*result.columnar_batch());
+  EXPECT_EQ(batch.num_rows(), 1000u);
+  auto column_it = batch.columns();
+  ResultProto::ColumnarBatch::Column::Decoder strings(*column_it);
+  EXPECT_EQ(strings.string_dict().ToStdString(),
+            std::string("fizz\0buzz\0", 10));
+  EXPECT_EQ(strings.string_indices().size, 1000 * sizeof(uint32_t));
+  EXPECT_FALSE(strings.has_null_bitmap());
+  EXPECT_FALSE(strings.has_cell_types());
+  ResultProto::ColumnarBatch::Column::Decoder longs(*++column_it);
+  EXPECT_EQ(longs.long_values().size, 1000 * sizeof(int64_t));
+
+  // The arrays can be accessed in place as typed arrays.
+  EXPECT_EQ((strings.string_indices().data - buf.data()) % 8, 0);
+  EXPECT_EQ((longs.long_values().data - buf.data()) % 8, 0);
+}
+
+TEST(QueryResultSerializerTest, ColumnarMatchesCells) {
+  auto tp = TraceProcessor::CreateInstance(trace_processor::Config());
+  RunQueryChecked(tp.get(), "create table tab (a, b, c);");
+
+  // Column a is all longs or NULL, b mixes all types and c is all strings.
+  std::minstd_rand0 rnd_engine(0);
+  std::string insert_values;
+  for (uint32_t i = 0; i < 1000; i++) {
+    std::string a = rnd_engine() % 4 == 0 ? "NULL" : std::to_string(i);
+    std::string b;
+    switch (rnd_engine() % 5) {
+      case 0:
+        b = "NULL";
+        break;
+      case 1:
+        b = std::to_string(rnd_engine());
+        break;
+      case 2:
+        b = std::to_string(rnd_engine()) + ".5";
+        break;
+      case 3:
+        b = "'str" + std::to_string(rnd_engine() % 10) + "'";
+        break;
+      case 4:
+        b = "X'" + base::ToHex(std::to_string(rnd_engine())) + "'";
+        break;
+    }
+    std::string c = "'s" + std::to_string(rnd_engine() % 7) + "'";
+    insert_values += "(" + a + "," + b + "," + c + "),";
+  }
+  insert_values.back() = ';';
+  RunQueryChecked(tp.get(), "insert into tab (a,b,c) values " + insert_values);
+
+  TestDeserializer expected;
+  {
+    QueryResultSerializer ser(tp->ExecuteQuery("select * from tab"));
+    expected.SerializeAndDeserialize(&ser);
+  }
+  ASSERT_EQ(expected.cells.size(), 3000u);
+
+  // Serialize with different batch and payload sizes.
+  for (int rep = 0; rep < 10; rep++) {
+    QueryResultSerializer ser(tp->ExecuteQuery("select * from tab"),
+                              QueryResultSerializer::Format::kColumnarBatch);
+    uint32_t cells_per_batch = 1 << (rnd_engine() % 8 + 2);
+    uint32_t binary_payload_size = 1 << (rnd_engine() % 8 + 8);
+    ser.set_batch_size_for_testing(cells_per_batch, binary_payload_size);
+    TestDeserializer deser;
+    deser.SerializeAndDeserialize(&ser);
+    ASSERT_THAT(deser.columns, ElementsAre("a", "b", "c"));
+    ASSERT_EQ(deser.cells.size(), expected.cells.size());
+    for (size_t i = 0; i < expected.cells.size(); i++) {
+      EXPECT_EQ(deser.cells[i], expected.cells[i]) << "Cell " << i;
+    }
+  }
+}
+
+TEST(QueryResultSerializerTest, ColumnarErrorAfterSomeResults) {
+  auto tp = TraceProcessor::CreateInstance(trace_processor::Config());
+  RunQueryChecked(tp.get(), "create table tab (x)");
+  RunQueryChecked(tp.get(), "insert into tab (x) values (0), (1), ('error')");
+  auto iter = tp->ExecuteQuery("select str_split('a;b', ';', x) as s from tab");
+  QueryResultSerializer ser(std::move(iter),
+                            QueryResultSerializer::Format::kColumnarBatch);
+  TestDeserializer deser;
+  deser.SerializeAndDeserialize(&ser);
+  EXPECT_NE(deser.error, "");
+  EXPECT_THAT(deser.cells,
+              ElementsAre(SqlValue::String("a"), SqlValue::String("b")));
+  EXPECT_TRUE(deser.eof_reached);
+}
+
 }  // namespace
 }  // namespace trace_processor
 }  // namespace perfetto
@@ -18,8 +18,12 @@
 
 #include <string.h>
 
+#include <algorithm>
+#include <deque>
+#include <memory>
 #include <vector>
 
+#include "perfetto/base/build_config.h"
 #include "perfetto/base/logging.h"
 #include "perfetto/base/time.h"
 #include "perfetto/ext/base/utils.h"
@@ -33,12 +37,21 @@
 
 #include "protos/perfetto/trace_processor/trace_processor.pbzero.h"
 
+#if !PERFETTO_BUILDFLAG(PERFETTO_OS_WASM)
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#endif
+
 namespace perfetto {
 namespace trace_processor {
 
 namespace {
 // Writes a "Loading trace ..." update every N bytes.
 constexpr size_t kProgressUpdateBytes = 50 * 1000 * 1000;
+// With set_pipelined_append(), appending blocks when the data not parsed yet
+// exceeds this.
+constexpr size_t kMaxPipelinedAppendBytes = 128 * 1024 * 1024;
 using TraceProcessorRpcStream = protos::pbzero::TraceProcessorRpcStream;
 using RpcProto = protos::pbzero::TraceProcessorRpc;
 
@@ -48,6 +61,21 @@ using RpcProto = protos::pbzero::TraceProcessorRpc;
 constexpr auto kSliceSize =
     QueryResultSerializer::kDefaultBatchSplitThreshold + 4096;
 
+QueryResultSerializer::Format GetResultFormat(const uint8_t* args,
+                                              size_t len) {
+  protos::pbzero::QueryArgs::Decoder query(args, len);
+  if (query.result_format() == protos::pbzero::QueryArgs::COLUMNAR_BATCH)
+    return QueryResultSerializer::Format::kColumnarBatch;
+  return QueryResultSerializer::Format::kCellsBatch;
+}
+
+// Returns the stricter of two QueryBudget limits, where 0 means no limit.
+uint64_t StricterLimit(uint64_t a, uint64_t b) {
+  if (!a || !b)
+    return a ? a : b;
+  return std::min(a, b);
+}
+
 // Holds a trace_processor::TraceProcessorRpc pbzero message. Avoids extra
 // copies by doing direct scattered calls from the fragmented heap buffer onto
 // the RpcResponseFunction (the receiver is expected to deal with arbitrary
@@ -88,8 +116,106 @@ void Response::Send(Rpc::RpcResponseFunction send_fn) {
 
 }  // namespace
 
+#if PERFETTO_BUILDFLAG(PERFETTO_OS_WASM)
+// Wasm builds always parse synchronously (see set_pipelined_append()).
+class Rpc::ParserThread {};
+#else
+// Parses the data appended with set_pipelined_append() in order, on a
+// dedicated thread.
+class Rpc::ParserThread {
+ public:
+  ParserThread() : thread_(&ParserThread::Run, this) {}
+
+  // Parses the data still queued before returning.
+  ~ParserThread() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      quit_ = true;
+    }
+    cv_.notify_all();
+    thread_.join();
+  }
+
+  // Queues |data| to be parsed by |tp|. Blocks while more than
+  // kMaxPipelinedAppendBytes are waiting to be parsed.
+  void Enqueue(TraceProcessor* tp,
+               std::unique_ptr<uint8_t[]> data,
+               size_t len) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock,
+             [this] { return pending_bytes_ < kMaxPipelinedAppendBytes; });
+    pending_bytes_ += len;
+    queue_.push_back(Chunk{tp, std::move(data), len});
+    cv_.notify_all();
+  }
+
+  // Blocks until all the queued data has been parsed.
+  void Wait() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this] { return pending_bytes_ == 0; });
+  }
+
+  // Returns the first parsing error since the previous call, if any.
+  util::Status TakeStatus() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    util::Status status = std::move(status_);
+    status_ = util::OkStatus();
+    return status;
+  }
+
+  // The bytes queued and not parsed yet.
+  size_t pending_bytes() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return pending_bytes_;
+  }
+
+ private:
+  struct Chunk {
+    TraceProcessor* tp = nullptr;
+    std::unique_ptr<uint8_t[]> data;
+    size_t len = 0;
+  };
+
+  void Run() {
+    for (;;) {
+      Chunk chunk;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this] { return quit_ || !queue_.empty(); });
+        if (queue_.empty())
+          return;
+        chunk = std::move(queue_.front());
+        queue_.pop_front();
+      }
+      util::Status status = chunk.tp->Parse(std::move(chunk.data), chunk.len);
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!status.ok() && status_.ok())
+          status_ = std::move(status);
+        // Only decremented now, so that Wait() also waits for |chunk|.
+        pending_bytes_ -= chunk.len;
+      }
+      cv_.notify_all();
+    }
+  }
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<Chunk> queue_;
+  size_t pending_bytes_ = 0;
+  util::Status status_;
+  bool quit_ = false;
+  std::thread thread_;
+};
+#endif  // PERFETTO_BUILDFLAG(PERFETTO_OS_WASM)
+
 Rpc::Rpc(std::unique_ptr<TraceProcessor> preloaded_instance)
     : trace_processor_(std::move(preloaded_instance)) {
+  // A preloaded instance (e.g. trace_processor_shell --httpd trace_file) has
+  // already been through NotifyEndOfFile(). |eof_| is left untouched so that
+  // Parse() keeps not resetting such an instance (the Config it was created
+  // with is not known here).
+  trace_finalized_ = trace_processor_ != nullptr;
   if (!trace_processor_)
     ResetTraceProcessorInternal(Config());
 }
@@ -98,10 +224,15 @@ Rpc::Rpc() : Rpc(nullptr) {}
 Rpc::~Rpc() = default;
 
 void Rpc::ResetTraceProcessorInternal(const Config& config) {
+  // The query must be completed before the trace processor goes away.
+  PERFETTO_DCHECK(!streaming_query_);
+  WaitForPipelinedParse();
+  // The errors of the previous trace are not relevant anymore.
+  TakePipelinedParseStatus();
   trace_processor_config_ = config;
   trace_processor_ = TraceProcessor::CreateInstance(config);
+  trace_finalized_ = false;
   bytes_parsed_ = bytes_last_progress_ = 0;
-  t_parse_started_ = base::GetWallTimeNs().count();
   // Deliberately not resetting the RPC channel state (rxbuf_, {tx,rx}_seq_id_).
   // This is invoked from the same client to clear the current trace state
   // before loading a new one. The IPC channel is orthogonal to that and the
@@ -178,6 +309,17 @@ void Rpc::ParseRpcRequest(const uint8_t* data, size_t len) {
 
   // The static cast is to prevent that the compiler breaks future proofness.
   const int req_type = static_cast<int>(req.request());
+
+  // The responses of a request are sent only once the result of the previous
+  // query has been sent in full, unless the request cancels it.
+  if (req_type == RpcProto::TPM_CANCEL_QUERY) {
+    CancelStreamingQuery();
+  } else {
+    FinishStreamingQuery();
+  }
+  if (req_type != RpcProto::TPM_APPEND_TRACE_DATA)
+    WaitForPipelinedParse();
+
   static const char kErrFieldNotSet[] = "RPC error: request field not set";
   switch (req_type) {
     case RpcProto::TPM_APPEND_TRACE_DATA: {
@@ -187,16 +329,28 @@ void Rpc::ParseRpcRequest(const uint8_t* data, size_t len) {
         result->set_error(kErrFieldNotSet);
       } else {
         protozero::ConstBytes byte_range = req.append_trace_data();
-        util::Status res = Parse(byte_range.data, byte_range.size);
+        util::Status res;
+        if (pipelined_append_) {
+          res = ParsePipelined(byte_range.data, byte_range.size);
+        } else {
+          res = Parse(byte_range.data, byte_range.size);
+        }
         if (!res.ok()) {
           result->set_error(res.message());
         }
+        result->set_total_bytes_parsed(
+            static_cast<int64_t>(GetBytesParsed()));
+        result->set_bytes_per_sec(GetParseRate());
       }
       resp.Send(rpc_response_fn_);
       break;
     }
     case RpcProto::TPM_FINALIZE_TRACE_DATA: {
       Response resp(tx_seq_id_++, req_type);
+      util::Status res = TakePipelinedParseStatus();
+      if (!res.ok()) {
+        resp->set_append_result()->set_error(res.message());
+      }
       NotifyEndOfFile();
       resp.Send(rpc_response_fn_);
       break;
@@ -209,16 +363,18 @@ void Rpc::ParseRpcRequest(const uint8_t* data, size_t len) {
         resp.Send(rpc_response_fn_);
       } else {
         protozero::ConstBytes args = req.query_args();
-        auto it = QueryInternal(args.data, args.size);
-        QueryResultSerializer serializer(std::move(it));
-        for (bool has_more = true; has_more;) {
-          Response resp(tx_seq_id_++, req_type);
-          has_more = serializer.Serialize(resp->set_query_result());
-          resp.Send(rpc_response_fn_);
-        }
+        streaming_query_ = StartQuery(args.data, args.size);
+        StepStreamingQuery();
+        if (!incremental_query_streaming_)
+          FinishStreamingQuery();
       }
       break;
     }
+    case RpcProto::TPM_CANCEL_QUERY: {
+      Response resp(tx_seq_id_++, req_type);
+      resp.Send(rpc_response_fn_);
+      break;
+    }
     case RpcProto::TPM_COMPUTE_METRIC: {
       Response resp(tx_seq_id_++, req_type);
       auto* result = resp->set_metric_result();
@@ -289,6 +445,7 @@ void Rpc::ParseRpcRequest(const uint8_t* data, size_t len) {
 }
 
 util::Status Rpc::Parse(const uint8_t* data, size_t len) {
+  WaitForPipelinedParse();
   PERFETTO_TP_TRACE(
       metatrace::Category::API_TIMELINE, "RPC_PARSE",
       [&](metatrace::Record* r) { r->AddArg("length", std::to_string(len)); });
@@ -299,6 +456,12 @@ util::Status Rpc::Parse(const uint8_t* data, size_t len) {
   }
 
   eof_ = false;
+  trace_finalized_ = false;
+  // The parse rate is measured from the first bytes of the trace: the trace
+  // processor can be created long before (e.g. the instance passed to the
+  // constructor by trace_processor_shell --httpd).
+  if (bytes_parsed_ == 0)
+    t_parse_started_ = base::GetWallTimeNs().count();
   bytes_parsed_ += len;
   MaybePrintProgress();
 
@@ -314,9 +477,11 @@ util::Status Rpc::Parse(const uint8_t* data, size_t len) {
 void Rpc::NotifyEndOfFile() {
   PERFETTO_TP_TRACE(metatrace::Category::API_TIMELINE,
                     "RPC_NOTIFY_END_OF_FILE");
+  WaitForPipelinedParse();
 
   trace_processor_->NotifyEndOfFile();
   eof_ = true;
+  trace_finalized_ = true;
   MaybePrintProgress();
 }
 
@@ -346,31 +511,122 @@ void Rpc::ResetTraceProcessor(const uint8_t* args, size_t len) {
 void Rpc::MaybePrintProgress() {
   if (eof_ || bytes_parsed_ - bytes_last_progress_ > kProgressUpdateBytes) {
     bytes_last_progress_ = bytes_parsed_;
-    auto t_load_s =
-        static_cast<double>(base::GetWallTimeNs().count() - t_parse_started_) /
-        1e9;
     fprintf(stderr, "\rLoading trace %.2f MB (%.1f MB/s)%s",
-            static_cast<double>(bytes_parsed_) / 1e6,
-            static_cast<double>(bytes_parsed_) / 1e6 / t_load_s,
+            static_cast<double>(GetBytesParsed()) / 1e6, GetParseRate() / 1e6,
             (eof_ ? "\n" : ""));
     fflush(stderr);
   }
 }
 
+size_t Rpc::GetBytesParsed() {
+#if !PERFETTO_BUILDFLAG(PERFETTO_OS_WASM)
+  // |bytes_parsed_| also counts the data queued for the parser thread.
+  if (parser_thread_)
+    return bytes_parsed_ - parser_thread_->pending_bytes();
+#endif
+  return bytes_parsed_;
+}
+
+double Rpc::GetParseRate() {
+  auto t_load_s =
+      static_cast<double>(base::GetWallTimeNs().count() - t_parse_started_) /
+      1e9;
+  return t_load_s > 0 ? static_cast<double>(GetBytesParsed()) / t_load_s : 0;
+}
+
+util::Status Rpc::ParsePipelined(const uint8_t* data, size_t len) {
+#if PERFETTO_BUILDFLAG(PERFETTO_OS_WASM)
+  return Parse(data, len);
+#else
+  PERFETTO_TP_TRACE(
+      metatrace::Category::API_TIMELINE, "RPC_PARSE_PIPELINED",
+      [&](metatrace::Record* r) { r->AddArg("length", std::to_string(len)); });
+  if (eof_) {
+    // See Parse().
+    ResetTraceProcessorInternal(trace_processor_config_);
+  }
+
+  eof_ = false;
+  trace_finalized_ = false;
+  if (bytes_parsed_ == 0)
+    t_parse_started_ = base::GetWallTimeNs().count();
+  bytes_parsed_ += len;
+  MaybePrintProgress();
+
+  if (len > 0) {
+    if (!parser_thread_)
+      parser_thread_ = std::make_unique<ParserThread>();
+    std::unique_ptr<uint8_t[]> data_copy(new uint8_t[len]);
+    memcpy(data_copy.get(), data, len);
+    parser_thread_->Enqueue(trace_processor_.get(), std::move(data_copy), len);
+  }
+  return TakePipelinedParseStatus();
+#endif
+}
+
+void Rpc::WaitForPipelinedParse() {
+#if !PERFETTO_BUILDFLAG(PERFETTO_OS_WASM)
+  if (parser_thread_)
+    parser_thread_->Wait();
+#endif
+}
+
+util::Status Rpc::TakePipelinedParseStatus() {
+#if !PERFETTO_BUILDFLAG(PERFETTO_OS_WASM)
+  if (parser_thread_)
+    return parser_thread_->TakeStatus();
+#endif
+  return util::OkStatus();
+}
+
+void Rpc::StepStreamingQuery() {
+  PERFETTO_CHECK(streaming_query_);
+  Response resp(tx_seq_id_++, RpcProto::TPM_QUERY_STREAMING);
+  bool has_more = streaming_query_->Serialize(resp->set_query_result());
+  resp.Send(rpc_response_fn_);
+  if (!has_more)
+    streaming_query_.reset();
+}
+
+void Rpc::FinishStreamingQuery() {
+  while (streaming_query_)
+    StepStreamingQuery();
+}
+
+void Rpc::DropStreamingQuery() {
+  streaming_query_.reset();
+}
+
+void Rpc::CancelStreamingQuery() {
+  if (!streaming_query_)
+    return;
+  Response resp(tx_seq_id_++, RpcProto::TPM_QUERY_STREAMING);
+  streaming_query_->Cancel(resp->set_query_result(), "Query cancelled");
+  resp.Send(rpc_response_fn_);
+  streaming_query_.reset();
+}
+
 void Rpc::Query(const uint8_t* args,
                 size_t len,
                 QueryResultBatchCallback result_callback) {
-  auto it = QueryInternal(args, len);
-  QueryResultSerializer serializer(std::move(it));
+  std::unique_ptr<QueryResultSerializer> serializer = StartQuery(args, len);
 
   std::vector<uint8_t> res;
   for (bool has_more = true; has_more;) {
-    has_more = serializer.Serialize(&res);
+    has_more = serializer->Serialize(&res);
     result_callback(res.data(), res.size(), has_more);
     res.clear();
   }
 }
 
+std::unique_ptr<QueryResultSerializer> Rpc::StartQuery(const uint8_t* args,
+                                                       size_t len) {
+  WaitForPipelinedParse();
+  auto it = QueryInternal(args, len);
+  return std::make_unique<QueryResultSerializer>(std::move(it),
+                                                 GetResultFormat(args, len));
+}
+
 Iterator Rpc::QueryInternal(const uint8_t* args, size_t len) {
   protos::pbzero::QueryArgs::Decoder query(args, len);
   std::string sql = query.sql_query().ToStdString();
@@ -383,14 +639,29 @@ Iterator Rpc::QueryInternal(const uint8_t* args, size_t len) {
                       }
                     });
 
+  // The client can only make the limits of the server stricter.
+  QueryBudget budget;
+  budget.timeout_ms =
+      StricterLimit(query_budget_.timeout_ms, query.timeout_ms());
+  budget.max_memory_bytes =
+      StricterLimit(query_budget_.max_memory_bytes, query.max_memory_bytes());
+  if (budget.timeout_ms || budget.max_memory_bytes)
+    return trace_processor_->ExecuteQueryWithBudget(sql, budget);
   return trace_processor_->ExecuteQuery(sql.c_str());
 }
 
+bool Rpc::IsReadOnlyQuery(const std::string& sql) {
+  WaitForPipelinedParse();
+  return trace_processor_->IsReadOnlyQuery(sql);
+}
+
 void Rpc::RestoreInitialTables() {
+  WaitForPipelinedParse();
   trace_processor_->RestoreInitialTables();
 }
 
 std::vector<uint8_t> Rpc::ComputeMetric(const uint8_t* args, size_t len) {
+  WaitForPipelinedParse();
   protozero::HeapBuffered<protos::pbzero::ComputeMetricResult> result;
   ComputeMetricInternal(args, len, result.get());
   return result.SerializeAsArray();
@@ -456,6 +727,7 @@ void Rpc::ComputeMetricInternal(const uint8_t* data,
 }
 
 void Rpc::EnableMetatrace(const uint8_t* data, size_t len) {
+  WaitForPipelinedParse();
   using protos::pbzero::MetatraceCategories;
   TraceProcessor::MetatraceConfig config;
   protos::pbzero::EnableMetatraceArgs::Decoder args(data, len);
@@ -465,6 +737,7 @@ void Rpc::EnableMetatrace(const uint8_t* data, size_t len) {
 }
 
 std::vector<uint8_t> Rpc::DisableAndReadMetatrace() {
+  WaitForPipelinedParse();
   protozero::HeapBuffered<protos::pbzero::DisableAndReadMetatraceResult> result;
   DisableAndReadMetatraceInternal(result.get());
   return result.SerializeAsArray();
@@ -482,6 +755,7 @@ void Rpc::DisableAndReadMetatraceInternal(
 }
 
 std::vector<uint8_t> Rpc::GetStatus() {
+  WaitForPipelinedParse();
   protozero::HeapBuffered<protos::pbzero::StatusResult> status;
   status->set_loaded_trace_name(trace_processor_->GetCurrentTraceName());
   status->set_human_readable_version(base::GetVersionString());
@@ -40,6 +40,7 @@ class DisableAndReadMetatraceResult;
 namespace trace_processor {
 
 class Iterator;
+class QueryResultSerializer;
 class TraceProcessor;
 
 // This class handles the binary {,un}marshalling for the Trace Processor RPC
@@ -86,6 +87,39 @@ class Rpc {
   using RpcResponseFunction = void (*)(const void* /*data*/, uint32_t /*len*/);
   void SetRpcResponseFunction(RpcResponseFunction f) { rpc_response_fn_ = f; }
 
+  // If enabled, OnRpcRequest() sends only the first batch of the result of a
+  // TPM_QUERY_STREAMING request and the transport sends the others with
+  // StepStreamingQuery(). This allows the transport to receive the following
+  // requests, e.g. TPM_CANCEL_QUERY, while the result is being sent. Any other
+  // request completes the query first.
+  void set_incremental_query_streaming(bool enabled) {
+    incremental_query_streaming_ = enabled;
+  }
+
+  // True if some batches of the result of a TPM_QUERY_STREAMING request are
+  // still to be sent.
+  bool has_streaming_query() const { return !!streaming_query_; }
+
+  // Sends the next batch of the streaming query.
+  void StepStreamingQuery();
+
+  // Sends all the remaining batches of the streaming query, if any.
+  void FinishStreamingQuery();
+
+  // Stops the streaming query, if any, without sending anything (e.g. because
+  // the client disconnected).
+  void DropStreamingQuery();
+
+  // If enabled, the data of TPM_APPEND_TRACE_DATA requests is parsed on a
+  // dedicated thread and the requests are acknowledged as soon as the data is
+  // queued, so that the transport receives the next chunk while the previous
+  // one is parsed. OnRpcRequest() blocks while too much data is queued. All
+  // the other requests wait for the queued data to be parsed first. Parse
+  // errors are returned by the following TPM_APPEND_TRACE_DATA or
+  // TPM_FINALIZE_TRACE_DATA response. Not supported in Wasm builds, where the
+  // data is always parsed synchronously.
+  void set_pipelined_append(bool enabled) { pipelined_append_ = enabled; }
+
   // 2. TraceProcessor legacy RPC endpoints.
   // The methods below are exposed for the old RPC interfaces, where each RPC
   // implementation deals with the method demuxing: (i) wasm_bridge.cc has one
@@ -131,10 +165,39 @@ class Rpc {
       void(const uint8_t* /*buf*/, size_t /*len*/, bool /*has_more*/)>;
   void Query(const uint8_t* args, size_t len, QueryResultBatchCallback);
 
+  // Like Query(), but returns the serializer instead of draining it. Each
+  // QueryResultSerializer::Serialize() call produces the next batch. This
+  // allows the caller to interleave the batches of several queries (see
+  // httpd.cc). The serializer must be destroyed before any further call that
+  // can change the trace processor state (e.g. Parse()).
+  std::unique_ptr<QueryResultSerializer> StartQuery(const uint8_t* args,
+                                                    size_t len);
+
+  // Limits the resources of the queries, e.g. as set by the flags of
+  // trace_processor_shell. The budget requested with a query can only make
+  // these limits stricter.
+  void set_query_budget(const QueryBudget& budget) { query_budget_ = budget; }
+
+  // True if the trace was fully loaded: after NotifyEndOfFile(), or from the
+  // start for an instance passed to the constructor, until new trace data is
+  // parsed.
+  bool is_trace_finalized() const { return trace_finalized_; }
+
+  // See TraceProcessor::IsReadOnlyQuery().
+  bool IsReadOnlyQuery(const std::string& sql);
+
  private:
+  class ParserThread;
+
   void ParseRpcRequest(const uint8_t* data, size_t len);
   void ResetTraceProcessorInternal(const Config& config);
   void MaybePrintProgress();
+  size_t GetBytesParsed();
+  double GetParseRate();
+  void CancelStreamingQuery();
+  util::Status ParsePipelined(const uint8_t* data, size_t len);
+  void WaitForPipelinedParse();
+  util::Status TakePipelinedParseStatus();
   Iterator QueryInternal(const uint8_t* args, size_t len);
   void ComputeMetricInternal(const uint8_t* args,
                              size_t len,
@@ -143,15 +206,22 @@ class Rpc {
       protos::pbzero::DisableAndReadMetatraceResult*);
 
   Config trace_processor_config_;
+  QueryBudget query_budget_;
   std::unique_ptr<TraceProcessor> trace_processor_;
   RpcResponseFunction rpc_response_fn_;
   protozero::ProtoRingBuffer rxbuf_;
   int64_t tx_seq_id_ = 0;
   int64_t rx_seq_id_ = 0;
   bool eof_ = false;
+  bool trace_finalized_ = false;
   int64_t t_parse_started_ = 0;
   size_t bytes_last_progress_ = 0;
   size_t bytes_parsed_ = 0;
+  bool incremental_query_streaming_ = false;
+  bool pipelined_append_ = false;
+  // Declared after |trace_processor_|: the thread must be joined first.
+  std::unique_ptr<ParserThread> parser_thread_;
+  std::unique_ptr<QueryResultSerializer> streaming_query_;
 };
 
 }  // namespace trace_processor
@@ -0,0 +1,204 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "src/trace_processor/rpc/rpc.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "perfetto/ext/trace_processor/rpc/query_result_serializer.h"
+#include "perfetto/protozero/scattered_heap_buffer.h"
+#include "perfetto/trace_processor/basic_types.h"
+#include "perfetto/trace_processor/trace_processor.h"
+#include "src/protozero/proto_ring_buffer.h"
+#include "test/gtest_and_gmock.h"
+
+#include "protos/perfetto/trace/ps/process_tree.pbzero.h"
+#include "protos/perfetto/trace/trace.pbzero.h"
+#include "protos/perfetto/trace/trace_packet.pbzero.h"
+#include "protos/perfetto/trace_processor/trace_processor.pbzero.h"
+
+namespace perfetto {
+namespace trace_processor {
+namespace {
+
+using RpcProto = protos::pbzero::TraceProcessorRpc;
+
+// The RpcResponseFunction is a plain function pointer.
+std::string* g_responses = nullptr;
+
+void OnResponse(const void* data, uint32_t len) {
+  g_responses->append(static_cast<const char*>(data), len);
+}
+
+class RpcTest : public ::testing::Test {
+ protected:
+  RpcTest() {
+    auto tp = TraceProcessor::CreateInstance(Config());
+    tp_ = tp.get();
+    rpc_ = std::make_unique<Rpc>(std::move(tp));
+    rpc_->SetRpcResponseFunction(&OnResponse);
+    g_responses = &responses_;
+  }
+
+  ~RpcTest() override { g_responses = nullptr; }
+
+  void SendRequest(RpcProto::TraceProcessorMethod method,
+                   const std::string& append_data = "") {
+    protozero::HeapBuffered<protos::pbzero::TraceProcessorRpcStream> req;
+    auto* msg = req->add_msg();
+    msg->set_seq(++seq_);
+    msg->set_request(method);
+    if (method == RpcProto::TPM_APPEND_TRACE_DATA)
+      msg->set_append_trace_data(append_data);
+    std::vector<uint8_t> buf = req.SerializeAsArray();
+    rpc_->OnRpcRequest(buf.data(), buf.size());
+  }
+
+  // Returns the errors of the append results of the responses received so far.
+  std::vector<std::string> TakeAppendErrors() {
+    protozero::ProtoRingBuffer rxbuf;
+    rxbuf.Append(responses_.data(), responses_.size());
+    responses_.clear();
+    std::vector<std::string> errors;
+    for (auto msg = rxbuf.ReadMessage(); msg.valid();
+         msg = rxbuf.ReadMessage()) {
+      RpcProto::Decoder resp(msg.start, msg.len);
+      if (!resp.has_append_result())
+        continue;
+      protos::pbzero::AppendTraceDataResult::Decoder result(
+          resp.append_result());
+      if (result.has_error())
+        errors.push_back(result.error().ToStdString());
+    }
+    return errors;
+  }
+
+  int64_t QueryLong(const std::string& sql) {
+    auto it = tp_->ExecuteQuery(sql);
+    EXPECT_TRUE(it.Next());
+    EXPECT_TRUE(it.Status().ok()) << it.Status().message();
+    return it.Get(0).long_value;
+  }
+
+  TraceProcessor* tp_ = nullptr;
+  std::unique_ptr<Rpc> rpc_;
+  std::string responses_;
+  int64_t seq_ = 0;
+};
+
+// Returns a trace with |process_count| processes with pid >= 100, one per
+// packet.
+std::string ProcessTreeTrace(uint32_t process_count) {
+  protozero::HeapBuffered<protos::pbzero::Trace> trace;
+  for (uint32_t i = 0; i < process_count; ++i) {
+    auto* packet = trace->add_packet();
+    packet->set_timestamp(1000 + i);
+    auto* process = packet->set_process_tree()->add_processes();
+    process->set_pid(static_cast<int32_t>(100 + i));
+    process->set_ppid(1);
+    process->add_cmdline("process_" + std::to_string(i));
+  }
+  return trace.SerializeAsString();
+}
+
+TEST_F(RpcTest, PipelinedAppendParsesAllData) {
+  rpc_->set_pipelined_append(true);
+  std::string trace = ProcessTreeTrace(1000);
+  // Packets are split across chunks.
+  constexpr size_t kChunkSize = 1000;
+  for (size_t off = 0; off < trace.size(); off += kChunkSize)
+    SendRequest(RpcProto::TPM_APPEND_TRACE_DATA, trace.substr(off, kChunkSize));
+  SendRequest(RpcProto::TPM_FINALIZE_TRACE_DATA);
+
+  EXPECT_TRUE(TakeAppendErrors().empty());
+  EXPECT_EQ(QueryLong("select count(*) from process where pid >= 100"),
+            1000);
+}
+
+TEST_F(RpcTest, PipelinedAppendReportsParseErrors) {
+  rpc_->set_pipelined_append(true);
+  SendRequest(RpcProto::TPM_APPEND_TRACE_DATA, "not a trace");
+  SendRequest(RpcProto::TPM_FINALIZE_TRACE_DATA);
+
+  // Depending on when the data is parsed, the error is returned either by the
+  // append or by the finalize response.
+  std::vector<std::string> errors = TakeAppendErrors();
+  ASSERT_EQ(errors.size(), 1u);
+  EXPECT_THAT(errors[0], ::testing::HasSubstr("Unknown trace type"));
+}
+
+TEST_F(RpcTest, SynchronousAppendReportsParseErrors) {
+  SendRequest(RpcProto::TPM_APPEND_TRACE_DATA, "not a trace");
+  std::vector<std::string> errors = TakeAppendErrors();
+  ASSERT_EQ(errors.size(), 1u);
+  EXPECT_THAT(errors[0], ::testing::HasSubstr("Unknown trace type"));
+}
+
+TEST_F(RpcTest, PreloadedInstanceIsFinalized) {
+  EXPECT_TRUE(rpc_->is_trace_finalized());
+  SendRequest(RpcProto::TPM_APPEND_TRACE_DATA, ProcessTreeTrace(1));
+  EXPECT_FALSE(rpc_->is_trace_finalized());
+  SendRequest(RpcProto::TPM_FINALIZE_TRACE_DATA);
+  EXPECT_TRUE(rpc_->is_trace_finalized());
+
+  Rpc empty_rpc;
+  EXPECT_FALSE(empty_rpc.is_trace_finalized());
+}
+
+TEST_F(RpcTest, IsReadOnlyQuery) {
+  auto it = tp_->ExecuteQuery("CREATE TABLE t(x INT)");
+  while (it.Next()) {
+  }
+  ASSERT_TRUE(it.Status().ok()) << it.Status().message();
+
+  EXPECT_TRUE(rpc_->IsReadOnlyQuery("SELECT 1"));
+  EXPECT_TRUE(rpc_->IsReadOnlyQuery(" select ';' from t;\n"));
+  EXPECT_TRUE(rpc_->IsReadOnlyQuery("WITH a AS (SELECT 1) SELECT * FROM a"));
+  EXPECT_FALSE(rpc_->IsReadOnlyQuery(
+      "WITH a AS (SELECT 1) INSERT INTO t SELECT * FROM a"));
+  EXPECT_FALSE(rpc_->IsReadOnlyQuery("DELETE FROM t"));
+  EXPECT_FALSE(rpc_->IsReadOnlyQuery("SELECT RUN_METRIC('foo.sql')"));
+  EXPECT_FALSE(rpc_->IsReadOnlyQuery("SELECT 1; SELECT 2"));
+  EXPECT_FALSE(rpc_->IsReadOnlyQuery("INCLUDE PERFETTO MODULE foo"));
+}
+
+TEST_F(RpcTest, QueryBudgetIsStricterOfServerAndClient) {
+  QueryBudget server_budget;
+  server_budget.timeout_ms = 50;
+  rpc_->set_query_budget(server_budget);
+
+  // The client asks for a much larger budget: the server one still applies.
+  protozero::HeapBuffered<protos::pbzero::QueryArgs> args;
+  args->set_sql_query(
+      "with recursive c(x) as (select 1 union all select x + 1 from c) "
+      "select x from c");
+  args->set_timeout_ms(60 * 1000);
+  std::vector<uint8_t> buf = args.SerializeAsArray();
+  auto serializer = rpc_->StartQuery(buf.data(), buf.size());
+  std::vector<uint8_t> result;
+  while (serializer->Serialize(&result)) {
+  }
+  protos::pbzero::QueryResult::Decoder decoded(result.data(), result.size());
+  ASSERT_TRUE(decoded.has_error());
+  EXPECT_THAT(decoded.error().ToStdString(), testing::HasSubstr("time budget"));
+}
+
+}  // namespace
+}  // namespace trace_processor
+}  // namespace perfetto
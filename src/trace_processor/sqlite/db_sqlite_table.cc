@@ -24,7 +24,9 @@
 #include "src/trace_processor/sqlite/query_cache.h"
 #include "src/trace_processor/sqlite/sqlite_utils.h"
 #include "src/trace_processor/tp_metatrace.h"
+#include "src/trace_processor/util/query_abort.h"
 #include "src/trace_processor/util/regex.h"
+#include "src/trace_processor/util/status_macros.h"
 
 namespace perfetto {
 namespace trace_processor {
@@ -613,6 +615,10 @@ base::Status DbSqliteTable::Cursor::Filter(const QueryConstraints& qc,
                                          : RowMap::OptimizeFor::kLookupSpeed;
   RowMap filter_map = SourceTable()->FilterToRowMap(constraints_, optimize_for);
 
+  // Filtering gives up early if the query is aborted: the RowMap is incomplete
+  // in that case.
+  RETURN_IF_ERROR(CheckQueryAbort());
+
   // If we have no order by constraints and it's cheap for us to use the
   // RowMap, just use the RowMap directoy.
   if (filter_map.IsRange() && filter_map.size() <= 1) {
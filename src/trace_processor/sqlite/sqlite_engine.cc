@@ -16,6 +16,7 @@
 
 #include "src/trace_processor/sqlite/sqlite_engine.h"
 
+#include <algorithm>
 #include <memory>
 #include <optional>
 #include <utility>
@@ -42,11 +43,81 @@ namespace perfetto {
 namespace trace_processor {
 namespace {
 
+// The allocator SQLite had before InstallCountingAllocator() wrapped it.
+sqlite3_mem_methods g_wrapped_mem_methods;
+bool g_memory_counting_supported = false;
+thread_local SqliteEngine::MemoryCounter* g_thread_memory_counter = nullptr;
+
+void AddToThreadMemoryCounter(int64_t delta) {
+  SqliteEngine::MemoryCounter* counter = g_thread_memory_counter;
+  if (!counter)
+    return;
+  counter->used += delta;
+  counter->peak = std::max(counter->peak, counter->used);
+}
+
+void* CountingMalloc(int size) {
+  void* ptr = g_wrapped_mem_methods.xMalloc(size);
+  if (ptr)
+    AddToThreadMemoryCounter(g_wrapped_mem_methods.xSize(ptr));
+  return ptr;
+}
+
+void CountingFree(void* ptr) {
+  if (ptr)
+    AddToThreadMemoryCounter(-g_wrapped_mem_methods.xSize(ptr));
+  g_wrapped_mem_methods.xFree(ptr);
+}
+
+void* CountingRealloc(void* ptr, int size) {
+  int old_size = ptr ? g_wrapped_mem_methods.xSize(ptr) : 0;
+  void* new_ptr = g_wrapped_mem_methods.xRealloc(ptr, size);
+  if (new_ptr)
+    AddToThreadMemoryCounter(g_wrapped_mem_methods.xSize(new_ptr) - old_size);
+  return new_ptr;
+}
+
+int CountingSize(void* ptr) {
+  return g_wrapped_mem_methods.xSize(ptr);
+}
+
+int CountingRoundup(int size) {
+  return g_wrapped_mem_methods.xRoundup(size);
+}
+
+int CountingInit(void*) {
+  return g_wrapped_mem_methods.xInit(g_wrapped_mem_methods.pAppData);
+}
+
+void CountingShutdown(void*) {
+  g_wrapped_mem_methods.xShutdown(g_wrapped_mem_methods.pAppData);
+}
+
+// Wraps the allocator of SQLite to account the memory of each thread. This
+// replaces SQLite's own memory statistics, which are disabled at build time
+// for performance and are process-wide anyway.
+bool InstallCountingAllocator() {
+  if (sqlite3_config(SQLITE_CONFIG_GETMALLOC, &g_wrapped_mem_methods) !=
+      SQLITE_OK) {
+    return false;
+  }
+  static sqlite3_mem_methods counting_mem_methods = {
+      &CountingMalloc, &CountingFree,  &CountingRealloc,  &CountingSize,
+      &CountingRoundup, &CountingInit, &CountingShutdown, nullptr};
+  return sqlite3_config(SQLITE_CONFIG_MALLOC, &counting_mem_methods) ==
+         SQLITE_OK;
+}
+
 void EnsureSqliteInitialized() {
   // sqlite3_initialize isn't actually thread-safe despite being documented
   // as such; we need to make sure multiple TraceProcessorImpl instances don't
   // call it concurrently and only gets called once per process, instead.
-  static bool init_once = [] { return sqlite3_initialize() == SQLITE_OK; }();
+  static bool init_once = [] {
+    // Configuring SQLite fails if something else in the process initialized
+    // it already: then memory budgets of queries can't be enforced.
+    g_memory_counting_supported = InstallCountingAllocator();
+    return sqlite3_initialize() == SQLITE_OK;
+  }();
   PERFETTO_CHECK(init_once);
 }
 
@@ -83,6 +154,19 @@ SqliteEngine::SqliteEngine() {
   db_.reset(std::move(db));
 }
 
+// static
+SqliteEngine::MemoryCounter* SqliteEngine::SetThreadMemoryCounter(
+    MemoryCounter* counter) {
+  MemoryCounter* prev = g_thread_memory_counter;
+  g_thread_memory_counter = counter;
+  return prev;
+}
+
+// static
+bool SqliteEngine::IsMemoryCountingSupported() {
+  return g_memory_counting_supported;
+}
+
 SqliteEngine::~SqliteEngine() {
   // IMPORTANT: the order of operations in this destructor is very sensitive and
   // should not be changed without careful consideration of the consequences.
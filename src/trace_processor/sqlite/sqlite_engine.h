@@ -75,9 +75,30 @@ class SqliteEngine {
     base::Status status_ = base::OkStatus();
   };
 
+  // Memory allocated by SQLite on a thread, see SetThreadMemoryCounter().
+  struct MemoryCounter {
+    // Bytes allocated minus bytes freed. Can be negative if memory allocated
+    // before the counter was installed is freed.
+    int64_t used = 0;
+    // Highest value of |used|.
+    int64_t peak = 0;
+  };
+
   SqliteEngine();
   ~SqliteEngine();
 
+  // Makes the memory SQLite allocates and frees on the calling thread be
+  // accounted in |counter| (if not nullptr). Returns the counter previously
+  // installed on the thread.
+  //
+  // Unlike sqlite3_memory_used(), this tells apart the memory used by queries
+  // running in different instances on different threads.
+  static MemoryCounter* SetThreadMemoryCounter(MemoryCounter* counter);
+
+  // Returns false if SQLite was initialized before the first SqliteEngine was
+  // created, in which case the memory counters are never updated.
+  static bool IsMemoryCountingSupported();
+
   // Prepares a SQLite statement for the given SQL.
   PreparedStatement PrepareStatement(SqlSource);
 
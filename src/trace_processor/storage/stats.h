@@ -109,9 +109,15 @@ namespace stats {
   F(traced_buf_bytes_overwritten,         kIndexed, kInfo,     kTrace,    ""), \
   F(traced_buf_bytes_read,                kIndexed, kInfo,     kTrace,    ""), \
   F(traced_buf_bytes_written,             kIndexed, kInfo,     kTrace,    ""), \
+  F(traced_buf_chunk_payload_bytes_read,  kIndexed, kInfo,     kTrace,    ""), \
+  F(traced_buf_chunk_payload_bytes_used,  kIndexed, kInfo,     kTrace,    ""), \
   F(traced_buf_chunks_discarded,          kIndexed, kInfo,     kTrace,    ""), \
+  F(traced_buf_chunks_discarded_over_quota,                                    \
+                                          kIndexed, kInfo,     kTrace,    ""), \
   F(traced_buf_chunks_overwritten,        kIndexed, kInfo,     kTrace,    ""), \
   F(traced_buf_chunks_read,               kIndexed, kInfo,     kTrace,    ""), \
+  F(traced_buf_chunks_read_with_fragmented_packet,                             \
+                                          kIndexed, kInfo,     kTrace,    ""), \
   F(traced_buf_chunks_rewritten,          kIndexed, kInfo,     kTrace,    ""), \
   F(traced_buf_chunks_written,            kIndexed, kInfo,     kTrace,    ""), \
   F(traced_buf_chunks_committed_out_of_order,                                  \
@@ -15,11 +15,13 @@
  */
 
 #include <algorithm>
+#include <chrono>
 #include <cstdio>
 #include <map>
 #include <optional>
 #include <random>
 #include <string>
+#include <thread>
 
 #include "perfetto/base/logging.h"
 #include "perfetto/ext/base/scoped_file.h"
@@ -29,6 +31,7 @@
 #include "protos/perfetto/trace_processor/trace_processor.pbzero.h"
 
 #include "src/base/test/utils.h"
+#include "src/trace_processor/util/query_abort.h"
 #include "test/gtest_and_gmock.h"
 
 namespace perfetto {
@@ -90,6 +93,136 @@ TEST(TraceProcessorCustomConfigTest, HandlesMalformedMountPath) {
   ASSERT_EQ(it.Get(0).long_value, 1);
 }
 
+// Counts forever.
+constexpr char kEndlessQuery[] =
+    "with recursive c(x) as (select 1 union all select x + 1 from c) "
+    "select x from c";
+
+TEST(TraceProcessorQueryBudgetTest, TimeoutAbortsQuery) {
+  Config config;
+  config.query_budget.timeout_ms = 50;
+  auto processor = TraceProcessor::CreateInstance(config);
+  processor->NotifyEndOfFile();
+
+  // The budget is enforced while the iterator is stepped...
+  auto it = processor->ExecuteQuery(kEndlessQuery);
+  while (it.Next()) {
+  }
+  ASSERT_FALSE(it.Status().ok());
+  ASSERT_THAT(it.Status().message(), testing::HasSubstr("time budget"));
+
+  // ... and while the statements preceding the last one are run.
+  it = processor->ExecuteQuery(
+      "create table t as select count(*) from (" +
+      std::string(kEndlessQuery) + "); select 1");
+  ASSERT_FALSE(it.Next());
+  ASSERT_THAT(it.Status().message(), testing::HasSubstr("time budget"));
+
+  // Each query has its own budget.
+  it = processor->ExecuteQuery("select 1");
+  ASSERT_TRUE(it.Next());
+  ASSERT_EQ(it.Get(0).long_value, 1);
+}
+
+TEST(TraceProcessorQueryBudgetTest, MemoryBudgetAbortsQuery) {
+  auto processor = TraceProcessor::CreateInstance(Config());
+  processor->NotifyEndOfFile();
+
+  // Sorting requires SQLite to buffer all the rows.
+  std::string sql =
+      "with recursive c(x) as (select 1 union all select x + 1 from c "
+      "where x < 1000000) select x from c order by x desc";
+  QueryBudget budget;
+  budget.max_memory_bytes = 1024 * 1024;
+  auto it = processor->ExecuteQueryWithBudget(sql, budget);
+  ASSERT_FALSE(it.Next());
+  ASSERT_THAT(it.Status().message(), testing::HasSubstr("memory budget"));
+
+  budget.max_memory_bytes = 0;
+  it = processor->ExecuteQueryWithBudget(sql, budget);
+  ASSERT_TRUE(it.Next());
+  ASSERT_EQ(it.Get(0).long_value, 1000000);
+}
+
+TEST(TraceProcessorQueryBudgetTest, TimeBetweenNextCallsIsNotCounted) {
+  Config config;
+  config.query_budget.timeout_ms = 50;
+  auto processor = TraceProcessor::CreateInstance(config);
+  processor->NotifyEndOfFile();
+
+  auto it = processor->ExecuteQuery("select 1 union all select 2");
+  ASSERT_TRUE(it.Next());
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  ASSERT_TRUE(it.Next());
+  ASSERT_EQ(it.Get(0).long_value, 2);
+  ASSERT_FALSE(it.Next());
+  ASSERT_TRUE(it.Status().ok()) << it.Status().message();
+}
+
+TEST(TraceProcessorQueryBudgetTest, MemoryBudgetIgnoresOtherInstances) {
+  auto processor = TraceProcessor::CreateInstance(Config());
+  auto other = TraceProcessor::CreateInstance(Config());
+  processor->NotifyEndOfFile();
+  other->NotifyEndOfFile();
+
+  QueryBudget budget;
+  budget.max_memory_bytes = 1024 * 1024;
+  auto it = processor->ExecuteQueryWithBudget(
+      "select 1 union all select count(*) from (with recursive c(x) as "
+      "(select 1 union all select x + 1 from c where x < 100000) select x "
+      "from c)",
+      budget);
+  ASSERT_TRUE(it.Next());
+
+  // The sorted rows stay in memory until |other_it| is destroyed.
+  auto other_it = other->ExecuteQuery(
+      "with recursive c(x) as (select 1 union all select x + 1 from c "
+      "where x < 1000000) select x from c order by x desc");
+  ASSERT_TRUE(other_it.Next());
+
+  ASSERT_TRUE(it.Next());
+  ASSERT_EQ(it.Get(0).long_value, 100000);
+  ASSERT_FALSE(it.Next());
+  ASSERT_TRUE(it.Status().ok()) << it.Status().message();
+}
+
+TEST(TraceProcessorQueryBudgetTest, BudgetOverridesConfig) {
+  Config config;
+  config.query_budget.timeout_ms = 1;
+  auto processor = TraceProcessor::CreateInstance(config);
+  processor->NotifyEndOfFile();
+
+  QueryBudget budget;
+  budget.timeout_ms = 60 * 1000;
+  auto it = processor->ExecuteQueryWithBudget(
+      "with recursive c(x) as (select 1 union all select x + 1 from c "
+      "where x < 1000000) select count(*) from c",
+      budget);
+  ASSERT_TRUE(it.Next());
+  ASSERT_EQ(it.Get(0).long_value, 1000000);
+}
+
+// Aborts the queries which run while it is installed.
+class CancelledQuery : public QueryAbortCheck {
+ public:
+  base::Status Check() const override {
+    return base::ErrStatus("Query cancelled");
+  }
+};
+
+TEST(TraceProcessorQueryBudgetTest, CallerAbortCheckStillApplies) {
+  auto processor = TraceProcessor::CreateInstance(Config());
+  processor->NotifyEndOfFile();
+
+  CancelledQuery cancelled;
+  const QueryAbortCheck* prev = SetThreadQueryAbortCheck(&cancelled);
+  auto it = processor->ExecuteQuery(kEndlessQuery);
+  while (it.Next()) {
+  }
+  SetThreadQueryAbortCheck(prev);
+  ASSERT_THAT(it.Status().message(), testing::HasSubstr("Query cancelled"));
+}
+
 class TraceProcessorIntegrationTest : public ::testing::Test {
  public:
   TraceProcessorIntegrationTest()
@@ -420,6 +553,35 @@ TEST_F(TraceProcessorIntegrationTest, RestoreInitialTables) {
   }
 }
 
+TEST_F(TraceProcessorIntegrationTest, RestoreInitialTablesKeepsModules) {
+  ASSERT_TRUE(LoadTrace("android_sched_and_ps.pb").ok());
+
+  SqlModule module;
+  module.name = "foo";
+  module.files.push_back(std::make_pair(
+      "foo.bar", "CREATE PERFETTO TABLE foo_sched_count AS "
+                 "SELECT COUNT(*) AS cnt FROM sched;"));
+  ASSERT_TRUE(Processor()->RegisterSqlModule(module).ok());
+
+  auto it = Query("INCLUDE PERFETTO MODULE foo.bar;");
+  it.Next();
+  ASSERT_TRUE(it.Status().ok());
+
+  it = Query("CREATE TABLE user1(unused text);");
+  it.Next();
+  ASSERT_TRUE(it.Status().ok());
+
+  // Only the user table should be deleted: the table created by the module
+  // is still valid and should be queryable without including it again.
+  ASSERT_EQ(RestoreInitialTables(), 1u);
+
+  it = Query(
+      "SELECT cnt = (SELECT COUNT(*) FROM sched) FROM foo_sched_count;");
+  ASSERT_TRUE(it.Next());
+  ASSERT_EQ(it.Get(0).long_value, 1);
+  ASSERT_FALSE(it.Next());
+}
+
 // This test checks that a ninja trace is tokenized properly even if read in
 // small chunks of 1KB each. The values used in the test have been cross-checked
 // with opening the same trace with ninjatracing + chrome://tracing.
@@ -17,6 +17,8 @@
 #include "src/trace_processor/trace_processor_impl.h"
 
 #include <algorithm>
+#include <atomic>
+#include <cctype>
 #include <cstdint>
 #include <memory>
 #include <string>
@@ -73,7 +75,9 @@
 #include "src/trace_processor/perfetto_sql/intrinsics/table_functions/experimental_flat_slice.h"
 #include "src/trace_processor/perfetto_sql/intrinsics/table_functions/experimental_sched_upid.h"
 #include "src/trace_processor/perfetto_sql/intrinsics/table_functions/experimental_slice_layout.h"
+#include "src/trace_processor/perfetto_sql/intrinsics/table_functions/slice_flattened.h"
 #include "src/trace_processor/perfetto_sql/intrinsics/table_functions/static_table_function.h"
+#include "src/trace_processor/perfetto_sql/intrinsics/table_functions/thread_executing_span.h"
 #include "src/trace_processor/perfetto_sql/intrinsics/table_functions/view.h"
 #include "src/trace_processor/perfetto_sql/prelude/tables_views.h"
 #include "src/trace_processor/perfetto_sql/stdlib/stdlib.h"
@@ -87,6 +91,7 @@
 #include "src/trace_processor/types/variadic.h"
 #include "src/trace_processor/util/protozero_to_json.h"
 #include "src/trace_processor/util/protozero_to_text.h"
+#include "src/trace_processor/util/query_abort.h"
 #include "src/trace_processor/util/regex.h"
 #include "src/trace_processor/util/sql_modules.h"
 #include "src/trace_processor/util/status_macros.h"
@@ -109,6 +114,33 @@ const char kAllTablesQuery[] =
     "SELECT tbl_name, type FROM (SELECT * FROM sqlite_master UNION ALL SELECT "
     "* FROM sqlite_temp_master)";
 
+// Number of SQLite VM instructions between checks of the query budget. Each
+// check costs a clock read: this keeps the overhead negligible while still
+// checking every few hundred microseconds.
+constexpr int kQueryBudgetCheckInstructions = 10000;
+
+// Functions which run SQL statements themselves: a statement calling them can
+// change the database even if SQLite considers it read-only.
+const char* const kStatefulFunctions[] = {"RUN_METRIC", "CREATE_FUNCTION",
+                                          "CREATE_VIEW_FUNCTION",
+                                          "EXPERIMENTAL_MEMOIZE", "IMPORT"};
+
+// SQLite authorizer callback denying calls to |kStatefulFunctions|.
+int DenyStatefulFunctions(void*,
+                          int action,
+                          const char*,
+                          const char* function_name,
+                          const char*,
+                          const char*) {
+  if (action != SQLITE_FUNCTION || !function_name)
+    return SQLITE_OK;
+  for (const char* name : kStatefulFunctions) {
+    if (base::CaseInsensitiveEqual(function_name, name))
+      return SQLITE_DENY;
+  }
+  return SQLITE_OK;
+}
+
 template <typename SqlFunction, typename Ptr = typename SqlFunction::Context*>
 void RegisterFunction(PerfettoSqlEngine* engine,
                       const char* name,
@@ -364,6 +396,7 @@ void TraceProcessorImpl::RegisterView(const View& view) {
 
 TraceProcessorImpl::TraceProcessorImpl(const Config& cfg)
     : TraceProcessorStorageImpl(cfg),
+      slice_tree_index_(&context_.storage->slice_table()),
       engine_(context_.storage->mutable_string_pool()) {
   context_.fuchsia_trace_tokenizer.reset(new FuchsiaTraceTokenizer(&context_));
   context_.fuchsia_trace_parser.reset(new FuchsiaTraceParser(&context_));
@@ -400,6 +433,9 @@ TraceProcessorImpl::TraceProcessorImpl(const Config& cfg)
   }
 
   sqlite3_str_split_init(engine_.sqlite_engine()->db());
+  sqlite3_progress_handler(engine_.sqlite_engine()->db(),
+                           kQueryBudgetCheckInstructions, &OnSqliteProgress,
+                           this);
   RegisterAdditionalModules(&context_);
 
   // New style function registration.
@@ -508,22 +544,28 @@ TraceProcessorImpl::TraceProcessorImpl(const Config& cfg)
   RegisterStaticTableFunction(std::unique_ptr<ExperimentalSliceLayout>(
       new ExperimentalSliceLayout(context_.storage.get()->mutable_string_pool(),
                                   &storage->slice_table())));
-  RegisterStaticTableFunction(std::unique_ptr<Ancestor>(
-      new Ancestor(Ancestor::Type::kSlice, context_.storage.get())));
   RegisterStaticTableFunction(std::unique_ptr<Ancestor>(new Ancestor(
-      Ancestor::Type::kStackProfileCallsite, context_.storage.get())));
+      Ancestor::Type::kSlice, context_.storage.get(), &slice_tree_index_)));
   RegisterStaticTableFunction(std::unique_ptr<Ancestor>(
-      new Ancestor(Ancestor::Type::kSliceByStack, context_.storage.get())));
-  RegisterStaticTableFunction(std::unique_ptr<Descendant>(
-      new Descendant(Descendant::Type::kSlice, context_.storage.get())));
+      new Ancestor(Ancestor::Type::kStackProfileCallsite,
+                   context_.storage.get(), &slice_tree_index_)));
+  RegisterStaticTableFunction(std::unique_ptr<Ancestor>(
+      new Ancestor(Ancestor::Type::kSliceByStack, context_.storage.get(),
+                   &slice_tree_index_)));
+  RegisterStaticTableFunction(std::unique_ptr<Descendant>(new Descendant(
+      Descendant::Type::kSlice, context_.storage.get(), &slice_tree_index_)));
   RegisterStaticTableFunction(std::unique_ptr<Descendant>(
-      new Descendant(Descendant::Type::kSliceByStack, context_.storage.get())));
-  RegisterStaticTableFunction(std::unique_ptr<ConnectedFlow>(new ConnectedFlow(
-      ConnectedFlow::Mode::kDirectlyConnectedFlow, context_.storage.get())));
-  RegisterStaticTableFunction(std::unique_ptr<ConnectedFlow>(new ConnectedFlow(
-      ConnectedFlow::Mode::kPrecedingFlow, context_.storage.get())));
-  RegisterStaticTableFunction(std::unique_ptr<ConnectedFlow>(new ConnectedFlow(
-      ConnectedFlow::Mode::kFollowingFlow, context_.storage.get())));
+      new Descendant(Descendant::Type::kSliceByStack, context_.storage.get(),
+                     &slice_tree_index_)));
+  RegisterStaticTableFunction(std::unique_ptr<ConnectedFlow>(
+      new ConnectedFlow(ConnectedFlow::Mode::kDirectlyConnectedFlow,
+                        context_.storage.get(), &slice_tree_index_)));
+  RegisterStaticTableFunction(std::unique_ptr<ConnectedFlow>(
+      new ConnectedFlow(ConnectedFlow::Mode::kPrecedingFlow,
+                        context_.storage.get(), &slice_tree_index_)));
+  RegisterStaticTableFunction(std::unique_ptr<ConnectedFlow>(
+      new ConnectedFlow(ConnectedFlow::Mode::kFollowingFlow,
+                        context_.storage.get(), &slice_tree_index_)));
   RegisterStaticTableFunction(
       std::unique_ptr<ExperimentalSchedUpid>(new ExperimentalSchedUpid(
           storage->sched_slice_table(), storage->thread_table())));
@@ -531,6 +573,14 @@ TraceProcessorImpl::TraceProcessorImpl(const Config& cfg)
       new ExperimentalAnnotatedStack(&context_)));
   RegisterStaticTableFunction(std::unique_ptr<ExperimentalFlatSlice>(
       new ExperimentalFlatSlice(&context_)));
+  RegisterStaticTableFunction(
+      std::unique_ptr<SliceFlattened>(new SliceFlattened(&context_)));
+  std::unique_ptr<ThreadExecutingSpanGraph> thread_executing_span_graph(
+      new ThreadExecutingSpanGraph(&context_));
+  ThreadExecutingSpanGraph* graph = thread_executing_span_graph.get();
+  RegisterStaticTableFunction(std::move(thread_executing_span_graph));
+  RegisterStaticTableFunction(std::unique_ptr<ThreadExecutingSpanCriticalPath>(
+      new ThreadExecutingSpanCriticalPath(&context_, graph)));
 
   // Views.
   RegisterView(storage->thread_slice_view());
@@ -694,14 +744,20 @@ void TraceProcessorImpl::NotifyEndOfFile() {
 }
 
 size_t TraceProcessorImpl::RestoreInitialTables() {
-  // Step 1: figure out what tables/views/indices we need to delete.
+  // Step 1: figure out what tables/views/indices we need to delete. Objects
+  // created by including SQL modules are kept: they only depend on the trace
+  // tables so they are still valid and recomputing them can take several
+  // seconds for the heavier stdlib modules.
+  std::vector<std::string> module_objects = engine_.GetIncludedModuleObjects();
   std::vector<std::pair<std::string, std::string>> deletion_list;
   std::string msg = "Resetting DB to initial state, deleting table/views:";
   for (auto it = ExecuteQuery(kAllTablesQuery); it.Next();) {
     std::string name(it.Get(0).string_value);
     std::string type(it.Get(1).string_value);
     if (std::find(initial_tables_.begin(), initial_tables_.end(), name) ==
-        initial_tables_.end()) {
+            initial_tables_.end() &&
+        std::find(module_objects.begin(), module_objects.end(), name) ==
+            module_objects.end()) {
       msg += " " + name;
       deletion_list.push_back(std::make_pair(type, name));
     }
@@ -726,20 +782,76 @@ size_t TraceProcessorImpl::RestoreInitialTables() {
 }
 
 Iterator TraceProcessorImpl::ExecuteQuery(const std::string& sql) {
+  return ExecuteQueryWithBudget(sql, context_.config.query_budget);
+}
+
+Iterator TraceProcessorImpl::ExecuteQueryWithBudget(const std::string& sql,
+                                                    const QueryBudget& budget) {
   PERFETTO_TP_TRACE(metatrace::Category::API_TIMELINE, "EXECUTE_QUERY");
 
   uint32_t sql_stats_row =
       context_.storage->mutable_sql_stats()->RecordQueryBegin(
           sql, base::GetWallTimeNs().count());
   std::string non_breaking_sql = base::ReplaceAll(sql, "\u00A0", " ");
+
+  query_interrupted_.store(false);
+  QueryBudgetTracker budget_tracker(budget, &query_interrupted_);
   base::StatusOr<PerfettoSqlEngine::ExecutionResult> result =
-      engine_.ExecuteUntilLastStatement(
-          SqlSource::FromExecuteQuery(std::move(non_breaking_sql)));
-  std::unique_ptr<IteratorImpl> impl(
-      new IteratorImpl(this, std::move(result), sql_stats_row));
+      base::ErrStatus(
+          "Query memory budgets are not supported: SQLite was initialized "
+          "before trace processor");
+  if (!budget.max_memory_bytes || SqliteEngine::IsMemoryCountingSupported()) {
+    budget_tracker.Resume();
+    result = engine_.ExecuteUntilLastStatement(
+        SqlSource::FromExecuteQuery(std::move(non_breaking_sql)));
+    budget_tracker.Pause();
+    if (!result.ok())
+      result = TakeQueryAbortReason(result.status());
+  }
+
+  std::unique_ptr<IteratorImpl> impl(new IteratorImpl(
+      this, std::move(result), sql_stats_row, budget_tracker));
   return Iterator(std::move(impl));
 }
 
+bool TraceProcessorImpl::IsReadOnlyQuery(const std::string& sql) {
+  // Preparing the statement is enough: nothing is executed. PerfettoSQL
+  // statements and macros are not valid SQLite so they fail to prepare.
+  sqlite3* db = engine_.sqlite_engine()->db();
+  sqlite3_set_authorizer(db, &DenyStatefulFunctions, nullptr);
+  sqlite3_stmt* raw_stmt = nullptr;
+  const char* tail = nullptr;
+  int ret = sqlite3_prepare_v2(db, sql.c_str(), static_cast<int>(sql.size()),
+                               &raw_stmt, &tail);
+  ScopedStmt stmt(raw_stmt);
+  sqlite3_set_authorizer(db, nullptr, nullptr);
+  if (ret != SQLITE_OK || !stmt || !sqlite3_stmt_readonly(stmt.get()))
+    return false;
+
+  // Anything but whitespace after the first statement (including a second
+  // statement) is conservatively rejected.
+  for (const char* c = tail; c && *c; ++c) {
+    if (!isspace(static_cast<unsigned char>(*c)) && *c != ';')
+      return false;
+  }
+  return true;
+}
+
+int TraceProcessorImpl::OnSqliteProgress(void* ctx) {
+  auto* self = static_cast<TraceProcessorImpl*>(ctx);
+  base::Status status = CheckQueryAbort();
+  if (status.ok())
+    return 0;
+  self->query_abort_reason_ = std::move(status);
+  return 1;
+}
+
+base::Status TraceProcessorImpl::TakeQueryAbortReason(base::Status status) {
+  base::Status reason = std::move(query_abort_reason_);
+  query_abort_reason_ = base::OkStatus();
+  return reason.ok() ? status : reason;
+}
+
 void TraceProcessorImpl::InterruptQuery() {
   if (!engine_.sqlite_engine()->db())
     return;
@@ -777,8 +889,7 @@ base::Status TraceProcessorImpl::RegisterSqlModule(SqlModule sql_module) {
     new_module.include_key_to_file.Insert(name_and_sql.first,
                                           {name_and_sql.second, false});
   }
-  engine_.RegisterModule(name, std::move(new_module));
-  return base::OkStatus();
+  return engine_.RegisterModule(name, std::move(new_module));
 }
 
 base::Status TraceProcessorImpl::RegisterMetric(const std::string& path,
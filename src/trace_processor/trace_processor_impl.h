@@ -34,6 +34,7 @@
 #include "src/trace_processor/perfetto_sql/intrinsics/functions/create_function.h"
 #include "src/trace_processor/perfetto_sql/intrinsics/functions/create_view_function.h"
 #include "src/trace_processor/perfetto_sql/intrinsics/functions/import.h"
+#include "src/trace_processor/perfetto_sql/intrinsics/table_functions/slice_tree_index.h"
 #include "src/trace_processor/sqlite/db_sqlite_table.h"
 #include "src/trace_processor/sqlite/query_cache.h"
 #include "src/trace_processor/sqlite/scoped_db.h"
@@ -70,6 +71,11 @@ class TraceProcessorImpl : public TraceProcessor,
   // TraceProcessor implementation:
   Iterator ExecuteQuery(const std::string& sql) override;
 
+  Iterator ExecuteQueryWithBudget(const std::string& sql,
+                                  const QueryBudget& budget) override;
+
+  bool IsReadOnlyQuery(const std::string& sql) override;
+
   base::Status RegisterMetric(const std::string& path,
                               const std::string& sql) override;
 
@@ -121,6 +127,18 @@ class TraceProcessorImpl : public TraceProcessor,
 
   bool IsRootMetricField(const std::string& metric_name);
 
+  // SQLite progress handler: aborts the running query if it was interrupted
+  // or exceeded its budget.
+  static int OnSqliteProgress(void* ctx);
+
+  // Returns the reason why the progress handler aborted the running query if
+  // |status| is the resulting error, or |status| otherwise.
+  base::Status TakeQueryAbortReason(base::Status status);
+
+  // Shared by the ancestor, descendant and connected flow table functions.
+  // Declared before |engine_| as those functions keep a pointer to it.
+  SliceTreeIndex slice_tree_index_;
+
   PerfettoSqlEngine engine_;
 
   DescriptorPool pool_;
@@ -132,6 +150,9 @@ class TraceProcessorImpl : public TraceProcessor,
   // to prevent single-flow compiler optimizations in ExecuteQuery().
   std::atomic<bool> query_interrupted_{false};
 
+  // Set by the progress handler when it aborts the running query.
+  base::Status query_abort_reason_;
+
   // Keeps track of the tables created by the ingestion process. This is used
   // by RestoreInitialTables() to delete all the tables/view that have been
   // created after that point.
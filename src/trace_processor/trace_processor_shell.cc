@@ -18,12 +18,16 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <sys/stat.h>
+#include <algorithm>
 #include <cctype>
 #include <cinttypes>
+#include <condition_variable>
 #include <functional>
 #include <iostream>
+#include <mutex>
 #include <optional>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
@@ -44,6 +48,7 @@
 #include "perfetto/ext/base/string_splitter.h"
 #include "perfetto/ext/base/string_utils.h"
 #include "perfetto/ext/base/string_view.h"
+#include "perfetto/ext/base/threading/thread_pool.h"
 #include "perfetto/ext/base/version.h"
 
 #include "perfetto/trace_processor/metatrace_config.h"
@@ -499,6 +504,23 @@ void PrintQueryResultInteractively(Iterator* it,
          static_cast<double>((t_end - t_start).count()) / 1E6);
 }
 
+// Formats |value| as a CSV field.
+std::string ToCsvField(const SqlValue& value) {
+  switch (value.type) {
+    case SqlValue::Type::kNull:
+      return "\"[NULL]\"";
+    case SqlValue::Type::kDouble:
+      return std::to_string(value.double_value);
+    case SqlValue::Type::kLong:
+      return std::to_string(value.long_value);
+    case SqlValue::Type::kString:
+      return "\"" + std::string(value.string_value) + "\"";
+    case SqlValue::Type::kBytes:
+      return "\"<raw bytes>\"";
+  }
+  PERFETTO_FATAL("For GCC");
+}
+
 base::Status PrintQueryResultAsCsv(Iterator* it, bool has_more, FILE* output) {
   for (uint32_t c = 0; c < it->ColumnCount(); c++) {
     if (c > 0)
@@ -511,25 +533,7 @@ base::Status PrintQueryResultAsCsv(Iterator* it, bool has_more, FILE* output) {
     for (uint32_t c = 0; c < it->ColumnCount(); c++) {
       if (c > 0)
         fprintf(output, ",");
-
-      auto value = it->Get(c);
-      switch (value.type) {
-        case SqlValue::Type::kNull:
-          fprintf(output, "\"%s\"", "[NULL]");
-          break;
-        case SqlValue::Type::kDouble:
-          fprintf(output, "%f", value.double_value);
-          break;
-        case SqlValue::Type::kLong:
-          fprintf(output, "%" PRIi64, value.long_value);
-          break;
-        case SqlValue::Type::kString:
-          fprintf(output, "\"%s\"", value.string_value);
-          break;
-        case SqlValue::Type::kBytes:
-          fprintf(output, "\"%s\"", "<raw bytes>");
-          break;
-      }
+      fprintf(output, "%s", ToCsvField(it->Get(c)).c_str());
     }
     fprintf(output, "\n");
   }
@@ -546,6 +550,21 @@ base::Status RunQueriesWithoutOutput(const std::string& sql_query) {
                    : it.Status();
 }
 
+base::Status CheckOnlyLastStatementHasOutput(Iterator* it, bool has_more) {
+  uint32_t prev_with_output = has_more ? it->StatementWithOutputCount() - 1
+                                       : it->StatementWithOutputCount();
+  if (prev_with_output > 0) {
+    return base::ErrStatus(
+        "Result rows were returned for multiples queries. Ensure that only the "
+        "final statement is a SELECT statment or use `suppress_query_output` "
+        "to prevent function invocations causing this "
+        "error (see "
+        "https://perfetto.dev/docs/contributing/"
+        "testing#trace-processor-diff-tests).");
+  }
+  return base::OkStatus();
+}
+
 base::Status RunQueriesAndPrintResult(const std::string& sql_query,
                                       FILE* output) {
   PERFETTO_DLOG("Executing query: %s", sql_query.c_str());
@@ -557,19 +576,8 @@ base::Status RunQueriesAndPrintResult(const std::string& sql_query,
   bool has_more = it.Next();
   RETURN_IF_ERROR(it.Status());
 
-  uint32_t prev_count = it.StatementCount() - 1;
-  uint32_t prev_with_output = has_more ? it.StatementWithOutputCount() - 1
-                                       : it.StatementWithOutputCount();
-  uint32_t prev_without_output_count = prev_count - prev_with_output;
-  if (prev_with_output > 0) {
-    return base::ErrStatus(
-        "Result rows were returned for multiples queries. Ensure that only the "
-        "final statement is a SELECT statment or use `suppress_query_output` "
-        "to prevent function invocations causing this "
-        "error (see "
-        "https://perfetto.dev/docs/contributing/"
-        "testing#trace-processor-diff-tests).");
-  }
+  RETURN_IF_ERROR(CheckOnlyLastStatementHasOutput(&it, has_more));
+  uint32_t prev_without_output_count = it.StatementCount() - 1;
   for (uint32_t i = 0; i < prev_without_output_count; ++i) {
     fprintf(output, "\n");
   }
@@ -692,12 +700,18 @@ struct CommandLineOptions {
   bool analyze_trace_proto_content = false;
   bool crop_track_events = false;
   std::vector<std::string> dev_flags;
+  QueryBudget query_budget;
+  bool batch = false;
+  std::vector<std::string> batch_trace_paths;
+  uint32_t batch_threads = 0;
+  uint64_t batch_max_memory_bytes = 0;
 };
 
 void PrintUsage(char** argv) {
   PERFETTO_ELOG(R"(
 Interactive trace processor shell.
 Usage: %s [FLAGS] trace_file.pb
+       %s --batch -q FILE [FLAGS] trace_file.pb...
 
 Options:
  -h, --help                           Prints this guide.
@@ -745,6 +759,14 @@ Feature flags:
                                       Does not have any affect unless --dev is
                                       specified.
 
+Query budgets:
+ --query-timeout-ms MS                Aborts any query running for longer than
+                                      MS milliseconds.
+ --query-max-memory-mb MB             Aborts any query for which SQLite
+                                      allocates more than MB megabytes (e.g. to
+                                      sort or to materialize intermediate
+                                      results).
+
 Standard library:
  --add-sql-module MODULE_PATH         Files from the directory will be treated
                                       as a new SQL module and can be used for
@@ -783,8 +805,29 @@ Metatracing:
  --metatrace-buffer-capacity N        Sets metatrace event buffer to capture
                                       last N events.
  --metatrace-categories CATEGORIES    A comma-separated list of metatrace
-                                      categories to enable.)",
-                argv[0]);
+                                      categories to enable.
+
+Batch mode:
+ --batch                              Loads each of the trace files passed as
+                                      arguments in its own trace processor,
+                                      runs the query file given with -q on each
+                                      of them and prints the union of the
+                                      results as CSV, with an additional
+                                      trace_id column holding the path of the
+                                      trace each row comes from. Metrics can be
+                                      computed with RUN_METRIC in the query.
+ --batch-trace-list FILE              Reads the paths of the traces from FILE,
+                                      one per line, in addition to the ones
+                                      passed as arguments. Implies --batch.
+ --batch-threads N                    Loads and queries up to N traces
+                                      concurrently, each on its own thread
+                                      (default: the number of CPUs).
+ --batch-max-memory-mb MB             Only starts loading a trace if the
+                                      estimated memory use of the traces being
+                                      processed stays below MB megabytes. The
+                                      estimate is proportional to the size of
+                                      the trace files.)",
+                argv[0], argv[0]);
 }
 
 CommandLineOptions ParseCommandLineOptions(int argc, char** argv) {
@@ -806,6 +849,12 @@ CommandLineOptions ParseCommandLineOptions(int argc, char** argv) {
     OPT_ANALYZE_TRACE_PROTO_CONTENT,
     OPT_CROP_TRACK_EVENTS,
     OPT_DEV_FLAG,
+    OPT_QUERY_TIMEOUT_MS,
+    OPT_QUERY_MAX_MEMORY_MB,
+    OPT_BATCH,
+    OPT_BATCH_TRACE_LIST,
+    OPT_BATCH_THREADS,
+    OPT_BATCH_MAX_MEMORY_MB,
   };
 
   static const option long_options[] = {
@@ -839,6 +888,14 @@ CommandLineOptions ParseCommandLineOptions(int argc, char** argv) {
       {"metrics-output", required_argument, nullptr, OPT_METRICS_OUTPUT},
       {"metric-extension", required_argument, nullptr, OPT_METRIC_EXTENSION},
       {"dev-flag", required_argument, nullptr, OPT_DEV_FLAG},
+      {"query-timeout-ms", required_argument, nullptr, OPT_QUERY_TIMEOUT_MS},
+      {"query-max-memory-mb", required_argument, nullptr,
+       OPT_QUERY_MAX_MEMORY_MB},
+      {"batch", no_argument, nullptr, OPT_BATCH},
+      {"batch-trace-list", required_argument, nullptr, OPT_BATCH_TRACE_LIST},
+      {"batch-threads", required_argument, nullptr, OPT_BATCH_THREADS},
+      {"batch-max-memory-mb", required_argument, nullptr,
+       OPT_BATCH_MAX_MEMORY_MB},
       {nullptr, 0, nullptr, 0}};
 
   bool explicit_interactive = false;
@@ -982,10 +1039,77 @@ CommandLineOptions ParseCommandLineOptions(int argc, char** argv) {
       continue;
     }
 
+    if (option == OPT_QUERY_TIMEOUT_MS) {
+      command_line_options.query_budget.timeout_ms =
+          base::StringToUInt64(optarg).value_or(0);
+      continue;
+    }
+
+    if (option == OPT_QUERY_MAX_MEMORY_MB) {
+      command_line_options.query_budget.max_memory_bytes =
+          base::StringToUInt64(optarg).value_or(0) * 1024 * 1024;
+      continue;
+    }
+
+    if (option == OPT_BATCH) {
+      command_line_options.batch = true;
+      continue;
+    }
+
+    if (option == OPT_BATCH_TRACE_LIST) {
+      std::string list;
+      if (!base::ReadFile(optarg, &list)) {
+        PERFETTO_ELOG("Unable to read file %s", optarg);
+        exit(1);
+      }
+      for (base::StringSplitter lines(std::move(list), '\n'); lines.Next();) {
+        std::string path = base::TrimWhitespace(lines.cur_token());
+        if (!path.empty()) {
+          command_line_options.batch_trace_paths.push_back(path);
+        }
+      }
+      command_line_options.batch = true;
+      continue;
+    }
+
+    if (option == OPT_BATCH_THREADS) {
+      command_line_options.batch_threads =
+          base::StringToUInt32(optarg).value_or(0);
+      continue;
+    }
+
+    if (option == OPT_BATCH_MAX_MEMORY_MB) {
+      command_line_options.batch_max_memory_bytes =
+          base::StringToUInt64(optarg).value_or(0) * 1024 * 1024;
+      continue;
+    }
+
     PrintUsage(argv);
     exit(option == 'h' ? 0 : 1);
   }
 
+  if (command_line_options.batch) {
+    // Batch mode only supports running a query file and printing its result:
+    // all the other outputs are per trace.
+    if (command_line_options.query_file_path.empty() || explicit_interactive ||
+        command_line_options.enable_httpd ||
+        !command_line_options.sqlite_file_path.empty() ||
+        !command_line_options.metric_names.empty() ||
+        !command_line_options.perf_file_path.empty() ||
+        !command_line_options.metatrace_path.empty()) {
+      PrintUsage(argv);
+      exit(1);
+    }
+    for (int i = optind; i < argc; i++) {
+      command_line_options.batch_trace_paths.push_back(argv[i]);
+    }
+    if (command_line_options.batch_trace_paths.empty()) {
+      PrintUsage(argv);
+      exit(1);
+    }
+    return command_line_options;
+  }
+
   command_line_options.launch_shell =
       explicit_interactive || (command_line_options.pre_metrics_path.empty() &&
                                command_line_options.metric_names.empty() &&
@@ -1546,6 +1670,188 @@ base::Status MaybeUpdateSqlModules(const CommandLineOptions& options) {
   return base::OkStatus();
 }
 
+// The memory used by a trace processor for each byte of trace file, as
+// assumed by --batch-max-memory-mb. Errs on the high side as compressed traces
+// expand when loaded.
+constexpr uint64_t kBatchMemoryPerTraceFileByte = 4;
+
+// Loads the trace at |path| in a new trace processor, runs |sql_query| on it
+// and appends the result to |output| as CSV: a header line with the column
+// names and then one line per row. The first column holds |path|.
+base::Status RunBatchQuery(const Config& config,
+                           const std::string& path,
+                           const std::string& sql_query,
+                           std::string* output) {
+  std::unique_ptr<TraceProcessor> tp = TraceProcessor::CreateInstance(config);
+  base::Status status = ReadTraceUnfinalized(tp.get(), path.c_str());
+  tp->Flush();
+  tp->NotifyEndOfFile();
+  if (!status.ok()) {
+    return base::ErrStatus("Could not read trace file (path: %s): %s",
+                           path.c_str(), status.c_message());
+  }
+
+  auto it = tp->ExecuteQuery(sql_query);
+  bool has_more = it.Next();
+  status = it.Status();
+  if (status.ok()) {
+    status = CheckOnlyLastStatementHasOutput(&it, has_more);
+  }
+  if (!status.ok()) {
+    return base::ErrStatus("%s: %s", path.c_str(), status.c_message());
+  }
+  *output += ToCsvField(SqlValue::String("trace_id"));
+  for (uint32_t c = 0; c < it.ColumnCount(); c++) {
+    std::string name = it.GetColumnName(c);
+    *output += "," + ToCsvField(SqlValue::String(name.c_str()));
+  }
+  *output += "\n";
+  std::string trace_id = ToCsvField(SqlValue::String(path.c_str()));
+  for (; has_more; has_more = it.Next()) {
+    *output += trace_id;
+    for (uint32_t c = 0; c < it.ColumnCount(); c++) {
+      *output += "," + ToCsvField(it.Get(c));
+    }
+    *output += "\n";
+  }
+  status = it.Status();
+  if (!status.ok()) {
+    return base::ErrStatus("%s: %s", path.c_str(), status.c_message());
+  }
+  return base::OkStatus();
+}
+
+// A trace of the batch.
+struct BatchTrace {
+  // The result of RunBatchQuery().
+  std::string output;
+  // Set once the trace was processed.
+  std::optional<base::Status> status;
+};
+
+// Copies the |output| of RunBatchQuery() to stdout, checking that its header
+// matches |header|, or setting it for the first trace.
+base::Status PrintBatchTraceOutput(const std::string& path,
+                                   const std::string& output,
+                                   std::optional<std::string>* header) {
+  size_t header_end = output.find('\n');
+  PERFETTO_CHECK(header_end != std::string::npos);
+  std::string trace_header = output.substr(0, header_end);
+  if (!*header) {
+    *header = trace_header;
+    fprintf(stdout, "%s\n", trace_header.c_str());
+  } else if (**header != trace_header) {
+    return base::ErrStatus(
+        "%s: the columns of the result differ from the ones of the previous "
+        "traces",
+        path.c_str());
+  }
+  fwrite(output.data() + header_end + 1, 1, output.size() - header_end - 1,
+         stdout);
+  return base::OkStatus();
+}
+
+// Runs the query file on each of the traces of the batch, each in its own
+// trace processor on a thread pool of --batch-threads threads, and prints the
+// results in the order of the traces as they become available. The results of
+// the traces which finish out of order are kept in memory until then.
+base::Status RunBatch(const Config& config, const CommandLineOptions& options) {
+  std::string sql_query;
+  if (!base::ReadFile(options.query_file_path, &sql_query)) {
+    return base::ErrStatus("Unable to read file %s",
+                           options.query_file_path.c_str());
+  }
+
+  const std::vector<std::string>& paths = options.batch_trace_paths;
+  std::vector<uint64_t> estimated_memory(paths.size());
+  for (size_t i = 0; i < paths.size(); i++) {
+    struct stat st;
+    if (stat(paths[i].c_str(), &st) == 0) {
+      estimated_memory[i] =
+          static_cast<uint64_t>(st.st_size) * kBatchMemoryPerTraceFileByte;
+    }
+  }
+
+  uint32_t thread_count = options.batch_threads;
+  if (thread_count == 0) {
+    thread_count = std::max(std::thread::hardware_concurrency(), 1u);
+  }
+
+  size_t next_trace = 0;
+  size_t next_output = 0;
+  size_t running_count = 0;
+  uint64_t reserved_memory = 0;
+  std::optional<std::string> header;
+  size_t failed_count = 0;
+
+  std::mutex mutex;
+  std::condition_variable trace_done;
+  // Start of |mutex| protected members.
+  std::vector<BatchTrace> traces(paths.size());
+  // The traces processed since the main thread last looked.
+  std::vector<size_t> done_traces;
+  // End of |mutex| protected members.
+
+  // Destroyed, i.e. joined, before anything the tasks refer to.
+  base::ThreadPool thread_pool(thread_count);
+
+  // Traces are started in order. A trace is started if it fits within the
+  // memory budget or if nothing else is running, so that a trace larger than
+  // the budget is still processed, on its own.
+  auto can_start_next = [&]() {
+    return next_trace < paths.size() && running_count < thread_count &&
+           (reserved_memory == 0 || options.batch_max_memory_bytes == 0 ||
+            reserved_memory + estimated_memory[next_trace] <=
+                options.batch_max_memory_bytes);
+  };
+  std::unique_lock<std::mutex> lock(mutex);
+  while (next_output < paths.size()) {
+    for (; can_start_next(); next_trace++) {
+      running_count++;
+      reserved_memory += estimated_memory[next_trace];
+      thread_pool.PostTask([&, i = next_trace] {
+        std::string output;
+        base::Status status =
+            RunBatchQuery(config, paths[i], sql_query, &output);
+        std::lock_guard<std::mutex> task_lock(mutex);
+        traces[i].output = std::move(output);
+        traces[i].status = std::move(status);
+        done_traces.push_back(i);
+        trace_done.notify_one();
+      });
+    }
+
+    trace_done.wait(lock, [&] { return !done_traces.empty(); });
+    for (size_t i : done_traces) {
+      running_count--;
+      reserved_memory -= estimated_memory[i];
+    }
+    done_traces.clear();
+
+    for (; next_output < paths.size() && traces[next_output].status;
+         next_output++) {
+      std::string output = std::move(traces[next_output].output);
+      base::Status status = *traces[next_output].status;
+      lock.unlock();
+      if (status.ok()) {
+        status = PrintBatchTraceOutput(paths[next_output], output, &header);
+      }
+      if (!status.ok()) {
+        PERFETTO_ELOG("%s", status.c_message());
+        failed_count++;
+      }
+      lock.lock();
+    }
+  }
+  lock.unlock();
+
+  if (failed_count > 0) {
+    return base::ErrStatus("Query failed on %zu of %zu traces", failed_count,
+                           paths.size());
+  }
+  return base::OkStatus();
+}
+
 base::Status TraceProcessorMain(int argc, char** argv) {
   CommandLineOptions options = ParseCommandLineOptions(argc, argv);
 
@@ -1559,6 +1865,7 @@ base::Status TraceProcessorMain(int argc, char** argv) {
       options.crop_track_events
           ? DropTrackEventDataBefore::kTrackEventRangeOfInterest
           : DropTrackEventDataBefore::kNoDrop;
+  config.query_budget = options.query_budget;
 
   std::vector<MetricExtension> metric_extensions;
   RETURN_IF_ERROR(ParseMetricExtensionPaths(
@@ -1580,6 +1887,10 @@ base::Status TraceProcessorMain(int argc, char** argv) {
     }
   }
 
+  if (options.batch) {
+    return RunBatch(config, options);
+  }
+
   std::unique_ptr<TraceProcessor> tp = TraceProcessor::CreateInstance(config);
   g_tp = tp.get();
 
@@ -1680,7 +1991,8 @@ base::Status TraceProcessorMain(int argc, char** argv) {
     }
 #endif
 
-    RunHttpRPCServer(std::move(tp), options.port_number);
+    RunHttpRPCServer(std::move(tp), options.port_number,
+                     options.query_budget);
     PERFETTO_FATAL("Should never return");
   }
 #endif
@@ -150,6 +150,8 @@ void TraceProcessorStorageImpl::NotifyEndOfFile() {
 
 void TraceProcessorStorageImpl::DestroyContext() {
   TraceProcessorContext context;
+  // The config is still needed to run queries (e.g. for the query budget).
+  context.config = context_.config;
   context.storage = std::move(context_.storage);
   context.heap_graph_tracker = std::move(context_.heap_graph_tracker);
   context.clock_converter = std::move(context_.clock_converter);
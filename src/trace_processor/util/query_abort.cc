@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "src/trace_processor/util/query_abort.h"
+
+namespace perfetto {
+namespace trace_processor {
+namespace {
+
+thread_local const QueryAbortCheck* g_thread_query_abort_check = nullptr;
+
+}  // namespace
+
+QueryAbortCheck::~QueryAbortCheck() = default;
+
+const QueryAbortCheck* SetThreadQueryAbortCheck(const QueryAbortCheck* check) {
+  const QueryAbortCheck* prev = g_thread_query_abort_check;
+  g_thread_query_abort_check = check;
+  return prev;
+}
+
+base::Status CheckQueryAbort() {
+  const QueryAbortCheck* check = g_thread_query_abort_check;
+  return check ? check->Check() : base::OkStatus();
+}
+
+}  // namespace trace_processor
+}  // namespace perfetto
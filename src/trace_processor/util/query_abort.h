@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SRC_TRACE_PROCESSOR_UTIL_QUERY_ABORT_H_
+#define SRC_TRACE_PROCESSOR_UTIL_QUERY_ABORT_H_
+
+#include <cstdint>
+
+#include "perfetto/base/compiler.h"
+#include "perfetto/trace_processor/status.h"
+
+namespace perfetto {
+namespace trace_processor {
+
+// Decides whether the query running on a thread should be aborted, e.g.
+// because it was interrupted or exceeded its budget.
+//
+// SQLite checks this from a progress handler, which is not called while
+// control is in C++ code (the filtering of the db layer, the computation of
+// table functions): long loops in such code call CheckQueryAbort() (or use a
+// QueryAbortPoller) to give up early.
+class QueryAbortCheck {
+ public:
+  virtual ~QueryAbortCheck();
+
+  // Returns an error if the query should be aborted. Once it does, it should
+  // keep doing so until the query is over.
+  virtual base::Status Check() const = 0;
+};
+
+// Installs |check| (which can be nullptr) as the check of the query running on
+// the calling thread. Returns the previously installed one.
+const QueryAbortCheck* SetThreadQueryAbortCheck(const QueryAbortCheck* check);
+
+// Returns an error if the query running on the calling thread, if any, should
+// be aborted.
+base::Status CheckQueryAbort();
+
+// Calls CheckQueryAbort() only once every |kInterval| calls to Poll(), for use
+// in loops whose iterations are much cheaper than the check.
+class QueryAbortPoller {
+ public:
+  static constexpr uint32_t kInterval = 4096;
+
+  base::Status Poll() {
+    if (PERFETTO_LIKELY(++count_ % kInterval != 0))
+      return base::OkStatus();
+    return CheckQueryAbort();
+  }
+
+ private:
+  uint32_t count_ = 0;
+};
+
+}  // namespace trace_processor
+}  // namespace perfetto
+
+#endif  // SRC_TRACE_PROCESSOR_UTIL_QUERY_ABORT_H_
@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "src/trace_processor/util/query_abort.h"
+
+#include "test/gtest_and_gmock.h"
+
+namespace perfetto {
+namespace trace_processor {
+namespace {
+
+class FakeQueryAbortCheck : public QueryAbortCheck {
+ public:
+  base::Status Check() const override {
+    ++check_count;
+    return aborted ? base::ErrStatus("Aborted") : base::OkStatus();
+  }
+
+  bool aborted = false;
+  mutable uint32_t check_count = 0;
+};
+
+TEST(QueryAbortTest, NoCheckInstalled) {
+  ASSERT_TRUE(CheckQueryAbort().ok());
+}
+
+TEST(QueryAbortTest, InstalledCheckIsUsedUntilRestored) {
+  FakeQueryAbortCheck outer;
+  FakeQueryAbortCheck inner;
+  inner.aborted = true;
+
+  ASSERT_EQ(SetThreadQueryAbortCheck(&outer), nullptr);
+  ASSERT_TRUE(CheckQueryAbort().ok());
+
+  ASSERT_EQ(SetThreadQueryAbortCheck(&inner), &outer);
+  ASSERT_EQ(CheckQueryAbort().message(), "Aborted");
+
+  ASSERT_EQ(SetThreadQueryAbortCheck(&outer), &inner);
+  ASSERT_TRUE(CheckQueryAbort().ok());
+
+  ASSERT_EQ(SetThreadQueryAbortCheck(nullptr), &outer);
+  ASSERT_TRUE(CheckQueryAbort().ok());
+}
+
+TEST(QueryAbortTest, PollerChecksOnceEveryInterval) {
+  FakeQueryAbortCheck check;
+  check.aborted = true;
+  const QueryAbortCheck* prev = SetThreadQueryAbortCheck(&check);
+
+  QueryAbortPoller poller;
+  for (uint32_t i = 1; i < QueryAbortPoller::kInterval; ++i) {
+    ASSERT_TRUE(poller.Poll().ok());
+  }
+  ASSERT_FALSE(poller.Poll().ok());
+  ASSERT_EQ(check.check_count, 1u);
+
+  SetThreadQueryAbortCheck(prev);
+}
+
+}  // namespace
+}  // namespace trace_processor
+}  // namespace perfetto
@@ -18,8 +18,11 @@
 #define SRC_TRACE_PROCESSOR_UTIL_SQL_MODULES_H_
 
 #include <string>
+#include <utility>
+#include <vector>
 
 #include "perfetto/ext/base/flat_hash_map.h"
+#include "perfetto/ext/base/hash.h"
 #include "perfetto/ext/base/string_splitter.h"
 #include "perfetto/ext/base/string_view.h"
 
@@ -35,8 +38,22 @@ using NameToModule =
 // function.
 struct RegisteredModule {
   struct ModuleFile {
+    ModuleFile(std::string file_sql, bool is_included)
+        : sql(std::move(file_sql)),
+          included(is_included),
+          sql_hash(base::Hasher::Combine(sql)) {}
+
     std::string sql;
     bool included;
+
+    // Hash of |sql|. Used to decide whether the objects created by a previous
+    // include of this file can be reused when the module is re-registered.
+    uint64_t sql_hash;
+
+    // (type, name) of the tables, views and indices created when this file was
+    // included. These survive RestoreInitialTables() as long as the file is
+    // not changed and are dropped when a changed version is registered.
+    std::vector<std::pair<std::string, std::string>> created_objects;
   };
   base::FlatHashMap<std::string, ModuleFile> include_key_to_file;
 };
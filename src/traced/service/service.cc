@@ -16,6 +16,7 @@
 
 #include <stdio.h>
 #include <algorithm>
+#include <optional>
 
 #include "perfetto/base/status.h"
 #include "perfetto/ext/base/file_utils.h"
@@ -53,6 +54,15 @@ Options and arguments
         <prod_mode> is the mode bits (e.g. 0660) for chmod the produce socket,
         <cons_group> is the group name for chgrp the consumer socket, and
         <cons_mode> is the mode bits (e.g. 0660) for chmod the consumer socket.
+    --copy-threads <N> : copies the data committed by producers into the trace
+        buffers on N worker threads, rather than on the main service thread.
+        Useful on machines with many producers writing at high rates.
+    --compression-threads <N> : compresses large batches of trace packets on N
+        worker threads when the trace config enables compression.
+    --persistent-buffers-dir <dir> : backs the buffers that have
+        BufferConfig.persistent set with files in <dir>. On startup, the
+        buffers left behind by a previous instance that crashed or was killed
+        are recovered into trace files in <dir>.
 
 Example:
     %s --set-socket-permissions traced-producer:0660:traced-consumer:0660
@@ -69,15 +79,26 @@ int PERFETTO_EXPORT_ENTRYPOINT ServiceMain(int argc, char** argv) {
     OPT_VERSION = 1000,
     OPT_SET_SOCKET_PERMISSIONS = 1001,
     OPT_BACKGROUND,
+    OPT_COPY_THREADS,
+    OPT_COMPRESSION_THREADS,
+    OPT_PERSISTENT_BUFFERS_DIR,
   };
 
   bool background = false;
+  uint32_t copy_threads = 0;
+  uint32_t compression_threads = 0;
+  std::string persistent_buffers_dir;
 
   static const option long_options[] = {
       {"background", no_argument, nullptr, OPT_BACKGROUND},
       {"version", no_argument, nullptr, OPT_VERSION},
       {"set-socket-permissions", required_argument, nullptr,
        OPT_SET_SOCKET_PERMISSIONS},
+      {"copy-threads", required_argument, nullptr, OPT_COPY_THREADS},
+      {"compression-threads", required_argument, nullptr,
+       OPT_COMPRESSION_THREADS},
+      {"persistent-buffers-dir", required_argument, nullptr,
+       OPT_PERSISTENT_BUFFERS_DIR},
       {nullptr, 0, nullptr, 0}};
 
   std::string producer_socket_group, consumer_socket_group,
@@ -107,6 +128,27 @@ int PERFETTO_EXPORT_ENTRYPOINT ServiceMain(int argc, char** argv) {
         consumer_socket_mode = parts[3];
         break;
       }
+      case OPT_COPY_THREADS: {
+        std::optional<uint32_t> threads = base::CStringToUInt32(optarg);
+        if (!threads || *threads > 64) {
+          PERFETTO_ELOG("--copy-threads must be a number in [0, 64]");
+          return 1;
+        }
+        copy_threads = *threads;
+        break;
+      }
+      case OPT_COMPRESSION_THREADS: {
+        std::optional<uint32_t> threads = base::CStringToUInt32(optarg);
+        if (!threads || *threads > 64) {
+          PERFETTO_ELOG("--compression-threads must be a number in [0, 64]");
+          return 1;
+        }
+        compression_threads = *threads;
+        break;
+      }
+      case OPT_PERSISTENT_BUFFERS_DIR:
+        persistent_buffers_dir = optarg;
+        break;
       default:
         PrintUsage(argv[0]);
         return 1;
@@ -123,6 +165,9 @@ int PERFETTO_EXPORT_ENTRYPOINT ServiceMain(int argc, char** argv) {
 #if PERFETTO_BUILDFLAG(PERFETTO_ZLIB)
   init_opts.compressor_fn = &ZlibCompressFn;
 #endif
+  init_opts.copy_threads = copy_threads;
+  init_opts.compression_threads = compression_threads;
+  init_opts.persistent_buffers_dir = persistent_buffers_dir;
   svc = ServiceIPCHost::CreateInstance(&task_runner, init_opts);
 
   // When built as part of the Android tree, the two socket are created and
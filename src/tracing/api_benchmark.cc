@@ -14,6 +14,10 @@
 
 #include <benchmark/benchmark.h>
 
+#include <memory>
+#include <mutex>
+#include <string>
+
 #include "perfetto/tracing.h"
 #include "protos/perfetto/trace/test_event.pbzero.h"
 #include "protos/perfetto/trace/trace.pbzero.h"
@@ -167,6 +171,42 @@ static void BM_TracingTrackEventLambda(benchmark::State& state) {
   PERFETTO_CHECK(!tracing_session->ReadTraceBlocking().empty());
 }
 
+// The tracing session of the multi-threaded benchmarks: started by the first
+// thread of the benchmark and stopped by the last one.
+std::mutex g_shared_session_mutex;
+int g_shared_session_threads = 0;
+std::unique_ptr<perfetto::TracingSession> g_shared_session;
+
+void JoinSharedTracingSession() {
+  std::lock_guard<std::mutex> lock(g_shared_session_mutex);
+  if (g_shared_session_threads++ == 0)
+    g_shared_session = StartTracing("track_event");
+}
+
+void LeaveSharedTracingSession() {
+  std::lock_guard<std::mutex> lock(g_shared_session_mutex);
+  if (--g_shared_session_threads == 0) {
+    g_shared_session->StopBlocking();
+    PERFETTO_CHECK(!g_shared_session->ReadTraceBlocking().empty());
+    g_shared_session.reset();
+  }
+}
+
+// Emits events from several threads at once, stressing the acquisition of
+// chunks in the shared memory buffer. Each event is large enough for a thread
+// to fill a chunk every few events.
+static void BM_TracingTrackEventMultiThreaded(benchmark::State& state) {
+  JoinSharedTracingSession();
+  const std::string payload(256, 'x');
+
+  for (auto _ : state) {
+    TRACE_EVENT_BEGIN("benchmark", "Event", "payload", payload);
+    benchmark::ClobberMemory();
+  }
+
+  LeaveSharedTracingSession();
+}
+
 }  // namespace
 
 BENCHMARK(BM_TracingDataSourceDisabled);
@@ -176,3 +216,4 @@ BENCHMARK(BM_TracingTrackEventBasic);
 BENCHMARK(BM_TracingTrackEventDebugAnnotations);
 BENCHMARK(BM_TracingTrackEventDisabled);
 BENCHMARK(BM_TracingTrackEventLambda);
+BENCHMARK(BM_TracingTrackEventMultiThreaded)->ThreadRange(1, 32)->UseRealTime();
@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "src/tracing/core/sharded_workers.h"
+
+#include <string>
+#include <utility>
+
+#include "perfetto/base/logging.h"
+#include "perfetto/ext/base/thread_utils.h"
+
+namespace perfetto {
+
+ShardedWorkers::ShardedWorkers(uint32_t num_threads,
+                               const char* thread_name_prefix)
+    : thread_name_prefix_(thread_name_prefix), shards_(num_threads) {
+  PERFETTO_CHECK(num_threads > 0);
+  for (size_t i = 0; i < shards_.size(); i++)
+    shards_[i].thread = std::thread(&ShardedWorkers::RunShard, this, i);
+}
+
+ShardedWorkers::~ShardedWorkers() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    quit_ = true;
+  }
+  for (Shard& shard : shards_) {
+    shard.tasks_cv.notify_one();
+    shard.thread.join();
+  }
+}
+
+void ShardedWorkers::PostTask(size_t shard, std::function<void()> task) {
+  Shard& dst = shards_[shard % shards_.size()];
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    dst.tasks.emplace_back(std::move(task));
+    pending_tasks_++;
+  }
+  dst.tasks_cv.notify_one();
+}
+
+void ShardedWorkers::WaitForIdle() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  idle_cv_.wait(lock, [this] { return pending_tasks_ == 0; });
+}
+
+void ShardedWorkers::RunShard(size_t shard_idx) {
+  base::MaybeSetThreadName(thread_name_prefix_ + std::to_string(shard_idx));
+  Shard& shard = shards_[shard_idx];
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (;;) {
+    shard.tasks_cv.wait(
+        lock, [this, &shard] { return quit_ || !shard.tasks.empty(); });
+    if (shard.tasks.empty())
+      return;  // |quit_| is set and all the tasks have run.
+    std::function<void()> task = std::move(shard.tasks.front());
+    shard.tasks.pop_front();
+    lock.unlock();
+    task();
+    lock.lock();
+    if (--pending_tasks_ == 0)
+      idle_cv_.notify_all();
+  }
+}
+
+}  // namespace perfetto
@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SRC_TRACING_CORE_SHARDED_WORKERS_H_
+#define SRC_TRACING_CORE_SHARDED_WORKERS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace perfetto {
+
+// A fixed set of worker threads, one per shard, used by the service to move
+// CPU heavy work off its task runner:
+// - Copying the chunks committed by producers into the TraceBuffer(s), when
+//   TracingServiceInitOpts.copy_threads > 0. Each TraceBuffer is assigned to
+//   one shard and only the worker thread of that shard copies chunks into it,
+//   so TraceBuffer(s) need no locking.
+// - Compressing the packets read from the TraceBuffer(s), when
+//   TracingServiceInitOpts.compression_threads > 0.
+//
+// Tasks posted to the same shard run in order. The service thread must call
+// WaitForIdle() before accessing the data that queued tasks use (e.g. before
+// reading a TraceBuffer, or before a producer's SMB goes away).
+class ShardedWorkers {
+ public:
+  // The threads are named |thread_name_prefix| followed by the shard index.
+  ShardedWorkers(uint32_t num_threads, const char* thread_name_prefix);
+
+  // Runs the tasks still queued, then joins the threads.
+  ~ShardedWorkers();
+
+  ShardedWorkers(const ShardedWorkers&) = delete;
+  ShardedWorkers& operator=(const ShardedWorkers&) = delete;
+
+  size_t num_shards() const { return shards_.size(); }
+
+  // Runs |task| on the worker thread of |shard| (modulo num_shards()).
+  void PostTask(size_t shard, std::function<void()> task);
+
+  // Blocks until all the tasks posted so far have run.
+  void WaitForIdle();
+
+ private:
+  struct Shard {
+    std::deque<std::function<void()>> tasks;
+    std::condition_variable tasks_cv;
+    std::thread thread;
+  };
+
+  void RunShard(size_t shard_idx);
+
+  const std::string thread_name_prefix_;
+  std::mutex mutex_;
+  std::condition_variable idle_cv_;
+  // Tasks posted and not run yet, across all shards.
+  size_t pending_tasks_ = 0;
+  bool quit_ = false;
+  std::vector<Shard> shards_;
+};
+
+}  // namespace perfetto
+
+#endif  // SRC_TRACING_CORE_SHARDED_WORKERS_H_
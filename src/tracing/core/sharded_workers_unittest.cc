@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "src/tracing/core/sharded_workers.h"
+
+#include <thread>
+#include <vector>
+
+#include "test/gtest_and_gmock.h"
+
+namespace perfetto {
+namespace {
+
+TEST(ShardedWorkersTest, TasksOfAShardRunInOrder) {
+  ShardedWorkers workers(3, "test-worker");
+  ASSERT_EQ(workers.num_shards(), 3u);
+
+  // Each shard only touches its own vector, as the service does with the
+  // TraceBuffer(s).
+  std::vector<std::vector<int>> results(workers.num_shards());
+  std::vector<std::thread::id> thread_ids(workers.num_shards());
+  for (int i = 0; i < 300; i++) {
+    size_t shard = static_cast<size_t>(i) % workers.num_shards();
+    workers.PostTask(shard, [&results, &thread_ids, shard, i] {
+      results[shard].push_back(i);
+      thread_ids[shard] = std::this_thread::get_id();
+    });
+  }
+  workers.WaitForIdle();
+
+  for (size_t shard = 0; shard < results.size(); shard++) {
+    ASSERT_EQ(results[shard].size(), 100u);
+    for (size_t j = 0; j < results[shard].size(); j++)
+      EXPECT_EQ(results[shard][j], static_cast<int>(shard + j * 3));
+    EXPECT_NE(thread_ids[shard], std::this_thread::get_id());
+  }
+}
+
+TEST(ShardedWorkersTest, DestructorRunsQueuedTasks) {
+  int runs = 0;
+  {
+    ShardedWorkers workers(1, "test-worker");
+    for (int i = 0; i < 100; i++)
+      workers.PostTask(0, [&runs] { runs++; });
+  }
+  EXPECT_EQ(runs, 100);
+}
+
+}  // namespace
+}  // namespace perfetto
@@ -18,10 +18,13 @@
 
 #include <algorithm>
 #include <limits>
+#include <thread>
 #include <utility>
 
+#include "perfetto/base/build_config.h"
 #include "perfetto/base/logging.h"
 #include "perfetto/base/task_runner.h"
+#include "perfetto/base/thread_utils.h"
 #include "perfetto/base/time.h"
 #include "perfetto/ext/tracing/core/commit_data_request.h"
 #include "perfetto/ext/tracing/core/shared_memory.h"
@@ -29,6 +32,11 @@
 #include "src/tracing/core/null_trace_writer.h"
 #include "src/tracing/core/trace_writer_impl.h"
 
+#if PERFETTO_BUILDFLAG(PERFETTO_OS_LINUX) || \
+    PERFETTO_BUILDFLAG(PERFETTO_OS_ANDROID)
+#include <sched.h>
+#endif
+
 namespace perfetto {
 
 using Chunk = SharedMemoryABI::Chunk;
@@ -47,6 +55,18 @@ MaybeUnboundBufferID MakeTargetBufferIdForReservation(uint16_t reservation_id) {
 bool IsReservationTargetBufferId(MaybeUnboundBufferID buffer_id) {
   return (buffer_id >> 16) > 0;
 }
+
+// Returns the page shard the calling thread should acquire chunks from.
+size_t GetPageShardForCurrentThread(size_t num_shards) {
+#if PERFETTO_BUILDFLAG(PERFETTO_OS_LINUX) || \
+    PERFETTO_BUILDFLAG(PERFETTO_OS_ANDROID)
+  int cpu = sched_getcpu();
+  if (cpu >= 0)
+    return static_cast<size_t>(cpu) % num_shards;
+#endif
+  // Spread the threads instead, which still avoids most of the contention.
+  return static_cast<size_t>(base::GetThreadId()) % num_shards;
+}
 }  // namespace
 
 // static
@@ -89,13 +109,94 @@ SharedMemoryArbiterImpl::SharedMemoryArbiterImpl(
       active_writer_ids_(kMaxWriterID),
       fully_bound_(task_runner && producer_endpoint),
       was_always_bound_(fully_bound_),
-      weak_ptr_factory_(this) {}
+      weak_ptr_factory_(this) {
+  const size_t num_pages = shmem_abi_.num_pages();
+  size_t num_shards = std::min<size_t>(std::thread::hardware_concurrency(),
+                                       num_pages / kMinPagesPerShard);
+  if (num_shards < 2)
+    return;
+  num_page_shards_ = num_shards;
+  page_shards_.reset(new PageShard[num_shards]);
+  for (size_t i = 0; i < num_shards; i++) {
+    PageShard& shard = page_shards_[i];
+    shard.begin_page = i * num_pages / num_shards;
+    shard.end_page = (i + 1) * num_pages / num_shards;
+    shard.next_page.store(shard.begin_page, std::memory_order_relaxed);
+  }
+}
+
+SharedMemoryABI::PageLayout SharedMemoryArbiterImpl::GetLayoutForSizeHint(
+    size_t size_hint) const {
+  if (size_hint == 0)
+    return default_page_layout;
+  for (uint32_t layout = SharedMemoryABI::kPageDiv14;
+       layout > SharedMemoryABI::kPageDiv1; layout--) {
+    size_t chunk_size = shmem_abi_.GetChunkSizeForLayout(
+        layout << SharedMemoryABI::kLayoutShift);
+    if (chunk_size - sizeof(SharedMemoryABI::ChunkHeader) >= size_hint)
+      return static_cast<SharedMemoryABI::PageLayout>(layout);
+  }
+  return SharedMemoryABI::kPageDiv1;
+}
+
+Chunk SharedMemoryArbiterImpl::TryAcquireChunkInPage(
+    size_t page_idx,
+    const SharedMemoryABI::ChunkHeader& header,
+    SharedMemoryABI::PageLayout layout,
+    bool any_layout) {
+  bool is_new_page = false;
+  if (shmem_abi_.is_page_free(page_idx))
+    is_new_page = shmem_abi_.TryPartitionPage(page_idx, layout);
+
+  uint32_t free_chunks;
+  if (is_new_page) {
+    free_chunks = (1 << SharedMemoryABI::kNumChunksForLayout[layout]) - 1;
+  } else {
+    uint32_t page_layout = shmem_abi_.GetPageLayout(page_idx);
+    if (!any_layout && (page_layout & SharedMemoryABI::kLayoutMask) !=
+                           (layout << SharedMemoryABI::kLayoutShift)) {
+      return Chunk();
+    }
+    free_chunks = shmem_abi_.GetFreeChunks(page_idx);
+  }
+
+  for (uint32_t chunk_idx = 0; free_chunks; chunk_idx++, free_chunks >>= 1) {
+    if (!(free_chunks & 1))
+      continue;
+    // We found a free chunk.
+    Chunk chunk =
+        shmem_abi_.TryAcquireChunkForWriting(page_idx, chunk_idx, &header);
+    if (chunk.is_valid())
+      return chunk;
+  }
+  return Chunk();
+}
+
+Chunk SharedMemoryArbiterImpl::TryAcquireChunkFromPageShard(
+    const SharedMemoryABI::ChunkHeader& header,
+    SharedMemoryABI::PageLayout layout,
+    bool any_layout) {
+  PageShard& shard =
+      page_shards_[GetPageShardForCurrentThread(num_page_shards_)];
+  const size_t shard_pages = shard.end_page - shard.begin_page;
+  const size_t first_page = shard.next_page.load(std::memory_order_relaxed);
+  for (size_t i = 0; i < shard_pages; i++) {
+    size_t page_idx =
+        shard.begin_page + (first_page - shard.begin_page + i) % shard_pages;
+    Chunk chunk = TryAcquireChunkInPage(page_idx, header, layout, any_layout);
+    if (chunk.is_valid()) {
+      shard.next_page.store(page_idx, std::memory_order_relaxed);
+      return chunk;
+    }
+  }
+  return Chunk();
+}
 
 Chunk SharedMemoryArbiterImpl::GetNewChunk(
     const SharedMemoryABI::ChunkHeader& header,
     BufferExhaustedPolicy buffer_exhausted_policy,
     size_t size_hint) {
-  PERFETTO_DCHECK(size_hint == 0);  // Not implemented yet.
+  const SharedMemoryABI::PageLayout layout = GetLayoutForSizeHint(size_hint);
 
   int stall_count = 0;
   unsigned stall_interval_us = 0;
@@ -105,6 +206,16 @@ Chunk SharedMemoryArbiterImpl::GetNewChunk(
   static const int kFlushCommitsAfterEveryNStalls = 2;
   static const int kAssertAtNStalls = 200;
 
+  // Writers in kStall mode take the lock: they might have to commit
+  // synchronously (see below).
+  if (page_shards_ && buffer_exhausted_policy == BufferExhaustedPolicy::kDrop) {
+    Chunk chunk =
+        TryAcquireChunkFromPageShard(header, layout, size_hint == 0);
+    if (chunk.is_valid())
+      return chunk;
+    // The shard is full: look for a free chunk in the whole SMB.
+  }
+
   for (;;) {
     // TODO(primiano): Probably this lock is not really required and this code
     // could be rewritten leveraging only the Try* atomic operations in
@@ -138,47 +249,29 @@ Chunk SharedMemoryArbiterImpl::GetNewChunk(
           buffer_exhausted_policy == BufferExhaustedPolicy::kStall &&
           commit_data_req_ && bytes_pending_commit_ >= shmem_abi_.size() / 2;
 
+      // With a size hint, the first pass over the SMB only takes chunks of the
+      // hinted layout and the second one settles for any free chunk.
+      const size_t num_pages = shmem_abi_.num_pages();
+      const size_t num_passes = size_hint ? 2 : 1;
       const size_t initial_page_idx = page_idx_;
-      for (size_t i = 0; i < shmem_abi_.num_pages(); i++) {
-        page_idx_ = (initial_page_idx + i) % shmem_abi_.num_pages();
-        bool is_new_page = false;
-
-        // TODO(primiano): make the page layout dynamic.
-        auto layout = SharedMemoryArbiterImpl::default_page_layout;
-
-        if (shmem_abi_.is_page_free(page_idx_)) {
-          // TODO(primiano): Use the |size_hint| here to decide the layout.
-          is_new_page = shmem_abi_.TryPartitionPage(page_idx_, layout);
-        }
-        uint32_t free_chunks;
-        if (is_new_page) {
-          free_chunks = (1 << SharedMemoryABI::kNumChunksForLayout[layout]) - 1;
-        } else {
-          free_chunks = shmem_abi_.GetFreeChunks(page_idx_);
+      for (size_t i = 0; i < num_pages * num_passes; i++) {
+        page_idx_ = (initial_page_idx + i) % num_pages;
+        const bool any_layout = size_hint == 0 || i >= num_pages;
+        Chunk chunk =
+            TryAcquireChunkInPage(page_idx_, header, layout, any_layout);
+        if (!chunk.is_valid())
+          continue;
+        if (stall_count > kLogAfterNStalls) {
+          PERFETTO_LOG("Recovered from stall after %d iterations", stall_count);
         }
 
-        for (uint32_t chunk_idx = 0; free_chunks;
-             chunk_idx++, free_chunks >>= 1) {
-          if (!(free_chunks & 1))
-            continue;
-          // We found a free chunk.
-          Chunk chunk = shmem_abi_.TryAcquireChunkForWriting(
-              page_idx_, chunk_idx, &header);
-          if (!chunk.is_valid())
-            continue;
-          if (stall_count > kLogAfterNStalls) {
-            PERFETTO_LOG("Recovered from stall after %d iterations",
-                         stall_count);
-          }
-
-          if (should_commit_synchronously) {
-            // We can't flush while holding the lock.
-            scoped_lock.unlock();
-            FlushPendingCommitDataRequests();
-            return chunk;
-          } else {
-            return chunk;
-          }
+        if (should_commit_synchronously) {
+          // We can't flush while holding the lock.
+          scoped_lock.unlock();
+          FlushPendingCommitDataRequests();
+          return chunk;
+        } else {
+          return chunk;
         }
       }
     }  // scoped_lock
@@ -269,7 +362,7 @@ void SharedMemoryArbiterImpl::UpdateCommitDataRequest(
       if (fully_bound_ && !delayed_flush_scheduled_) {
         weak_this = weak_ptr_factory_.GetWeakPtr();
         task_runner_to_post_delayed_callback_on = task_runner_;
-        flush_delay_ms = batch_commits_duration_ms_;
+        flush_delay_ms = GetBatchCommitsDelayMsLocked();
         delayed_flush_scheduled_ = true;
       }
     }
@@ -279,6 +372,8 @@ void SharedMemoryArbiterImpl::UpdateCommitDataRequest(
     if (chunk.is_valid()) {
       PERFETTO_DCHECK(chunk.writer_id() == writer_id);
       uint8_t chunk_idx = chunk.chunk_idx();
+      if (bytes_pending_commit_ == 0)
+        first_pending_chunk_time_ns_ = base::GetWallTimeNs().count();
       bytes_pending_commit_ += chunk.size();
       size_t page_idx;
 
@@ -390,6 +485,29 @@ void SharedMemoryArbiterImpl::UpdateCommitDataRequest(
   }
 }
 
+uint32_t SharedMemoryArbiterImpl::GetBatchCommitsDelayMsLocked() {
+  if (batch_commits_duration_ms_ == 0)
+    return 0;
+
+  // This is advisory only: the pages can change state concurrently.
+  const size_t num_pages = shmem_abi_.num_pages();
+  size_t used_pages = 0;
+  for (size_t i = 0; i < num_pages; i++) {
+    if (!shmem_abi_.is_page_free(i))
+      used_pages++;
+  }
+  const size_t used_percent = used_pages * 100 / num_pages;
+  if (used_percent <= kBatchCommitsLowWatermarkPercent)
+    return batch_commits_duration_ms_;
+  if (used_percent >= kBatchCommitsHighWatermarkPercent)
+    return 0;
+  const uint64_t remaining_percent =
+      kBatchCommitsHighWatermarkPercent - used_percent;
+  return static_cast<uint32_t>(
+      uint64_t{batch_commits_duration_ms_} * remaining_percent /
+      (kBatchCommitsHighWatermarkPercent - kBatchCommitsLowWatermarkPercent));
+}
+
 bool SharedMemoryArbiterImpl::TryDirectPatchLocked(
     WriterID writer_id,
     const Patch& patch,
@@ -562,6 +680,12 @@ void SharedMemoryArbiterImpl::FlushPendingCommitDataRequests(
         }
       }
 
+      if (bytes_pending_commit_ > 0) {
+        int64_t latency_ns =
+            base::GetWallTimeNs().count() - first_pending_chunk_time_ns_;
+        commit_data_req_->set_batching_latency_us(
+            static_cast<uint64_t>(std::max<int64_t>(latency_ns, 0) / 1000));
+      }
       req = std::move(commit_data_req_);
       bytes_pending_commit_ = 0;
     }
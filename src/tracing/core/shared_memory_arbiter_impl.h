@@ -19,6 +19,7 @@
 
 #include <stdint.h>
 
+#include <atomic>
 #include <functional>
 #include <map>
 #include <memory>
@@ -48,7 +49,9 @@ class TaskRunner;
 // There is one arbiter instance per Producer.
 // This class is thread-safe and uses locks to do so. Data sources are supposed
 // to interact with this sporadically, only when they run out of space on their
-// current thread-local chunk.
+// current thread-local chunk. On large enough SMBs, writers using the kDrop
+// policy first try to acquire a chunk without taking the lock, from a range of
+// pages reserved to the CPU they run on (see |page_shards_|).
 //
 // The arbiter can become "unbound" as a consequence of:
 //  (a) being created without an endpoint
@@ -129,6 +132,11 @@ class SharedMemoryArbiterImpl : public SharedMemoryArbiter {
   // Returns a new Chunk to write tracing data. Depending on the provided
   // BufferExhaustedPolicy, this may return an invalid chunk if no valid free
   // chunk could be found in the SMB.
+  // |size_hint| is the payload size that the writer expects to need. If not 0,
+  // the chunk preferably comes from a page partitioned with the layout with
+  // the smallest chunks that fit it (see GetLayoutForSizeHint()), or from a
+  // free page that gets partitioned that way. Any other free chunk is taken
+  // only if there is none of those.
   SharedMemoryABI::Chunk GetNewChunk(const SharedMemoryABI::ChunkHeader&,
                                      BufferExhaustedPolicy,
                                      size_t size_hint = 0);
@@ -209,11 +217,64 @@ class SharedMemoryArbiterImpl : public SharedMemoryArbiter {
   // reservation ID in |target_buffer_reservations_|.
   static constexpr BufferID kInvalidBufferId = 0;
 
+  // A range of SMB pages where the writers running on a subset of the CPUs
+  // look for free chunks first, without taking |lock_|. Aligned to avoid false
+  // sharing of |next_page| between CPUs.
+  struct alignas(64) PageShard {
+    size_t begin_page = 0;
+    size_t end_page = 0;
+    // The page where the next lookup starts: the last page a chunk was
+    // acquired from.
+    std::atomic<size_t> next_page{0};
+  };
+
+  // The SMB is split in shards only if each shard gets at least this many
+  // pages, so that a CPU does not run out of free chunks in its shard too
+  // often.
+  static constexpr size_t kMinPagesPerShard = 8;
+
+  // Batching periods last the full SetBatchCommitsDuration() while at most
+  // this percentage of the SMB pages are in use. Above it, the period is
+  // shortened linearly and commits become immediate when the SMB reaches
+  // kBatchCommitsHighWatermarkPercent.
+  static constexpr size_t kBatchCommitsLowWatermarkPercent = 25;
+  static constexpr size_t kBatchCommitsHighWatermarkPercent = 75;
+
   static SharedMemoryABI::PageLayout default_page_layout;
 
   SharedMemoryArbiterImpl(const SharedMemoryArbiterImpl&) = delete;
   SharedMemoryArbiterImpl& operator=(const SharedMemoryArbiterImpl&) = delete;
 
+  // Returns the layout with the smallest chunks whose payload fits
+  // |size_hint|, or |default_page_layout| if |size_hint| is 0.
+  SharedMemoryABI::PageLayout GetLayoutForSizeHint(size_t size_hint) const;
+
+  // Partitions |page_idx| with |layout| if it is free and tries to acquire one
+  // of its free chunks. Unless |any_layout| is true, gives up on pages already
+  // partitioned with a different layout. Thread-safe: relies only on the
+  // atomic operations of SharedMemoryABI.
+  SharedMemoryABI::Chunk TryAcquireChunkInPage(
+      size_t page_idx,
+      const SharedMemoryABI::ChunkHeader&,
+      SharedMemoryABI::PageLayout layout,
+      bool any_layout);
+
+  // Looks for a free chunk in the shard of the CPU the calling thread runs on,
+  // without taking |lock_|. Returns an invalid chunk if none is free.
+  SharedMemoryABI::Chunk TryAcquireChunkFromPageShard(
+      const SharedMemoryABI::ChunkHeader&,
+      SharedMemoryABI::PageLayout layout,
+      bool any_layout);
+
+  // Returns the duration of a batching period starting now, based on how many
+  // SMB pages are in use: chunks being written, batched in |commit_data_req_|
+  // or committed and not read by the service yet. A mostly empty SMB allows
+  // the commits to be coalesced for longer; as the SMB fills up, because the
+  // service reads it more slowly than it is written, commits are sent sooner.
+  //
+  // Note: the caller must be holding |lock_| for the duration of the call.
+  uint32_t GetBatchCommitsDelayMsLocked();
+
   void UpdateCommitDataRequest(SharedMemoryABI::Chunk chunk,
                                WriterID writer_id,
                                MaybeUnboundBufferID target_buffer,
@@ -263,6 +324,11 @@ class SharedMemoryArbiterImpl : public SharedMemoryArbiter {
   // endpoint that doesn't support shared memory (e.g. vsock).
   const bool use_shmem_emulation_ = false;
 
+  // Set in the constructor and immutable afterwards. Empty if the SMB is too
+  // small to be split.
+  std::unique_ptr<PageShard[]> page_shards_;
+  size_t num_page_shards_ = 0;
+
   // --- Begin lock-protected members ---
 
   std::mutex lock_;
@@ -272,6 +338,8 @@ class SharedMemoryArbiterImpl : public SharedMemoryArbiter {
   size_t page_idx_ = 0;
   std::unique_ptr<CommitDataRequest> commit_data_req_;
   size_t bytes_pending_commit_ = 0;  // SUM(chunk.size() : commit_data_req_).
+  // When the first chunk of |commit_data_req_| was returned.
+  int64_t first_pending_chunk_time_ns_ = 0;
   IdAllocator<WriterID> active_writer_ids_;
   bool did_shutdown_ = false;
 
@@ -297,7 +365,8 @@ class SharedMemoryArbiterImpl : public SharedMemoryArbiter {
   // reservation was unbound.
   std::vector<std::function<void()>> pending_flush_callbacks_;
 
-  // See SharedMemoryArbiter::SetBatchCommitsDuration.
+  // See SharedMemoryArbiter::SetBatchCommitsDuration. This is the maximum
+  // duration of a batching period, see GetBatchCommitsDelayMsLocked().
   uint32_t batch_commits_duration_ms_ = 0;
 
   // See SharedMemoryArbiter::EnableDirectSMBPatching.
@@ -17,6 +17,10 @@
 #include "src/tracing/core/shared_memory_arbiter_impl.h"
 
 #include <bitset>
+#include <set>
+#include <thread>
+#include <vector>
+
 #include "perfetto/ext/base/utils.h"
 #include "perfetto/ext/tracing/core/basic_types.h"
 #include "perfetto/ext/tracing/core/commit_data_request.h"
@@ -134,6 +138,45 @@ TEST_P(SharedMemoryArbiterImplTest, GetAndReturnChunks) {
   task_runner_->RunUntilCheckpoint("on_commit_2");
 }
 
+// The size hint picks the layout of the pages partitioned for a new chunk.
+TEST_P(SharedMemoryArbiterImplTest, SizeHintPicksPageLayout) {
+  SharedMemoryABI* abi = arbiter_->shmem_abi_for_testing();
+  auto num_chunks_in_page = [abi](const SharedMemoryABI::Chunk& chunk) {
+    size_t page_idx = abi->GetPageAndChunkIndex(chunk).first;
+    return SharedMemoryABI::GetNumChunksForLayout(
+        abi->GetPageLayout(page_idx));
+  };
+
+  SharedMemoryABI::Chunk small =
+      arbiter_->GetNewChunk({}, BufferExhaustedPolicy::kStall, 64);
+  ASSERT_TRUE(small.is_valid());
+  EXPECT_EQ(num_chunks_in_page(small), 14u);
+
+  SharedMemoryABI::Chunk medium =
+      arbiter_->GetNewChunk({}, BufferExhaustedPolicy::kStall, page_size() / 3);
+  ASSERT_TRUE(medium.is_valid());
+  EXPECT_EQ(num_chunks_in_page(medium), 2u);
+  EXPECT_GE(medium.payload_size(), page_size() / 3);
+
+  SharedMemoryABI::Chunk large =
+      arbiter_->GetNewChunk({}, BufferExhaustedPolicy::kStall, page_size());
+  ASSERT_TRUE(large.is_valid());
+  EXPECT_EQ(num_chunks_in_page(large), 1u);
+
+  // Once there are no free pages nor chunks of the hinted size left, any free
+  // chunk is taken.
+  for (size_t i = 3; i < kNumPages; i++) {
+    SharedMemoryABI::Chunk chunk =
+        arbiter_->GetNewChunk({}, BufferExhaustedPolicy::kStall, page_size());
+    ASSERT_TRUE(chunk.is_valid());
+    EXPECT_EQ(num_chunks_in_page(chunk), 1u);
+  }
+  SharedMemoryABI::Chunk fallback =
+      arbiter_->GetNewChunk({}, BufferExhaustedPolicy::kStall, page_size());
+  ASSERT_TRUE(fallback.is_valid());
+  EXPECT_NE(num_chunks_in_page(fallback), 1u);
+}
+
 TEST_P(SharedMemoryArbiterImplTest, BatchCommits) {
   SharedMemoryArbiterImpl::set_default_layout_for_testing(
       SharedMemoryABI::PageLayout::kPageDiv1);
@@ -211,6 +254,55 @@ TEST_P(SharedMemoryArbiterImplTest, BatchCommits) {
   arbiter_->FlushPendingCommitDataRequests();
 }
 
+// Batching periods are shortened as the SMB fills up, down to immediate commits
+// when most of its pages are in use.
+TEST_P(SharedMemoryArbiterImplTest, BatchCommitsWhenSMBIsFilling) {
+  SharedMemoryArbiterImpl::set_default_layout_for_testing(
+      SharedMemoryABI::PageLayout::kPageDiv1);
+  arbiter_->SetBatchCommitsDuration(UINT32_MAX);
+
+  // 11 of the 14 pages are in use: above the high watermark.
+  std::vector<SharedMemoryABI::Chunk> chunks;
+  for (size_t i = 0; i < 11; i++) {
+    chunks.push_back(
+        arbiter_->GetNewChunk({}, BufferExhaustedPolicy::kDefault));
+    ASSERT_TRUE(chunks.back().is_valid());
+  }
+
+  EXPECT_CALL(mock_producer_endpoint_, CommitData(_, _))
+      .WillOnce(Invoke([](const CommitDataRequest& req,
+                          MockProducerEndpoint::CommitDataCallback) {
+        ASSERT_EQ(1, req.chunks_to_move_size());
+        EXPECT_TRUE(req.has_batching_latency_us());
+      }));
+  PatchList ignored;
+  arbiter_->ReturnCompletedChunk(std::move(chunks[0]), 1, &ignored);
+  task_runner_->RunUntilIdle();
+  ASSERT_TRUE(Mock::VerifyAndClearExpectations(&mock_producer_endpoint_));
+
+  // The service frees the committed chunk and the remaining ones. Once the SMB
+  // is mostly empty, commits are batched for the full period again.
+  for (size_t i = 0; i < 11; i++) {
+    auto* abi = arbiter_->shmem_abi_for_testing();
+    if (i > 0) {
+      abi->ReleaseChunkAsComplete(std::move(chunks[i]));
+    }
+    SharedMemoryABI::Chunk chunk = abi->TryAcquireChunkForReading(i, 0);
+    ASSERT_TRUE(chunk.is_valid());
+    abi->ReleaseChunkAsFree(std::move(chunk));
+  }
+  SharedMemoryABI::Chunk chunk =
+      arbiter_->GetNewChunk({}, BufferExhaustedPolicy::kDefault);
+  ASSERT_TRUE(chunk.is_valid());
+  EXPECT_CALL(mock_producer_endpoint_, CommitData(_, _)).Times(0);
+  arbiter_->ReturnCompletedChunk(std::move(chunk), 1, &ignored);
+  task_runner_->RunUntilIdle();
+  ASSERT_TRUE(Mock::VerifyAndClearExpectations(&mock_producer_endpoint_));
+
+  EXPECT_CALL(mock_producer_endpoint_, CommitData(_, _)).Times(1);
+  arbiter_->FlushPendingCommitDataRequests();
+}
+
 TEST_P(SharedMemoryArbiterImplTest, UseShmemEmulation) {
   arbiter_.reset(new SharedMemoryArbiterImpl(
       buf(), buf_size(), ShmemMode::kShmemEmulation, page_size(),
@@ -362,6 +454,42 @@ TEST_P(SharedMemoryArbiterImplTest, BufferExhaustedPolicyDrop) {
   ASSERT_TRUE(chunks[0].is_valid());
 }
 
+// Verify that, on an SMB large enough to be split in per-CPU page shards,
+// threads acquiring chunks concurrently get distinct chunks and can use all of
+// the SMB before running out of chunks.
+TEST_P(SharedMemoryArbiterImplTest, ConcurrentGetNewChunkDrop) {
+  SharedMemoryArbiterImpl::set_default_layout_for_testing(
+      SharedMemoryABI::PageLayout::kPageDiv2);
+  static constexpr size_t kLargeNumPages = 64;
+  static constexpr size_t kNumThreads = 4;
+  TestSharedMemory shmem(page_size() * kLargeNumPages);
+  arbiter_.reset(new SharedMemoryArbiterImpl(
+      shmem.start(), shmem.size(), ShmemMode::kDefault, page_size(),
+      &mock_producer_endpoint_, task_runner_.get()));
+
+  std::vector<std::vector<uint8_t*>> chunks(kNumThreads);
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < kNumThreads; i++) {
+    threads.emplace_back([this, &chunks, i] {
+      for (;;) {
+        SharedMemoryABI::Chunk chunk =
+            arbiter_->GetNewChunk({}, BufferExhaustedPolicy::kDrop);
+        if (!chunk.is_valid())
+          break;
+        chunks[i].push_back(chunk.begin());
+      }
+    });
+  }
+  for (auto& thread : threads)
+    thread.join();
+
+  std::set<uint8_t*> all_chunks;
+  for (const auto& thread_chunks : chunks)
+    all_chunks.insert(thread_chunks.begin(), thread_chunks.end());
+  EXPECT_EQ(all_chunks.size(), kLargeNumPages * 2);
+  arbiter_.reset();
+}
+
 TEST_P(SharedMemoryArbiterImplTest, CreateUnboundAndBind) {
   auto checkpoint_writer = task_runner_->CreateCheckpoint("writer_registered");
   auto checkpoint_flush = task_runner_->CreateCheckpoint("flush_completed");
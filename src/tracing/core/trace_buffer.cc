@@ -16,9 +16,28 @@
 
 #include "src/tracing/core/trace_buffer.h"
 
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
 #include <limits>
+#include <new>
+
+#include "perfetto/base/build_config.h"
+
+#if !PERFETTO_BUILDFLAG(PERFETTO_OS_WIN)
+#include <unistd.h>
+#endif
+
+#if PERFETTO_BUILDFLAG(PERFETTO_OS_LINUX) || \
+    PERFETTO_BUILDFLAG(PERFETTO_OS_ANDROID)
+#include <linux/falloc.h>
+#endif
 
 #include "perfetto/base/logging.h"
+#include "perfetto/ext/base/file_utils.h"
+#include "perfetto/ext/base/memfd.h"
+#include "perfetto/ext/base/sys_types.h"
 #include "perfetto/ext/base/utils.h"
 #include "perfetto/ext/tracing/core/shared_memory_abi.h"
 #include "perfetto/ext/tracing/core/trace_packet.h"
@@ -46,13 +65,128 @@ const size_t TraceBuffer::InlineChunkHeaderSize = sizeof(ChunkRecord);
 
 // static
 std::unique_ptr<TraceBuffer> TraceBuffer::Create(size_t size_in_bytes,
-                                                 OverwritePolicy pol) {
+                                                 OverwritePolicy pol,
+                                                 bool use_memfd) {
   std::unique_ptr<TraceBuffer> trace_buffer(new TraceBuffer(pol));
+#if PERFETTO_BUILDFLAG(PERFETTO_OS_LINUX) || \
+    PERFETTO_BUILDFLAG(PERFETTO_OS_ANDROID)
+  if (use_memfd && base::HasMemfdSupport()) {
+    base::ScopedFile memfd =
+        base::CreateMemfd("perfetto_trace_buffer", MFD_CLOEXEC);
+    if (memfd && ftruncate(*memfd, static_cast<off_t>(size_in_bytes)) == 0) {
+      trace_buffer->backing_fd_ = std::move(memfd);
+    } else {
+      // Not fatal, the buffer just won't be a splice() source nor cloned
+      // copy-on-write.
+      PERFETTO_PLOG("Failed to back the trace buffer with a memfd");
+    }
+  }
+#else
+  base::ignore_result(use_memfd);
+#endif
   if (!trace_buffer->Initialize(size_in_bytes))
     return nullptr;
   return trace_buffer;
 }
 
+// static
+std::unique_ptr<TraceBuffer> TraceBuffer::CreatePersistent(
+    const std::string& path,
+    size_t size_in_bytes,
+    OverwritePolicy pol) {
+#if PERFETTO_BUILDFLAG(PERFETTO_OS_WIN)
+  base::ignore_result(path, size_in_bytes, pol);
+  PERFETTO_ELOG("Persistent trace buffers are not supported on Windows");
+  return nullptr;
+#else
+  if (size_in_bytes % sizeof(ChunkRecord) != 0) {
+    PERFETTO_ELOG("Invalid persistent trace buffer size %zu", size_in_bytes);
+    return nullptr;
+  }
+  base::ScopedFile fd = base::OpenFile(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if (!fd) {
+    PERFETTO_PLOG("Failed to create %s", path.c_str());
+    return nullptr;
+  }
+  std::unique_ptr<TraceBuffer> trace_buffer(new TraceBuffer(pol));
+  // From now on the file is deleted with |trace_buffer|, also on failure.
+  trace_buffer->persistent_path_ = path;
+  const off_t file_size =
+      static_cast<off_t>(size_in_bytes + sizeof(PersistentTrailer));
+  if (ftruncate(*fd, file_size) != 0) {
+    PERFETTO_PLOG("Failed to resize %s", path.c_str());
+    return nullptr;
+  }
+  trace_buffer->backing_fd_ = std::move(fd);
+  if (!trace_buffer->Initialize(size_in_bytes))
+    return nullptr;
+  return trace_buffer;
+#endif
+}
+
+// static
+std::unique_ptr<TraceBuffer> TraceBuffer::RecoverPersistent(
+    const std::string& path) {
+#if PERFETTO_BUILDFLAG(PERFETTO_OS_WIN)
+  base::ignore_result(path);
+  return nullptr;
+#else
+  base::ScopedFile fd = base::OpenFile(path, O_RDWR);
+  struct stat stat_buf {};
+  if (!fd || fstat(*fd, &stat_buf) != 0) {
+    PERFETTO_PLOG("Failed to open %s", path.c_str());
+    return nullptr;
+  }
+  const size_t file_size = static_cast<size_t>(stat_buf.st_size);
+  if (file_size <= sizeof(PersistentTrailer) ||
+      file_size > std::numeric_limits<uint32_t>::max()) {
+    PERFETTO_ELOG("%s is not a persistent trace buffer", path.c_str());
+    return nullptr;
+  }
+  base::PagedMemory data = base::PagedMemory::MapFile(
+      *fd, file_size, base::PagedMemory::kMayFail);
+  if (!data.IsValid()) {
+    PERFETTO_PLOG("Failed to map %s", path.c_str());
+    return nullptr;
+  }
+
+  // Validate the trailer before trusting any of the offsets in it.
+  const size_t size = file_size - sizeof(PersistentTrailer);
+  const PersistentTrailer* trailer = reinterpret_cast<const PersistentTrailer*>(
+      reinterpret_cast<const uint8_t*>(data.Get()) + size);
+  const uint64_t write_range = trailer->write_range.load();
+  const size_t write_begin = static_cast<size_t>(write_range >> 32);
+  const size_t write_end = static_cast<size_t>(write_range & 0xffffffff);
+  if (trailer->magic != PersistentTrailer::kMagic || trailer->size != size ||
+      size % sizeof(ChunkRecord) != 0 || write_begin > write_end ||
+      write_begin >= size || write_end > size ||
+      write_begin % sizeof(ChunkRecord) != 0 ||
+      write_end % sizeof(ChunkRecord) != 0) {
+    PERFETTO_ELOG("%s is not a valid persistent trace buffer", path.c_str());
+    return nullptr;
+  }
+
+  std::unique_ptr<TraceBuffer> trace_buffer(new TraceBuffer(kOverwrite));
+  trace_buffer->data_ = std::move(data);
+  trace_buffer->backing_fd_ = std::move(fd);
+  trace_buffer->size_ = size;
+  trace_buffer->stats_.set_buffer_size(size);
+  trace_buffer->max_chunk_size_ = std::min(size, ChunkRecord::kMaxSize);
+  trace_buffer->wptr_ = trace_buffer->begin() + write_begin;
+  trace_buffer->read_only_ = true;
+
+  // Walk the records from the oldest to the newest, skipping the range that
+  // was being written. If the buffer has wrapped, the oldest records are the
+  // ones after the write range, otherwise that part of the buffer is zeroed.
+  trace_buffer->RecoverChunkRecords(write_end, size);
+  trace_buffer->RecoverChunkRecords(0, write_begin);
+  trace_buffer->has_data_ = !trace_buffer->index_.empty();
+  trace_buffer->read_iter_ =
+      trace_buffer->GetReadIterForSequence(trace_buffer->index_.end());
+  return trace_buffer;
+#endif
+}
+
 TraceBuffer::TraceBuffer(OverwritePolicy pol) : overwrite_policy_(pol) {
   // See comments in ChunkRecord for the rationale of this.
   static_assert(sizeof(ChunkRecord) == sizeof(SharedMemoryABI::PageHeader) +
@@ -60,7 +194,17 @@ TraceBuffer::TraceBuffer(OverwritePolicy pol) : overwrite_policy_(pol) {
                 "ChunkRecord out of sync with the layout of SharedMemoryABI");
 }
 
-TraceBuffer::~TraceBuffer() = default;
+TraceBuffer::~TraceBuffer() {
+  // The buffer is going away in an orderly way: there is nothing to recover.
+  if (!persistent_path_.empty())
+    remove(persistent_path_.c_str());
+
+  if (cow_link_ && cow_link_->source == this) {
+    cow_link_->source = nullptr;
+  } else if (cow_link_ && cow_link_->source) {
+    cow_link_->source->ReleaseCowFile(*backing_fd_);
+  }
+}
 
 bool TraceBuffer::Initialize(size_t size) {
   static_assert(
@@ -68,13 +212,32 @@ bool TraceBuffer::Initialize(size_t size) {
       "sizeof(ChunkRecord) must be an integer divider of a page size");
   auto max_size = std::numeric_limits<decltype(ChunkMeta::record_off)>::max();
   PERFETTO_CHECK(size <= static_cast<size_t>(max_size));
-  data_ = base::PagedMemory::Allocate(
-      size, base::PagedMemory::kMayFail | base::PagedMemory::kDontCommit);
+  const int alloc_flags =
+      base::PagedMemory::kMayFail | base::PagedMemory::kDontCommit;
+  const bool persistent = !persistent_path_.empty();
+#if !PERFETTO_BUILDFLAG(PERFETTO_OS_WIN)
+  if (backing_fd_) {
+    const size_t map_size =
+        size + (persistent ? sizeof(PersistentTrailer) : 0);
+    data_ = base::PagedMemory::MapFile(*backing_fd_, map_size, alloc_flags);
+    if (!data_.IsValid()) {
+      PERFETTO_PLOG("Failed to map the trace buffer file");
+      backing_fd_.reset();
+    }
+  }
+#endif
+  // A persistent buffer can't fall back on anonymous memory.
+  if (!data_.IsValid() && !persistent)
+    data_ = base::PagedMemory::Allocate(size, alloc_flags);
   if (!data_.IsValid()) {
     PERFETTO_ELOG("Trace buffer allocation failed (size: %zu)", size);
     return false;
   }
   size_ = size;
+  if (persistent) {
+    persistent_trailer_ = new (begin() + size) PersistentTrailer();
+    persistent_trailer_->size = size;
+  }
   stats_.set_buffer_size(size);
   max_chunk_size_ = std::min(size, ChunkRecord::kMaxSize);
   wptr_ = begin();
@@ -218,6 +381,23 @@ void TraceBuffer::CopyChunkUntrusted(ProducerID producer_id_trusted,
   if (PERFETTO_UNLIKELY(discard_writes_))
     return DiscardWrite();
 
+  // A producer over its quota can only recycle the space of its own chunks.
+  ProducerQuota* quota = nullptr;
+  if (PERFETTO_UNLIKELY(producer_quotas_.size()))
+    quota = producer_quotas_.Find(producer_id_trusted);
+  if (quota) {
+    size_t bytes_used = quota->bytes_used + record_size;
+    if (bytes_used > quota->max_bytes)
+      bytes_used -= GetBytesOverwrittenFor(producer_id_trusted, record_size);
+    if (bytes_used > quota->max_bytes) {
+      stats_.set_chunks_discarded_over_quota(
+          stats_.chunks_discarded_over_quota() + 1);
+      quota->writers_with_dropped_chunks.insert(writer_id);
+      DropFragmentsContinuingInto(key);
+      return;
+    }
+  }
+
   // If there isn't enough room from the given write position. Write a padding
   // record to clear the end of the buffer and wrap back.
   const size_t cached_size_to_end = size_to_end();
@@ -226,8 +406,10 @@ void TraceBuffer::CopyChunkUntrusted(ProducerID producer_id_trusted,
     if (res == -1)
       return DiscardWrite();
     PERFETTO_DCHECK(static_cast<size_t>(res) <= cached_size_to_end);
+    BeginPersistentWrite(cached_size_to_end);
     AddPaddingRecord(cached_size_to_end);
     wptr_ = begin();
+    EndPersistentWrite();
     stats_.set_write_wrap_count(stats_.write_wrap_count() + 1);
     PERFETTO_DCHECK(size_to_end() >= record_size);
   }
@@ -256,6 +438,7 @@ void TraceBuffer::CopyChunkUntrusted(ProducerID producer_id_trusted,
   if (del_res == -1)
     return DiscardWrite();
   size_t padding_size = static_cast<size_t>(del_res);
+  BeginPersistentWrite(record_size + padding_size);
 
   // Now first insert the new chunk. At the end, if necessary, add the padding.
   stats_.set_chunks_written(stats_.chunks_written() + 1);
@@ -266,11 +449,15 @@ void TraceBuffer::CopyChunkUntrusted(ProducerID producer_id_trusted,
       key, ChunkMeta(chunk_off, num_fragments, chunk_complete, chunk_flags,
                      producer_uid_trusted, producer_pid_trusted));
   PERFETTO_DCHECK(it_and_inserted.second);
+  if (quota && quota->writers_with_dropped_chunks.erase(writer_id))
+    it_and_inserted.first->second.set_follows_dropped_chunks();
   TRACE_BUFFER_DLOG("  copying @ [%" PRIdPTR " - %" PRIdPTR "] %zu", wptr_ - begin(),
                     uintptr_t(wptr_ - begin()) + record_size, record_size);
   WriteChunkRecord(wptr_, record, src, size);
   TRACE_BUFFER_DLOG("Chunk raw: %s", base::HexDump(wptr_, record_size).c_str());
   wptr_ += record_size;
+  if (quota)
+    quota->bytes_used += record_size;
   if (wptr_ >= end()) {
     PERFETTO_DCHECK(padding_size == 0);
     wptr_ = begin();
@@ -303,6 +490,47 @@ void TraceBuffer::CopyChunkUntrusted(ProducerID producer_id_trusted,
 
   if (padding_size)
     AddPaddingRecord(padding_size);
+  EndPersistentWrite();
+}
+
+void TraceBuffer::RecoverChunkRecords(size_t begin_off, size_t end_off) {
+  size_t off = begin_off;
+  while (end_off - off >= sizeof(ChunkRecord)) {
+    const ChunkRecord& record = *GetChunkRecordAt(begin() + off);
+    // The rest of the range has never been written.
+    if (!record.is_valid())
+      break;
+    if (record.size % sizeof(ChunkRecord) != 0 ||
+        record.size > end_off - off) {
+      PERFETTO_ELOG("Broken ChunkRecord chain at offset %zu", off);
+      break;
+    }
+    if (!record.is_padding) {
+      // The patches for the last fragment will never arrive. Drop it, like
+      // CopyChunkUntrusted() does for the last fragment of incomplete chunks.
+      uint16_t num_fragments = record.num_fragments;
+      uint8_t flags = record.flags;
+      if ((flags & kChunkNeedsPatching) && num_fragments > 0) {
+        num_fragments--;
+        flags &= ~kLastPacketContinuesOnNextChunk;
+        flags &= ~kChunkNeedsPatching;
+      }
+      ChunkMeta::Key key(record);
+      index_.erase(key);
+      index_.emplace(key, ChunkMeta(static_cast<uint32_t>(off), num_fragments,
+                                    /*complete=*/true, flags, kInvalidUid,
+                                    base::kInvalidPid));
+
+      // Same logic as in CopyChunkUntrusted(), the records are visited in the
+      // order they were written.
+      ChunkID& last_chunk_id =
+          last_chunk_id_written_[std::make_pair(key.producer_id,
+                                                key.writer_id)];
+      if (key.chunk_id - last_chunk_id < kMaxChunkID / 2)
+        last_chunk_id = key.chunk_id;
+    }
+    off += record.size;
+  }
 }
 
 ssize_t TraceBuffer::DeleteNextChunksFor(size_t bytes_to_clear) {
@@ -376,6 +604,13 @@ ssize_t TraceBuffer::DeleteNextChunksFor(size_t bytes_to_clear) {
 
   // Remove from the index.
   for (auto it : index_delete) {
+    if (PERFETTO_UNLIKELY(producer_quotas_.size())) {
+      ProducerQuota* quota = producer_quotas_.Find(it->first.producer_id);
+      if (quota) {
+        quota->bytes_used -=
+            GetChunkRecordAt(begin() + it->second.record_off)->size;
+      }
+    }
     index_.erase(it);
   }
   stats_.set_chunks_overwritten(chunks_overwritten);
@@ -386,6 +621,70 @@ ssize_t TraceBuffer::DeleteNextChunksFor(size_t bytes_to_clear) {
   return static_cast<ssize_t>(next_chunk_ptr - search_end);
 }
 
+size_t TraceBuffer::GetBytesOverwrittenFor(ProducerID producer_id,
+                                           size_t record_size) {
+  size_t bytes = 0;
+  auto scan = [&](uint8_t* ptr, uint8_t* search_end) {
+    while (ptr < search_end) {
+      const ChunkRecord& record = *GetChunkRecordAt(ptr);
+      if (!record.is_valid())
+        return;  // The rest of the buffer has never been written.
+      if (!record.is_padding && record.producer_id == producer_id)
+        bytes += record.size;
+      ptr += record.size;
+    }
+  };
+  // A record that doesn't fit before end() clears the rest of the buffer and
+  // is written at begin(), see CopyChunkUntrusted().
+  if (record_size > size_to_end()) {
+    scan(wptr_, end());
+    scan(begin(), begin() + record_size);
+  } else {
+    scan(wptr_, wptr_ + record_size);
+  }
+  return bytes;
+}
+
+void TraceBuffer::DropFragmentsContinuingInto(const ChunkMeta::Key& key) {
+  ChunkMeta::Key prev_key = key;
+  for (;;) {
+    prev_key.chunk_id--;
+    auto it = index_.find(prev_key);
+    if (it == index_.end())
+      return;
+    ChunkMeta& chunk_meta = it->second;
+    if (!(chunk_meta.flags & kLastPacketContinuesOnNextChunk))
+      return;
+    // Drop the last fragment, like CopyChunkUntrusted() does for incomplete
+    // chunks. If it was the only one and continued a previous chunk, the packet
+    // started further back.
+    const bool continues_prev_chunk =
+        chunk_meta.num_fragments == 1 &&
+        (chunk_meta.flags & kFirstPacketContinuesFromPrevChunk);
+    if (chunk_meta.num_fragments > chunk_meta.num_fragments_read)
+      chunk_meta.num_fragments--;
+    chunk_meta.flags &= ~kLastPacketContinuesOnNextChunk;
+    if (!continues_prev_chunk)
+      return;
+  }
+}
+
+void TraceBuffer::SetProducerQuota(ProducerID producer_id, size_t max_bytes) {
+  PERFETTO_CHECK(!read_only_);
+  ProducerQuota& quota = producer_quotas_[producer_id];
+  quota.max_bytes = max_bytes;
+  quota.bytes_used = 0;
+  for (auto it = index_.lower_bound(ChunkMeta::Key(producer_id, 0, 0));
+       it != index_.end() && it->first.producer_id == producer_id; ++it) {
+    quota.bytes_used += GetChunkRecordAt(begin() + it->second.record_off)->size;
+  }
+}
+
+void TraceBuffer::CopyProducerQuotasFrom(const TraceBuffer& other) {
+  for (auto it = other.producer_quotas_.GetIterator(); it; ++it)
+    SetProducerQuota(it.key(), it.value().max_bytes);
+}
+
 void TraceBuffer::AddPaddingRecord(size_t size) {
   PERFETTO_DCHECK(size >= sizeof(ChunkRecord) && size <= ChunkRecord::kMaxSize);
   ChunkRecord record(size);
@@ -527,8 +826,10 @@ void TraceBuffer::SequenceIterator::MoveNext() {
   // There may be a missing chunk in the sequence of chunks, in which case the
   // next chunk's ID won't follow the last one's. If so, skip the rest of the
   // sequence. We'll return to it later once the hole is filled.
-  if (last_chunk_id + 1 != cur->first.chunk_id)
+  if (last_chunk_id + 1 != cur->first.chunk_id &&
+      !cur->second.follows_dropped_chunks()) {
     cur = seq_end;
+  }
 }
 
 bool TraceBuffer::ReadNextTracePacket(
@@ -619,6 +920,8 @@ bool TraceBuffer::ReadNextTracePacket(
     // |previous_packet_dropped| in this case.
     if (chunk_meta->num_fragments_read > 0)
       previous_packet_dropped = chunk_meta->last_read_packet_skipped();
+    else if (chunk_meta->follows_dropped_chunks())
+      previous_packet_dropped = true;
 
     while (chunk_meta->num_fragments_read < chunk_meta->num_fragments) {
       enum { kSkip = 0, kReadOnePacket, kTryReadAhead } action;
@@ -871,6 +1174,15 @@ TraceBuffer::ReadPacketResult TraceBuffer::ReadNextPacketInChunk(
                         chunk_meta->is_complete())) {
     stats_.set_chunks_read(stats_.chunks_read() + 1);
     stats_.set_bytes_read(stats_.bytes_read() + chunk_record->size);
+    stats_.set_chunk_payload_bytes_read(stats_.chunk_payload_bytes_read() +
+                                        chunk_record->size -
+                                        sizeof(ChunkRecord));
+    stats_.set_chunk_payload_bytes_used(stats_.chunk_payload_bytes_used() +
+                                        chunk_meta->cur_fragment_offset);
+    if (chunk_meta->flags & kLastPacketContinuesOnNextChunk) {
+      stats_.set_chunks_read_with_fragmented_packet(
+          stats_.chunks_read_with_fragmented_packet() + 1);
+    }
     auto* writer_stats = writer_stats_.Insert(producer_and_writer_id, {}).first;
     writer_stats->used_chunk_hist.Add(chunk_meta->cur_fragment_offset);
   } else {
@@ -899,24 +1211,89 @@ void TraceBuffer::DiscardWrite() {
   TRACE_BUFFER_DLOG("  discarding write");
 }
 
-std::unique_ptr<TraceBuffer> TraceBuffer::CloneReadOnly() const {
+void TraceBuffer::ReleaseCowFile(int fd) {
+#if PERFETTO_BUILDFLAG(PERFETTO_OS_LINUX) || \
+    PERFETTO_BUILDFLAG(PERFETTO_OS_ANDROID)
+  // Writing a page of the private mapping copies it out of the file. After
+  // that the mapping doesn't read from the file anymore and its pages can be
+  // punched out.
+  const size_t page_size = base::GetSysPageSize();
+  for (size_t off = 0; off < size_; off += page_size) {
+    volatile uint8_t* page = begin() + off;
+    *page = *page;
+  }
+  if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0,
+                static_cast<off_t>(size_)) != 0) {
+    PERFETTO_PLOG("Failed to free the pages of the cloned trace buffer");
+  }
+#else
+  base::ignore_result(fd);
+#endif
+  cow_link_.reset();
+}
+
+std::unique_ptr<TraceBuffer> TraceBuffer::CloneReadOnly() {
   std::unique_ptr<TraceBuffer> buf(new TraceBuffer(CloneCtor(), *this));
   if (!buf->data_.IsValid())
     return nullptr;  // PagedMemory::Allocate() failed. We are out of memory.
   return buf;
 }
 
-TraceBuffer::TraceBuffer(CloneCtor, const TraceBuffer& src)
+TraceBuffer::TraceBuffer(CloneCtor, TraceBuffer& src)
     : overwrite_policy_(src.overwrite_policy_),
       read_only_(true),
       discard_writes_(src.discard_writes_) {
-  if (!Initialize(src.data_.size()))
+#if PERFETTO_BUILDFLAG(PERFETTO_OS_LINUX) || \
+    PERFETTO_BUILDFLAG(PERFETTO_OS_ANDROID)
+  // Copy-on-write clone: the clone maps the file of |src|, and |src| switches
+  // to a private mapping of it so that the file stops changing. The file of a
+  // persistent buffer must keep following the writes, so it gets copied.
+  const bool copy_on_write =
+      !src.read_only_ && src.backing_fd_ && src.persistent_path_.empty();
+  if (copy_on_write)
+    backing_fd_.reset(dup(*src.backing_fd_));
+#endif
+  if (!Initialize(src.size_))
     return;  // TraceBuffer::Clone() will check |data_| and return nullptr.
 
   // The assignments below must be done after Initialize().
 
-  data_.EnsureCommitted(data_.size());
-  memcpy(data_.Get(), src.data_.Get(), src.data_.size());
+#if PERFETTO_BUILDFLAG(PERFETTO_OS_LINUX) || \
+    PERFETTO_BUILDFLAG(PERFETTO_OS_ANDROID)
+  // The private mapping of |src| goes to a new address, as replacing the
+  // shared one in place can't be undone if mmap() fails. Only |wptr_| points
+  // into the buffer, the index uses offsets.
+  if (backing_fd_) {
+    base::PagedMemory src_data = base::PagedMemory::MapFile(
+        *src.backing_fd_, src.size_,
+        base::PagedMemory::kMayFail | base::PagedMemory::kDontCommit |
+            base::PagedMemory::kMapPrivate);
+    if (src_data.IsValid()) {
+      const size_t wptr_off = static_cast<size_t>(src.wptr_ - src.begin());
+      src.data_ = std::move(src_data);
+      src.wptr_ = src.begin() + wptr_off;
+      src.backing_fd_.reset();
+      cow_link_ = std::make_shared<CowLink>();
+      cow_link_->source = &src;
+      src.cow_link_ = cow_link_;
+    } else {
+      // Fall back on a copy: the shared mapping would follow the writes.
+      PERFETTO_PLOG("Failed to map the trace buffer file privately");
+      backing_fd_.reset();
+      data_ = base::PagedMemory::Allocate(
+          size_, base::PagedMemory::kMayFail | base::PagedMemory::kDontCommit);
+      if (!data_.IsValid())
+        return;
+      wptr_ = begin();
+    }
+  }
+#endif
+
+  // Initialize() falls back on anonymous memory if the file can't be mapped.
+  if (!backing_fd_) {
+    data_.EnsureCommitted(size_);
+    memcpy(data_.Get(), src.data_.Get(), size_);
+  }
   last_chunk_id_written_ = src.last_chunk_id_written_;
 
   stats_ = src.stats_;
@@ -21,13 +21,18 @@
 #include <string.h>
 
 #include <array>
+#include <atomic>
 #include <limits>
 #include <map>
+#include <memory>
+#include <set>
+#include <string>
 #include <tuple>
 
 #include "perfetto/base/logging.h"
 #include "perfetto/ext/base/flat_hash_map.h"
 #include "perfetto/ext/base/paged_memory.h"
+#include "perfetto/ext/base/scoped_file.h"
 #include "perfetto/ext/base/thread_annotations.h"
 #include "perfetto/ext/base/utils.h"
 #include "perfetto/ext/tracing/core/basic_types.h"
@@ -177,8 +182,34 @@ class TraceBuffer {
                                            /*AppendOnly=*/true>;
 
   // Can return nullptr if the memory allocation fails.
+  // If |use_memfd| is true and the platform supports it, the buffer memory is
+  // backed by a memfd rather than anonymous memory, so that the packets read
+  // from it can be moved into a file with splice() (see GetFileForRange()) and
+  // that CloneReadOnly() doesn't need to copy it.
   static std::unique_ptr<TraceBuffer> Create(size_t size_in_bytes,
-                                             OverwritePolicy = kOverwrite);
+                                             OverwritePolicy = kOverwrite,
+                                             bool use_memfd = false);
+
+  // Like Create(), but the buffer memory is a MAP_SHARED mapping of the file
+  // at |path|, which is created (or truncated) here. The file holds the ring
+  // buffer followed by a PersistentTrailer, which tracks the write pointer in
+  // a crash-consistent way. If the process dies without destroying the
+  // buffer, the file survives and RecoverPersistent() can read it back. The
+  // file is deleted when the buffer is destroyed.
+  // |size_in_bytes| must be a multiple of 16. Returns nullptr on failure and
+  // on Windows.
+  static std::unique_ptr<TraceBuffer> CreatePersistent(
+      const std::string& path,
+      size_t size_in_bytes,
+      OverwritePolicy = kOverwrite);
+
+  // Reconstructs a read-only buffer from the file left behind by a
+  // CreatePersistent() buffer that was never destroyed, by walking the
+  // ChunkRecord(s) in it. Returns nullptr if |path| doesn't contain a valid
+  // buffer. All the chunks are treated as complete, and the uid and pid of the
+  // producers are unknown. The file is left untouched.
+  static std::unique_ptr<TraceBuffer> RecoverPersistent(
+      const std::string& path);
 
   ~TraceBuffer();
 
@@ -214,6 +245,17 @@ class TraceBuffer {
                           const uint8_t* src,
                           size_t size);
 
+  // Caps the bytes of the buffer that the chunks of |producer_id| can take,
+  // so that a chatty producer can't evict the data of the other producers.
+  // Once the producer holds |max_bytes|, a new chunk from it is accepted only
+  // if it overwrites as many bytes of the same producer. Otherwise the chunk
+  // is dropped and counted in stats().chunks_discarded_over_quota().
+  void SetProducerQuota(ProducerID producer_id, size_t max_bytes);
+
+  // Applies the quotas of |other| to this buffer. Used when a buffer is
+  // replaced by an empty one of the same size.
+  void CopyProducerQuotasFrom(const TraceBuffer& other);
+
   // Applies a batch of |patches| to the given chunk, if the given chunk is
   // still in the buffer. Does nothing if the given ChunkID is gone.
   // Returns true if the chunk has been found and patched, false otherwise.
@@ -280,7 +322,31 @@ class TraceBuffer {
   // new buffer will be reset, as if no Read() had been called. Calls to
   // CopyChunkUntrusted() and TryPatchChunkContents() on the returned cloned
   // TraceBuffer will CHECK().
-  std::unique_ptr<TraceBuffer> CloneReadOnly() const;
+  // If the buffer is backed by a memfd, the clone doesn't copy the contents:
+  // it takes over the memfd, and this buffer switches to a private
+  // copy-on-write mapping of it, so GetFileForRange() returns -1 for it. While
+  // the clone is alive, the pages this buffer overwrites take up to another
+  // size() bytes. When the clone is destroyed, this buffer copies the pages it
+  // didn't overwrite and the file is freed. That must not race with writes to
+  // this buffer.
+  std::unique_ptr<TraceBuffer> CloneReadOnly();
+
+  // If the buffer is backed by a file (a memfd or a persistent buffer file)
+  // and [|ptr|, |ptr| + |size|) lies within it (e.g. a slice of a packet
+  // returned by ReadNextTracePacket()), returns the file descriptor and sets
+  // |offset| to the position of |ptr| in it. Returns -1 otherwise.
+  int GetFileForRange(const void* ptr, size_t size, uint64_t* offset) const {
+    if (!backing_fd_)
+      return -1;
+    const uintptr_t addr = reinterpret_cast<uintptr_t>(ptr);
+    const uintptr_t buf_start = reinterpret_cast<uintptr_t>(begin());
+    if (addr < buf_start || addr > buf_start + size_ ||
+        size > buf_start + size_ - addr) {
+      return -1;
+    }
+    *offset = addr - buf_start;
+    return *backing_fd_;
+  }
 
   void set_read_only() { read_only_ = true; }
   const WriterStatsMap& writer_stats() const { return writer_stats_; }
@@ -404,7 +470,12 @@ class TraceBuffer {
       // If set, we skipped the last packet that we read from this chunk e.g.
       // because we it was a continuation from a previous chunk that was dropped
       // or due to an ABI violation.
-      kLastReadPacketSkipped = 1 << 1
+      kLastReadPacketSkipped = 1 << 1,
+
+      // If set, the chunks of the same sequence right before this one were
+      // dropped because the producer was over its quota. Readers don't wait
+      // for the missing ChunkID(s) before moving on to this chunk.
+      kFollowsDroppedChunks = 1 << 2
     };
 
     ChunkMeta(uint32_t _record_off,
@@ -446,6 +517,12 @@ class TraceBuffer {
       }
     }
 
+    bool follows_dropped_chunks() const {
+      return index_flags & kFollowsDroppedChunks;
+    }
+
+    void set_follows_dropped_chunks() { index_flags |= kFollowsDroppedChunks; }
+
     const uint32_t record_off;  // Offset of ChunkRecord within |data_|.
     const uid_t trusted_uid;    // uid of the producer.
     const pid_t trusted_pid;    // pid of the producer.
@@ -471,6 +548,21 @@ class TraceBuffer {
 
   using ChunkMap = std::map<ChunkMeta::Key, ChunkMeta>;
 
+  // Stored in the file of a persistent buffer right after the ring buffer.
+  struct PersistentTrailer {
+    static constexpr uint64_t kMagic = 0x5246554254524650;  // "PFTRBUFR".
+
+    uint64_t magic = kMagic;
+    uint64_t size = 0;  // Size of the ring buffer.
+
+    // The [begin, end) offsets of the part of the ring buffer being written,
+    // packed as (begin << 32 | end) so that they are updated in one store.
+    // When no write is in progress begin == end == the write pointer. Records
+    // within the range might be partially written if the process died, the
+    // records after it and before it are intact.
+    std::atomic<uint64_t> write_range{0};
+  };
+
   // Allows to iterate over a sub-sequence of |index_| for all keys belonging to
   // the same {ProducerID,WriterID}. Furthermore takes into account the wrapping
   // of ChunkID. Instances are valid only as long as the |index_| is not altered
@@ -546,10 +638,46 @@ class TraceBuffer {
   // Not using the implicit copy ctor to avoid unintended copies.
   // This tagged ctor should be used only for Clone().
   struct CloneCtor {};
-  TraceBuffer(CloneCtor, const TraceBuffer&);
+  TraceBuffer(CloneCtor, TraceBuffer&);
 
+  // Maps |backing_fd_|, if set, or allocates anonymous memory otherwise.
   bool Initialize(size_t size);
 
+  // Called on the source of a copy-on-write clone when the clone, which owns
+  // the file |fd|, is destroyed. Copies the pages of the file that this buffer
+  // still shares into its private mapping, then frees them from the file.
+  void ReleaseCowFile(int fd);
+
+  // Adds the ChunkRecord(s) found in [|begin_off|, |end_off|) of the buffer to
+  // the index. Used by RecoverPersistent().
+  void RecoverChunkRecords(size_t begin_off, size_t end_off);
+
+  // Only for persistent buffers. Marks the next |size| bytes from |wptr_| as
+  // being written, until the next EndPersistentWrite().
+  void BeginPersistentWrite(size_t size) {
+    if (PERFETTO_LIKELY(!persistent_trailer_))
+      return;
+    const uint64_t begin_off = GetOffset(wptr_);
+    // The range must be recorded before any of the writes it covers. Those are
+    // plain (non-atomic) writes, which a store alone does not order: the
+    // fence keeps the compiler from hoisting them above it. Only a crash of
+    // this process is covered, whose stores all reach the page cache, so no
+    // ordering is needed against other threads or CPUs.
+    persistent_trailer_->write_range.store(begin_off << 32 |
+                                           (begin_off + size));
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+  }
+
+  void EndPersistentWrite() {
+    if (PERFETTO_LIKELY(!persistent_trailer_))
+      return;
+    const uint64_t wptr_off = GetOffset(wptr_);
+    // Symmetric to BeginPersistentWrite(): the writes must not be sunk below
+    // the store which marks them as complete.
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    persistent_trailer_->write_range.store(wptr_off << 32 | wptr_off);
+  }
+
   // Returns an object that allows to iterate over chunks in the |index_| that
   // have the same {ProducerID, WriterID} of
   // |seq_begin.first.{producer,writer}_id|. |seq_begin| must be an iterator to
@@ -594,6 +722,17 @@ class TraceBuffer {
   // (60 - 42), the distance between chunk 5 and the end of the deletion range.
   ssize_t DeleteNextChunksFor(size_t bytes_to_clear);
 
+  // Returns the bytes of the chunks of |producer_id| that writing a record of
+  // |record_size| bytes would overwrite. Walks the same ChunkRecord(s) as the
+  // DeleteNextChunksFor() calls in CopyChunkUntrusted(), without deleting.
+  size_t GetBytesOverwrittenFor(ProducerID producer_id, size_t record_size);
+
+  // Called when the chunk |key| is dropped because its producer is over its
+  // quota. A packet that continues into that chunk can't be completed anymore:
+  // drops its fragments from the preceding chunks, so that readers don't wait
+  // for the rest of it.
+  void DropFragmentsContinuingInto(const ChunkMeta::Key& key);
+
   // Decodes the boundaries of the next packet (or a fragment) pointed by
   // ChunkMeta and pushes that into |TracePacket|. It also increments the
   // |num_fragments_read| counter.
@@ -675,9 +814,22 @@ class TraceBuffer {
   size_t size_to_end() const { return static_cast<size_t>(end() - wptr_); }
 
   base::PagedMemory data_;
-  size_t size_ = 0;            // Size in bytes of |data_|.
-  size_t max_chunk_size_ = 0;  // Max size in bytes allowed for a chunk.
-  uint8_t* wptr_ = nullptr;    // Write pointer.
+  base::ScopedFile backing_fd_;  // Mapped into |data_|, if set.
+
+  // Shared by a copy-on-write clone and its source, see CloneReadOnly().
+  // |source| is cleared if the source is destroyed before the clone.
+  struct CowLink {
+    TraceBuffer* source = nullptr;
+  };
+  std::shared_ptr<CowLink> cow_link_;
+  size_t size_ = 0;              // Size in bytes of the ring buffer.
+  size_t max_chunk_size_ = 0;    // Max size in bytes allowed for a chunk.
+  uint8_t* wptr_ = nullptr;      // Write pointer.
+
+  // Only for CreatePersistent() buffers. |persistent_trailer_| points right
+  // after the end of the ring buffer in |data_|.
+  std::string persistent_path_;
+  PersistentTrailer* persistent_trailer_ = nullptr;
 
   // An index that keeps track of the positions and metadata of each
   // ChunkRecord.
@@ -707,6 +859,16 @@ class TraceBuffer {
   // many producers/writers within the same trace session).
   std::map<std::pair<ProducerID, WriterID>, ChunkID> last_chunk_id_written_;
 
+  // Set by SetProducerQuota(). |bytes_used| is the size of the ChunkRecord(s)
+  // of the producer that are in |index_|. |writers_with_dropped_chunks| are
+  // the sequences whose last chunk was dropped because of the quota.
+  struct ProducerQuota {
+    size_t max_bytes = 0;
+    size_t bytes_used = 0;
+    std::set<WriterID> writers_with_dropped_chunks;
+  };
+  base::FlatHashMap<ProducerID, ProducerQuota> producer_quotas_;
+
   // Statistics about buffer usage.
   TraceStats::BufferStats stats_;
 
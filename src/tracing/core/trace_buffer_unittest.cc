@@ -19,8 +19,13 @@
 #include <initializer_list>
 #include <random>
 #include <sstream>
+#include <string>
 #include <vector>
 
+#include "perfetto/base/build_config.h"
+#include "perfetto/ext/base/file_utils.h"
+#include "perfetto/ext/base/memfd.h"
+#include "perfetto/ext/base/temp_file.h"
 #include "perfetto/ext/base/utils.h"
 #include "perfetto/ext/tracing/core/basic_types.h"
 #include "perfetto/ext/tracing/core/shared_memory_abi.h"
@@ -30,11 +35,18 @@
 #include "src/tracing/test/fake_packet.h"
 #include "test/gtest_and_gmock.h"
 
+#if PERFETTO_BUILDFLAG(PERFETTO_OS_LINUX) || \
+    PERFETTO_BUILDFLAG(PERFETTO_OS_ANDROID)
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 namespace perfetto {
 
 using ::testing::ContainerEq;
 using ::testing::ElementsAre;
 using ::testing::IsEmpty;
+using ::testing::Not;
 
 class TraceBufferTest : public testing::Test {
  public:
@@ -55,11 +67,44 @@ class TraceBufferTest : public testing::Test {
 
   void ResetBuffer(
       size_t size_,
-      TraceBuffer::OverwritePolicy policy = TraceBuffer::kOverwrite) {
-    trace_buffer_ = TraceBuffer::Create(size_, policy);
+      TraceBuffer::OverwritePolicy policy = TraceBuffer::kOverwrite,
+      bool use_memfd = false) {
+    trace_buffer_ = TraceBuffer::Create(size_, policy, use_memfd);
     ASSERT_TRUE(trace_buffer_);
   }
 
+  void ResetPersistentBuffer(const std::string& path, size_t size) {
+    trace_buffer_ = TraceBuffer::CreatePersistent(path, size);
+    ASSERT_TRUE(trace_buffer_);
+  }
+
+  // Destroys the buffer in an orderly way, which deletes its file.
+  void DestroyBuffer() { trace_buffer_.reset(); }
+
+  // Pretends that the service died while writing the given part of a
+  // persistent buffer.
+  void SetPersistentWriteRange(uint64_t begin_off, uint64_t end_off) {
+    trace_buffer_->persistent_trailer_->write_range.store(begin_off << 32 |
+                                                          end_off);
+  }
+
+  // Reads all the packets in |buf|, as returned by ReadPacket().
+  static std::vector<std::vector<FakePacketFragment>> ReadAllPackets(
+      const std::unique_ptr<TraceBuffer>& buf) {
+    std::vector<std::vector<FakePacketFragment>> packets;
+    buf->BeginRead();
+    for (;;) {
+      std::vector<FakePacketFragment> packet = ReadPacket(buf);
+      if (packet.empty())
+        return packets;
+      packets.emplace_back(std::move(packet));
+    }
+  }
+
+  std::vector<std::vector<FakePacketFragment>> ReadAllPackets() {
+    return ReadAllPackets(trace_buffer_);
+  }
+
   bool TryPatchChunkContents(ProducerID p,
                              WriterID w,
                              ChunkID c,
@@ -293,6 +338,34 @@ TEST_F(TraceBufferTest, ReadWrite_Padding) {
   EXPECT_EQ(384u, trace_buffer()->stats().padding_bytes_cleared());
 }
 
+TEST_F(TraceBufferTest, ReadWrite_ChunkUtilizationStats) {
+  ResetBuffer(4096);
+  // A chunk with a single small packet and unused space at the end.
+  ASSERT_EQ(512u, CreateChunk(ProducerID(1), WriterID(1), ChunkID(0))
+                      .AddPacket(128 - 16, 'a')
+                      .PadTo(512)
+                      .CopyIntoTraceBuffer());
+  // A packet fragmented across two full chunks.
+  ASSERT_EQ(256u, CreateChunk(ProducerID(1), WriterID(1), ChunkID(1))
+                      .AddPacket(256 - 16, 'b', kContOnNextChunk)
+                      .CopyIntoTraceBuffer());
+  ASSERT_EQ(256u, CreateChunk(ProducerID(1), WriterID(1), ChunkID(2))
+                      .AddPacket(256 - 16, 'c', kContFromPrevChunk)
+                      .CopyIntoTraceBuffer());
+
+  trace_buffer()->BeginRead();
+  ASSERT_THAT(ReadPacket(), ElementsAre(FakePacketFragment(128 - 16, 'a')));
+  ASSERT_THAT(ReadPacket(), ElementsAre(FakePacketFragment(256 - 16, 'b'),
+                                        FakePacketFragment(256 - 16, 'c')));
+  ASSERT_THAT(ReadPacket(), IsEmpty());
+
+  const auto& stats = trace_buffer()->stats();
+  EXPECT_EQ(3u, stats.chunks_read());
+  EXPECT_EQ(496u + 240u * 2, stats.chunk_payload_bytes_read());
+  EXPECT_EQ(112u + 240u * 2, stats.chunk_payload_bytes_used());
+  EXPECT_EQ(1u, stats.chunks_read_with_fragmented_packet());
+}
+
 // Like ReadWrite_Padding, but this time the padding introduced is the minimum
 // allowed (16 bytes). This is to exercise edge cases in the padding logic.
 // [c0: 2048               ][c1: 1024         ][c2: 1008       ][c3: 16]
@@ -1747,6 +1820,93 @@ TEST_F(TraceBufferTest, DiscardPolicy) {
   ASSERT_THAT(ReadPacket(), IsEmpty());
 }
 
+// A producer over its quota can't evict the chunks of the other producers, but
+// can still recycle the space of its own chunks.
+TEST_F(TraceBufferTest, ProducerQuota_ProtectsOtherProducers) {
+  ResetBuffer(4096);
+  trace_buffer()->SetProducerQuota(ProducerID(2), 1024);
+
+  CreateChunk(ProducerID(1), WriterID(1), ChunkID(0))
+      .AddPacket(1024 - 16, 'a')
+      .CopyIntoTraceBuffer();
+  CreateChunk(ProducerID(2), WriterID(1), ChunkID(0))
+      .AddPacket(512 - 16, 'x')
+      .CopyIntoTraceBuffer();
+  CreateChunk(ProducerID(2), WriterID(1), ChunkID(1))
+      .AddPacket(512 - 16, 'y')
+      .CopyIntoTraceBuffer();
+
+  // Over quota: dropped.
+  CreateChunk(ProducerID(2), WriterID(1), ChunkID(2))
+      .AddPacket(512 - 16, 'z')
+      .CopyIntoTraceBuffer();
+
+  // Fill the buffer and overwrite 'a'. The write pointer is now at 'x'.
+  CreateChunk(ProducerID(1), WriterID(1), ChunkID(1))
+      .AddPacket(1024 - 16, 'b')
+      .CopyIntoTraceBuffer();
+  CreateChunk(ProducerID(1), WriterID(1), ChunkID(2))
+      .AddPacket(1024 - 16, 'c')
+      .CopyIntoTraceBuffer();
+  CreateChunk(ProducerID(1), WriterID(1), ChunkID(3))
+      .AddPacket(1024 - 16, 'd')
+      .CopyIntoTraceBuffer();
+
+  // Takes the place of 'x', which keeps the producer within its quota.
+  CreateChunk(ProducerID(2), WriterID(1), ChunkID(3))
+      .AddPacket(512 - 16, 'w')
+      .CopyIntoTraceBuffer();
+
+  bool previous_packet_dropped = false;
+  trace_buffer()->BeginRead();
+  ASSERT_THAT(ReadPacket(), ElementsAre(FakePacketFragment(1024 - 16, 'b')));
+  ASSERT_THAT(ReadPacket(), ElementsAre(FakePacketFragment(1024 - 16, 'c')));
+  ASSERT_THAT(ReadPacket(), ElementsAre(FakePacketFragment(1024 - 16, 'd')));
+  ASSERT_THAT(ReadPacket(), ElementsAre(FakePacketFragment(512 - 16, 'y')));
+  ASSERT_THAT(ReadPacket(nullptr, &previous_packet_dropped),
+              ElementsAre(FakePacketFragment(512 - 16, 'w')));
+  EXPECT_TRUE(previous_packet_dropped);
+  ASSERT_THAT(ReadPacket(), IsEmpty());
+
+  EXPECT_EQ(1u, trace_buffer()->stats().chunks_discarded_over_quota());
+  EXPECT_EQ(2u, trace_buffer()->stats().chunks_overwritten());
+}
+
+// A packet that continues into a chunk dropped because of the quota is lost,
+// but doesn't stall the reads of the sequence.
+TEST_F(TraceBufferTest, ProducerQuota_DropsFragmentsOfDroppedChunks) {
+  ResetBuffer(4096);
+  trace_buffer()->SetProducerQuota(ProducerID(1), 1100);
+
+  CreateChunk(ProducerID(1), WriterID(1), ChunkID(0))
+      .AddPacket(200, 'a')
+      .AddPacket(296, 'b', kContOnNextChunk)
+      .CopyIntoTraceBuffer();
+  CreateChunk(ProducerID(1), WriterID(1), ChunkID(1))
+      .AddPacket(496, 'b', kContFromPrevChunk | kContOnNextChunk)
+      .CopyIntoTraceBuffer();
+
+  // Over quota: dropped.
+  CreateChunk(ProducerID(1), WriterID(1), ChunkID(2))
+      .AddPacket(100, 'b', kContFromPrevChunk)
+      .AddPacket(396, 'c')
+      .CopyIntoTraceBuffer();
+
+  // Small enough to fit in the quota.
+  CreateChunk(ProducerID(1), WriterID(1), ChunkID(3))
+      .AddPacket(48, 'd')
+      .CopyIntoTraceBuffer();
+
+  bool previous_packet_dropped = false;
+  trace_buffer()->BeginRead();
+  ASSERT_THAT(ReadPacket(), ElementsAre(FakePacketFragment(200, 'a')));
+  ASSERT_THAT(ReadPacket(nullptr, &previous_packet_dropped),
+              ElementsAre(FakePacketFragment(48, 'd')));
+  EXPECT_TRUE(previous_packet_dropped);
+  ASSERT_THAT(ReadPacket(), IsEmpty());
+  EXPECT_EQ(1u, trace_buffer()->stats().chunks_discarded_over_quota());
+}
+
 TEST_F(TraceBufferTest, MissingPacketsOnSequence) {
   ResetBuffer(4096);
   SuppressClientDchecksForTesting();
@@ -1929,4 +2089,243 @@ TEST_F(TraceBufferTest, Clone_WithPatches) {
   ASSERT_THAT(ReadPacket(snap), IsEmpty());
 }
 
+#if PERFETTO_BUILDFLAG(PERFETTO_OS_LINUX) || \
+    PERFETTO_BUILDFLAG(PERFETTO_OS_ANDROID)
+TEST_F(TraceBufferTest, MemfdBacked) {
+  if (!base::HasMemfdSupport())
+    GTEST_SKIP() << "memfd is not supported by the kernel";
+  ResetBuffer(4096, TraceBuffer::kOverwrite, /*use_memfd=*/true);
+  ASSERT_EQ(64u, CreateChunk(ProducerID(1), WriterID(1), ChunkID(0))
+                     .AddPacket(64 - 16, 'a')
+                     .CopyIntoTraceBuffer());
+
+  trace_buffer()->BeginRead();
+  TracePacket packet;
+  TraceBuffer::PacketSequenceProperties sequence_properties{};
+  bool previous_packet_dropped = false;
+  ASSERT_TRUE(trace_buffer()->ReadNextTracePacket(
+      &packet, &sequence_properties, &previous_packet_dropped));
+  ASSERT_EQ(packet.slices().size(), 1u);
+  const Slice& slice = packet.slices()[0];
+
+  // The packet can be read back from the memfd.
+  uint64_t offset = 0;
+  int fd = trace_buffer()->GetFileForRange(slice.start, slice.size, &offset);
+  ASSERT_GE(fd, 0);
+  std::string contents(slice.size, '\0');
+  ASSERT_EQ(pread(fd, &contents[0], slice.size, static_cast<off_t>(offset)),
+            static_cast<ssize_t>(slice.size));
+  EXPECT_EQ(memcmp(contents.data(), slice.start, slice.size), 0);
+
+  // Neither ranges outside of the buffer nor clones map to a memfd.
+  char outside[4] = {};
+  EXPECT_EQ(trace_buffer()->GetFileForRange(outside, sizeof(outside), &offset),
+            -1);
+  EXPECT_EQ(trace_buffer()->GetFileForRange(slice.start, 4096, &offset), -1);
+  std::unique_ptr<TraceBuffer> snap = trace_buffer()->CloneReadOnly();
+  EXPECT_EQ(snap->GetFileForRange(slice.start, slice.size, &offset), -1);
+}
+
+TEST_F(TraceBufferTest, Clone_CopyOnWrite) {
+  if (!base::HasMemfdSupport())
+    GTEST_SKIP() << "memfd is not supported by the kernel";
+  ResetBuffer(4096, TraceBuffer::kOverwrite, /*use_memfd=*/true);
+  for (char i = 'a'; i < 'a' + 4; i++) {
+    ASSERT_EQ(1024u, CreateChunk(ProducerID(1), WriterID(1), ChunkID(i))
+                         .AddPacket(1024 - 16, i)
+                         .CopyIntoTraceBuffer());
+  }
+  std::unique_ptr<TraceBuffer> snap = trace_buffer()->CloneReadOnly();
+  ASSERT_TRUE(snap);
+
+  // The source buffer is still writable. Overwrite all of it.
+  for (char i = 'A'; i < 'A' + 4; i++) {
+    ASSERT_EQ(1024u, CreateChunk(ProducerID(2), WriterID(1), ChunkID(i))
+                         .AddPacket(1024 - 16, i)
+                         .CopyIntoTraceBuffer());
+  }
+
+  // The clone still sees the contents at the time of the clone, and is now the
+  // one backed by the memfd.
+  snap->BeginRead();
+  TracePacket packet;
+  TraceBuffer::PacketSequenceProperties sequence_properties{};
+  bool previous_packet_dropped = false;
+  ASSERT_TRUE(snap->ReadNextTracePacket(&packet, &sequence_properties,
+                                        &previous_packet_dropped));
+  ASSERT_EQ(packet.slices().size(), 1u);
+  uint64_t offset = 0;
+  const Slice& slice = packet.slices()[0];
+  EXPECT_GE(snap->GetFileForRange(slice.start, slice.size, &offset), 0);
+  EXPECT_EQ(sequence_properties.producer_id_trusted, ProducerID(1));
+  for (char i = 'b'; i < 'a' + 4; i++) {
+    ASSERT_THAT(ReadPacket(snap),
+                ElementsAre(FakePacketFragment(1024 - 16, i)));
+  }
+  ASSERT_THAT(ReadPacket(snap), IsEmpty());
+
+  // The source sees the new contents, from its private pages.
+  trace_buffer()->BeginRead();
+  for (char i = 'A'; i < 'A' + 4; i++) {
+    ASSERT_THAT(ReadPacket(), ElementsAre(FakePacketFragment(1024 - 16, i)));
+  }
+  ASSERT_THAT(ReadPacket(), IsEmpty());
+  EXPECT_EQ(trace_buffer()->GetFileForRange(slice.start, 4, &offset), -1);
+
+  // Further clones of the source are copies.
+  std::unique_ptr<TraceBuffer> snap2 = trace_buffer()->CloneReadOnly();
+  ASSERT_TRUE(snap2);
+  snap2->BeginRead();
+  for (char i = 'A'; i < 'A' + 4; i++) {
+    ASSERT_THAT(ReadPacket(snap2),
+                ElementsAre(FakePacketFragment(1024 - 16, i)));
+  }
+  ASSERT_THAT(ReadPacket(snap2), IsEmpty());
+}
+
+TEST_F(TraceBufferTest, Clone_CopyOnWriteFreesFileWithClone) {
+  if (!base::HasMemfdSupport())
+    GTEST_SKIP() << "memfd is not supported by the kernel";
+  const size_t kChunkSize = base::GetSysPageSize();
+  ResetBuffer(kChunkSize * 4, TraceBuffer::kOverwrite, /*use_memfd=*/true);
+  for (char i = 'a'; i < 'a' + 4; i++) {
+    ASSERT_EQ(kChunkSize, CreateChunk(ProducerID(1), WriterID(1), ChunkID(i))
+                              .AddPacket(kChunkSize - 16, i)
+                              .CopyIntoTraceBuffer());
+  }
+  std::unique_ptr<TraceBuffer> snap = trace_buffer()->CloneReadOnly();
+  ASSERT_TRUE(snap);
+
+  // Keep the file of the clone open to look at its pages.
+  snap->BeginRead();
+  TracePacket packet;
+  TraceBuffer::PacketSequenceProperties sequence_properties{};
+  bool previous_packet_dropped = false;
+  ASSERT_TRUE(snap->ReadNextTracePacket(&packet, &sequence_properties,
+                                        &previous_packet_dropped));
+  uint64_t offset = 0;
+  const Slice& slice = packet.slices()[0];
+  int fd = snap->GetFileForRange(slice.start, slice.size, &offset);
+  ASSERT_GE(fd, 0);
+  base::ScopedFile file(dup(fd));
+  struct stat st {};
+  ASSERT_EQ(fstat(*file, &st), 0);
+  EXPECT_GT(st.st_blocks, 0);
+
+  // Overwrite only the first page of the source, then destroy the clone.
+  ASSERT_EQ(kChunkSize, CreateChunk(ProducerID(2), WriterID(1), ChunkID(0))
+                            .AddPacket(kChunkSize - 16, 'A')
+                            .CopyIntoTraceBuffer());
+  snap.reset();
+  ASSERT_EQ(fstat(*file, &st), 0);
+  EXPECT_EQ(st.st_blocks, 0);
+
+  // The source kept both the page it overwrote and the ones it didn't.
+  trace_buffer()->BeginRead();
+  for (char i = 'b'; i < 'a' + 4; i++) {
+    ASSERT_THAT(ReadPacket(),
+                ElementsAre(FakePacketFragment(kChunkSize - 16, i)));
+  }
+  ASSERT_THAT(ReadPacket(),
+              ElementsAre(FakePacketFragment(kChunkSize - 16, 'A')));
+  ASSERT_THAT(ReadPacket(), IsEmpty());
+}
+#endif
+
+#if !PERFETTO_BUILDFLAG(PERFETTO_OS_WIN)
+TEST_F(TraceBufferTest, Persistent_RecoverAfterCrash) {
+  base::TempDir tmp_dir = base::TempDir::Create();
+  const std::string path = tmp_dir.path() + "/buf.pbuf";
+  ResetPersistentBuffer(path, 4096);
+
+  CreateChunk(ProducerID(1), WriterID(1), ChunkID(0))
+      .AddPacket(10, 'a')
+      .AddPacket(20, 'b', kContOnNextChunk)
+      .CopyIntoTraceBuffer();
+  CreateChunk(ProducerID(2), WriterID(1), ChunkID(0))
+      .AddPacket(30, 'c')
+      .CopyIntoTraceBuffer();
+  CreateChunk(ProducerID(1), WriterID(1), ChunkID(1))
+      .AddPacket(40, 'd', kContFromPrevChunk)
+      .AddPacket(50, 'e')
+      .CopyIntoTraceBuffer();
+
+  // The buffer is still alive, as if the service died without destroying it.
+  std::unique_ptr<TraceBuffer> recovered = TraceBuffer::RecoverPersistent(path);
+  ASSERT_TRUE(recovered);
+  recovered->BeginRead();
+  TraceBuffer::PacketSequenceProperties sequence_properties{};
+  ASSERT_THAT(ReadPacket(recovered, &sequence_properties),
+              ElementsAre(FakePacketFragment(10, 'a')));
+  EXPECT_EQ(sequence_properties.producer_id_trusted, ProducerID(1));
+  EXPECT_EQ(sequence_properties.producer_uid_trusted, kInvalidUid);
+  ASSERT_THAT(ReadPacket(recovered), ElementsAre(FakePacketFragment(20, 'b'),
+                                                 FakePacketFragment(40, 'd')));
+  ASSERT_THAT(ReadPacket(recovered), ElementsAre(FakePacketFragment(50, 'e')));
+  ASSERT_THAT(ReadPacket(recovered), ElementsAre(FakePacketFragment(30, 'c')));
+  ASSERT_THAT(ReadPacket(recovered), IsEmpty());
+
+  DestroyBuffer();
+  EXPECT_FALSE(base::FileExists(path));
+}
+
+TEST_F(TraceBufferTest, Persistent_RecoverWrapped) {
+  base::TempDir tmp_dir = base::TempDir::Create();
+  const std::string path = tmp_dir.path() + "/buf.pbuf";
+  ResetPersistentBuffer(path, 4096);
+
+  // Wrap a few times, with chunk sizes that don't divide the buffer size.
+  for (ChunkID chunk_id = 0; chunk_id < 50; chunk_id++) {
+    CreateChunk(ProducerID(1), WriterID(chunk_id % 3 + 1), chunk_id)
+        .AddPacket(100 + chunk_id * 13 % 200, static_cast<char>(chunk_id))
+        .CopyIntoTraceBuffer();
+  }
+
+  std::unique_ptr<TraceBuffer> recovered = TraceBuffer::RecoverPersistent(path);
+  ASSERT_TRUE(recovered);
+  auto recovered_packets = ReadAllPackets(recovered);
+  EXPECT_THAT(recovered_packets, Not(IsEmpty()));
+  EXPECT_EQ(recovered_packets, ReadAllPackets());
+  recovered.reset();
+  DestroyBuffer();
+}
+
+TEST_F(TraceBufferTest, Persistent_SkipsRecordsBeingWritten) {
+  base::TempDir tmp_dir = base::TempDir::Create();
+  const std::string path = tmp_dir.path() + "/buf.pbuf";
+  ResetPersistentBuffer(path, 4096);
+
+  // The records take 32 and 64 bytes, once rounded up to 16 bytes.
+  CreateChunk(ProducerID(1), WriterID(1), ChunkID(0))
+      .AddPacket(10, 'a')
+      .CopyIntoTraceBuffer();
+  CreateChunk(ProducerID(1), WriterID(1), ChunkID(1))
+      .AddPacket(40, 'b')
+      .CopyIntoTraceBuffer();
+  SetPersistentWriteRange(32, 96);
+
+  std::unique_ptr<TraceBuffer> recovered = TraceBuffer::RecoverPersistent(path);
+  ASSERT_TRUE(recovered);
+  recovered->BeginRead();
+  ASSERT_THAT(ReadPacket(recovered), ElementsAre(FakePacketFragment(10, 'a')));
+  ASSERT_THAT(ReadPacket(recovered), IsEmpty());
+  recovered.reset();
+  DestroyBuffer();
+}
+
+TEST_F(TraceBufferTest, Persistent_RejectsInvalidFiles) {
+  base::TempDir tmp_dir = base::TempDir::Create();
+  const std::string path = tmp_dir.path() + "/buf.pbuf";
+  EXPECT_FALSE(TraceBuffer::RecoverPersistent(path));
+
+  std::string garbage(4096 + 64, 'x');
+  base::ScopedFile fd(base::OpenFile(path, O_WRONLY | O_CREAT, 0600));
+  ASSERT_TRUE(fd);
+  ASSERT_EQ(base::WriteAll(*fd, garbage.data(), garbage.size()),
+            static_cast<ssize_t>(garbage.size()));
+  EXPECT_FALSE(TraceBuffer::RecoverPersistent(path));
+  remove(path.c_str());
+}
+#endif
+
 }  // namespace perfetto
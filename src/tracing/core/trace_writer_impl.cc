@@ -41,6 +41,11 @@ namespace perfetto {
 namespace {
 constexpr size_t kPacketHeaderSize = SharedMemoryABI::kPacketHeaderSize;
 uint8_t g_garbage_chunk[1024];
+
+// Writers get chunks of the default size until they have returned this many
+// chunks: short-lived writers don't get to pick a layout from one or two
+// samples.
+constexpr uint32_t kMinChunkSizeSamples = 4;
 }  // namespace
 
 TraceWriterImpl::TraceWriterImpl(SharedMemoryArbiterImpl* shmem_arbiter,
@@ -77,6 +82,7 @@ void TraceWriterImpl::Flush(std::function<void()> callback) {
   PERFETTO_CHECK(cur_packet_->is_finalized());
 
   if (cur_chunk_.is_valid()) {
+    UpdateChunkSizeHint(/*filled=*/false);
     shmem_arbiter_->ReturnCompletedChunk(std::move(cur_chunk_), target_buffer_,
                                          &patch_list_);
   } else {
@@ -205,8 +211,13 @@ protozero::ContiguousMemoryRange TraceWriterImpl::GetNewBuffer() {
   header.chunk_id.store(next_chunk_id_, std::memory_order_relaxed);
   header.packets.store(packets, std::memory_order_relaxed);
 
+  if (cur_chunk_.is_valid())
+    UpdateChunkSizeHint(/*filled=*/true);
+  size_t size_hint = num_chunk_size_samples_ >= kMinChunkSizeSamples
+                         ? chunk_size_hint_
+                         : 0;
   SharedMemoryABI::Chunk new_chunk =
-      shmem_arbiter_->GetNewChunk(header, buffer_exhausted_policy_);
+      shmem_arbiter_->GetNewChunk(header, buffer_exhausted_policy_, size_hint);
   if (!new_chunk.is_valid()) {
     // Shared memory buffer exhausted, switch into |drop_packets_| mode. We'll
     // drop data until the garbage chunk has been filled once and then retry.
@@ -391,6 +402,19 @@ void TraceWriterImpl::FinishTracePacket() {
   }
 }
 
+void TraceWriterImpl::UpdateChunkSizeHint(bool filled) {
+  const uint8_t* const wptr = protobuf_stream_writer_.write_ptr();
+  if (wptr < cur_chunk_.payload_begin() || wptr > cur_chunk_.end())
+    return;  // Writing into the garbage chunk.
+  size_t used = static_cast<size_t>(wptr - cur_chunk_.payload_begin());
+  size_t sample = filled ? used * 2 : used;
+  if (num_chunk_size_samples_ < kMinChunkSizeSamples)
+    num_chunk_size_samples_++;
+  chunk_size_hint_ = num_chunk_size_samples_ == 1
+                         ? sample
+                         : (chunk_size_hint_ * 3 + sample) / 4;
+}
+
 uint8_t* TraceWriterImpl::AnnotatePatch(uint8_t* to_patch) {
   if (!cur_chunk_.is_valid()) {
     return nullptr;
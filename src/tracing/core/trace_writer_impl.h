@@ -77,6 +77,13 @@ class TraceWriterImpl : public TraceWriter,
   protozero::ContiguousMemoryRange GetNewBuffer() override;
   uint8_t* AnnotatePatch(uint8_t*) override;
 
+  // Updates |chunk_size_hint_| with the bytes written into |cur_chunk_|, right
+  // before returning it. A chunk returned because it was |filled| counts twice
+  // its used size: writers of large packets, or writing at a high rate, move
+  // to larger chunks, while writers that flush mostly empty chunks move to
+  // smaller ones.
+  void UpdateChunkSizeHint(bool filled);
+
   // The per-producer arbiter that coordinates access to the shared memory
   // buffer from several threads.
   SharedMemoryArbiterImpl* const shmem_arbiter_;
@@ -98,6 +105,11 @@ class TraceWriterImpl : public TraceWriter,
   // this allows the Service to reconstruct the linear sequence of packets.
   ChunkID next_chunk_id_ = 0;
 
+  // Moving average of the payload bytes this writer needs per chunk, over the
+  // last |num_chunk_size_samples_| chunks returned. See UpdateChunkSizeHint().
+  size_t chunk_size_hint_ = 0;
+  uint32_t num_chunk_size_samples_ = 0;
+
   // The chunk we are holding onto (if any).
   SharedMemoryABI::Chunk cur_chunk_;
 
@@ -990,6 +990,52 @@ TEST_P(TraceWriterImplTest, NestedMsgsPatches) {
   EXPECT_THAT(last_commit_.chunks_to_patch()[0].patches(), SizeIs(3));
 }
 
+TEST_P(TraceWriterImplTest, ChunkSizeShrinksWithFlushes) {
+  const BufferID kBufId = 42;
+  std::unique_ptr<TraceWriter> writer = arbiter_->CreateTraceWriter(kBufId);
+  SharedMemoryABI* abi = arbiter_->shmem_abi_for_testing();
+
+  // Each chunk is returned by a Flush() with only a small packet in it. Once
+  // the first page, partitioned with the default layout, is used up, the next
+  // page is partitioned in the smallest chunks.
+  for (int i = 0; i < 8; i++) {
+    writer->NewTracePacket()->set_for_testing()->set_str("foo");
+    writer->Flush();
+  }
+  EXPECT_EQ(abi->GetNumChunksForLayout(abi->GetPageLayout(0)), 4u);
+  EXPECT_EQ(abi->GetNumChunksForLayout(abi->GetPageLayout(1)), 14u);
+
+  writer.reset();
+  EXPECT_THAT(GetPacketsFromShmemAndPatches(), SizeIs(8));
+}
+
+TEST_P(TraceWriterImplTest, ChunkSizeGrowsWithLargePackets) {
+  const BufferID kBufId = 42;
+  std::unique_ptr<TraceWriter> writer = arbiter_->CreateTraceWriter(kBufId);
+  SharedMemoryABI* abi = arbiter_->shmem_abi_for_testing();
+
+  // The packets fill up every chunk, the writer moves to the largest chunks.
+  const size_t kNumPackets = 6;
+  for (size_t i = 0; i < kNumPackets; i++) {
+    writer->NewTracePacket()->set_for_testing()->set_str(
+        std::string(page_size(), 'x'));
+  }
+  writer.reset();
+
+  size_t last_page = 0;
+  for (size_t page_idx = 0; page_idx < abi->num_pages(); page_idx++) {
+    if (abi->GetPageLayout(page_idx))
+      last_page = page_idx;
+  }
+  EXPECT_EQ(abi->GetNumChunksForLayout(abi->GetPageLayout(0)), 4u);
+  EXPECT_EQ(abi->GetNumChunksForLayout(abi->GetPageLayout(last_page)), 1u);
+  std::vector<std::string> packets = GetPacketsFromShmemAndPatches();
+  ASSERT_THAT(packets, SizeIs(kNumPackets));
+  protos::gen::TracePacket packet;
+  EXPECT_TRUE(packet.ParseFromString(packets.back()));
+  EXPECT_EQ(packet.for_testing().str(), std::string(page_size(), 'x'));
+}
+
 // TODO(primiano): add multi-writer test.
 
 }  // namespace
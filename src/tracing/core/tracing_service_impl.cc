@@ -17,7 +17,9 @@
 #include "src/tracing/core/tracing_service_impl.h"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <stdio.h>
 #include <string.h>
 
 #include <cinttypes>
@@ -47,6 +49,16 @@
 #include <sys/stat.h>
 #endif
 
+#if PERFETTO_BUILDFLAG(PERFETTO_OS_ANDROID) || \
+    PERFETTO_BUILDFLAG(PERFETTO_OS_LINUX)
+#define PERFETTO_HAS_SPLICE
+#include <sys/syscall.h>
+// Not exposed by the libc headers unless _GNU_SOURCE is defined.
+#ifndef F_SETPIPE_SZ
+#define F_SETPIPE_SZ 1031
+#endif
+#endif
+
 #include <algorithm>
 
 #include "perfetto/base/build_config.h"
@@ -112,6 +124,22 @@ constexpr int kMaxConcurrentTracingSessionsPerUid = 5;
 constexpr int kMaxConcurrentTracingSessionsForStatsdUid = 10;
 constexpr int64_t kMinSecondsBetweenTracesGuardrail = 5 * 60;
 
+// Batches of packets are compressed on the |compress_workers_| in groups of
+// at least this size. Smaller groups compress worse and gain little from
+// running in parallel.
+constexpr size_t kMinCompressionGroupSize = 128 * 1024;
+
+// Extension of the files that back the persistent buffers, in
+// InitOpts.persistent_buffers_dir.
+constexpr char kPersistentBufferExtension[] = ".pbuf";
+
+// Recovered traces are named <buffer file>-recovered-<unix time>.pftrace.
+// Only the newest kMaxRecoveredTraces are kept so that a service which keeps
+// crashing doesn't fill the disk.
+constexpr char kRecoveredTraceInfix[] = "-recovered-";
+constexpr char kRecoveredTraceExtension[] = ".pftrace";
+constexpr size_t kMaxRecoveredTraces = 10;
+
 constexpr uint32_t kMillisPerHour = 3600000;
 constexpr uint32_t kMillisPerDay = kMillisPerHour * 24;
 constexpr uint32_t kMaxTracingDurationMillis = 7 * 24 * kMillisPerHour;
@@ -145,6 +173,142 @@ ssize_t writev(int fd, const struct iovec* iov, int iovcnt) {
 #endif  // PERFETTO_BUILDFLAG(PERFETTO_OS_WIN) ||
         // PERFETTO_BUILDFLAG(PERFETTO_OS_NACL)
 
+// Slices smaller than this are written with writev() even when they could be
+// spliced: splice() takes two syscalls, which pay off only for slices about as
+// big as the common 4KB chunks.
+constexpr size_t kMinSpliceSize = 2048;
+
+// Writes the packets of |buf|, obtained from TraceBuffer::RecoverPersistent(),
+// into a new trace file at |path|. The packets of each sequence are tagged with
+// a trusted_packet_sequence_id, like in ReadBuffers(). The uid and pid of the
+// producers are not known anymore. Returns the number of packets written.
+std::optional<size_t> WriteRecoveredTrace(TraceBuffer* buf,
+                                          const std::string& path) {
+  base::ScopedFile fd =
+      base::OpenFile(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (!fd)
+    return std::nullopt;
+  std::map<std::pair<ProducerID, WriterID>, PacketSequenceID> sequence_ids;
+  size_t num_packets = 0;
+  buf->BeginRead();
+  for (;;) {
+    TracePacket packet;
+    TraceBuffer::PacketSequenceProperties sequence_properties{};
+    bool previous_packet_dropped;
+    if (!buf->ReadNextTracePacket(&packet, &sequence_properties,
+                                  &previous_packet_dropped)) {
+      break;
+    }
+    if (!PacketStreamValidator::Validate(packet.slices()))
+      continue;
+
+    auto key = std::make_pair(sequence_properties.producer_id_trusted,
+                              sequence_properties.writer_id);
+    PacketSequenceID next_sequence_id = static_cast<PacketSequenceID>(
+        kServicePacketSequenceID + 1 + sequence_ids.size());
+    PacketSequenceID sequence_id =
+        sequence_ids.emplace(key, next_sequence_id).first->second;
+    Slice slice = Slice::Allocate(32);
+    protozero::StaticBuffered<protos::pbzero::TracePacket> trusted_packet(
+        slice.own_data(), slice.size);
+    trusted_packet->set_trusted_packet_sequence_id(sequence_id);
+    if (previous_packet_dropped)
+      trusted_packet->set_previous_packet_dropped(previous_packet_dropped);
+    slice.size = trusted_packet.Finalize();
+    packet.AddSlice(std::move(slice));
+
+    char* preamble;
+    size_t preamble_size;
+    std::tie(preamble, preamble_size) = packet.GetProtoPreamble();
+    if (base::WriteAll(*fd, preamble, preamble_size) < 0)
+      return std::nullopt;
+    for (const Slice& packet_slice : packet.slices()) {
+      if (base::WriteAll(*fd, packet_slice.start, packet_slice.size) < 0)
+        return std::nullopt;
+    }
+    num_packets++;
+  }
+  return num_packets;
+}
+
+// Returns the file that |iov| can be spliced from, if any of |bufs| contains
+// it, and sets |offset| to its position in there. Returns -1 otherwise.
+int GetSpliceSource(const std::vector<const TraceBuffer*>& bufs,
+                    const struct iovec& iov,
+                    uint64_t* offset) {
+  if (iov.iov_len < kMinSpliceSize)
+    return -1;
+  for (const TraceBuffer* buf : bufs) {
+    int fd = buf->GetFileForRange(iov.iov_base, iov.iov_len, offset);
+    if (fd >= 0)
+      return fd;
+  }
+  return -1;
+}
+
+// Moves |size| bytes at |offset| of |src_fd| into |dst_fd| with splice(),
+// through |pipe|. The pages are passed by reference through the pipe rather
+// than copied to and from userspace. Returns the number of bytes written into
+// |dst_fd|, which is less than |size| only on failure. If the failure is
+// because splice() isn't supported for the files (e.g. |dst_fd| was opened
+// with O_APPEND), sets |unsupported|. In this case the data that already made
+// it into the pipe is copied into |dst_fd|, so that the caller can write the
+// remaining bytes in some other way.
+size_t SpliceIntoFile(int src_fd,
+                      uint64_t offset,
+                      size_t size,
+                      const base::Pipe& pipe,
+                      int dst_fd,
+                      bool* unsupported) {
+  *unsupported = false;
+  size_t written = 0;
+#if defined(PERFETTO_HAS_SPLICE)
+  // splice() is invoked through syscall() as, like memfd_create(), it's not
+  // declared by the libc headers without _GNU_SOURCE.
+  auto do_splice = [](int fd_in, int64_t* off_in, int fd_out, size_t len) {
+    return static_cast<ssize_t>(
+        syscall(__NR_splice, fd_in, off_in, fd_out, nullptr, len, 0));
+  };
+  int64_t src_off = static_cast<int64_t>(offset);
+  while (written < size) {
+    ssize_t in_pipe = PERFETTO_EINTR(
+        do_splice(src_fd, &src_off, *pipe.wr, size - written));
+    if (in_pipe <= 0) {
+      *unsupported = in_pipe < 0 && errno == EINVAL;
+      return written;
+    }
+    while (in_pipe > 0) {
+      ssize_t wr_size = PERFETTO_EINTR(
+          do_splice(*pipe.rd, nullptr, dst_fd, static_cast<size_t>(in_pipe)));
+      if (wr_size < 0 && errno == EINVAL) {
+        *unsupported = true;
+        char buf[4096];
+        while (in_pipe > 0) {
+          size_t rd_max = std::min(sizeof(buf), static_cast<size_t>(in_pipe));
+          ssize_t rd_size = PERFETTO_EINTR(read(*pipe.rd, buf, rd_max));
+          if (rd_size <= 0 ||
+              base::WriteAll(dst_fd, buf, static_cast<size_t>(rd_size)) !=
+                  rd_size) {
+            return written;
+          }
+          in_pipe -= rd_size;
+          written += static_cast<size_t>(rd_size);
+        }
+        return written;
+      }
+      if (wr_size <= 0)
+        return written;
+      in_pipe -= wr_size;
+      written += static_cast<size_t>(wr_size);
+    }
+  }
+#else   // PERFETTO_HAS_SPLICE
+  base::ignore_result(src_fd, offset, size, pipe, dst_fd);
+  *unsupported = true;
+#endif  // PERFETTO_HAS_SPLICE
+  return written;
+}
+
 // Partially encodes a CommitDataRequest in an int32 for the purposes of
 // metatracing. Note that it encodes only the bottom 10 bits of the producer id
 // (which is technically 16 bits wide).
@@ -318,6 +482,55 @@ std::optional<protozero::StringFilter::Policy> ConvertPolicy(
   return std::nullopt;
 }
 
+// A committed chunk to be copied into |buf| by a |copy_workers_| thread.
+struct ChunkCopy {
+  TraceBuffer* buf = nullptr;
+  WriterID writer_id = 0;
+  ChunkID chunk_id = 0;
+  uint16_t num_fragments = 0;
+  uint8_t chunk_flags = 0;
+  // Acquired for reading in the producer's SMB and released as free once
+  // copied. Invalid if the chunk was committed over IPC, see |ipc_data|.
+  SharedMemoryABI::Chunk chunk;
+  std::string ipc_data;
+  uint8_t ipc_chunk_idx = 0;
+};
+
+// Runs on the |copy_workers_| thread that owns the buffers of |copies|.
+void CopyChunks(ProducerID producer_id_trusted,
+                uid_t producer_uid_trusted,
+                pid_t producer_pid_trusted,
+                SharedMemoryABI* shmem_abi,
+                std::vector<ChunkCopy>* copies) {
+  for (ChunkCopy& copy : *copies) {
+    const bool over_ipc = !copy.chunk.is_valid();
+    SharedMemoryABI::Chunk chunk =
+        over_ipc ? SharedMemoryABI::MakeChunkFromSerializedData(
+                       reinterpret_cast<uint8_t*>(&copy.ipc_data[0]),
+                       static_cast<uint16_t>(copy.ipc_data.size()),
+                       copy.ipc_chunk_idx)
+                 : std::move(copy.chunk);
+    copy.buf->CopyChunkUntrusted(
+        producer_id_trusted, producer_uid_trusted, producer_pid_trusted,
+        copy.writer_id, copy.chunk_id, copy.num_fragments, copy.chunk_flags,
+        /*chunk_complete=*/true, chunk.payload_begin(), chunk.payload_size());
+    if (!over_ipc)
+      shmem_abi->ReleaseChunkAsFree(std::move(chunk));
+  }
+}
+
+template <typename H>
+void SerializeCommitHistogram(const H& hist,
+                              TraceStats::CommitHistogram* hist_proto) {
+  // The -1 in the for loop below is to skip the implicit overflow bucket.
+  for (size_t i = 0; i < hist.num_buckets() - 1; ++i)
+    hist_proto->add_bucket_def(hist.GetBucketThres(i));
+  for (size_t i = 0; i < hist.num_buckets(); ++i) {
+    hist_proto->add_counts(hist.GetBucketCount(i));
+    hist_proto->add_sum(hist.GetBucketSum(i));
+  }
+}
+
 }  // namespace
 
 // static
@@ -342,6 +555,14 @@ TracingServiceImpl::TracingServiceImpl(
           static_cast<uint32_t>(base::GetWallTimeNs().count())),
       weak_ptr_factory_(this) {
   PERFETTO_DCHECK(task_runner_);
+  if (init_opts_.copy_threads > 0)
+    copy_workers_.reset(
+        new ShardedWorkers(init_opts_.copy_threads, "traced-copy"));
+  if (init_opts_.compression_threads > 0)
+    compress_workers_.reset(
+        new ShardedWorkers(init_opts_.compression_threads, "traced-zip"));
+  if (!init_opts_.persistent_buffers_dir.empty())
+    RecoverPersistentBuffers();
 }
 
 TracingServiceImpl::~TracingServiceImpl() {
@@ -438,6 +659,10 @@ void TracingServiceImpl::DisconnectProducer(ProducerID id) {
   PERFETTO_DLOG("Producer %" PRIu16 " disconnected", id);
   PERFETTO_DCHECK(producers_.count(id));
 
+  // The queued copies of the producer's chunks read from its shared memory
+  // buffer, which is about to be unmapped.
+  WaitForChunkCopies();
+
   // Scrape remaining chunks for this producer to ensure we don't lose data.
   if (auto* producer = GetProducer(id)) {
     for (auto& session_id_and_session : tracing_sessions_)
@@ -910,6 +1135,14 @@ base::Status TracingServiceImpl::EnableTracing(ConsumerEndpointImpl* consumer,
   bool did_allocate_all_buffers = true;
   bool invalid_buffer_config = false;
 
+  // The buffers are backed by a memfd, when supported, so that clones are
+  // copy-on-write. Their packets are spliced straight into the file if they
+  // don't need to be rewritten by filtering or compression first.
+  const bool splice_into_file = tracing_session->write_into_file &&
+                                !tracing_session->trace_filter &&
+                                !tracing_session->compress_deflate;
+  tracing_session->splice_into_file = splice_into_file;
+
   // Allocate the trace buffers. Also create a map to translate a consumer
   // relative index (TraceConfig.DataSourceConfig.target_buffer) into the
   // corresponding BufferID, which is a global ID namespace for the service and
@@ -941,8 +1174,22 @@ base::Status TracingServiceImpl::EnableTracing(ConsumerEndpointImpl* consumer,
         buffer_cfg.fill_policy() == TraceConfig::BufferConfig::DISCARD
             ? TraceBuffer::kDiscard
             : TraceBuffer::kOverwrite;
-    auto it_and_inserted =
-        buffers_.emplace(global_id, TraceBuffer::Create(buf_size, policy));
+    std::unique_ptr<TraceBuffer> buffer;
+    if (buffer_cfg.persistent() &&
+        !init_opts_.persistent_buffers_dir.empty()) {
+      buffer = TraceBuffer::CreatePersistent(
+          init_opts_.persistent_buffers_dir + "/buffer-" +
+              std::to_string(global_id) + kPersistentBufferExtension,
+          buf_size, policy);
+    } else {
+      if (buffer_cfg.persistent()) {
+        PERFETTO_LOG(
+            "Persistent buffers are not enabled in this service. Using a "
+            "regular buffer");
+      }
+      buffer = TraceBuffer::Create(buf_size, policy, /*use_memfd=*/true);
+    }
+    auto it_and_inserted = buffers_.emplace(global_id, std::move(buffer));
     PERFETTO_DCHECK(it_and_inserted.second);  // buffers_.count(global_id) == 0.
     std::unique_ptr<TraceBuffer>& trace_buffer = it_and_inserted.first->second;
     if (!trace_buffer) {
@@ -1891,6 +2138,8 @@ void TracingServiceImpl::ScrapeSharedMemoryBuffers(
   if (producer->writers_.empty())
     return;
 
+  WaitForChunkCopies();
+
   // Performance optimization: On flush or session disconnect, this method is
   // called for each producer. If the producer doesn't participate in the
   // session, there's no need to scape its chunks right now. We can tell if a
@@ -2260,6 +2509,7 @@ std::vector<TracePacket> TracingServiceImpl::ReadBuffers(
   PERFETTO_DCHECK_THREAD(thread_checker_);
   PERFETTO_DCHECK(tracing_session);
   *has_more = false;
+  WaitForChunkCopies();
 
   std::vector<TracePacket> packets;
   packets.reserve(1024);  // Just an educated guess to avoid trivial expansions.
@@ -2456,14 +2706,123 @@ void TracingServiceImpl::MaybeFilterPackets(TracingSession* tracing_session,
       static_cast<uint64_t>((end - start).count());
 }
 
+void TracingServiceImpl::RecoverPersistentBuffers() {
+  const std::string& dir = init_opts_.persistent_buffers_dir;
+  std::vector<std::string> files;
+  base::Status status = base::ListFilesRecursive(dir, files);
+  if (!status.ok()) {
+    PERFETTO_ELOG("Failed to list the persistent buffers: %s",
+                  status.c_message());
+    return;
+  }
+  const std::string recovery_suffix =
+      kRecoveredTraceInfix + std::to_string(base::GetWallTimeS().count()) +
+      kRecoveredTraceExtension;
+  // (unix time, file name) of the traces recovered by previous instances.
+  std::vector<std::pair<int64_t, std::string>> recovered_traces;
+  for (const std::string& file : files) {
+    if (file.find('/') != std::string::npos)
+      continue;
+    if (base::GetFileExtension(file) == kRecoveredTraceExtension) {
+      size_t infix = file.rfind(kRecoveredTraceInfix);
+      if (infix == std::string::npos)
+        continue;
+      size_t time_begin = infix + strlen(kRecoveredTraceInfix);
+      std::optional<int64_t> time = base::StringToInt64(file.substr(
+          time_begin,
+          file.size() - strlen(kRecoveredTraceExtension) - time_begin));
+      if (time)
+        recovered_traces.emplace_back(*time, file);
+      continue;
+    }
+    if (base::GetFileExtension(file) != kPersistentBufferExtension)
+      continue;
+    // These are left behind only by a previous instance of the service that
+    // didn't shut down cleanly.
+    const std::string path = dir + "/" + file;
+    std::unique_ptr<TraceBuffer> buf = TraceBuffer::RecoverPersistent(path);
+    if (buf) {
+      // E.g. buffer-1.pbuf -> buffer-1-recovered-1700000000.pftrace.
+      std::string trace_path =
+          dir + "/" +
+          file.substr(0, file.size() - strlen(kPersistentBufferExtension)) +
+          recovery_suffix;
+      std::optional<size_t> num_packets =
+          WriteRecoveredTrace(buf.get(), trace_path);
+      if (num_packets) {
+        PERFETTO_LOG("Recovered %zu packets from %s into %s", *num_packets,
+                     path.c_str(), trace_path.c_str());
+        recovered_traces.emplace_back(std::numeric_limits<int64_t>::max(),
+                                      trace_path.substr(dir.size() + 1));
+      } else {
+        PERFETTO_PLOG("Failed to write %s", trace_path.c_str());
+        remove(trace_path.c_str());
+      }
+    }
+    remove(path.c_str());
+  }
+
+  if (recovered_traces.size() <= kMaxRecoveredTraces)
+    return;
+  std::sort(recovered_traces.begin(), recovered_traces.end());
+  const size_t num_to_delete = recovered_traces.size() - kMaxRecoveredTraces;
+  for (size_t i = 0; i < num_to_delete; i++) {
+    const std::string path = dir + "/" + recovered_traces[i].second;
+    PERFETTO_LOG("Deleting old recovered trace %s", path.c_str());
+    remove(path.c_str());
+  }
+}
+
 void TracingServiceImpl::MaybeCompressPackets(
     TracingSession* tracing_session,
     std::vector<TracePacket>* packets) {
   if (!tracing_session->compress_deflate) {
     return;
   }
+  const uint32_t level = tracing_session->config.compression_level();
+  if (!compress_workers_) {
+    init_opts_.compressor_fn(packets, level);
+    return;
+  }
 
-  init_opts_.compressor_fn(packets);
+  // Split the batch in up to num_shards() consecutive groups of similar size
+  // and compress each group on its own worker. Each group becomes one or more
+  // self-contained compressed packets, so concatenating the outputs in order
+  // yields the same trace as compressing the batch in one go.
+  size_t total_size = 0;
+  for (const TracePacket& packet : *packets)
+    total_size += packet.size();
+  const size_t group_size = std::max(
+      total_size / compress_workers_->num_shards(), kMinCompressionGroupSize);
+  std::vector<std::vector<TracePacket>> groups(1);
+  size_t cur_group_size = 0;
+  for (TracePacket& packet : *packets) {
+    if (cur_group_size >= group_size) {
+      groups.emplace_back();
+      cur_group_size = 0;
+    }
+    cur_group_size += packet.size();
+    groups.back().emplace_back(std::move(packet));
+  }
+  packets->clear();
+
+  if (groups.size() > 1) {
+    InitOpts::CompressorFn compressor_fn = init_opts_.compressor_fn;
+    for (size_t i = 0; i < groups.size(); i++) {
+      std::vector<TracePacket>* group = &groups[i];
+      compress_workers_->PostTask(
+          i, [compressor_fn, group, level] { compressor_fn(group, level); });
+    }
+    // The groups live on this stack frame: wait for all of them.
+    compress_workers_->WaitForIdle();
+  } else {
+    init_opts_.compressor_fn(&groups[0], level);
+  }
+
+  for (std::vector<TracePacket>& group : groups) {
+    for (TracePacket& packet : group)
+      packets->emplace_back(std::move(packet));
+  }
 }
 
 bool TracingServiceImpl::WriteIntoFile(TracingSession* tracing_session,
@@ -2515,19 +2874,78 @@ bool TracingServiceImpl::WriteIntoFile(TracingSession* tracing_session,
   PERFETTO_DCHECK(num_iovecs <= max_iovecs);
   int fd = *tracing_session->write_into_file;
 
+  // The file-backed buffers whose slices can be spliced into the file.
+  std::vector<const TraceBuffer*> splice_srcs;
+  if (tracing_session->splice_into_file) {
+    for (BufferID buf_id : tracing_session->buffers_index) {
+      if (const TraceBuffer* buf = GetBufferByID(buf_id))
+        splice_srcs.push_back(buf);
+    }
+  }
+
   uint64_t total_wr_size = 0;
 
-  // writev() can take at most IOV_MAX entries per call. Batch them.
+  // writev() can take at most IOV_MAX entries per call. Batch them, cutting
+  // the batches at the slices that can be spliced.
   constexpr size_t kIOVMax = IOV_MAX;
-  for (size_t i = 0; i < num_iovecs; i += kIOVMax) {
-    int iov_batch_size = static_cast<int>(std::min(num_iovecs - i, kIOVMax));
-    ssize_t wr_size = PERFETTO_EINTR(writev(fd, &iovecs[i], iov_batch_size));
-    if (wr_size <= 0) {
-      PERFETTO_PLOG("writev() failed");
+  for (size_t i = 0; i < num_iovecs;) {
+    size_t batch_end = i;
+    int splice_fd = -1;
+    uint64_t splice_off = 0;
+    for (; batch_end < num_iovecs && batch_end - i < kIOVMax; batch_end++) {
+      splice_fd = GetSpliceSource(splice_srcs, iovecs[batch_end], &splice_off);
+      if (splice_fd >= 0)
+        break;
+    }
+
+    if (batch_end > i) {
+      int iov_batch_size = static_cast<int>(batch_end - i);
+      ssize_t wr_size = PERFETTO_EINTR(writev(fd, &iovecs[i], iov_batch_size));
+      if (wr_size <= 0) {
+        PERFETTO_PLOG("writev() failed");
+        stop_writing_into_file = true;
+        break;
+      }
+      total_wr_size += static_cast<size_t>(wr_size);
+      i = batch_end;
+      continue;
+    }
+
+    // |iovecs[i]| is in a memfd-backed buffer, splice it into the file.
+    if (!tracing_session->splice_pipe.wr) {
+      tracing_session->splice_pipe = base::Pipe::Create();
+#if defined(PERFETTO_HAS_SPLICE)
+      // Best effort: a pipe as large as the batches read from the buffers
+      // saves syscalls, but its size is capped by /proc/sys/fs/pipe-max-size.
+      fcntl(*tracing_session->splice_pipe.wr, F_SETPIPE_SZ,
+            static_cast<int>(kWriteIntoFileChunkSize));
+#endif
+    }
+    bool unsupported = false;
+    const size_t size = iovecs[i].iov_len;
+    size_t wr_size = SpliceIntoFile(splice_fd, splice_off, size,
+                                    tracing_session->splice_pipe, fd,
+                                    &unsupported);
+    total_wr_size += wr_size;
+    if (unsupported) {
+      // Fall back to writev() for the rest of the slice, if any, and for the
+      // rest of the session.
+      PERFETTO_LOG("The trace file doesn't support splice(), using writev()");
+      tracing_session->splice_into_file = false;
+      tracing_session->splice_pipe = base::Pipe();
+      splice_srcs.clear();
+      iovecs[i].iov_base = static_cast<char*>(iovecs[i].iov_base) + wr_size;
+      iovecs[i].iov_len -= wr_size;
+      if (iovecs[i].iov_len == 0)
+        i++;
+      continue;
+    }
+    if (wr_size < size) {
+      PERFETTO_PLOG("splice() failed");
       stop_writing_into_file = true;
       break;
     }
-    total_wr_size += static_cast<size_t>(wr_size);
+    i++;
   }
 
   tracing_session->bytes_written_into_file += total_wr_size;
@@ -2545,6 +2963,7 @@ void TracingServiceImpl::FreeBuffers(TracingSessionID tsid) {
     PERFETTO_DLOG("FreeBuffers() failed, invalid session ID %" PRIu64, tsid);
     return;  // TODO(primiano): signal failure?
   }
+  WaitForChunkCopies();
   DisableTracing(tsid, /*disable_immediately=*/true);
 
   PERFETTO_DCHECK(tracing_session->AllDataSourceInstancesStopped());
@@ -2849,6 +3268,23 @@ TracingServiceImpl::DataSourceInstance* TracingServiceImpl::SetupDataSource(
   PERFETTO_DCHECK(global_id);
   ds_config.set_target_buffer(global_id);
 
+  const TraceConfig::BufferConfig& buffer_cfg =
+      tracing_session->config.buffers()[relative_buffer_id];
+  for (const auto& quota : buffer_cfg.producer_quotas()) {
+    if (quota.producer_name() != producer->name_ ||
+        quota.max_buffer_percent() == 0) {
+      continue;
+    }
+    // The buffer can be written by the copy workers at any time.
+    WaitForChunkCopies();
+    TraceBuffer* buf = GetBufferByID(global_id);
+    if (buf) {
+      const uint32_t percent = std::min(quota.max_buffer_percent(), 100u);
+      buf->SetProducerQuota(producer->id_, buf->size() / 100 * percent);
+    }
+    break;
+  }
+
   PERFETTO_DLOG("Setting up data source %s with target buffer %" PRIu16,
                 ds_config.name().c_str(), global_id);
   if (!producer->shared_memory()) {
@@ -2910,11 +3346,28 @@ void TracingServiceImpl::CopyProducerPageIntoLogBuffer(
     size_t size) {
   PERFETTO_DCHECK_THREAD(thread_checker_);
 
+  TraceBuffer* buf =
+      GetTargetBufferForChunk(producer_id_trusted, writer_id, buffer_id);
+  if (!buf)
+    return;
+
+  buf->CopyChunkUntrusted(producer_id_trusted, producer_uid_trusted,
+                          producer_pid_trusted, writer_id, chunk_id,
+                          num_fragments, chunk_flags, chunk_complete, src,
+                          size);
+}
+
+TraceBuffer* TracingServiceImpl::GetTargetBufferForChunk(
+    ProducerID producer_id_trusted,
+    WriterID writer_id,
+    BufferID buffer_id) {
+  PERFETTO_DCHECK_THREAD(thread_checker_);
+
   ProducerEndpointImpl* producer = GetProducer(producer_id_trusted);
   if (!producer) {
     PERFETTO_DFATAL("Producer not found.");
     chunks_discarded_++;
-    return;
+    return nullptr;
   }
 
   TraceBuffer* buf = GetBufferByID(buffer_id);
@@ -2923,7 +3376,7 @@ void TracingServiceImpl::CopyProducerPageIntoLogBuffer(
                   " for producer %" PRIu16,
                   buffer_id, producer_id_trusted);
     chunks_discarded_++;
-    return;
+    return nullptr;
   }
 
   // Verify that the producer is actually allowed to write into the target
@@ -2936,7 +3389,7 @@ void TracingServiceImpl::CopyProducerPageIntoLogBuffer(
                   producer_id_trusted, buffer_id);
     PERFETTO_DFATAL("Forbidden target buffer");
     chunks_discarded_++;
-    return;
+    return nullptr;
   }
 
   // If the writer was registered by the producer, it should only write into the
@@ -2951,19 +3404,18 @@ void TracingServiceImpl::CopyProducerPageIntoLogBuffer(
                   buffer_id);
     PERFETTO_DFATAL("Wrong target buffer");
     chunks_discarded_++;
-    return;
+    return nullptr;
   }
 
-  buf->CopyChunkUntrusted(producer_id_trusted, producer_uid_trusted,
-                          producer_pid_trusted, writer_id, chunk_id,
-                          num_fragments, chunk_flags, chunk_complete, src,
-                          size);
+  return buf;
 }
 
 void TracingServiceImpl::ApplyChunkPatches(
     ProducerID producer_id_trusted,
     const std::vector<CommitDataRequest::ChunkToPatch>& chunks_to_patch) {
   PERFETTO_DCHECK_THREAD(thread_checker_);
+  if (!chunks_to_patch.empty())
+    WaitForChunkCopies();
 
   for (const auto& chunk : chunks_to_patch) {
     const ChunkID chunk_id = static_cast<ChunkID>(chunk.chunk_id());
@@ -3079,6 +3531,38 @@ TraceBuffer* TracingServiceImpl::GetBufferByID(BufferID buffer_id) {
   return &*buf_iter->second;
 }
 
+void TracingServiceImpl::UpdateCommitHistograms(
+    ProducerID producer_id,
+    const std::vector<BufferID>& target_buffers,
+    std::optional<uint64_t> batching_latency_us) {
+  PERFETTO_DCHECK_THREAD(thread_checker_);
+  for (auto& id_and_session : tracing_sessions_) {
+    TracingSession& session = id_and_session.second;
+    uint64_t chunks = 0;
+    for (BufferID buffer_id : target_buffers) {
+      const auto& buffers = session.buffers_index;
+      if (std::find(buffers.begin(), buffers.end(), buffer_id) != buffers.end())
+        chunks++;
+    }
+    // Commits without chunks (e.g. only patches or flush acks) are accounted
+    // to the sessions the producer has data sources in.
+    if (chunks == 0 && session.data_source_instances.count(producer_id) == 0)
+      continue;
+    session.commit_chunks_hist.Add(static_cast<HistValue>(chunks));
+    if (batching_latency_us) {
+      session.commit_latency_us_hist.Add(static_cast<HistValue>(
+          std::min<uint64_t>(*batching_latency_us,
+                             std::numeric_limits<HistValue>::max())));
+    }
+  }
+}
+
+void TracingServiceImpl::WaitForChunkCopies() {
+  PERFETTO_DCHECK_THREAD(thread_checker_);
+  if (copy_workers_)
+    copy_workers_->WaitForIdle();
+}
+
 void TracingServiceImpl::OnStartTriggersTimeout(TracingSessionID tsid) {
   // Skip entirely the flush if the trace session doesn't exist anymore.
   // This is to prevent misleading error messages to be logged.
@@ -3351,6 +3835,7 @@ void TracingServiceImpl::EmitStats(TracingSession* tracing_session,
 }
 
 TraceStats TracingServiceImpl::GetTraceStats(TracingSession* tracing_session) {
+  WaitForChunkCopies();
   TraceStats trace_stats;
   trace_stats.set_producers_connected(static_cast<uint32_t>(producers_.size()));
   trace_stats.set_producers_seen(last_producer_id_);
@@ -3367,6 +3852,10 @@ TraceStats TracingServiceImpl::GetTraceStats(TracingSession* tracing_session) {
   trace_stats.set_flushes_succeeded(tracing_session->flushes_succeeded);
   trace_stats.set_flushes_failed(tracing_session->flushes_failed);
   trace_stats.set_final_flush_outcome(tracing_session->final_flush_outcome);
+  SerializeCommitHistogram(tracing_session->commit_chunks_hist,
+                           trace_stats.mutable_commit_chunks_histogram());
+  SerializeCommitHistogram(tracing_session->commit_latency_us_hist,
+                           trace_stats.mutable_commit_latency_us_histogram());
 
   if (tracing_session->trace_filter) {
     auto* filt_stats = trace_stats.mutable_filter_stats();
@@ -3628,6 +4117,7 @@ void TracingServiceImpl::FlushAndCloneSession(ConsumerEndpointImpl* consumer,
 
   // If any of the buffers are marked as clear_before_clone, reset them before
   // issuing the Flush(kCloneReason).
+  WaitForChunkCopies();
   size_t buf_idx = 0;
   for (BufferID src_buf_id : session->buffers_index) {
     if (!session->config.buffers()[buf_idx++].clear_before_clone())
@@ -3648,7 +4138,7 @@ void TracingServiceImpl::FlushAndCloneSession(ConsumerEndpointImpl* consumer,
     const auto buf_policy = buf->overwrite_policy();
     const auto buf_size = buf->size();
     std::unique_ptr<TraceBuffer> old_buf = std::move(buf);
-    buf = TraceBuffer::Create(buf_size, buf_policy);
+    buf = TraceBuffer::Create(buf_size, buf_policy, /*use_memfd=*/true);
     if (!buf) {
       // This is extremely rare but could happen on 32-bit. If the new buffer
       // allocation failed, put back the buffer where it was and fail the clone.
@@ -3659,6 +4149,7 @@ void TracingServiceImpl::FlushAndCloneSession(ConsumerEndpointImpl* consumer,
           {false, "Buffer allocation failed while attempting to clone", {}});
       return;
     }
+    buf->CopyProducerQuotasFrom(*old_buf);
   }
 
   auto weak_this = weak_ptr_factory_.GetWeakPtr();
@@ -3686,6 +4177,7 @@ base::Status TracingServiceImpl::DoCloneSession(ConsumerEndpointImpl* consumer,
                                                 base::Uuid* new_uuid) {
   PERFETTO_DLOG("CloneSession(%" PRIu64 ") started, consumer uid: %d", src_tsid,
                 static_cast<int>(consumer->uid_));
+  WaitForChunkCopies();
 
   TracingSession* src = GetTracingSession(src_tsid);
 
@@ -3722,8 +4214,10 @@ base::Status TracingServiceImpl::DoCloneSession(ConsumerEndpointImpl* consumer,
       const auto buf_policy = src_buf->overwrite_policy();
       const auto buf_size = src_buf->size();
       new_buf = std::move(src_buf);
-      src_buf = TraceBuffer::Create(buf_size, buf_policy);
-      if (!src_buf) {
+      src_buf = TraceBuffer::Create(buf_size, buf_policy, /*use_memfd=*/true);
+      if (src_buf) {
+        src_buf->CopyProducerQuotasFrom(*new_buf);
+      } else {
         // If the allocation fails put the buffer back and let the code below
         // handle the failure gracefully.
         src_buf = std::move(new_buf);
@@ -4240,6 +4734,17 @@ void TracingServiceImpl::ProducerEndpointImpl::CommitData(
     return;
   }
   PERFETTO_DCHECK(shmem_abi_.is_valid());
+
+  // With copy threads, the chunks are validated here and copied by the worker
+  // thread owning their target buffer, with one task per worker.
+  ShardedWorkers* copy_workers = service_->copy_workers_.get();
+  std::vector<std::shared_ptr<std::vector<ChunkCopy>>> copies_by_shard(
+      copy_workers ? copy_workers->num_shards() : 0);
+
+  // Target buffer of each chunk moved, for the per-session commit stats.
+  std::vector<BufferID> moved_chunk_buffers;
+  moved_chunk_buffers.reserve(req_untrusted.chunks_to_move_size());
+
   for (const auto& entry : req_untrusted.chunks_to_move()) {
     const uint32_t page_idx = entry.page();
     if (page_idx >= shmem_abi_.num_pages())
@@ -4275,6 +4780,7 @@ void TracingServiceImpl::ProducerEndpointImpl::CommitData(
     // are just memory_order_relaxed. Also, the code here assumes that all this
     // data can be malicious and just gives up if anything is malformed.
     BufferID buffer_id = static_cast<BufferID>(entry.target_buffer());
+    moved_chunk_buffers.push_back(buffer_id);
     const SharedMemoryABI::ChunkHeader& chunk_header = *chunk.header();
     WriterID writer_id = chunk_header.writer_id.load(std::memory_order_relaxed);
     ChunkID chunk_id = chunk_header.chunk_id.load(std::memory_order_relaxed);
@@ -4282,10 +4788,34 @@ void TracingServiceImpl::ProducerEndpointImpl::CommitData(
     uint16_t num_fragments = packets.count;
     uint8_t chunk_flags = packets.flags;
 
-    service_->CopyProducerPageIntoLogBuffer(
-        id_, uid_, pid_, writer_id, chunk_id, buffer_id, num_fragments,
-        chunk_flags,
-        /*chunk_complete=*/true, chunk.payload_begin(), chunk.payload_size());
+    if (copy_workers) {
+      TraceBuffer* buf =
+          service_->GetTargetBufferForChunk(id_, writer_id, buffer_id);
+      if (buf) {
+        auto& copies = copies_by_shard[buffer_id % copies_by_shard.size()];
+        if (!copies)
+          copies.reset(new std::vector<ChunkCopy>());
+        copies->emplace_back();
+        ChunkCopy& copy = copies->back();
+        copy.buf = buf;
+        copy.writer_id = writer_id;
+        copy.chunk_id = chunk_id;
+        copy.num_fragments = num_fragments;
+        copy.chunk_flags = chunk_flags;
+        if (commit_data_over_ipc) {
+          copy.ipc_data = entry.data();
+          copy.ipc_chunk_idx = static_cast<uint8_t>(entry.chunk());
+        } else {
+          copy.chunk = std::move(chunk);
+        }
+        continue;
+      }
+    } else {
+      service_->CopyProducerPageIntoLogBuffer(
+          id_, uid_, pid_, writer_id, chunk_id, buffer_id, num_fragments,
+          chunk_flags,
+          /*chunk_complete=*/true, chunk.payload_begin(), chunk.payload_size());
+    }
 
     if (!commit_data_over_ipc) {
       // This one has release-store semantics.
@@ -4293,8 +4823,26 @@ void TracingServiceImpl::ProducerEndpointImpl::CommitData(
     }
   }  // for(chunks_to_move)
 
+  for (size_t shard = 0; shard < copies_by_shard.size(); shard++) {
+    std::shared_ptr<std::vector<ChunkCopy>> copies =
+        std::move(copies_by_shard[shard]);
+    if (!copies)
+      continue;
+    // |shmem_abi_| outlives the task: DisconnectProducer() waits for it.
+    copy_workers->PostTask(shard, [producer_id = id_, uid = uid_, pid = pid_,
+                                   shmem_abi = &shmem_abi_, copies] {
+      CopyChunks(producer_id, uid, pid, shmem_abi, copies.get());
+    });
+  }
+
   service_->ApplyChunkPatches(id_, req_untrusted.chunks_to_patch());
 
+  service_->UpdateCommitHistograms(
+      id_, moved_chunk_buffers,
+      req_untrusted.has_batching_latency_us()
+          ? std::make_optional(req_untrusted.batching_latency_us())
+          : std::nullopt);
+
   if (req_untrusted.flush_request_id()) {
     service_->NotifyFlushDoneForProducer(id_, req_untrusted.flush_request_id());
   }
@@ -33,6 +33,7 @@
 #include "perfetto/base/time.h"
 #include "perfetto/ext/base/circular_queue.h"
 #include "perfetto/ext/base/periodic_task.h"
+#include "perfetto/ext/base/pipe.h"
 #include "perfetto/ext/base/uuid.h"
 #include "perfetto/ext/base/weak_ptr.h"
 #include "perfetto/ext/tracing/core/basic_types.h"
@@ -46,6 +47,8 @@
 #include "perfetto/tracing/core/forward_decls.h"
 #include "perfetto/tracing/core/trace_config.h"
 #include "src/android_stats/perfetto_atoms.h"
+#include "src/tracing/core/sharded_workers.h"
+#include "src/tracing/core/histogram.h"
 #include "src/tracing/core/id_allocator.h"
 
 namespace protozero {
@@ -288,8 +291,16 @@ class TracingServiceImpl : public TracingService {
                                      bool chunk_complete,
                                      const uint8_t* src,
                                      size_t size);
+  // Returns the buffer that the chunks of |writer_id| can be copied into, or
+  // nullptr if |buffer_id| is not a valid target for them.
+  TraceBuffer* GetTargetBufferForChunk(ProducerID, WriterID, BufferID);
   void ApplyChunkPatches(ProducerID,
                          const std::vector<CommitDataRequest::ChunkToPatch>&);
+  // Adds a CommitData() request of |producer_id| which moved one chunk into
+  // each of |target_buffers| to the stats of the sessions it belongs to.
+  void UpdateCommitHistograms(ProducerID producer_id,
+                              const std::vector<BufferID>& target_buffers,
+                              std::optional<uint64_t> batching_latency_us);
   void NotifyFlushDoneForProducer(ProducerID, FlushRequestID);
   void NotifyDataSourceStarted(ProducerID, const DataSourceInstanceID);
   void NotifyDataSourceStopped(ProducerID, const DataSourceInstanceID);
@@ -427,6 +438,11 @@ class TracingServiceImpl : public TracingService {
     explicit PendingFlush(decltype(callback) cb) : callback(std::move(cb)) {}
   };
 
+  // See TraceStats.commit_{chunks,latency_us}_histogram.
+  using CommitChunksHistogram = Histogram<0, 1, 2, 4, 8, 16, 32, 64, 128, 256>;
+  using CommitLatencyHistogram =
+      Histogram<100, 1000, 5000, 10000, 50000, 100000, 500000, 1000000>;
+
   // Holds the state of a tracing session. A tracing session is uniquely bound
   // a specific Consumer. Each Consumer can own one or more sessions.
   struct TracingSession {
@@ -585,6 +601,11 @@ class TracingServiceImpl : public TracingService {
     uint64_t flushes_succeeded = 0;
     uint64_t flushes_failed = 0;
 
+    // CommitData() stats of the producers of this session, counting only the
+    // chunks targeting the buffers of this session.
+    CommitChunksHistogram commit_chunks_hist;
+    CommitLatencyHistogram commit_latency_us_hist;
+
     // Outcome of the final Flush() done by FlushAndDisableTracing().
     protos::gen::TraceStats_FinalFlushOutcome final_flush_outcome{};
 
@@ -641,6 +662,12 @@ class TracingServiceImpl : public TracingService {
     uint64_t max_file_size_bytes = 0;
     uint64_t bytes_written_into_file = 0;
 
+    // Set when the TraceBuffer(s) of a |write_into_file| session are backed by
+    // a memfd. In this case large packet slices are moved into the file with
+    // splice() through |splice_pipe|, rather than copied by writev().
+    bool splice_into_file = false;
+    base::Pipe splice_pipe;
+
     // Periodic task for snapshotting service events (e.g. clocks, sync markers
     // etc)
     base::PeriodicTask snapshot_periodic_task;
@@ -731,6 +758,10 @@ class TracingServiceImpl : public TracingService {
   void ScrapeSharedMemoryBuffers(TracingSession*, ProducerEndpointImpl*);
   void PeriodicClearIncrementalStateTask(TracingSessionID, bool post_next_only);
   TraceBuffer* GetBufferByID(BufferID);
+  // Blocks until |copy_workers_|, if any, have copied all the chunks committed
+  // so far. Must be called before accessing a TraceBuffer on the service
+  // thread, other than to create it.
+  void WaitForChunkCopies();
   base::Status DoCloneSession(ConsumerEndpointImpl*,
                               TracingSessionID,
                               bool final_flush_outcome,
@@ -755,6 +786,12 @@ class TracingServiceImpl : public TracingService {
   void MaybeFilterPackets(TracingSession* tracing_session,
                           std::vector<TracePacket>* packets);
 
+  // Recovers the persistent buffers left behind in
+  // InitOpts.persistent_buffers_dir by a previous instance of the service into
+  // trace files, then deletes them. Only the newest recovered traces are kept
+  // (see kMaxRecoveredTraces). Called once, on construction.
+  void RecoverPersistentBuffers();
+
   // If `*tracing_session` has compression enabled, compress `*packets`.
   void MaybeCompressPackets(TracingSession* tracing_session,
                             std::vector<TracePacket>* packets);
@@ -797,6 +834,12 @@ class TracingServiceImpl : public TracingService {
   std::set<ConsumerEndpointImpl*> consumers_;
   std::map<TracingSessionID, TracingSession> tracing_sessions_;
   std::map<BufferID, std::unique_ptr<TraceBuffer>> buffers_;
+  // Set if InitOpts.copy_threads > 0. Declared after |buffers_| so that the
+  // copies still queued complete before the buffers are destroyed.
+  std::unique_ptr<ShardedWorkers> copy_workers_;
+  // Set if InitOpts.compression_threads > 0. Only used from within
+  // MaybeCompressPackets(), which waits for all its tasks before returning.
+  std::unique_ptr<ShardedWorkers> compress_workers_;
   std::map<std::string, int64_t> session_to_last_trace_s_;
 
   // Contains timestamps of triggers.
@@ -16,6 +16,7 @@
 
 #include "src/tracing/core/tracing_service_impl.h"
 
+#include <fcntl.h>
 #include <string.h>
 
 #include "perfetto/ext/base/file_utils.h"
@@ -61,7 +62,9 @@ using ::testing::AssertionSuccess;
 using ::testing::Contains;
 using ::testing::DoAll;
 using ::testing::Each;
+using ::testing::ElementsAre;
 using ::testing::ElementsAreArray;
+using ::testing::EndsWith;
 using ::testing::Eq;
 using ::testing::ExplainMatchResult;
 using ::testing::HasSubstr;
@@ -2065,6 +2068,75 @@ TEST_F(TracingServiceImplTest, CompressionWriteIntoFile) {
                   Property(&protos::gen::TestEvent::str, Eq("payload-2")))));
 }
 
+TEST_F(TracingServiceImplTest, CompressionOnWorkerThreads) {
+  static const size_t kNumTestPackets = 8;
+  static const size_t kPayloadSize = 64 * 1024UL;
+
+  TracingService::InitOpts init_opts;
+  init_opts.compressor_fn = ZlibCompressFn;
+  init_opts.compression_threads = 2;
+  InitializeSvcWithOpts(init_opts);
+
+  std::unique_ptr<MockConsumer> consumer = CreateMockConsumer();
+  consumer->Connect(svc.get());
+
+  std::unique_ptr<MockProducer> producer = CreateMockProducer();
+  producer->Connect(svc.get(), "mock_producer");
+  producer->RegisterDataSource("data_source");
+
+  TraceConfig trace_config;
+  trace_config.add_buffers()->set_size_kb(4096);
+  auto* ds_config = trace_config.add_data_sources()->mutable_config();
+  ds_config->set_name("data_source");
+  ds_config->set_target_buffer(0);
+  trace_config.set_write_into_file(true);
+  trace_config.set_file_write_period_ms(100000);  // 100s
+  trace_config.set_compression_type(TraceConfig::COMPRESSION_TYPE_DEFLATE);
+  trace_config.set_compression_level(1);
+  base::TempFile tmp_file = base::TempFile::Create();
+  consumer->EnableTracing(trace_config, base::ScopedFile(dup(tmp_file.fd())));
+
+  producer->WaitForTracingSetup();
+  producer->WaitForDataSourceSetup("data_source");
+  producer->WaitForDataSourceStart("data_source");
+
+  std::unique_ptr<TraceWriter> writer =
+      producer->CreateTraceWriter("data_source");
+  for (size_t i = 0; i < kNumTestPackets; i++) {
+    std::string payload(kPayloadSize, static_cast<char>('a' + i));
+    writer->NewTracePacket()->set_for_testing()->set_str(payload);
+  }
+  writer->Flush();
+  writer.reset();
+
+  consumer->DisableTracing();
+  producer->WaitForDataSourceStop("data_source");
+  consumer->WaitForTracingDisabled();
+
+  std::string trace_raw;
+  ASSERT_TRUE(base::ReadFile(tmp_file.path().c_str(), &trace_raw));
+  protos::gen::Trace trace;
+  ASSERT_TRUE(trace.ParseFromString(trace_raw));
+  EXPECT_THAT(trace.packet(),
+              Each(Property(&protos::gen::TracePacket::compressed_packets,
+                            Not(IsEmpty()))));
+  // The batch is larger than two compression groups, so each worker must have
+  // emitted at least one compressed packet.
+  EXPECT_GE(trace.packet().size(), 2u);
+
+  // The packets are still in the order they were written.
+  std::vector<std::string> payloads;
+  for (const auto& packet : DecompressTrace(trace.packet())) {
+    if (packet.has_for_testing())
+      payloads.push_back(packet.for_testing().str());
+  }
+  ASSERT_EQ(payloads.size(), kNumTestPackets);
+  for (size_t i = 0; i < kNumTestPackets; i++) {
+    EXPECT_EQ(payloads[i],
+              std::string(kPayloadSize, static_cast<char>('a' + i)));
+  }
+}
+
 TEST_F(TracingServiceImplTest, CloneSessionWithCompression) {
   TracingService::InitOpts init_opts;
   init_opts.compressor_fn = ZlibCompressFn;
@@ -2270,6 +2342,163 @@ TEST_F(TracingServiceImplTest, WriteIntoFileWithPath) {
                   Property(&protos::gen::TestEvent::str, Eq("payload")))));
 }
 
+#if !PERFETTO_BUILDFLAG(PERFETTO_OS_WIN)
+TEST_F(TracingServiceImplTest, RecoverPersistentBuffers) {
+  base::TempDir tmp_dir = base::TempDir::Create();
+  TracingService::InitOpts init_opts;
+  init_opts.persistent_buffers_dir = tmp_dir.path();
+  InitializeSvcWithOpts(init_opts);
+
+  std::unique_ptr<MockConsumer> consumer = CreateMockConsumer();
+  consumer->Connect(svc.get());
+
+  std::unique_ptr<MockProducer> producer = CreateMockProducer();
+  producer->Connect(svc.get(), "mock_producer");
+  producer->RegisterDataSource("data_source");
+
+  TraceConfig trace_config;
+  auto* buf_config = trace_config.add_buffers();
+  buf_config->set_size_kb(128);
+  buf_config->set_persistent(true);
+  auto* ds_config = trace_config.add_data_sources()->mutable_config();
+  ds_config->set_name("data_source");
+  ds_config->set_target_buffer(0);
+  consumer->EnableTracing(trace_config);
+
+  producer->WaitForTracingSetup();
+  producer->WaitForDataSourceSetup("data_source");
+  producer->WaitForDataSourceStart("data_source");
+
+  std::unique_ptr<TraceWriter> writer =
+      producer->CreateTraceWriter("data_source");
+  writer->NewTracePacket()->set_for_testing()->set_str("payload-1");
+  writer->NewTracePacket()->set_for_testing()->set_str("payload-2");
+  auto flush_request = consumer->Flush();
+  producer->ExpectFlush(writer.get());
+  ASSERT_TRUE(flush_request.WaitForReply());
+
+  std::vector<std::string> files;
+  ASSERT_TRUE(base::ListFilesRecursive(tmp_dir.path(), files).ok());
+  ASSERT_THAT(files, ElementsAre(EndsWith(".pbuf")));
+
+  // A new instance of the service finds the file of the running one, as if
+  // that one had crashed, and recovers it.
+  TracingService::InitOpts recovery_opts;
+  recovery_opts.persistent_buffers_dir = tmp_dir.path();
+  std::unique_ptr<TracingService> recovery_svc = TracingService::CreateInstance(
+      std::unique_ptr<SharedMemory::Factory>(new TestSharedMemory::Factory()),
+      &task_runner, recovery_opts);
+
+  files.clear();
+  ASSERT_TRUE(base::ListFilesRecursive(tmp_dir.path(), files).ok());
+  ASSERT_THAT(files, ElementsAre(EndsWith(".pftrace")));
+  const std::string trace_path = tmp_dir.path() + "/" + files[0];
+  std::string trace_raw;
+  ASSERT_TRUE(base::ReadFile(trace_path, &trace_raw));
+  remove(trace_path.c_str());
+  protos::gen::Trace trace;
+  ASSERT_TRUE(trace.ParseFromString(trace_raw));
+  std::vector<std::string> payloads;
+  for (const auto& packet : trace.packet()) {
+    EXPECT_GT(packet.trusted_packet_sequence_id(), kServicePacketSequenceID);
+    if (packet.has_for_testing())
+      payloads.push_back(packet.for_testing().str());
+  }
+  EXPECT_THAT(payloads, ElementsAre("payload-1", "payload-2"));
+
+  consumer->DisableTracing();
+  producer->WaitForDataSourceStop("data_source");
+  consumer->WaitForTracingDisabled();
+}
+
+TEST_F(TracingServiceImplTest, RecoveredTracesAreCapped) {
+  base::TempDir tmp_dir = base::TempDir::Create();
+  for (int i = 0; i < 12; i++) {
+    std::string path = tmp_dir.path() + "/buffer-1-recovered-" +
+                       std::to_string(1000 + i) + ".pftrace";
+    ASSERT_TRUE(base::OpenFile(path, O_CREAT | O_WRONLY, 0600));
+  }
+
+  TracingService::InitOpts init_opts;
+  init_opts.persistent_buffers_dir = tmp_dir.path();
+  InitializeSvcWithOpts(init_opts);
+
+  // The two oldest traces are deleted.
+  std::vector<std::string> files;
+  ASSERT_TRUE(base::ListFilesRecursive(tmp_dir.path(), files).ok());
+  ASSERT_EQ(files.size(), 10u);
+  for (const std::string& file : files) {
+    EXPECT_THAT(file, Not(HasSubstr("-1000.")));
+    EXPECT_THAT(file, Not(HasSubstr("-1001.")));
+    remove((tmp_dir.path() + "/" + file).c_str());
+  }
+}
+#endif
+
+// Packets much larger than a chunk are made of chunk-sized slices, which are
+// spliced into the file when the platform supports it. With an O_APPEND file,
+// which can't be spliced into, the service must fall back to writev().
+TEST_F(TracingServiceImplTest, WriteIntoFileLargePackets) {
+  static const size_t kNumTestPackets = 8;
+  static const size_t kPayloadSize = 64 * 1024UL;
+
+  for (bool append : {false, true}) {
+    std::unique_ptr<MockConsumer> consumer = CreateMockConsumer();
+    consumer->Connect(svc.get());
+
+    std::unique_ptr<MockProducer> producer = CreateMockProducer();
+    producer->Connect(svc.get(), "mock_producer");
+    producer->RegisterDataSource("data_source");
+
+    TraceConfig trace_config;
+    trace_config.add_buffers()->set_size_kb(4096);
+    auto* ds_config = trace_config.add_data_sources()->mutable_config();
+    ds_config->set_name("data_source");
+    ds_config->set_target_buffer(0);
+    trace_config.set_write_into_file(true);
+    trace_config.set_file_write_period_ms(100000);  // 100s
+    base::TempFile tmp_file = base::TempFile::Create();
+    base::ScopedFile fd(base::OpenFile(tmp_file.path(),
+                                       O_WRONLY | (append ? O_APPEND : 0)));
+    ASSERT_TRUE(fd);
+    consumer->EnableTracing(trace_config, std::move(fd));
+
+    producer->WaitForTracingSetup();
+    producer->WaitForDataSourceSetup("data_source");
+    producer->WaitForDataSourceStart("data_source");
+
+    std::unique_ptr<TraceWriter> writer =
+        producer->CreateTraceWriter("data_source");
+    for (size_t i = 0; i < kNumTestPackets; i++) {
+      // Interleave small and large packets.
+      std::string payload(i % 2 ? 10 : kPayloadSize,
+                          static_cast<char>('a' + i));
+      writer->NewTracePacket()->set_for_testing()->set_str(payload);
+    }
+    writer->Flush();
+    writer.reset();
+
+    consumer->DisableTracing();
+    producer->WaitForDataSourceStop("data_source");
+    consumer->WaitForTracingDisabled();
+
+    std::string trace_raw;
+    ASSERT_TRUE(base::ReadFile(tmp_file.path().c_str(), &trace_raw));
+    protos::gen::Trace trace;
+    ASSERT_TRUE(trace.ParseFromString(trace_raw));
+    std::vector<std::string> payloads;
+    for (const auto& packet : trace.packet()) {
+      if (packet.has_for_testing())
+        payloads.push_back(packet.for_testing().str());
+    }
+    ASSERT_EQ(payloads.size(), kNumTestPackets);
+    for (size_t i = 0; i < kNumTestPackets; i++) {
+      EXPECT_EQ(payloads[i], std::string(i % 2 ? 10 : kPayloadSize,
+                                         static_cast<char>('a' + i)));
+    }
+  }
+}
+
 TEST_F(TracingServiceImplTest, WriteIntoFileFilterMultipleChunks) {
   static const size_t kNumTestPackets = 5;
   static const size_t kPayloadSize = 500 * 1024UL;
@@ -2473,6 +2702,143 @@ TEST_F(TracingServiceImplTest, ExplicitFlush) {
                   Property(&protos::gen::TestEvent::str, Eq("payload")))));
 }
 
+TEST_F(TracingServiceImplTest, CopyChunksOnWorkerThreads) {
+  TracingService::InitOpts init_opts;
+  init_opts.copy_threads = 2;
+  InitializeSvcWithOpts(init_opts);
+
+  std::unique_ptr<MockConsumer> consumer = CreateMockConsumer();
+  consumer->Connect(svc.get());
+
+  std::unique_ptr<MockProducer> producer = CreateMockProducer();
+  producer->Connect(svc.get(), "mock_producer");
+  producer->RegisterDataSource("data_source_1");
+  producer->RegisterDataSource("data_source_2");
+
+  // One buffer per data source, so that the chunks of the two writers are
+  // copied by different threads.
+  TraceConfig trace_config;
+  trace_config.add_buffers()->set_size_kb(512);
+  trace_config.add_buffers()->set_size_kb(512);
+  auto* ds_config_1 = trace_config.add_data_sources()->mutable_config();
+  ds_config_1->set_name("data_source_1");
+  ds_config_1->set_target_buffer(0);
+  auto* ds_config_2 = trace_config.add_data_sources()->mutable_config();
+  ds_config_2->set_name("data_source_2");
+  ds_config_2->set_target_buffer(1);
+
+  consumer->EnableTracing(trace_config);
+  producer->WaitForTracingSetup();
+  producer->WaitForDataSourceSetup("data_source_1");
+  producer->WaitForDataSourceSetup("data_source_2");
+  producer->WaitForDataSourceStart("data_source_1");
+  producer->WaitForDataSourceStart("data_source_2");
+
+  std::unique_ptr<TraceWriter> writer1 =
+      producer->CreateTraceWriter("data_source_1");
+  std::unique_ptr<TraceWriter> writer2 =
+      producer->CreateTraceWriter("data_source_2");
+  const std::string payload(1000, 'x');
+  for (int i = 0; i < 100; i++) {
+    writer1->NewTracePacket()->set_for_testing()->set_str("w1_" + payload);
+    writer2->NewTracePacket()->set_for_testing()->set_str("w2_" + payload);
+  }
+
+  auto flush_request = consumer->Flush();
+  producer->ExpectFlush({writer1.get(), writer2.get()});
+  ASSERT_TRUE(flush_request.WaitForReply());
+
+  consumer->DisableTracing();
+  producer->WaitForDataSourceStop("data_source_1");
+  producer->WaitForDataSourceStop("data_source_2");
+  consumer->WaitForTracingDisabled();
+
+  auto packets = consumer->ReadBuffers();
+  size_t w1_packets = 0;
+  size_t w2_packets = 0;
+  for (const auto& packet : packets) {
+    if (!packet.has_for_testing())
+      continue;
+    const std::string& str = packet.for_testing().str();
+    w1_packets += str == "w1_" + payload;
+    w2_packets += str == "w2_" + payload;
+  }
+  EXPECT_EQ(w1_packets, 100u);
+  EXPECT_EQ(w2_packets, 100u);
+}
+
+// A producer connecting while the chunks of another one are being copied by
+// the worker threads gets its quota applied to the shared buffer.
+TEST_F(TracingServiceImplTest, ProducerQuotaWithCopyThreads) {
+  TracingService::InitOpts init_opts;
+  init_opts.copy_threads = 2;
+  InitializeSvcWithOpts(init_opts);
+
+  std::unique_ptr<MockConsumer> consumer = CreateMockConsumer();
+  consumer->Connect(svc.get());
+
+  std::unique_ptr<MockProducer> producer_a = CreateMockProducer();
+  producer_a->Connect(svc.get(), "producer_a");
+  producer_a->RegisterDataSource("data_source");
+
+  TraceConfig trace_config;
+  auto* buf_config = trace_config.add_buffers();
+  buf_config->set_size_kb(64);
+  auto* quota = buf_config->add_producer_quotas();
+  quota->set_producer_name("producer_b");
+  quota->set_max_buffer_percent(25);
+  trace_config.add_data_sources()->mutable_config()->set_name("data_source");
+
+  consumer->EnableTracing(trace_config);
+  producer_a->WaitForTracingSetup();
+  producer_a->WaitForDataSourceSetup("data_source");
+  producer_a->WaitForDataSourceStart("data_source");
+
+  std::unique_ptr<TraceWriter> writer_a =
+      producer_a->CreateTraceWriter("data_source");
+  const std::string payload(1000, 'x');
+  for (int i = 0; i < 30; i++)
+    writer_a->NewTracePacket()->set_for_testing()->set_str("a_" + payload);
+  writer_a->Flush();
+
+  std::unique_ptr<MockProducer> producer_b = CreateMockProducer();
+  producer_b->Connect(svc.get(), "producer_b");
+  producer_b->RegisterDataSource("data_source");
+  producer_b->WaitForTracingSetup();
+  producer_b->WaitForDataSourceSetup("data_source");
+  producer_b->WaitForDataSourceStart("data_source");
+
+  std::unique_ptr<TraceWriter> writer_b =
+      producer_b->CreateTraceWriter("data_source");
+  for (int i = 0; i < 200; i++)
+    writer_b->NewTracePacket()->set_for_testing()->set_str("b_" + payload);
+
+  auto flush_request = consumer->Flush();
+  producer_a->ExpectFlush(writer_a.get());
+  producer_b->ExpectFlush(writer_b.get());
+  ASSERT_TRUE(flush_request.WaitForReply());
+
+  consumer->DisableTracing();
+  producer_a->WaitForDataSourceStop("data_source");
+  producer_b->WaitForDataSourceStop("data_source");
+  consumer->WaitForTracingDisabled();
+
+  size_t a_packets = 0;
+  size_t b_packets = 0;
+  for (const auto& packet : consumer->ReadBuffers()) {
+    if (!packet.has_for_testing())
+      continue;
+    const std::string& str = packet.for_testing().str();
+    a_packets += str == "a_" + payload;
+    b_packets += str == "b_" + payload;
+  }
+  // producer_b is capped to 16KB of the buffer: the data of producer_a, which
+  // fits in the rest, is not overwritten.
+  EXPECT_EQ(a_packets, 30u);
+  EXPECT_GT(b_packets, 0u);
+  EXPECT_LE(b_packets, 16u);
+}
+
 TEST_F(TracingServiceImplTest, ImplicitFlushOnTimedTraces) {
   std::unique_ptr<MockConsumer> consumer = CreateMockConsumer();
   consumer->Connect(svc.get());
@@ -3759,7 +4125,85 @@ TEST_F(TracingServiceImplTest, TraceWriterStats) {
           ASSERT_TRUE(false) << "Unexpected sequence " << wri.sequence_id();
       }
     }
+
+    // Each of the five writer flushes committed one chunk.
+    const auto& chunks_hist = packet.trace_stats().commit_chunks_histogram();
+    ASSERT_EQ(chunks_hist.counts().size(), chunks_hist.bucket_def().size() + 1);
+    int64_t chunks_committed = 0;
+    for (int64_t sum : chunks_hist.sum())
+      chunks_committed += sum;
+    EXPECT_GE(chunks_committed, 5);
+
+    const auto& latency_hist =
+        packet.trace_stats().commit_latency_us_histogram();
+    uint64_t commits_with_latency = 0;
+    for (uint64_t count : latency_hist.counts())
+      commits_with_latency += count;
+    EXPECT_GE(commits_with_latency, 5u);
+  }
+}
+
+TEST_F(TracingServiceImplTest, CommitHistogramsArePerSession) {
+  std::unique_ptr<MockConsumer> consumer_1 = CreateMockConsumer();
+  consumer_1->Connect(svc.get());
+  std::unique_ptr<MockConsumer> consumer_2 = CreateMockConsumer();
+  consumer_2->Connect(svc.get());
+
+  std::unique_ptr<MockProducer> producer_1 = CreateMockProducer();
+  producer_1->Connect(svc.get(), "mock_producer_1");
+  producer_1->RegisterDataSource("data_source_1");
+  std::unique_ptr<MockProducer> producer_2 = CreateMockProducer();
+  producer_2->Connect(svc.get(), "mock_producer_2");
+  producer_2->RegisterDataSource("data_source_2");
+
+  TraceConfig trace_config_1;
+  trace_config_1.add_buffers()->set_size_kb(128);
+  trace_config_1.add_data_sources()->mutable_config()->set_name(
+      "data_source_1");
+  consumer_1->EnableTracing(trace_config_1);
+  producer_1->WaitForTracingSetup();
+  producer_1->WaitForDataSourceSetup("data_source_1");
+  producer_1->WaitForDataSourceStart("data_source_1");
+
+  TraceConfig trace_config_2;
+  trace_config_2.add_buffers()->set_size_kb(128);
+  trace_config_2.add_data_sources()->mutable_config()->set_name(
+      "data_source_2");
+  consumer_2->EnableTracing(trace_config_2);
+  producer_2->WaitForTracingSetup();
+  producer_2->WaitForDataSourceSetup("data_source_2");
+  producer_2->WaitForDataSourceStart("data_source_2");
+
+  // Only the producer of the first session commits chunks.
+  std::unique_ptr<TraceWriter> writer =
+      producer_1->CreateTraceWriter("data_source_1");
+  for (int i = 0; i < 3; i++) {
+    writer->NewTracePacket()->set_for_testing()->set_str("payload");
+    writer->Flush();
   }
+  auto flush_request = consumer_1->Flush();
+  producer_1->ExpectFlush(writer.get());
+  ASSERT_TRUE(flush_request.WaitForReply());
+
+  auto chunks_committed = [](MockConsumer* consumer) {
+    int64_t chunks = 0;
+    for (const auto& packet : consumer->ReadBuffers()) {
+      if (!packet.has_trace_stats())
+        continue;
+      for (int64_t sum : packet.trace_stats().commit_chunks_histogram().sum())
+        chunks += sum;
+    }
+    return chunks;
+  };
+  consumer_1->DisableTracing();
+  producer_1->WaitForDataSourceStop("data_source_1");
+  consumer_1->WaitForTracingDisabled();
+  EXPECT_GE(chunks_committed(consumer_1.get()), 3);
+
+  consumer_2->DisableTracing();
+  producer_2->WaitForDataSourceStop("data_source_2");
+  consumer_2->WaitForTracingDisabled();
+  EXPECT_EQ(chunks_committed(consumer_2.get()), 0);
 }
 
 TEST_F(TracingServiceImplTest, ObserveEventsDataSourceInstances) {
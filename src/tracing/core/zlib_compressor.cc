@@ -22,6 +22,8 @@
 
 #include <zlib.h>
 
+#include <algorithm>
+
 #include "protos/perfetto/trace/trace.pbzero.h"
 #include "protos/perfetto/trace/trace_packet.pbzero.h"
 
@@ -58,7 +60,7 @@ Slice PreambleToSlice(const Preamble& preamble) {
 // testing.
 class ZlibPacketCompressor {
  public:
-  ZlibPacketCompressor();
+  explicit ZlibPacketCompressor(int level);
   ~ZlibPacketCompressor();
 
   // Can be called multiple times, before Finish() is called.
@@ -80,9 +82,9 @@ class ZlibPacketCompressor {
   std::unique_ptr<uint8_t[]> cur_slice_;
 };
 
-ZlibPacketCompressor::ZlibPacketCompressor() {
+ZlibPacketCompressor::ZlibPacketCompressor(int level) {
   memset(&stream_, 0, sizeof(stream_));
-  int status = deflateInit(&stream_, 6);
+  int status = deflateInit(&stream_, level);
   PERFETTO_CHECK(status == Z_OK);
 }
 
@@ -153,12 +155,17 @@ void ZlibPacketCompressor::PushCurSlice() {
 
 }  // namespace
 
-void ZlibCompressFn(std::vector<TracePacket>* packets) {
+void ZlibCompressFn(std::vector<TracePacket>* packets, uint32_t level) {
   if (packets->empty()) {
     return;
   }
 
-  ZlibPacketCompressor stream;
+  int zlib_level = Z_DEFAULT_COMPRESSION;
+  if (level > 0) {
+    zlib_level =
+        static_cast<int>(std::min<uint32_t>(level, Z_BEST_COMPRESSION));
+  }
+  ZlibPacketCompressor stream(zlib_level);
 
   for (const TracePacket& packet : *packets) {
     stream.PushPacket(packet);
@@ -17,6 +17,8 @@
 #ifndef SRC_TRACING_CORE_ZLIB_COMPRESSOR_H_
 #define SRC_TRACING_CORE_ZLIB_COMPRESSOR_H_
 
+#include <stdint.h>
+
 #include <vector>
 
 #include "perfetto/ext/tracing/core/trace_packet.h"
@@ -26,7 +28,9 @@ namespace perfetto {
 // Matches TracingServiceImpl::kMaxTracePacketSliceSize. Exposed for testing.
 static constexpr size_t kZlibCompressSliceSize = 128 * 1024 - 512;
 
-void ZlibCompressFn(std::vector<TracePacket>*);
+// |level| is the zlib compression level, from 1 (fastest) to 9 (smallest
+// output). 0 selects the zlib default. Thread safe.
+void ZlibCompressFn(std::vector<TracePacket>*, uint32_t level);
 
 }  // namespace perfetto
 
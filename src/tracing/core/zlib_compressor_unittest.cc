@@ -111,7 +111,7 @@ static_assert(kZlibCompressSliceSize ==
 TEST(ZlibCompressFnTest, Empty) {
   std::vector<TracePacket> packets;
 
-  ZlibCompressFn(&packets);
+  ZlibCompressFn(&packets, /*level=*/0);
 
   EXPECT_THAT(packets, IsEmpty());
 }
@@ -128,7 +128,7 @@ TEST(ZlibCompressFnTest, End2EndCompressAndDecompress) {
     for_testing->set_str("def");
   }));
 
-  ZlibCompressFn(&packets);
+  ZlibCompressFn(&packets, /*level=*/0);
 
   ASSERT_THAT(packets, SizeIs(1));
   protos::gen::TracePacket compressed_packet_proto;
@@ -146,6 +146,38 @@ TEST(ZlibCompressFnTest, End2EndCompressAndDecompress) {
                            Property(&protos::gen::TestEvent::str, "def"))));
 }
 
+TEST(ZlibCompressFnTest, CompressionLevel) {
+  std::vector<TracePacket> packets;
+  for (int i = 0; i < 100; i++) {
+    packets.push_back(CreateTracePacket([i](protos::gen::TracePacket* msg) {
+      auto* for_testing = msg->mutable_for_testing();
+      for_testing->set_str("payload " + std::to_string(i % 7) +
+                           RandomString(8) + std::string(200, 'x'));
+    }));
+  }
+
+  std::vector<std::string> decompressed;
+  std::vector<size_t> compressed_sizes;
+  for (uint32_t level : {1u, 9u}) {
+    std::vector<TracePacket> packets_copy = CopyTracePackets(packets);
+    ZlibCompressFn(&packets_copy, level);
+    ASSERT_THAT(packets_copy, SizeIs(1));
+    protos::gen::TracePacket compressed_packet_proto;
+    ASSERT_TRUE(compressed_packet_proto.ParseFromString(
+        packets_copy[0].GetRawBytesForTesting()));
+    const std::string& data = compressed_packet_proto.compressed_packets();
+    compressed_sizes.push_back(data.size());
+    decompressed.push_back(Decompress(data));
+  }
+
+  // Both levels produce the same trace, the higher one in less space.
+  EXPECT_EQ(decompressed[0], decompressed[1]);
+  EXPECT_LE(compressed_sizes[1], compressed_sizes[0]);
+  protos::gen::Trace subtrace;
+  ASSERT_TRUE(subtrace.ParseFromString(decompressed[0]));
+  EXPECT_THAT(subtrace.packet(), SizeIs(100));
+}
+
 TEST(ZlibCompressFnTest, MaxSliceSize) {
   std::vector<TracePacket> packets;
 
@@ -160,7 +192,7 @@ TEST(ZlibCompressFnTest, MaxSliceSize) {
     }));
     {
       std::vector<TracePacket> packets_copy = CopyTracePackets(packets);
-      ZlibCompressFn(&packets_copy);
+      ZlibCompressFn(&packets_copy, /*level=*/0);
       ASSERT_THAT(packets_copy, SizeIs(1));
       compressed_packet = std::move(packets_copy[0]);
     }
@@ -35,8 +35,8 @@
 
 #include "perfetto/base/compiler.h"
 #include "perfetto/base/logging.h"
+#include "perfetto/ext/base/memfd.h"
 #include "perfetto/ext/base/temp_file.h"
-#include "src/tracing/ipc/memfd.h"
 
 namespace perfetto {
 
@@ -47,7 +47,7 @@ int kFileSeals = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL;
 // static
 std::unique_ptr<PosixSharedMemory> PosixSharedMemory::Create(size_t size) {
   base::ScopedFile fd =
-      CreateMemfd("perfetto_shmem", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+      base::CreateMemfd("perfetto_shmem", MFD_CLOEXEC | MFD_ALLOW_SEALING);
   bool is_memfd = !!fd;
 
   // In-tree builds only allow mem_fd, so we can inspect the seals to verify the
@@ -82,11 +82,11 @@ std::unique_ptr<PosixSharedMemory> PosixSharedMemory::AttachToFd(
 
 #if PERFETTO_BUILDFLAG(PERFETTO_ANDROID_BUILD)
   // In-tree kernels all support memfd.
-  PERFETTO_CHECK(HasMemfdSupport());
+  PERFETTO_CHECK(base::HasMemfdSupport());
 #else
   // In out-of-tree builds, we only require seals if the kernel supports memfd.
   if (requires_seals)
-    requires_seals = HasMemfdSupport();
+    requires_seals = base::HasMemfdSupport();
 #endif
 
   if (requires_seals) {
@@ -29,12 +29,12 @@
 
 #include "perfetto/base/build_config.h"
 #include "perfetto/ext/base/file_utils.h"
+#include "perfetto/ext/base/memfd.h"
 #include "perfetto/ext/base/scoped_file.h"
 #include "perfetto/ext/base/temp_file.h"
 #include "perfetto/ext/base/utils.h"
 #include "src/base/test/test_task_runner.h"
 #include "src/base/test/vm_test_utils.h"
-#include "src/tracing/ipc/memfd.h"
 #include "test/gtest_and_gmock.h"
 
 namespace perfetto {
@@ -103,7 +103,7 @@ TEST(PosixSharedMemoryTest, AttachToFdRequiresSeals) {
   std::unique_ptr<PosixSharedMemory> shm =
       PosixSharedMemory::AttachToFd(tmp_file.ReleaseFD());
 
-  if (HasMemfdSupport()) {
+  if (base::HasMemfdSupport()) {
     EXPECT_EQ(shm.get(), nullptr);
   } else {
     ASSERT_NE(shm.get(), nullptr);